@@ -0,0 +1,638 @@
+#include "archive.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <ctime>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "codec.h"
+#include "defines.h"
+#include "io_engine.h"
+#include "offset_index.h"
+#include "stats.h"
+#include "store.h"
+#include "utils.h"
+
+namespace {
+
+constexpr size_t record_size = BLOCK_SIZE_BYTES + HASHING_BLOCK_SIZE;
+constexpr size_t batch_entries = std::min<size_t>(ARCHIVE_BATCH_ENTRIES,
+                                                  std::max<size_t>(ARCHIVE_BATCH_BYTES / HASHING_BLOCK_SIZE, 1));
+constexpr size_t span_bytes = std::max<size_t>(ARCHIVE_READ_SPAN_BYTES, record_size);
+constexpr uint32_t NO_SLOT = UINT32_MAX;
+
+struct archive_file_t
+{
+  std::filesystem::path name; // relative to files_dir
+  uint64_t size;
+  uint64_t entries;
+  bool sparse;
+  bool sized; // size is known from offset index, files stored before offset indexes are sized by restoring
+  uint64_t restored = 0; // bytes of resolved segments
+};
+
+// entries [first_entry, first_entry + count) of file, they are batch entries from batch_entry
+struct archive_segment_t
+{
+  size_t file;
+  uint64_t first_entry;
+  size_t count;
+  size_t batch_entry;
+  uint64_t offset; // in file
+  bool last;
+};
+
+struct archive_batch_t
+{
+  std::vector<archive_segment_t> segments;
+  std::vector<unsigned char> entries;
+  // locations of entries of sparse files, zero if unknown
+  std::vector<hash_location_t> locations;
+  // equal digests of batch share slot of block, zero runs have NO_SLOT
+  std::vector<uint32_t> slots;
+  std::vector<char> blocks;
+  std::vector<uint32_t> block_lens;
+};
+
+struct archive_totals_t
+{
+  uint64_t entries = 0;
+  uint64_t slots = 0;
+  uint64_t spans = 0;
+  uint64_t readed = 0;
+};
+
+bool valid_stored_name(const std::filesystem::path& name)
+{
+  if (name.empty() || name.is_absolute()) return false;
+  for (const auto& part : name) {
+    if (part == ".." || part == VERSIONS_DIRECTORY) return false;
+  }
+  const std::string filename = name.filename().string();
+  const size_t suffix = sizeof(VERSION_TMP_SUFFIX) - 1;
+  return filename.size() < suffix || filename.compare(filename.size() - suffix, suffix, VERSION_TMP_SUFFIX) != 0;
+}
+
+std::vector<archive_file_t> collect_files(const archive_options_t& options, size_t * skipped)
+{
+  std::vector<std::filesystem::path> names;
+  if (options.list) {
+    std::ifstream list_file;
+    if (options.source != "-") {
+      list_file.open(options.source);
+      if (!list_file) {
+        exit_error(wrap_ostringstream("error: can't open list " << options.source << ", aborted..."), 6);
+      }
+    }
+    std::istream& in = options.source == "-" ? std::cin : list_file;
+    std::string line;
+    while (std::getline(in, line)) {
+      if (!line.empty()) names.push_back(std::filesystem::path(line).lexically_normal());
+    }
+  } else {
+    const std::filesystem::path root = (files_dir / options.source).lexically_normal();
+    if (std::filesystem::is_directory(root)) {
+      for (auto it = std::filesystem::recursive_directory_iterator(root); it != std::filesystem::recursive_directory_iterator(); ++it) {
+        if (it->is_directory() && it->path().filename() == VERSIONS_DIRECTORY) {
+          it.disable_recursion_pending();
+        } else if (it->is_regular_file()) {
+          names.push_back(it->path().lexically_relative(files_dir.lexically_normal()));
+        }
+      }
+      std::sort(names.begin(), names.end());
+    } else if (std::filesystem::exists(root)) {
+      names.push_back(std::filesystem::path(options.source).lexically_normal());
+    } else {
+      exit_error("error: file not found, aborted...", 6);
+    }
+  }
+
+  std::vector<archive_file_t> files;
+  files.reserve(names.size());
+  for (const auto& name : names) {
+    const std::filesystem::path file = files_dir / name;
+    std::error_code error;
+    if (!valid_stored_name(name) || !std::filesystem::is_regular_file(file, error)) {
+      std::cerr << "warn: stored file " << name << " not found, skipped\n";
+      ++*skipped;
+      continue;
+    }
+    file_t index(offset_index_path(file), O_RDONLY);
+    const bool sized = index.open();
+    files.push_back({ name, sized ? stored_file_size(index) : 0, std::filesystem::file_size(file) / BYTES_HASH,
+                      std::filesystem::exists(locations_path(file)), sized });
+  }
+  return files;
+}
+
+void read_exactly(file_t& file, off_t pos, char * data, size_t len)
+{
+  if (file.read(pos, data, len) != (ssize_t) len) {
+    exit_error(wrap_ostringstream("error: can't read " << file.path() << ", aborted..."), 10);
+  }
+}
+
+// takes next entries of files from cursor, segments of file follow each other in batches
+bool plan_batch(const std::vector<archive_file_t>& files, size_t& file, uint64_t& entry, archive_batch_t& batch)
+{
+  batch.segments.clear();
+  batch.entries.clear();
+  batch.locations.clear();
+  size_t taken = 0;
+  while (file < files.size() && taken < batch_entries) {
+    const archive_file_t& planned = files[file];
+    const size_t count = std::min<uint64_t>(planned.entries - entry, batch_entries - taken);
+    batch.segments.push_back({ file, entry, count, taken, 0, entry + count == planned.entries });
+    batch.entries.resize((taken + count) * BYTES_HASH);
+    batch.locations.resize(taken + count);
+    if (count > 0) {
+      stage_timer_t timer(STAGE_RECIPE_READ);
+      const std::filesystem::path recipe = files_dir / planned.name;
+      file_t in(recipe, O_RDONLY);
+      if (!in.open()) exit_error(wrap_ostringstream("error: can't open " << recipe << ", aborted..."), 10);
+      read_exactly(in, entry * BYTES_HASH, (char *) batch.entries.data() + taken * BYTES_HASH, count * BYTES_HASH);
+      if (planned.sparse) {
+        file_t locations(locations_path(recipe), O_RDONLY);
+        if (!locations.open()) exit_error(wrap_ostringstream("error: can't open locations of " << recipe << ", aborted..."), 10);
+        read_exactly(locations, entry * sizeof(hash_location_t), (char *) (batch.locations.data() + taken),
+                     count * sizeof(hash_location_t));
+      }
+    }
+    taken += count;
+    entry += count;
+    if (entry == planned.entries) {
+      file++;
+      entry = 0;
+    }
+  }
+  return !batch.segments.empty();
+}
+
+// block of slot from record at data of readed bytes, false if record is broken or base isn't resolved
+bool decode_record(const char * data, ssize_t readed, char * block, uint32_t * block_len)
+{
+  if (readed < (ssize_t) BLOCK_SIZE_BYTES) return false;
+  bool delta;
+  const size_t len = read_record_prefix(data, &delta);
+  if (BLOCK_SIZE_BYTES + len > (size_t) readed) return false;
+  if (!delta) {
+    if (len > HASHING_BLOCK_SIZE) return false;
+    memcpy(block, data + BLOCK_SIZE_BYTES, len);
+    *block_len = len;
+    return true;
+  }
+  stage_timer_t timer(STAGE_DELTA);
+  const ssize_t resolved = resolve_record(data + BLOCK_SIZE_BYTES, len, true, block);
+  if (resolved < 0) return false;
+  *block_len = resolved;
+  return true;
+}
+
+// union of batch digests is looked up by index in batches and readed by spans in order of locations
+void resolve_batch(archive_batch_t& batch, archive_totals_t& totals)
+{
+  const size_t count = batch.entries.size() / BYTES_HASH;
+  const unsigned char * entries = batch.entries.data();
+  std::vector<uint32_t> order;
+  order.reserve(count);
+  batch.slots.assign(count, NO_SLOT);
+  uint64_t run_length;
+  for (size_t i = 0; i < count; i++) {
+    if (!read_zero_run_entry(entries + i * BYTES_HASH, &run_length)) order.push_back(i);
+  }
+  digest_sorter_t sorter;
+  sorter.sort(entries, order.data(), order.size());
+  std::vector<uint32_t> slot_entries;
+  std::vector<hash_location_t> slot_locations;
+  for (size_t i = 0; i < order.size(); i++) {
+    const uint32_t entry = order[i];
+    if (i == 0 || memcmp(entries + order[i - 1] * BYTES_HASH, entries + entry * BYTES_HASH, BYTES_HASH) != 0) {
+      slot_entries.push_back(entry);
+      slot_locations.push_back(batch.locations[entry]);
+    } else if (slot_locations.back().file == 0) {
+      slot_locations.back() = batch.locations[entry];
+    }
+    batch.slots[entry] = slot_entries.size() - 1;
+  }
+  const size_t slots = slot_entries.size();
+  totals.entries += count;
+  totals.slots += slots;
+
+  // blocks of dense files are found by index
+  std::vector<uint32_t> lookups;
+  for (size_t slot = 0; slot < slots; slot++) {
+    if (slot_locations[slot].file == 0) lookups.push_back(slot);
+  }
+  std::vector<char> hexes(SELECT_MANY_HASHES_COUNT * HASH_HEX_BYTES);
+  std::unique_ptr<bool[]> found(new bool[SELECT_MANY_HASHES_COUNT]);
+  std::vector<hash_location_t> found_locations(SELECT_MANY_HASHES_COUNT);
+  for (size_t begin = 0; begin < lookups.size(); begin += SELECT_MANY_HASHES_COUNT) {
+    const size_t part = std::min<size_t>(lookups.size() - begin, SELECT_MANY_HASHES_COUNT);
+    for (size_t i = 0; i < part; i++) {
+      to_my_hex(hexes.data() + i * HASH_HEX_BYTES, entries + slot_entries[lookups[begin + i]] * BYTES_HASH, BYTES_HASH);
+    }
+    {
+      stage_timer_t timer(STAGE_DB_LOOKUP);
+      hash_index->find_many(hexes.data(), part, found.get(), found_locations.data());
+    }
+    for (size_t i = 0; i < part; i++) {
+      if (found[i]) slot_locations[lookups[begin + i]] = found_locations[i];
+    }
+  }
+
+  // records are readed in order of hash files, close records share span
+  std::vector<uint32_t> by_location;
+  for (size_t slot = 0; slot < slots; slot++) {
+    if (slot_locations[slot].file != 0) by_location.push_back(slot);
+  }
+  std::sort(by_location.begin(), by_location.end(), [&slot_locations](uint32_t a, uint32_t b) {
+    const hash_location_t& first = slot_locations[a];
+    const hash_location_t& second = slot_locations[b];
+    return first.file != second.file ? first.file < second.file : first.pos < second.pos;
+  });
+  batch.blocks.resize(slots * HASHING_BLOCK_SIZE);
+  batch.block_lens.assign(slots, 0);
+  std::vector<bool> resolved(slots, false);
+  std::vector<char> spans(ARCHIVE_READ_SPANS * span_bytes);
+  std::vector<io_request_t> requests;
+  std::vector<std::pair<size_t, size_t>> ranges; // of by_location
+  io_engine_t& engine = store_io_engine();
+  for (size_t next = 0; next < by_location.size();) {
+    requests.clear();
+    ranges.clear();
+    while (next < by_location.size() && requests.size() < ARCHIVE_READ_SPANS) {
+      const hash_location_t& start = slot_locations[by_location[next]];
+      // records of known length end span exactly, records of same position can differ by known length
+      off_t span_end = start.pos + record_read_size(start);
+      size_t end = next + 1;
+      while (end < by_location.size()) {
+        const hash_location_t& location = slot_locations[by_location[end]];
+        const hash_location_t& previous = slot_locations[by_location[end - 1]];
+        const off_t location_end = std::max<off_t>(span_end, location.pos + record_read_size(location));
+        if (location.file != start.file || location_end - start.pos > (off_t) span_bytes
+            || location.pos - previous.pos > (off_t) (record_size + ARCHIVE_READ_GAP_BYTES)) {
+          break;
+        }
+        span_end = location_end;
+        end++;
+      }
+      auto it = open_hash_file(start.file);
+      if (it) {
+        const size_t len = span_end - start.pos;
+        requests.push_back({ it->fd(), spans.data() + requests.size() * span_bytes, len, (off_t) start.pos, false, 0 });
+        ranges.emplace_back(next, end);
+      }
+      next = end;
+    }
+    {
+      stage_timer_t timer(STAGE_CHUNK_READ);
+      engine.run(requests.data(), requests.size());
+    }
+    for (size_t i = 0; i < requests.size(); i++) {
+      const io_request_t& request = requests[i];
+      if (request.result <= 0) continue;
+      totals.spans++;
+      totals.readed += request.result;
+      for (size_t k = ranges[i].first; k < ranges[i].second; k++) {
+        const uint32_t slot = by_location[k];
+        const size_t offset = slot_locations[slot].pos - request.pos;
+        resolved[slot] = decode_record(request.buf + offset, request.result - (ssize_t) offset,
+                                       batch.blocks.data() + slot * HASHING_BLOCK_SIZE, &batch.block_lens[slot]);
+      }
+    }
+  }
+  char hex[HASH_HEX_BYTES + 1] = {};
+  for (size_t slot = 0; slot < slots; slot++) {
+    if (resolved[slot]) continue;
+    // record longer than its length in index is readed again by largest record size
+    if (slot_locations[slot].file != 0) {
+      const ssize_t len = read_located_block(slot_locations[slot], batch.blocks.data() + slot * HASHING_BLOCK_SIZE);
+      if (len >= 0) {
+        batch.block_lens[slot] = len;
+        continue;
+      }
+    }
+    to_my_hex(hex, entries + slot_entries[slot] * BYTES_HASH, BYTES_HASH);
+    stats_add(COUNTER_MISSING_CHUNKS);
+    std::cerr << "warn: block \'" << hex << "\' not found, replace by \'x\' symbols\n";
+    strset(batch.blocks.data() + slot * HASHING_BLOCK_SIZE, 'x', HASHING_BLOCK_SIZE);
+    batch.block_lens[slot] = HASHING_BLOCK_SIZE;
+  }
+}
+
+// bytes of blocks and zero runs of resolved segment
+uint64_t segment_bytes(const archive_batch_t& batch, const archive_segment_t& segment)
+{
+  uint64_t bytes = 0;
+  uint64_t run_length;
+  for (size_t i = segment.batch_entry; i < segment.batch_entry + segment.count; i++) {
+    if (batch.slots[i] == NO_SLOT) {
+      read_zero_run_entry(batch.entries.data() + i * BYTES_HASH, &run_length);
+      bytes += run_length;
+    } else {
+      bytes += batch.block_lens[batch.slots[i]];
+    }
+  }
+  return bytes;
+}
+
+// offsets of segments, restored size of file should be its size in offset index,
+// size of file without it is restored size
+void place_segments(archive_batch_t& batch, std::vector<archive_file_t>& files)
+{
+  for (auto& segment : batch.segments) {
+    archive_file_t& file = files[segment.file];
+    segment.offset = file.restored;
+    const uint64_t bytes = segment_bytes(batch, segment);
+    file.restored += bytes;
+    stats_add(COUNTER_BYTES_RESTORED, bytes);
+    if (!segment.last) continue;
+    if (!file.sized) {
+      file.size = file.restored;
+    } else if (file.restored != file.size) {
+      exit_error(wrap_ostringstream("error: restored size of " << file.name << " differs from offset index, aborted..."), 10);
+    }
+  }
+}
+
+// tar header needs size before data, so file without offset index is resolved once only for its size
+uint64_t measure_file(const archive_file_t& file, archive_batch_t& batch, archive_totals_t& totals)
+{
+  const std::vector<archive_file_t> measured = { file };
+  size_t index = 0;
+  uint64_t entry = 0;
+  uint64_t size = 0;
+  while (plan_batch(measured, index, entry, batch)) {
+    resolve_batch(batch, totals);
+    for (const auto& segment : batch.segments) size += segment_bytes(batch, segment);
+  }
+  return size;
+}
+
+void write_all(int fd, const char * data, size_t len, off_t pos = -1)
+{
+  for (size_t written = 0; written < len;) {
+    stats_add(COUNTER_SYSCALLS);
+    const ssize_t result = pos < 0 ? handle_eintr(::write, fd, data + written, len - written)
+                                   : handle_eintr(::pwrite, fd, data + written, len - written, pos + written);
+    if (result <= 0) exit_error(wrap_ostringstream("error: can't write output, errno: " << errno), 10);
+    written += result;
+  }
+}
+
+// segment is written by pwrite at its offset, zero runs are holes
+void write_segment(const archive_batch_t& batch, const archive_segment_t& segment, const archive_file_t& file,
+                   const std::filesystem::path& target, std::vector<char>& buffer)
+{
+  const std::filesystem::path path = target / file.name;
+  const int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC | (segment.first_entry == 0 ? O_TRUNC : 0), 0644);
+  if (fd < 0) exit_error(wrap_ostringstream("error: can't create " << path << ", errno: " << errno), 10);
+  off_t pos = segment.offset;
+  size_t used = 0;
+  auto flush = [&]() {
+    stage_timer_t timer(STAGE_OUTPUT_WRITE);
+    write_all(fd, buffer.data(), used, pos);
+    pos += used;
+    used = 0;
+  };
+  uint64_t run_length;
+  for (size_t i = segment.batch_entry; i < segment.batch_entry + segment.count; i++) {
+    const uint32_t slot = batch.slots[i];
+    if (slot == NO_SLOT) {
+      flush();
+      read_zero_run_entry(batch.entries.data() + i * BYTES_HASH, &run_length);
+      pos += run_length;
+      continue;
+    }
+    const uint32_t len = batch.block_lens[slot];
+    if (used + len > buffer.size()) flush();
+    memcpy(buffer.data() + used, batch.blocks.data() + slot * HASHING_BLOCK_SIZE, len);
+    used += len;
+  }
+  flush();
+  // file ending with hole is extended to its end
+  if (segment.last && ftruncate(fd, file.size) != 0) {
+    exit_error(wrap_ostringstream("error: can't extend " << path << ", errno: " << errno), 10);
+  }
+  ::close(fd);
+}
+
+// ustar stream, names longer than ustar fields are written as GNU long names
+class tar_writer_t
+{
+public:
+  explicit tar_writer_t(int fd)
+    : fd_(fd)
+    , buffer_(BUFFER_READ_SIZE)
+    , mtime_(time(nullptr))
+  {
+  }
+
+  void header(const std::string& name, uint64_t size)
+  {
+    char block[TAR_BLOCK_SIZE] = {};
+    if (name.size() > 100 && !split_name(name, block)) {
+      static const char LONG_LINK[] = "././@LongLink";
+      memcpy(block, LONG_LINK, sizeof(LONG_LINK));
+      fill_header(block, name.size() + 1, 'L');
+      write(block, TAR_BLOCK_SIZE);
+      write(name.c_str(), name.size() + 1);
+      pad(name.size() + 1);
+      memset(block, 0, TAR_BLOCK_SIZE);
+      memcpy(block, name.data(), 100);
+    } else if (name.size() <= 100) {
+      memcpy(block, name.data(), name.size());
+    }
+    fill_header(block, size, '0');
+    write(block, TAR_BLOCK_SIZE);
+  }
+
+  void write(const char * data, size_t len)
+  {
+    while (len > 0) {
+      if (used_ == buffer_.size()) flush();
+      const size_t part = std::min(len, buffer_.size() - used_);
+      memcpy(buffer_.data() + used_, data, part);
+      used_ += part;
+      data += part;
+      len -= part;
+    }
+  }
+
+  void zeros(uint64_t len)
+  {
+    while (len > 0) {
+      if (used_ == buffer_.size()) flush();
+      const size_t part = std::min<uint64_t>(len, buffer_.size() - used_);
+      memset(buffer_.data() + used_, 0, part);
+      used_ += part;
+      len -= part;
+    }
+  }
+
+  // data of size bytes is padded to tar block
+  void pad(uint64_t size)
+  {
+    zeros((TAR_BLOCK_SIZE - size % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE);
+  }
+
+  // end of archive is two zero blocks
+  void finish()
+  {
+    zeros(2 * TAR_BLOCK_SIZE);
+    flush();
+  }
+
+  void flush()
+  {
+    stage_timer_t timer(STAGE_OUTPUT_WRITE);
+    write_all(fd_, buffer_.data(), used_);
+    used_ = 0;
+  }
+
+private:
+  // name is split to prefix and name fields at '/'
+  static bool split_name(const std::string& name, char * block)
+  {
+    for (size_t slash = name.find('/'); slash != std::string::npos; slash = name.find('/', slash + 1)) {
+      if (slash <= 155 && name.size() - slash - 1 <= 100 && name.size() - slash - 1 > 0) {
+        memcpy(block, name.data() + slash + 1, name.size() - slash - 1);
+        memcpy(block + 345, name.data(), slash);
+        return true;
+      }
+    }
+    return false;
+  }
+
+  static void octal(char * field, size_t width, uint64_t value)
+  {
+    snprintf(field, width, "%0*llo", (int) width - 1, (unsigned long long) value);
+  }
+
+  void fill_header(char * block, uint64_t size, char type)
+  {
+    octal(block + 100, 8, 0644);
+    octal(block + 108, 8, 0);
+    octal(block + 116, 8, 0);
+    if (size < (1ull << 33)) {
+      octal(block + 124, 12, size);
+    } else {
+      // base-256 size of GNU tar
+      block[124] = (char) 0x80;
+      for (size_t i = 0; i < 8; i++) {
+        block[135 - i] = (size >> (8 * i)) & 0xff;
+      }
+    }
+    octal(block + 136, 12, mtime_);
+    block[156] = type;
+    memcpy(block + 257, "ustar", 6);
+    memcpy(block + 263, "00", 2);
+    memset(block + 148, ' ', 8);
+    unsigned int checksum = 0;
+    for (size_t i = 0; i < TAR_BLOCK_SIZE; i++) {
+      checksum += (unsigned char) block[i];
+    }
+    snprintf(block + 148, 8, "%06o", checksum);
+  }
+
+  int fd_;
+  std::vector<char> buffer_;
+  size_t used_ = 0;
+  time_t mtime_;
+};
+
+void write_tar_segment(const archive_batch_t& batch, const archive_segment_t& segment, const archive_file_t& file,
+                       tar_writer_t& tar)
+{
+  if (segment.first_entry == 0) tar.header(file.name.string(), file.size);
+  uint64_t run_length;
+  for (size_t i = segment.batch_entry; i < segment.batch_entry + segment.count; i++) {
+    const uint32_t slot = batch.slots[i];
+    if (slot == NO_SLOT) {
+      read_zero_run_entry(batch.entries.data() + i * BYTES_HASH, &run_length);
+      tar.zeros(run_length);
+    } else {
+      tar.write(batch.blocks.data() + slot * HASHING_BLOCK_SIZE, batch.block_lens[slot]);
+    }
+  }
+  if (segment.last) tar.pad(file.size);
+}
+
+} // anonimous namespace
+
+size_t restore_archive(const archive_options_t& options)
+{
+  size_t skipped = 0;
+  std::vector<archive_file_t> files = collect_files(options, &skipped);
+  const bool tar = options.target.empty();
+  const std::filesystem::path target = options.target;
+  const size_t threads = tar ? 1 : options.threads ? options.threads : std::max(1u, std::thread::hardware_concurrency());
+  if (!tar) {
+    for (const auto& file : files) {
+      std::filesystem::create_directories((target / file.name).parent_path());
+    }
+  }
+  tar_writer_t tar_writer(STDOUT_FILENO);
+  std::vector<std::vector<char>> buffers(threads, std::vector<char>(tar ? 0 : BUFFER_READ_SIZE));
+
+  // batch is written by writers while next one is resolved
+  archive_batch_t batches[2];
+  archive_totals_t totals;
+  if (tar) {
+    for (auto& sized : files) {
+      if (sized.sized) continue;
+      sized.size = measure_file(sized, batches[0], totals);
+      sized.sized = true;
+    }
+  }
+  std::vector<std::thread> writers;
+  std::atomic<size_t> next_segment;
+  auto join_writers = [&writers]() {
+    for (auto& writer : writers) {
+      writer.join();
+    }
+    writers.clear();
+  };
+  size_t file = 0;
+  uint64_t entry = 0;
+  for (size_t current = 0; plan_batch(files, file, entry, batches[current]); current ^= 1) {
+    resolve_batch(batches[current], totals);
+    place_segments(batches[current], files);
+    join_writers();
+    const archive_batch_t * batch = &batches[current];
+    next_segment = 0;
+    for (size_t i = 0; i < threads; i++) {
+      writers.emplace_back([&, i, batch]() {
+        for (size_t segment; (segment = next_segment++) < batch->segments.size();) {
+          const archive_segment_t& written = batch->segments[segment];
+          if (tar) {
+            write_tar_segment(*batch, written, files[written.file], tar_writer);
+          } else {
+            write_segment(*batch, written, files[written.file], target, buffers[i]);
+          }
+        }
+      });
+    }
+  }
+  join_writers();
+  if (tar) tar_writer.finish();
+  close_store_files();
+
+  uint64_t bytes = 0;
+  for (const auto& restored : files) {
+    bytes += restored.size;
+  }
+  std::cerr << "info: archive: restored files: " << files.size() << ", bytes: " << bytes
+            << ", skipped: " << skipped << ", entries: " << totals.entries << ", unique chunks: " << totals.slots
+            << ", read spans: " << totals.spans << ", read bytes: " << totals.readed << std::endl;
+  return files.size();
+}
@@ -0,0 +1,26 @@
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+#include <cstddef>
+#include <string>
+
+struct archive_options_t
+{
+  // stored file or directory relative to files dir, or list of stored names (one per line, "-" - stdin)
+  // when list is set
+  std::string source;
+  bool list = false;
+
+  // files are restored to target/name, empty - tar stream to stdout
+  std::string target;
+
+  // writing threads of target directory, 0 - count of CPUs
+  size_t threads = 0;
+};
+
+// restores latest versions of stored files with one session: chunks of batches of files are resolved
+// together, their records are readed in order of hash files and written by other threads.
+// prints summary to stderr, returns count of restored files
+size_t restore_archive(const archive_options_t& options);
+
+#endif // ARCHIVE_H
@@ -0,0 +1,815 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "bulk.h"
+#include "codec.h"
+#include "defines.h"
+#include "index.h"
+#include "replay.h"
+#include "stats.h"
+#include "store.h"
+#include "synthetic.h"
+#include "utils.h"
+
+namespace {
+
+using clock_type = std::chrono::steady_clock;
+
+struct bench_options_t
+{
+  bool micro = true;
+  bool e2e = true;
+  bool pg = false;
+  bool keep = false;
+  bool sparse = false;
+  size_t shards = 1; // of in-process index
+  size_t iterations = 2000;
+  synthetic_options_t synthetic;
+  std::string replay; // trace of --trace session, replayed instead of benchmarks
+};
+
+// one machine-readable result line
+class json_line_t
+{
+public:
+  explicit json_line_t(const char * benchmark)
+  {
+    out_ << std::setprecision(6) << "{\"benchmark\":\"" << benchmark << "\"";
+  }
+
+  ~json_line_t()
+  {
+    std::cout << out_.str() << "}" << std::endl;
+  }
+
+  template<typename T>
+  json_line_t& add(const char * key, T value)
+  {
+    out_ << ",\"" << key << "\":" << value;
+    return *this;
+  }
+
+  json_line_t& add(const char * key, const char * value)
+  {
+    out_ << ",\"" << key << "\":\"" << value << "\"";
+    return *this;
+  }
+
+private:
+  std::ostringstream out_;
+};
+
+class synthetic_buf_t : public std::streambuf
+{
+public:
+  explicit synthetic_buf_t(synthetic_stream_t& stream)
+    : stream_(stream)
+    , buf_(BUFFER_READ_SIZE, 0)
+  {
+  }
+
+protected:
+  int_type underflow() override
+  {
+    const size_t filled = stream_.read(buf_.data(), buf_.size());
+    if (filled == 0) return traits_type::eof();
+    setg(buf_.data(), buf_.data(), buf_.data() + filled);
+    return traits_type::to_int_type(*gptr());
+  }
+
+private:
+  synthetic_stream_t& stream_;
+  std::string buf_;
+};
+
+// compares written bytes with regenerated stream
+class verify_buf_t : public std::streambuf
+{
+public:
+  explicit verify_buf_t(synthetic_stream_t& stream)
+    : stream_(stream)
+  {
+  }
+
+  size_t mismatched() const { return mismatched_; }
+
+  size_t written() const { return written_; }
+
+protected:
+  std::streamsize xsputn(const char * s, std::streamsize n) override
+  {
+    if (expected_.size() < (size_t) n) expected_.resize(n);
+    const size_t filled = stream_.read(expected_.data(), n);
+    for (size_t i = 0; i < (size_t) n; i++) {
+      if (i >= filled || expected_[i] != s[i]) mismatched_++;
+    }
+    written_ += n;
+    return n;
+  }
+
+  int_type overflow(int_type c) override
+  {
+    if (c == traits_type::eof()) return traits_type::not_eof(c);
+    const char ch = traits_type::to_char_type(c);
+    xsputn(&ch, 1);
+    return c;
+  }
+
+private:
+  synthetic_stream_t& stream_;
+  std::string expected_;
+  size_t mismatched_ = 0;
+  size_t written_ = 0;
+};
+
+template<typename Operation>
+double measure(Operation operation)
+{
+  const auto start = clock_type::now();
+  operation();
+  return std::chrono::duration<double>(clock_type::now() - start).count();
+}
+
+size_t stored_bytes()
+{
+  size_t result = 0;
+  for (auto& entry : std::filesystem::directory_iterator(hashes_dir)) {
+    if (entry.is_regular_file() && check_valid_hash_filename(entry.path().filename()))
+      result += entry.file_size();
+  }
+  return result;
+}
+
+void bench_to_my_hex(size_t iterations)
+{
+  const size_t digests = 1024;
+  std::string raw(digests * BYTES_HASH, 0);
+  synthetic_stream_t::fill_block(raw.data(), raw.size(), 1);
+  std::string hex(digests * HASH_HEX_BYTES, 0);
+  const size_t allocs = stats_counter(COUNTER_ALLOCATIONS);
+  double seconds = measure([&]() {
+    for (size_t i = 0; i < iterations; i++) {
+      to_my_hex(hex.data(), (const unsigned char *) raw.data(), raw.size());
+    }
+  });
+  const size_t used = stats_counter(COUNTER_ALLOCATIONS) - allocs;
+  json_line_t("to_my_hex")
+    .add("digests", digests * iterations)
+    .add("ns_per_digest", seconds * 1e9 / (digests * iterations))
+    .add("mb_per_s", raw.size() * iterations / seconds / (1 << 20))
+    .add("allocations", used);
+}
+
+void bench_sort_my_hex(size_t iterations)
+{
+  for (size_t count : { 64, 4096 }) {
+    std::string raw(count * BYTES_HASH, 0);
+    std::string hex(count * HASH_HEX_BYTES, 0);
+    std::vector<size_t> indexes(count);
+    double seconds = 0;
+    const size_t allocs = stats_counter(COUNTER_ALLOCATIONS);
+    const size_t rounds = std::max<size_t>(1, iterations * 64 / count);
+    for (size_t i = 0; i < rounds; i++) {
+      synthetic_stream_t::fill_block(raw.data(), raw.size(), i + 1);
+      to_my_hex(hex.data(), (const unsigned char *) raw.data(), raw.size());
+      seconds += measure([&]() {
+        init_sort_indexes(indexes.data(), count);
+        sort_my_hex(hex.data(), HASH_HEX_BYTES, indexes.data(), count);
+      });
+    }
+    const size_t used = stats_counter(COUNTER_ALLOCATIONS) - allocs;
+    json_line_t("sort_my_hex")
+      .add("hexes", count)
+      .add("sorts", rounds)
+      .add("ns_per_hex", seconds * 1e9 / (count * rounds))
+      .add("allocations", used);
+  }
+}
+
+void bench_add_number(size_t iterations)
+{
+  std::vector<unsigned long long> numbers(4096);
+  uint64_t state = 1;
+  for (auto& number : numbers) {
+    state = state * 6364136223846793005ull + 1442695040888963407ull;
+    number = state >> (state % 64);
+  }
+  char buf[32];
+  size_t writed = 0;
+  const size_t allocs = stats_counter(COUNTER_ALLOCATIONS);
+  double seconds = measure([&]() {
+    for (size_t i = 0; i < iterations; i++) {
+      for (auto number : numbers) {
+        writed += add_number(buf, sizeof(buf), number);
+      }
+    }
+  });
+  const size_t used = stats_counter(COUNTER_ALLOCATIONS) - allocs;
+  json_line_t("add_number")
+    .add("numbers", numbers.size() * iterations)
+    .add("ns_per_number", seconds * 1e9 / (numbers.size() * iterations))
+    .add("digits", writed)
+    .add("allocations", used);
+}
+
+// variants of codec kernels, scalar one is former implementation of utils.
+// outputs of variants are compared with scalar ones
+void bench_codec(size_t iterations)
+{
+  const size_t digests = 1024;
+  std::string raw(digests * BYTES_HASH, 0);
+  synthetic_stream_t::fill_block(raw.data(), raw.size(), 1);
+  std::vector<unsigned long long> numbers(digests);
+  uint64_t state = 1;
+  for (auto& number : numbers) {
+    state = state * 6364136223846793005ull + 1442695040888963407ull;
+    number = state >> (state % 64);
+  }
+  std::string hex(digests * HASH_HEX_BYTES, 0);
+  std::string decimals(digests * 24, 0);
+  std::string list(digests * (HASH_HEX_BYTES + 3), 0);
+  std::string rows(digests * (HASH_HEX_BYTES + 48), 0);
+  std::string reference[4];
+  const codec_isa_t detected = codec_isa();
+  for (codec_isa_t isa : { CODEC_SCALAR, CODEC_SSE, CODEC_AVX2 }) {
+    if (!codec_isa_supported(isa)) continue;
+    codec_force_isa(isa);
+    const double hex_seconds = measure([&]() {
+      for (size_t i = 0; i < iterations; i++) {
+        codec_to_hex(hex.data(), (const unsigned char *) raw.data(), raw.size());
+      }
+    });
+    size_t decimals_size = 0;
+    const double number_seconds = measure([&]() {
+      for (size_t i = 0; i < iterations; i++) {
+        decimals_size = 0;
+        for (auto number : numbers) {
+          decimals_size += codec_add_number(decimals.data() + decimals_size, decimals.size() - decimals_size, number);
+        }
+      }
+    });
+    size_t list_size = 0;
+    const double list_seconds = measure([&]() {
+      for (size_t i = 0; i < iterations; i++) {
+        list_size = 0;
+        for (size_t begin = 0; begin < digests; begin += SELECT_MANY_HASHES_COUNT) {
+          const size_t count = std::min<size_t>(digests - begin, SELECT_MANY_HASHES_COUNT);
+          list_size += codec_add_hex_list(list.data() + list_size, list.size() - list_size,
+                                          hex.data() + begin * HASH_HEX_BYTES, count);
+        }
+      }
+    });
+    size_t rows_size = 0;
+    const double rows_seconds = measure([&]() {
+      for (size_t i = 0; i < iterations; i++) {
+        rows_size = 0;
+        for (size_t digest = 0; digest < digests; digest++) {
+          rows_size += codec_add_insert_row(rows.data() + rows_size, rows.size() - rows_size,
+                                            hex.data() + digest * HASH_HEX_BYTES, digest, numbers[digest]);
+        }
+      }
+    });
+    const std::string outputs[4] = { hex, decimals.substr(0, decimals_size), list.substr(0, list_size),
+                                      rows.substr(0, rows_size) };
+    size_t mismatches = 0;
+    for (size_t i = 0; i < 4; i++) {
+      if (isa == CODEC_SCALAR) reference[i] = outputs[i];
+      mismatches += outputs[i] != reference[i];
+    }
+    json_line_t("codec")
+      .add("isa", codec_isa_name(isa))
+      .add("hex_ns_per_digest", hex_seconds * 1e9 / (digests * iterations))
+      .add("number_ns", number_seconds * 1e9 / (digests * iterations))
+      .add("hex_list_ns_per_hex", list_seconds * 1e9 / (digests * iterations))
+      .add("insert_row_ns", rows_seconds * 1e9 / (digests * iterations))
+      .add("mismatches", mismatches);
+  }
+  codec_force_isa(detected);
+}
+
+void bench_sort_digests(size_t iterations)
+{
+  digest_sorter_t sorter;
+  for (size_t count : { 64, 4096 }) {
+    std::string raw(count * BYTES_HASH, 0);
+    std::vector<uint32_t> indexes(count);
+    double seconds = 0;
+    double std_seconds = 0;
+    size_t unsorted = 0;
+    const size_t allocs = stats_counter(COUNTER_ALLOCATIONS);
+    const size_t rounds = std::max<size_t>(1, iterations * 64 / count);
+    for (size_t i = 0; i < rounds; i++) {
+      synthetic_stream_t::fill_block(raw.data(), raw.size(), i + 1);
+      seconds += measure([&]() {
+        for (size_t index = 0; index < count; index++) {
+          indexes[index] = index;
+        }
+        sorter.sort((const unsigned char *) raw.data(), indexes.data(), count);
+      });
+      // comparison sort of full digests, which was used before
+      std_seconds += measure([&]() {
+        for (size_t index = 0; index < count; index++) {
+          indexes[index] = index;
+        }
+        std::sort(indexes.begin(), indexes.end(), [&raw](uint32_t a, uint32_t b) {
+          return memcmp(raw.data() + a * BYTES_HASH, raw.data() + b * BYTES_HASH, BYTES_HASH) < 0;
+        });
+      });
+      sorter.sort((const unsigned char *) raw.data(), indexes.data(), count);
+      for (size_t index = 1; index < count; index++) {
+        unsorted += memcmp(raw.data() + indexes[index - 1] * BYTES_HASH, raw.data() + indexes[index] * BYTES_HASH,
+                           BYTES_HASH) > 0;
+      }
+    }
+    const size_t used = stats_counter(COUNTER_ALLOCATIONS) - allocs;
+    json_line_t("sort_digests")
+      .add("digests", count)
+      .add("sorts", rounds)
+      .add("ns_per_digest", seconds * 1e9 / (count * rounds))
+      .add("std_sort_ns_per_digest", std_seconds * 1e9 / (count * rounds))
+      .add("unsorted", unsorted)
+      .add("allocations", used);
+  }
+}
+
+void bench_save_and_fill(size_t iterations)
+{
+  const size_t buffers = std::max<size_t>(1, iterations / 20);
+  synthetic_options_t unique_options;
+  unique_options.duplicate_ratio = 0;
+  unique_options.total_bytes = buffers * BUFFER_READ_SIZE;
+  synthetic_stream_t unique(unique_options);
+  std::string data(BUFFER_READ_SIZE, 0);
+  const std::filesystem::path recipe = files_dir / "micro_save_buffer";
+
+  for (const char * variant : { "unique", "duplicate" }) {
+    std::filesystem::remove(recipe);
+    open_output_hash_file();
+    requested_file = openfile(recipe.c_str(), O_APPEND | O_WRONLY | O_CREAT);
+    unique.reset();
+    double seconds = 0;
+    const size_t allocs = stats_counter(COUNTER_ALLOCATIONS);
+    const size_t round_trips = hash_index->round_trips();
+    for (size_t i = 0; i < buffers; i++) {
+      const size_t filled = unique.read(data.data(), data.size());
+      seconds += measure([&]() { save_buffer((const unsigned char *) data.data(), filled); });
+    }
+    const size_t used = stats_counter(COUNTER_ALLOCATIONS) - allocs;
+    json_line_t("save_buffer")
+      .add("variant", variant)
+      .add("buffers", buffers)
+      .add("buffer_bytes", BUFFER_READ_SIZE)
+      .add("us_per_buffer", seconds * 1e6 / buffers)
+      .add("mb_per_s", buffers * BUFFER_READ_SIZE / seconds / (1 << 20))
+      .add("db_round_trips", hash_index->round_trips() - round_trips)
+      .add("allocations_per_buffer", (double) used / buffers);
+    close_store_files();
+  }
+
+  requested_file = openfile(recipe.c_str(), O_RDONLY);
+  std::string hashes(buffers * READED_BLOCKS * BYTES_HASH, 0);
+  const ssize_t readed = requested_file->read(hashes.data(), hashes.size());
+  soft_assert(readed > 0);
+  const size_t all_hashes = readed / BYTES_HASH;
+  size_t filled = 0;
+  const size_t allocs = stats_counter(COUNTER_ALLOCATIONS);
+  const size_t round_trips = hash_index->round_trips();
+  double seconds = measure([&]() {
+    for (size_t current = 0; current < all_hashes;) {
+      size_t nhashes = all_hashes - current;
+      filled += fill_buffer_from_hashes(data.data(), data.size(), hashes.data() + current * BYTES_HASH, &nhashes);
+      current += nhashes;
+    }
+  });
+  const size_t used = stats_counter(COUNTER_ALLOCATIONS) - allocs;
+  json_line_t("fill_buffer_from_hashes")
+    .add("hashes", all_hashes)
+    .add("ns_per_hash", seconds * 1e9 / all_hashes)
+    .add("mb_per_s", filled / seconds / (1 << 20))
+    .add("db_round_trips", hash_index->round_trips() - round_trips)
+    .add("allocations_per_mb", used / (filled / (double) (1 << 20)));
+  close_store_files();
+}
+
+void bench_end_to_end(const synthetic_options_t& options, const char * index_name)
+{
+  synthetic_stream_t stream(options);
+  const std::filesystem::path recipe =
+    files_dir / ("e2e_" + std::to_string(options.seed) + "_" + std::to_string(getpid()));
+  std::filesystem::remove(recipe);
+  const double megabytes = options.total_bytes / (double) (1 << 20);
+  const double chunks = options.total_bytes / (double) HASHING_BLOCK_SIZE;
+  const size_t stored_before = stored_bytes();
+
+  size_t allocs = stats_counter(COUNTER_ALLOCATIONS);
+  size_t round_trips = hash_index->round_trips() + (hook_index ? hook_index->round_trips() : 0);
+  // sparse index has row per hook, dense one - per unique chunk
+  const size_t rows = stats_counter(sparse_index ? COUNTER_SPARSE_HOOKS : COUNTER_UNIQUE_CHUNKS);
+  {
+    synthetic_buf_t buf(stream);
+    std::istream in(&buf);
+    const double seconds = measure([&]() { write_stored_file(recipe, in); });
+    const size_t used = stats_counter(COUNTER_ALLOCATIONS) - allocs;
+    const size_t stored = stored_bytes() - stored_before;
+    json_line_t("ingest")
+      .add("index", index_name)
+      .add("durability", commit_options.durability == DURABILITY_GROUP ? "group" : "relaxed")
+      .add("delta", delta_compression ? "on" : "off")
+      .add("sparse", sparse_index ? "on" : "off")
+      .add("bytes", options.total_bytes)
+      .add("duplicate_ratio", options.duplicate_ratio)
+      .add("locality", options.locality)
+      .add("edit_ratio", options.edit_ratio)
+      .add("shift_ratio", options.shift_ratio)
+      .add("zero_ratio", options.zero_ratio)
+      .add("seconds", seconds)
+      .add("mb_per_s", megabytes / seconds)
+      .add("chunks_per_s", chunks / seconds)
+      .add("db_round_trips", hash_index->round_trips() + (hook_index ? hook_index->round_trips() : 0) - round_trips)
+      .add("allocations_per_mb", used / megabytes)
+      .add("index_rows", stats_counter(sparse_index ? COUNTER_SPARSE_HOOKS : COUNTER_UNIQUE_CHUNKS) - rows)
+      .add("stored_bytes", stored)
+      .add("recipe_bytes", std::filesystem::file_size(recipe));
+  }
+
+  stream.reset();
+  allocs = stats_counter(COUNTER_ALLOCATIONS);
+  round_trips = hash_index->round_trips();
+  {
+    verify_buf_t buf(stream);
+    std::ostream out(&buf);
+    const double seconds = measure([&]() { read_stored_file(recipe, out); });
+    const size_t used = stats_counter(COUNTER_ALLOCATIONS) - allocs;
+    json_line_t("restore")
+      .add("index", index_name)
+      .add("bytes", buf.written())
+      .add("seconds", seconds)
+      .add("mb_per_s", megabytes / seconds)
+      .add("chunks_per_s", chunks / seconds)
+      .add("db_round_trips", hash_index->round_trips() - round_trips)
+      .add("allocations_per_mb", used / megabytes)
+      .add("mismatched_bytes", buf.mismatched() + (options.total_bytes - std::min(options.total_bytes, buf.written())));
+  }
+
+  // 4 KiB ranges spread over file, last one crosses end of file
+  const size_t range_length = 4096;
+  const size_t ranges = 16;
+  std::string expected(range_length, 0);
+  size_t mismatched = 0;
+  double seconds = 0;
+  round_trips = hash_index->round_trips();
+  for (size_t i = 1; i <= ranges; i++) {
+    const size_t offset = options.total_bytes / ranges * i - (i == ranges ? range_length / 2 : 777 * i);
+    std::ostringstream out;
+    seconds += measure([&]() { read_stored_range(recipe, offset, range_length, out); });
+    stream.reset();
+    for (size_t skipped = 0; skipped < offset;) {
+      skipped += stream.read(expected.data(), std::min(range_length, offset - skipped));
+    }
+    const size_t length = stream.read(expected.data(), range_length);
+    const std::string restored = out.str();
+    mismatched += restored.size() == length ? 0 : range_length;
+    for (size_t j = 0; j < std::min(length, restored.size()); j++) {
+      mismatched += restored[j] != expected[j];
+    }
+  }
+  json_line_t("restore_range")
+    .add("index", index_name)
+    .add("range_bytes", range_length)
+    .add("ranges", ranges)
+    .add("us_per_range", seconds * 1e6 / ranges)
+    .add("db_round_trips_per_range", (hash_index->round_trips() - round_trips) / (double) ranges)
+    .add("mismatched_bytes", mismatched);
+}
+
+// second version of synthetic stream with edited blocks stored with update_stored_file,
+// both versions are restored and compared
+void bench_update(const synthetic_options_t& options, const std::filesystem::path& root, const char * index_name)
+{
+  synthetic_options_t edited = options;
+  edited.edit_ratio = std::max(options.edit_ratio, 0.01);
+  const std::filesystem::path file = files_dir / ("update_" + std::to_string(getpid()));
+  size_t mismatched = 0;
+  double seconds = 0;
+  size_t round_trips = 0;
+  size_t previous_chunks = 0;
+  for (const synthetic_options_t& version : { options, edited }) {
+    const std::filesystem::path input = root / "update_input";
+    {
+      synthetic_stream_t stream(version);
+      std::ofstream out(input, std::ios::binary);
+      std::string buf(BUFFER_READ_SIZE, 0);
+      size_t length;
+      while ((length = stream.read(buf.data(), buf.size())) > 0) out.write(buf.data(), length);
+    }
+    const int fd = open(input.c_str(), O_RDONLY);
+    soft_assert(fd >= 0);
+    round_trips = hash_index->round_trips();
+    previous_chunks = stats_counter(COUNTER_PREVIOUS_CHUNKS);
+    seconds = measure([&]() { update_stored_file(file, fd); });
+    round_trips = hash_index->round_trips() - round_trips;
+    previous_chunks = stats_counter(COUNTER_PREVIOUS_CHUNKS) - previous_chunks;
+    close(fd);
+    std::filesystem::remove(input);
+  }
+  for (uint64_t version = 1; version <= 2; version++) {
+    synthetic_stream_t stream(version == 1 ? options : edited);
+    verify_buf_t buf(stream);
+    std::ostream out(&buf);
+    read_stored_file(stored_version_path(file, version), out);
+    mismatched += buf.mismatched() + (options.total_bytes - std::min(options.total_bytes, buf.written()));
+  }
+  json_line_t("update")
+    .add("index", index_name)
+    .add("bytes", options.total_bytes)
+    .add("edit_ratio", edited.edit_ratio)
+    .add("seconds", seconds)
+    .add("mb_per_s", options.total_bytes / seconds / (1 << 20))
+    .add("db_round_trips", round_trips)
+    .add("previous_version_chunks", previous_chunks)
+    .add("versions", stored_versions(file))
+    .add("mismatched_bytes", mismatched);
+}
+
+// tree of small files with content of synthetic stream, stored with bulk_store_files
+void bench_bulk(const synthetic_options_t& options, const std::filesystem::path& root, const char * index_name)
+{
+  const size_t file_size = 4096 + 100;
+  const size_t count = std::max<size_t>(options.total_bytes / file_size / 4, 16);
+  const std::filesystem::path source = root / "bulk_source";
+  synthetic_stream_t stream(options);
+  std::string content(file_size, 0);
+  for (size_t i = 0; i < count; i++) {
+    const std::filesystem::path path = source / std::to_string(i % 16) / std::to_string(i);
+    std::filesystem::create_directories(path.parent_path());
+    const size_t length = stream.read(content.data(), file_size - i % 64);
+    std::ofstream(path, std::ios::binary).write(content.data(), length);
+  }
+
+  bulk_options_t bulk_options;
+  bulk_options.source = source;
+  bulk_options.prefix = "bulk_" + std::to_string(options.seed) + "_" + std::to_string(getpid());
+  size_t allocs = stats_counter(COUNTER_ALLOCATIONS);
+  size_t round_trips = hash_index->round_trips();
+  std::ostringstream summary;
+  const double seconds = measure([&]() {
+    std::streambuf * cout_buf = std::cout.rdbuf(summary.rdbuf());
+    bulk_store_files(bulk_options);
+    std::cout.rdbuf(cout_buf);
+  });
+  const size_t used = stats_counter(COUNTER_ALLOCATIONS) - allocs;
+  const size_t trips = hash_index->round_trips() - round_trips;
+
+  size_t mismatched_files = 0;
+  for (size_t i = 0; i < count; i++) {
+    const std::filesystem::path name = std::to_string(i % 16) / std::filesystem::path(std::to_string(i));
+    std::ifstream in(source / name, std::ios::binary);
+    const std::string expected((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    std::ostringstream out;
+    read_stored_file(files_dir / bulk_options.prefix / name, out);
+    mismatched_files += out.str() != expected;
+  }
+  json_line_t("bulk_ingest")
+    .add("index", index_name)
+    .add("files", count)
+    .add("seconds", seconds)
+    .add("files_per_s", count / seconds)
+    .add("db_round_trips", trips)
+    .add("allocations_per_file", used / (double) count)
+    .add("mismatched_files", mismatched_files);
+}
+
+// ingest of synthetic stream saved to file through istream, mapped file and pipe,
+// blocks are already stored by bench_end_to_end, so only input path differs
+void bench_file_ingest(const synthetic_options_t& options, const std::filesystem::path& root, const char * index_name)
+{
+  const std::filesystem::path input = root / "input";
+  {
+    synthetic_stream_t stream(options);
+    std::ofstream out(input, std::ios::binary);
+    std::string buf(BUFFER_READ_SIZE, 0);
+    size_t length;
+    while ((length = stream.read(buf.data(), buf.size())) > 0) out.write(buf.data(), length);
+  }
+  const double megabytes = options.total_bytes / (double) (1 << 20);
+  std::string expected;
+  for (const char * source : { "istream", "mapped", "pipe" }) {
+    const std::filesystem::path recipe =
+      files_dir / ("input_" + std::string(source) + "_" + std::to_string(getpid()));
+    std::filesystem::remove(recipe);
+    double seconds;
+    const size_t allocs = stats_counter(COUNTER_ALLOCATIONS);
+    if (!strcmp(source, "istream")) {
+      std::ifstream in(input, std::ios::binary);
+      seconds = measure([&]() { write_stored_file(recipe, in); });
+    } else if (!strcmp(source, "mapped")) {
+      const int fd = open(input.c_str(), O_RDONLY);
+      soft_assert(fd >= 0);
+      seconds = measure([&]() { write_stored_file(recipe, fd); });
+      close(fd);
+    } else {
+      int fds[2];
+      soft_assert(pipe(fds) == 0);
+      std::thread writer([&]() {
+        std::ifstream in(input, std::ios::binary);
+        std::string buf(BUFFER_READ_SIZE, 0);
+        while (in.read(buf.data(), buf.size()) || in.gcount() > 0) {
+          for (ssize_t done = 0; done < in.gcount();) {
+            const ssize_t written = write(fds[1], buf.data() + done, in.gcount() - done);
+            if (written <= 0) break;
+            done += written;
+          }
+        }
+        close(fds[1]);
+      });
+      seconds = measure([&]() { write_stored_file(recipe, fds[0]); });
+      writer.join();
+      close(fds[0]);
+    }
+    const size_t used = stats_counter(COUNTER_ALLOCATIONS) - allocs;
+    std::ifstream in(recipe, std::ios::binary);
+    const std::string recipe_content((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    if (expected.empty()) expected = recipe_content;
+    json_line_t("file_ingest")
+      .add("index", index_name)
+      .add("source", source)
+      .add("bytes", options.total_bytes)
+      .add("seconds", seconds)
+      .add("mb_per_s", megabytes / seconds)
+      .add("allocations_per_mb", used / megabytes)
+      .add("recipe_mismatch", recipe_content != expected);
+  }
+  std::filesystem::remove(input);
+}
+
+// recorded session is repeated on fresh store, outcomes and locality of reads are compared with recorded ones
+void bench_replay(const std::string& trace, const char * index_name)
+{
+  const size_t allocs = stats_counter(COUNTER_ALLOCATIONS);
+  const replay_result_t result = replay_trace(trace, "replay_" + std::to_string(getpid()));
+  const size_t used = stats_counter(COUNTER_ALLOCATIONS) - allocs;
+  const double megabytes = result.ingested_bytes / (double) (1 << 20);
+  json_line_t("replay_ingest")
+    .add("index", index_name)
+    .add("buffers", result.buffers)
+    .add("chunks", result.chunks)
+    .add("bytes", result.ingested_bytes)
+    .add("warmup_chunks", result.warmup_chunks)
+    .add("seconds", result.ingest_seconds)
+    .add("mb_per_s", result.ingest_seconds > 0 ? megabytes / result.ingest_seconds : 0)
+    .add("db_round_trips", result.ingest_round_trips)
+    .add("outcome_mismatches", result.outcome_mismatches);
+  json_line_t("replay_restore")
+    .add("index", index_name)
+    .add("fills", result.fills)
+    .add("reads", result.reads)
+    .add("bytes", result.restored_bytes)
+    .add("seconds", result.restore_seconds)
+    .add("mb_per_s", result.restore_seconds > 0 ? result.restored_bytes / result.restore_seconds / (1 << 20) : 0)
+    .add("db_round_trips", result.restore_round_trips)
+    .add("recorded_near_reads", result.recorded_near_reads)
+    .add("replayed_near_reads", result.replayed_near_reads)
+    .add("mismatched_bytes", result.mismatched_bytes)
+    .add("allocations", used);
+}
+
+void print_help()
+{
+  std::cout << "usage: benchmark [--micro|--e2e|--replay trace] [--pg] [--keep] [--stats] [--relaxed] [--delta] [--sparse] [--shards N] [--iterations N] [--size MiB]"
+               " [--dup ratio] [--locality ratio] [--edit ratio] [--shift ratio] [--zero ratio] [--seed N]"
+               "\nprints one JSON object per line for each benchmark."
+               "\n\"--micro\" runs only kernels benchmarks, \"--e2e\" - only ingest and restore of synthetic data,"
+               " ingest of it from file and pipe, update to edited version and bulk ingest of small files."
+               "\n\"--replay\" repeats session recorded by \"--trace\" of server with synthetic blocks of its seeds,"
+               " blocks found by recorded session without storing them are stored before."
+               "\n\"--pg\" uses DB from db_connection.txt instead of in-process index,"
+               " benchmark rows are left in DB, use dedicated database."
+               "\n\"--stats\" prints server counters and stage timings to stderr at exit."
+               "\n\"--relaxed\" ingests without syncing files before index commits."
+               "\n\"--delta\" stores new blocks similar to stored ones as deltas."
+               "\n\"--sparse\" indexes only hooks of segments in end-to-end benchmarks."
+               "\n\"--shards\" spreads in-process index over N shards, \"--pg\" takes shards from db_connection.txt."
+               "\nstore files are created in temporary directory, removed at exit without \"--keep\".\n";
+}
+
+} // anonimous namespace
+
+int main(int argc, char ** argv)
+{
+  bench_options_t options;
+  options.synthetic.total_bytes = 16 * 1024 * 1024;
+  auto option_value = [argc, argv](int& i) -> const char * {
+    if (i + 1 >= argc) {
+      exit_error(wrap_ostringstream("error: value of \"" << argv[i] << "\" not found, aborted..."), 3);
+    }
+    return argv[++i];
+  };
+  for (int i = 1; i < argc; i++) {
+    if (!(strcmp(argv[i], "-h") && strcmp(argv[i], "--help"))) {
+      print_help();
+      return 0;
+    } else if (!strcmp(argv[i], "--micro")) {
+      options.e2e = false;
+    } else if (!strcmp(argv[i], "--e2e")) {
+      options.micro = false;
+    } else if (!strcmp(argv[i], "--pg")) {
+      options.pg = true;
+    } else if (!strcmp(argv[i], "--stats")) {
+      stats_print_at_exit();
+    } else if (!strcmp(argv[i], "--keep")) {
+      options.keep = true;
+    } else if (!strcmp(argv[i], "--shards")) {
+      options.shards = std::clamp<long long>(atoll(option_value(i)), 1, INDEX_MAX_SHARDS);
+    } else if (!strcmp(argv[i], "--relaxed")) {
+      commit_options.durability = DURABILITY_RELAXED;
+    } else if (!strcmp(argv[i], "--delta")) {
+      delta_compression = true;
+    } else if (!strcmp(argv[i], "--sparse")) {
+      options.sparse = true;
+    } else if (!strcmp(argv[i], "--iterations")) {
+      options.iterations = atoll(option_value(i));
+    } else if (!strcmp(argv[i], "--size")) {
+      options.synthetic.total_bytes = atof(option_value(i)) * 1024 * 1024;
+    } else if (!strcmp(argv[i], "--dup")) {
+      options.synthetic.duplicate_ratio = atof(option_value(i));
+    } else if (!strcmp(argv[i], "--locality")) {
+      options.synthetic.locality = atof(option_value(i));
+    } else if (!strcmp(argv[i], "--zero")) {
+      options.synthetic.zero_ratio = atof(option_value(i));
+    } else if (!strcmp(argv[i], "--edit")) {
+      options.synthetic.edit_ratio = atof(option_value(i));
+    } else if (!strcmp(argv[i], "--shift")) {
+      options.synthetic.shift_ratio = atof(option_value(i));
+    } else if (!strcmp(argv[i], "--seed")) {
+      options.synthetic.seed = atoll(option_value(i));
+    } else if (!strcmp(argv[i], "--replay")) {
+      options.replay = option_value(i);
+      options.micro = false;
+      options.e2e = false;
+    } else {
+      exit_error(wrap_ostringstream("error: unknown parameter \"" << argv[i] << "\", aborted..."), 3);
+    }
+  }
+
+  const std::filesystem::path root =
+    std::filesystem::temp_directory_path() / ("deduplication_bench_" + std::to_string(getpid()));
+  init_store_dirs(root / "files", root / "hashes", root / "offsets");
+  sparse_index = options.sparse;
+  if (options.sparse) {
+    delta_compression = false;
+    if (!options.pg) hook_index = std::make_unique<memory_hash_index_t>();
+  }
+  if (options.pg) {
+    connect_store("db_connection.txt");
+  } else if (options.shards > 1) {
+    std::vector<std::unique_ptr<hash_index_t>> shards;
+    for (size_t i = 0; i < options.shards; i++) {
+      shards.push_back(std::make_unique<memory_hash_index_t>());
+    }
+    hash_index = std::make_unique<sharded_hash_index_t>(std::move(shards));
+  } else {
+    hash_index = std::make_unique<memory_hash_index_t>();
+  }
+  const size_t shards = options.pg ? shard_conns.size() : options.shards;
+  const std::string index_label = std::string(options.pg ? "pg" : "memory")
+                                + (shards > 1 ? "_" + std::to_string(shards) + "_shards" : "");
+  const char * index_name = index_label.c_str();
+
+  // micro benchmarks and replayed fills find blocks by index, so sparse index is used only end-to-end
+  sparse_index = false;
+  if (!options.replay.empty()) {
+    bench_replay(options.replay, index_name);
+  }
+  if (options.micro) {
+    bench_to_my_hex(options.iterations);
+    bench_sort_my_hex(options.iterations);
+    bench_add_number(options.iterations);
+    bench_codec(options.iterations);
+    bench_sort_digests(options.iterations);
+    bench_save_and_fill(options.iterations);
+  }
+  if (options.e2e) {
+    sparse_index = options.sparse;
+    bench_end_to_end(options.synthetic, index_name);
+    bench_file_ingest(options.synthetic, root, index_name);
+    bench_update(options.synthetic, root, index_name);
+    bench_bulk(options.synthetic, root, index_name);
+  }
+
+  soft_close_all();
+  if (!options.keep) std::filesystem::remove_all(root);
+  return 0;
+}
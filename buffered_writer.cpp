@@ -0,0 +1,72 @@
+#include "buffered_writer.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include <errno.h>
+#include <unistd.h>
+
+#include "stats.h"
+#include "store.h"
+
+buffered_writer_t::buffered_writer_t(size_t capacity)
+  : buffer_(capacity)
+{
+}
+
+void buffered_writer_t::set_engine(io_engine_t * engine)
+{
+  engine_ = engine;
+  if (engine_) engine_->register_buffer(buffer_.data(), buffer_.size());
+}
+
+void buffered_writer_t::attach(int fd, off_t offset)
+{
+  flush();
+  fd_ = fd;
+  offset_ = offset;
+}
+
+void buffered_writer_t::detach()
+{
+  flush();
+  fd_ = -1;
+  offset_ = 0;
+}
+
+void buffered_writer_t::append(const char * data, size_t len)
+{
+  while (len > 0) {
+    if (used_ == buffer_.size()) flush();
+    const size_t part = std::min(len, buffer_.size() - used_);
+    memcpy(buffer_.data() + used_, data, part);
+    used_ += part;
+    data += part;
+    len -= part;
+  }
+}
+
+void buffered_writer_t::flush()
+{
+  if (used_ == 0) return;
+  soft_assert(fd_ >= 0);
+  if (engine_) {
+    io_request_t request = { fd_, buffer_.data(), used_, offset_, true, 0 };
+    engine_->run(&request, 1);
+    if (request.result != (ssize_t) used_) {
+      exit_error(wrap_ostringstream("error: can't write " << used_ << " bytes, result: " << request.result), 10);
+    }
+  } else {
+    for (size_t writed = 0; writed < used_;) {
+      stats_add(COUNTER_SYSCALLS);
+      const ssize_t result = pwrite(fd_, buffer_.data() + writed, used_ - writed, offset_ + writed);
+      if (result < 0 && errno == EINTR) continue;
+      if (result <= 0) {
+        exit_error(wrap_ostringstream("error: can't write " << used_ << " bytes, errno: " << errno), 10);
+      }
+      writed += result;
+    }
+  }
+  offset_ += used_;
+  used_ = 0;
+}
@@ -0,0 +1,53 @@
+#ifndef BUFFERED_WRITER_H
+#define BUFFERED_WRITER_H
+
+#include <cstddef>
+#include <vector>
+
+#include <sys/types.h>
+
+#include "io_engine.h"
+
+// appends records to end of attached file by large writes,
+// offset of file end is tracked in memory, file is not seeked
+class buffered_writer_t
+{
+public:
+  explicit buffered_writer_t(size_t capacity);
+
+  // flushes are done by engine, buffer is registered in it
+  void set_engine(io_engine_t * engine);
+
+  // flushes previous file, appends go to fd from offset
+  void attach(int fd, off_t offset);
+
+  // flushes and forgets file, should be called before file closing
+  void detach();
+
+  int fd() const { return fd_; }
+
+  // offset of next appended byte in file
+  off_t offset() const { return offset_ + used_; }
+
+  // space for len <= capacity bytes of record, record is appended by commit(len)
+  char * reserve(size_t len)
+  {
+    if (used_ + len > buffer_.size()) flush();
+    return buffer_.data() + used_;
+  }
+
+  void commit(size_t len) { used_ += len; }
+
+  void append(const char * data, size_t len);
+
+  void flush();
+
+private:
+  std::vector<char> buffer_;
+  size_t used_ = 0;
+  int fd_ = -1;
+  off_t offset_ = 0;
+  io_engine_t * engine_ = nullptr;
+};
+
+#endif // BUFFERED_WRITER_H
@@ -0,0 +1,278 @@
+#include "bulk.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <streambuf>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+#include "defines.h"
+#include "stats.h"
+#include "store.h"
+
+namespace {
+
+struct bulk_entry_t
+{
+  std::filesystem::path source;
+  std::filesystem::path name; // relative to files_dir
+};
+
+// stored file name must stay inside files_dir
+bool valid_name(const std::filesystem::path& name)
+{
+  if (name.empty() || name.is_absolute()) return false;
+  for (const auto& part : name) {
+    if (part == "..") return false;
+  }
+  return true;
+}
+
+// directories are taken from shared queue by all threads
+std::vector<bulk_entry_t> walk_directory(const std::filesystem::path& root, const std::filesystem::path& prefix,
+                                         size_t threads)
+{
+  std::mutex mutex;
+  std::condition_variable changed;
+  std::deque<std::filesystem::path> directories = { root };
+  size_t walking = 0;
+  std::vector<bulk_entry_t> entries;
+  auto walker = [&]() {
+    std::vector<std::filesystem::path> found_directories;
+    std::vector<bulk_entry_t> found_entries;
+    std::unique_lock lock(mutex);
+    while (true) {
+      changed.wait(lock, [&]() { return !directories.empty() || walking == 0; });
+      if (directories.empty()) return;
+      const std::filesystem::path directory = std::move(directories.front());
+      directories.pop_front();
+      walking++;
+      lock.unlock();
+      std::error_code error;
+      for (std::filesystem::directory_iterator it(directory, error), end; !error && it != end; it.increment(error)) {
+        // symlinks are not followed
+        const auto status = it->symlink_status(error);
+        if (error) break;
+        if (std::filesystem::is_directory(status)) {
+          found_directories.push_back(it->path());
+        } else if (std::filesystem::is_regular_file(status)) {
+          found_entries.push_back({ it->path(), prefix / it->path().lexically_relative(root) });
+        }
+      }
+      if (error) {
+        std::cerr << "warn: can't read directory " << directory << ": " << error.message() << "\n";
+      }
+      lock.lock();
+      walking--;
+      directories.insert(directories.end(), found_directories.begin(), found_directories.end());
+      entries.insert(entries.end(), std::make_move_iterator(found_entries.begin()),
+                     std::make_move_iterator(found_entries.end()));
+      found_directories.clear();
+      found_entries.clear();
+      changed.notify_all();
+    }
+  };
+  std::vector<std::thread> workers;
+  for (size_t i = 0; i < threads; i++) {
+    workers.emplace_back(walker);
+  }
+  for (auto& worker : workers) {
+    worker.join();
+  }
+  // same tree gives same order of stored blocks
+  std::sort(entries.begin(), entries.end(), [](const bulk_entry_t& a, const bulk_entry_t& b) {
+    return a.name < b.name;
+  });
+  return entries;
+}
+
+std::vector<bulk_entry_t> read_list(const std::string& list, const std::filesystem::path& prefix)
+{
+  std::ifstream list_file;
+  if (list != "-") {
+    list_file.open(list);
+    if (!list_file) {
+      exit_error(wrap_ostringstream("error: can't open list " << list << ", aborted..."), 6);
+    }
+  }
+  std::istream& in = list == "-" ? std::cin : list_file;
+  std::vector<bulk_entry_t> entries;
+  std::string line;
+  while (std::getline(in, line)) {
+    if (line.empty()) continue;
+    const std::filesystem::path source = line;
+    std::error_code error;
+    if (!std::filesystem::is_regular_file(source, error)) {
+      std::cerr << "warn: " << source << " is not regular file, skipped\n";
+      continue;
+    }
+    entries.push_back({ source, prefix / source.relative_path().lexically_normal() });
+  }
+  return entries;
+}
+
+// read ahead files, bounded by BULK_PREFETCH_BYTES
+class prefetcher_t
+{
+public:
+  struct item_t
+  {
+    bool loaded = false;
+    std::string data;
+  };
+
+  explicit prefetcher_t(const std::vector<bulk_entry_t>& entries)
+    : entries_(entries)
+    , thread_([this]() { run(); })
+  {
+  }
+
+  ~prefetcher_t()
+  {
+    {
+      std::lock_guard lock(mutex_);
+      stopped_ = true;
+    }
+    changed_.notify_all();
+    thread_.join();
+  }
+
+  // items are taken in order of entries
+  item_t take()
+  {
+    std::unique_lock lock(mutex_);
+    changed_.wait(lock, [this]() { return !ready_.empty(); });
+    item_t item = std::move(ready_.front());
+    ready_.pop_front();
+    buffered_ -= item.data.size();
+    changed_.notify_all();
+    return item;
+  }
+
+private:
+  void run()
+  {
+    for (const auto& entry : entries_) {
+      item_t item;
+      std::error_code error;
+      const auto size = std::filesystem::file_size(entry.source, error);
+      if (!error && size <= BULK_PREFETCH_FILE_LIMIT) {
+        std::unique_lock lock(mutex_);
+        changed_.wait(lock, [this, size]() { return stopped_ || buffered_ + size <= BULK_PREFETCH_BYTES; });
+        if (stopped_) return;
+        buffered_ += size;
+        lock.unlock();
+        std::ifstream in(entry.source, std::ios::binary);
+        item.data.resize(size);
+        in.read(item.data.data(), size);
+        item.loaded = in && (size_t) in.gcount() == size && in.peek() == std::char_traits<char>::eof();
+        if (!item.loaded) {
+          lock.lock();
+          buffered_ -= size;
+          lock.unlock();
+          item.data.clear();
+        }
+      }
+      std::lock_guard lock(mutex_);
+      if (stopped_) return;
+      ready_.push_back(std::move(item));
+      changed_.notify_all();
+    }
+  }
+
+  const std::vector<bulk_entry_t>& entries_;
+  std::mutex mutex_;
+  std::condition_variable changed_;
+  std::deque<item_t> ready_;
+  size_t buffered_ = 0;
+  bool stopped_ = false;
+  std::thread thread_;
+};
+
+class memory_buf_t : public std::streambuf
+{
+public:
+  explicit memory_buf_t(std::string& data)
+  {
+    setg(data.data(), data.data(), data.data() + data.size());
+  }
+};
+
+} // anonimous namespace
+
+void bulk_store_files(const bulk_options_t& options)
+{
+  const size_t threads = options.threads ? options.threads : std::max(1u, std::thread::hardware_concurrency());
+  std::vector<bulk_entry_t> entries;
+  if (options.list) {
+    entries = read_list(options.source, options.prefix);
+  } else {
+    const std::filesystem::path root = std::filesystem::path(options.source).lexically_normal();
+    if (!std::filesystem::is_directory(root)) {
+      exit_error(wrap_ostringstream("error: " << root << " is not directory, aborted..."), 6);
+    }
+    std::filesystem::path prefix = options.prefix;
+    if (prefix.empty()) {
+      prefix = root.has_filename() ? root.filename() : root.parent_path().filename();
+    }
+    entries = walk_directory(root, prefix, threads);
+  }
+
+  size_t skipped = 0;
+  std::vector<bulk_entry_t> storing;
+  storing.reserve(entries.size());
+  std::unordered_set<std::string> names; // names of storing, list can repeat them
+  for (auto& entry : entries) {
+    if (!valid_name(entry.name)) {
+      std::cerr << "warn: bad stored name " << entry.name << " of " << entry.source << ", skipped\n";
+      skipped++;
+    } else if (std::filesystem::exists(files_dir / entry.name)) {
+      std::cerr << "warn: file " << entry.name << " exists, skipped\n";
+      skipped++;
+    } else if (!names.insert(entry.name.lexically_normal().string()).second) {
+      std::cerr << "warn: file " << entry.name << " of " << entry.source << " is repeated in list, skipped\n";
+      skipped++;
+    } else {
+      storing.push_back(std::move(entry));
+    }
+  }
+
+  size_t stored = 0;
+  size_t bytes = 0;
+  open_output_hash_file();
+  begin_commit_groups();
+  {
+    prefetcher_t prefetcher(storing);
+    for (const auto& entry : storing) {
+      prefetcher_t::item_t item = prefetcher.take();
+      const std::filesystem::path file = files_dir / entry.name;
+      std::filesystem::create_directories(file.parent_path());
+      const size_t bytes_before = stats_counter(COUNTER_BYTES_INGESTED);
+      if (item.loaded) {
+        memory_buf_t buf(item.data);
+        std::istream in(&buf);
+        store_stream(file, in);
+      } else {
+        std::ifstream in(entry.source, std::ios::binary);
+        if (!in) {
+          std::cerr << "warn: can't open " << entry.source << ", skipped\n";
+          skipped++;
+          continue;
+        }
+        store_stream(file, in);
+      }
+      bytes += stats_counter(COUNTER_BYTES_INGESTED) - bytes_before;
+      stored++;
+      rotate_output_hash_file();
+    }
+  }
+  end_commit_groups();
+  close_store_files();
+  std::cout << "bulk: stored files: " << stored << ", bytes: " << bytes << ", skipped: " << skipped << std::endl;
+}
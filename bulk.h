@@ -0,0 +1,24 @@
+#ifndef BULK_H
+#define BULK_H
+
+#include <cstddef>
+#include <string>
+
+struct bulk_options_t
+{
+  // directory or list of paths (one per line, "-" - stdin) when list is set
+  std::string source;
+  bool list = false;
+
+  // stored files are named prefix/relative path, default - name of source directory
+  std::string prefix;
+
+  // directory walking threads, 0 - count of CPUs
+  size_t threads = 0;
+};
+
+// stores all files of source with one DB session, index is committed by groups,
+// prints summary to stdout
+void bulk_store_files(const bulk_options_t& options);
+
+#endif // BULK_H
@@ -0,0 +1,61 @@
+#include "chunker.h"
+
+#include <algorithm>
+
+namespace {
+
+struct gear_table_t
+{
+  gear_table_t()
+  {
+    uint64_t state = 0x6765617254616231ull;
+    for (auto& value : values) {
+      uint64_t z = (state += 0x9E3779B97F4A7C15ull);
+      z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+      z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+      value = z ^ (z >> 31);
+    }
+  }
+
+  uint64_t values[256];
+};
+
+const gear_table_t gear;
+
+} // anonimous namespace
+
+chunker_t::chunker_t(chunking_t chunking, size_t average_size)
+  : chunking_(chunking)
+{
+  average_size = std::max<size_t>(average_size, 1);
+  if (chunking_ == CHUNKING_FIXED) {
+    min_size_ = max_size_ = average_size;
+    mask_ = 0;
+    return;
+  }
+  size_t bits = 0;
+  while ((size_t(2) << bits) <= average_size) bits++;
+  average_size = size_t(1) << bits;
+  min_size_ = std::max<size_t>(average_size / 4, 1);
+  max_size_ = average_size * 4;
+  // high bits of gear hash depend on last 64 bytes
+  mask_ = bits ? ((uint64_t(1) << bits) - 1) << (64 - bits) : 0;
+}
+
+size_t chunker_t::next(const char * data, size_t size) const
+{
+  if (size <= min_size_) return size;
+  const size_t limit = std::min(size, max_size_);
+  if (chunking_ == CHUNKING_FIXED) return limit;
+  const unsigned char * bytes = (const unsigned char *) data;
+  uint64_t hash = 0;
+  // bytes before min_size only warm up hash
+  for (size_t i = min_size_ > 64 ? min_size_ - 64 : 0; i < min_size_; i++) {
+    hash = (hash << 1) + gear.values[bytes[i]];
+  }
+  for (size_t i = min_size_; i < limit; i++) {
+    hash = (hash << 1) + gear.values[bytes[i]];
+    if ((hash & mask_) == 0) return i + 1;
+  }
+  return limit;
+}
@@ -0,0 +1,35 @@
+#ifndef CHUNKER_H
+#define CHUNKER_H
+
+#include <cstddef>
+#include <cstdint>
+
+enum chunking_t {
+  CHUNKING_FIXED = 0,
+  CHUNKING_CDC   = 1
+};
+
+// cuts data into chunks, fixed or content defined by gear rolling hash
+// (cut points do not move when bytes are inserted before them)
+class chunker_t
+{
+public:
+  // average_size is rounded to power of two for CHUNKING_CDC,
+  // cdc chunks are in [average_size / 4, average_size * 4]
+  chunker_t(chunking_t chunking, size_t average_size);
+
+  // length of next chunk at data, size - bytes left till end of input
+  size_t next(const char * data, size_t size) const;
+
+  size_t min_size() const { return min_size_; }
+
+  size_t max_size() const { return max_size_; }
+
+private:
+  chunking_t chunking_;
+  size_t min_size_;
+  size_t max_size_;
+  uint64_t mask_;
+};
+
+#endif // CHUNKER_H
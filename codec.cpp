@@ -0,0 +1,391 @@
+#include "codec.h"
+
+#include <algorithm>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CODEC_X86 1
+#else
+#define CODEC_X86 0
+#endif
+
+#include "defines.h"
+#include "utils.h"
+
+namespace {
+
+codec_isa_t detect_isa()
+{
+#if CODEC_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) return CODEC_AVX2;
+  if (__builtin_cpu_supports("sse2")) return CODEC_SSE;
+#endif
+  return CODEC_SCALAR;
+}
+
+// zero initialized before detection, so calls from static constructors use scalar variant
+const codec_isa_t detected_isa = detect_isa();
+codec_isa_t active_isa = detected_isa;
+
+constexpr unsigned SORT_MIN_RADIX_BITS = 4;
+constexpr unsigned SORT_MAX_RADIX_BITS = 16;
+static_assert(BYTES_HASH >= sizeof(uint64_t), "digest prefix is longer than digest");
+constexpr size_t INSERTION_SORT_LIMIT = 16;
+
+const char DIGIT_PAIRS[] =
+  "00010203040506070809"
+  "10111213141516171819"
+  "20212223242526272829"
+  "30313233343536373839"
+  "40414243444546474849"
+  "50515253545556575859"
+  "60616263646566676869"
+  "70717273747576777879"
+  "80818283848586878889"
+  "90919293949596979899";
+
+void to_hex_scalar(char * hex, const unsigned char * bytes, size_t n)
+{
+  for (size_t i = 0; i < n; i++) {
+    hex[2 * i]     = 'A' + ((bytes[i] >> 4) % 0x10);
+    hex[2 * i + 1] = 'A' +  (bytes[i]       % 0x10);
+  }
+}
+
+size_t add_number_scalar(char * buf, size_t left, unsigned long long number)
+{
+  size_t power = 1;
+  unsigned long long current = 1;
+  while (number / current >= 10) {
+    current *= 10;
+    power++;
+  }
+  if (left < power) return 0;
+  size_t writed = 0;
+  while (current > 0) {
+    buf[writed++] = '0' + ((number / current) % 10);
+    number = number % current;
+    current /= 10;
+  }
+  return writed;
+}
+
+size_t decimal_digits(unsigned long long number)
+{
+  size_t digits = 1;
+  while (true) {
+    if (number < 10) return digits;
+    if (number < 100) return digits + 1;
+    if (number < 1000) return digits + 2;
+    if (number < 10000) return digits + 3;
+    number /= 10000;
+    digits += 4;
+  }
+}
+
+// two digits per division, written from the end
+size_t add_number_pairs(char * buf, size_t left, unsigned long long number)
+{
+  const size_t digits = decimal_digits(number);
+  if (left < digits) return 0;
+  char * end = buf + digits;
+  while (number >= 100) {
+    const size_t pair = (number % 100) * 2;
+    number /= 100;
+    *--end = DIGIT_PAIRS[pair + 1];
+    *--end = DIGIT_PAIRS[pair];
+  }
+  if (number >= 10) {
+    *--end = DIGIT_PAIRS[number * 2 + 1];
+    *--end = DIGIT_PAIRS[number * 2];
+  } else {
+    *--end = '0' + number;
+  }
+  return digits;
+}
+
+size_t hex_list_length(size_t count)
+{
+  return count * (HASH_HEX_BYTES + 3) - 1;
+}
+
+size_t add_hex_list_scalar(char * buf, size_t left, const char * hexes, size_t count)
+{
+  size_t pos = 0;
+  for (size_t i = 0; i < count; i++) {
+    pos += i == 0 ? add_wrapped_sql(buf + pos, left - pos, hexes, HASH_HEX_BYTES)
+                  : add_wrapped_with_delim_sql(buf + pos, left - pos, hexes + i * HASH_HEX_BYTES, HASH_HEX_BYTES);
+  }
+  return pos;
+}
+
+size_t add_insert_row_scalar(char * buf, size_t left, const char * hex, unsigned long long file, unsigned long long pos)
+{
+  if (left < 1) return 0;
+  size_t writed = 0;
+  buf[writed++] = '(';
+  const size_t wrapped = add_wrapped_sql(buf + writed, left - writed, hex, HASH_HEX_BYTES);
+  if (wrapped == 0 || left - writed - wrapped < 1) return 0;
+  writed += wrapped;
+  buf[writed++] = ',';
+  const size_t file_digits = add_number_scalar(buf + writed, left - writed, file);
+  if (file_digits == 0 || left - writed - file_digits < 1) return 0;
+  writed += file_digits;
+  buf[writed++] = ',';
+  const size_t pos_digits = add_number_scalar(buf + writed, left - writed, pos);
+  return pos_digits ? writed + pos_digits : 0;
+}
+
+#if CODEC_X86
+
+__attribute__((target("sse2")))
+void to_hex_sse(char * hex, const unsigned char * bytes, size_t n)
+{
+  const __m128i mask = _mm_set1_epi8(0x0f);
+  const __m128i alphabet = _mm_set1_epi8('A');
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    const __m128i value = _mm_loadu_si128((const __m128i *) (bytes + i));
+    const __m128i high = _mm_and_si128(_mm_srli_epi16(value, 4), mask);
+    const __m128i low = _mm_and_si128(value, mask);
+    _mm_storeu_si128((__m128i *) (hex + 2 * i), _mm_add_epi8(_mm_unpacklo_epi8(high, low), alphabet));
+    _mm_storeu_si128((__m128i *) (hex + 2 * i + 16), _mm_add_epi8(_mm_unpackhi_epi8(high, low), alphabet));
+  }
+  to_hex_scalar(hex + 2 * i, bytes + i, n - i);
+}
+
+__attribute__((target("avx2")))
+void to_hex_avx2(char * hex, const unsigned char * bytes, size_t n)
+{
+  const __m256i mask = _mm256_set1_epi8(0x0f);
+  const __m256i alphabet = _mm256_set1_epi8('A');
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    const __m256i value = _mm256_loadu_si256((const __m256i *) (bytes + i));
+    const __m256i high = _mm256_and_si256(_mm256_srli_epi16(value, 4), mask);
+    const __m256i low = _mm256_and_si256(value, mask);
+    // unpacks interleave inside 128-bit lanes: first has bytes 0-7 and 16-23, second - 8-15 and 24-31
+    const __m256i first = _mm256_add_epi8(_mm256_unpacklo_epi8(high, low), alphabet);
+    const __m256i second = _mm256_add_epi8(_mm256_unpackhi_epi8(high, low), alphabet);
+    _mm256_storeu_si256((__m256i *) (hex + 2 * i), _mm256_permute2x128_si256(first, second, 0x20));
+    _mm256_storeu_si256((__m256i *) (hex + 2 * i + 32), _mm256_permute2x128_si256(first, second, 0x31));
+  }
+  to_hex_sse(hex + 2 * i, bytes + i, n - i);
+}
+
+// hex is copied by vector moves, tail by memcpy
+__attribute__((target("sse2")))
+inline void copy_hex_sse(char * to, const char * from)
+{
+  size_t i = 0;
+  for (; i + 16 <= HASH_HEX_BYTES; i += 16) {
+    _mm_storeu_si128((__m128i *) (to + i), _mm_loadu_si128((const __m128i *) (from + i)));
+  }
+  memcpy(to + i, from + i, HASH_HEX_BYTES - i);
+}
+
+__attribute__((target("avx2")))
+inline void copy_hex_avx2(char * to, const char * from)
+{
+  size_t i = 0;
+  for (; i + 32 <= HASH_HEX_BYTES; i += 32) {
+    _mm256_storeu_si256((__m256i *) (to + i), _mm256_loadu_si256((const __m256i *) (from + i)));
+  }
+  memcpy(to + i, from + i, HASH_HEX_BYTES - i);
+}
+
+__attribute__((target("sse2")))
+size_t add_hex_list_sse(char * buf, size_t left, const char * hexes, size_t count)
+{
+  if (count == 0 || left < hex_list_length(count)) return 0;
+  char * out = buf;
+  for (size_t i = 0; i < count; i++) {
+    if (i > 0) *out++ = ',';
+    out[0] = '\'';
+    copy_hex_sse(out + 1, hexes + i * HASH_HEX_BYTES);
+    out[HASH_HEX_BYTES + 1] = '\'';
+    out += HASH_HEX_BYTES + 2;
+  }
+  return out - buf;
+}
+
+__attribute__((target("avx2")))
+size_t add_hex_list_avx2(char * buf, size_t left, const char * hexes, size_t count)
+{
+  if (count == 0 || left < hex_list_length(count)) return 0;
+  char * out = buf;
+  for (size_t i = 0; i < count; i++) {
+    if (i > 0) *out++ = ',';
+    out[0] = '\'';
+    copy_hex_avx2(out + 1, hexes + i * HASH_HEX_BYTES);
+    out[HASH_HEX_BYTES + 1] = '\'';
+    out += HASH_HEX_BYTES + 2;
+  }
+  return out - buf;
+}
+
+// ('hex', and two numbers with comma
+size_t insert_row_length(unsigned long long file, unsigned long long pos)
+{
+  return HASH_HEX_BYTES + 5 + decimal_digits(file) + decimal_digits(pos);
+}
+
+// row around hex copied to buf + 2, buf has place for row
+size_t add_insert_row_numbers(char * buf, size_t left, unsigned long long file, unsigned long long pos)
+{
+  buf[0] = '(';
+  buf[1] = '\'';
+  buf[HASH_HEX_BYTES + 2] = '\'';
+  buf[HASH_HEX_BYTES + 3] = ',';
+  size_t writed = HASH_HEX_BYTES + 4;
+  writed += add_number_pairs(buf + writed, left - writed, file);
+  buf[writed++] = ',';
+  writed += add_number_pairs(buf + writed, left - writed, pos);
+  return writed;
+}
+
+__attribute__((target("sse2")))
+size_t add_insert_row_sse(char * buf, size_t left, const char * hex, unsigned long long file, unsigned long long pos)
+{
+  if (left < insert_row_length(file, pos)) return 0;
+  copy_hex_sse(buf + 2, hex);
+  return add_insert_row_numbers(buf, left, file, pos);
+}
+
+__attribute__((target("avx2")))
+size_t add_insert_row_avx2(char * buf, size_t left, const char * hex, unsigned long long file, unsigned long long pos)
+{
+  if (left < insert_row_length(file, pos)) return 0;
+  copy_hex_avx2(buf + 2, hex);
+  return add_insert_row_numbers(buf, left, file, pos);
+}
+
+#endif // CODEC_X86
+
+uint64_t digest_prefix(const unsigned char * digest)
+{
+  uint64_t prefix;
+  memcpy(&prefix, digest, sizeof(prefix));
+  return __builtin_bswap64(prefix);
+}
+
+} // anonimous namespace
+
+codec_isa_t codec_isa()
+{
+  return active_isa;
+}
+
+bool codec_isa_supported(codec_isa_t isa)
+{
+  return isa <= detected_isa;
+}
+
+const char * codec_isa_name(codec_isa_t isa)
+{
+  switch (isa) {
+    case CODEC_AVX2: return "avx2";
+    case CODEC_SSE: return "sse2";
+    default: return "scalar";
+  }
+}
+
+void codec_force_isa(codec_isa_t isa)
+{
+  if (codec_isa_supported(isa)) active_isa = isa;
+}
+
+void codec_to_hex(char * hex, const unsigned char * bytes, size_t n)
+{
+#if CODEC_X86
+  switch (active_isa) {
+    case CODEC_AVX2: return to_hex_avx2(hex, bytes, n);
+    case CODEC_SSE: return to_hex_sse(hex, bytes, n);
+    default: break;
+  }
+#endif
+  to_hex_scalar(hex, bytes, n);
+}
+
+size_t codec_add_number(char * buf, size_t left, unsigned long long number)
+{
+  // decimal conversion of one number has no useful vector form, other variants use table of digit pairs
+  if (active_isa == CODEC_SCALAR) return add_number_scalar(buf, left, number);
+  return add_number_pairs(buf, left, number);
+}
+
+size_t codec_add_hex_list(char * buf, size_t left, const char * hexes, size_t count)
+{
+#if CODEC_X86
+  switch (active_isa) {
+    case CODEC_AVX2: return add_hex_list_avx2(buf, left, hexes, count);
+    case CODEC_SSE: return add_hex_list_sse(buf, left, hexes, count);
+    default: break;
+  }
+#endif
+  if (count == 0 || left < hex_list_length(count)) return 0;
+  return add_hex_list_scalar(buf, left, hexes, count);
+}
+
+size_t codec_add_insert_row(char * buf, size_t left, const char * hex, unsigned long long file,
+                            unsigned long long pos)
+{
+#if CODEC_X86
+  switch (active_isa) {
+    case CODEC_AVX2: return add_insert_row_avx2(buf, left, hex, file, pos);
+    case CODEC_SSE: return add_insert_row_sse(buf, left, hex, file, pos);
+    default: break;
+  }
+#endif
+  return add_insert_row_scalar(buf, left, hex, file, pos);
+}
+
+void digest_sorter_t::sort(const unsigned char * digests, uint32_t * indexes, size_t count)
+{
+  keys_.resize(count);
+  sorted_.resize(count);
+  // about two keys per bucket, so buckets are mostly ordered by radix alone
+  unsigned bits = SORT_MIN_RADIX_BITS;
+  while (bits < SORT_MAX_RADIX_BITS && ((size_t) 1 << bits) < count / 2) bits++;
+  const unsigned shift = 64 - bits;
+  const size_t buckets = (size_t) 1 << bits;
+  starts_.assign(buckets + 1, 0);
+  for (size_t i = 0; i < count; i++) {
+    keys_[i] = { digest_prefix(digests + (size_t) indexes[i] * BYTES_HASH), indexes[i] };
+    starts_[(keys_[i].prefix >> shift) + 1]++;
+  }
+  for (size_t bucket = 1; bucket <= buckets; bucket++) {
+    starts_[bucket] += starts_[bucket - 1];
+  }
+  next_.assign(starts_.begin(), starts_.end() - 1);
+  for (size_t i = 0; i < count; i++) {
+    sorted_[next_[keys_[i].prefix >> shift]++] = keys_[i];
+  }
+  // full digests are compared only for equal prefixes
+  auto less = [digests](const key_t& a, const key_t& b) {
+    if (a.prefix != b.prefix) return a.prefix < b.prefix;
+    const int cmp = memcmp(digests + (size_t) a.index * BYTES_HASH, digests + (size_t) b.index * BYTES_HASH, BYTES_HASH);
+    return cmp < 0 || (cmp == 0 && a.index < b.index);
+  };
+  for (size_t bucket = 0; bucket < buckets; bucket++) {
+    key_t * begin = sorted_.data() + starts_[bucket];
+    key_t * end = sorted_.data() + starts_[bucket + 1];
+    if ((size_t) (end - begin) > INSERTION_SORT_LIMIT) {
+      std::sort(begin, end, less);
+      continue;
+    }
+    for (key_t * current = begin + 1; current < end; current++) {
+      const key_t key = *current;
+      key_t * place = current;
+      for (; place > begin && less(key, place[-1]); place--) {
+        *place = place[-1];
+      }
+      *place = key;
+    }
+  }
+  for (size_t i = 0; i < count; i++) {
+    indexes[i] = sorted_[i].index;
+  }
+}
@@ -0,0 +1,59 @@
+#ifndef CODEC_H
+#define CODEC_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// kernels of digest and SQL text encoding. variant is chosen once by CPU features,
+// scalar variant is reference implementation of utils
+enum codec_isa_t {
+  CODEC_SCALAR = 0,
+  CODEC_SSE    = 1, // SSE2
+  CODEC_AVX2   = 2
+};
+
+codec_isa_t codec_isa();
+
+bool codec_isa_supported(codec_isa_t isa);
+
+const char * codec_isa_name(codec_isa_t isa);
+
+// benchmarks compare variants, not supported variant is ignored
+void codec_force_isa(codec_isa_t isa);
+
+// hex of n bytes in to_my_hex alphabet
+void codec_to_hex(char * hex, const unsigned char * bytes, size_t n);
+
+// decimal of number, returns writed bytes or 0 if it doesn't fit to left
+size_t codec_add_number(char * buf, size_t left, unsigned long long number);
+
+// 'hex','hex',... of count hexes of HASH_HEX_BYTES, returns writed bytes or 0 if they don't fit to left
+size_t codec_add_hex_list(char * buf, size_t left, const char * hexes, size_t count);
+
+// ('hex',file,pos of insert request, returns writed bytes or 0 if row doesn't fit to left
+size_t codec_add_insert_row(char * buf, size_t left, const char * hex, unsigned long long file,
+                            unsigned long long pos);
+
+// sorts indexes of digests of BYTES_HASH bytes by digests, equal ones by indexes.
+// digest prefixes are sorted with indexes in contiguous keys by radix of 4-16 first bits,
+// memory of keys is kept for next sorts
+class digest_sorter_t
+{
+public:
+  void sort(const unsigned char * digests, uint32_t * indexes, size_t count);
+
+private:
+  struct key_t
+  {
+    uint64_t prefix;
+    uint32_t index;
+  };
+
+  std::vector<key_t> keys_;
+  std::vector<key_t> sorted_;
+  std::vector<uint32_t> starts_;
+  std::vector<uint32_t> next_;
+};
+
+#endif // CODEC_H
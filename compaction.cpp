@@ -0,0 +1,746 @@
+#include "compaction.h"
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <optional>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include <stdio.h>
+#include <sys/mman.h>
+
+#include <openssl/sha.h>
+
+#include "queries.h"
+#include "rate_limiter.h"
+#include "store.h"
+#include "utils.h"
+
+namespace {
+
+struct hash_file_t
+{
+  std::string id;
+  std::string path;
+  size_t total_bytes = 0;
+  size_t live_bytes = 0;
+  bool retire = false;
+};
+
+using digest_t = std::array<char, BYTES_HASH>;
+
+constexpr size_t NOT_REFERENCED = SIZE_MAX;
+
+struct chunk_t
+{
+  digest_t raw;
+  size_t file;      // index in hash files
+  off_t pos;        // position of block size prefix
+  size_t len;       // without block size prefix
+  size_t rank;      // 0 - referenced by newest file, NOT_REFERENCED - by none
+  off_t new_pos;
+  bool delta;
+  digest_t base;    // raw hash of base of delta record
+  bool indexed;     // found in index by its position
+};
+
+// indexed record considered dead, kept in dead log until retirement
+struct dead_chunk_t
+{
+  digest_t raw;
+  uint64_t file;
+  int64_t pos;
+  uint64_t len;
+};
+
+struct location_t
+{
+  std::string file;
+  off_t pos;
+};
+
+struct compaction_totals_t
+{
+  size_t scanned = 0;
+  size_t scanned_bytes = 0;
+  size_t retired = 0;
+  size_t written = 0;
+  size_t moved = 0;
+  size_t freed_bytes = 0;
+};
+
+using time_point_t = std::filesystem::file_time_type;
+
+// flags of digest in liveness
+constexpr uint32_t LIVE_REFERENCED = 1;    // referenced by stored file at compaction start
+constexpr uint32_t LIVE_BASE = 2;          // base of delta record at compaction start
+constexpr uint32_t REFERENCED_LATER = 4;   // referenced by stored file or delta record written while compaction
+
+constexpr uint32_t BASE_RANK = UINT32_MAX;
+
+// open addressing table of digest prefixes with their rank and flags, built once for whole compaction.
+// it's mapped from unlinked file of hashes dir, so its size isn't bounded by memory.
+// digests with same prefix share slot: dead chunk can be kept as live or moved with other rank, both are safe
+class liveness_t
+{
+public:
+  // capacity - upper bound of count of added digests
+  explicit liveness_t(size_t capacity);
+
+  liveness_t(const liveness_t& other) = delete;
+
+  ~liveness_t();
+
+  // smaller rank is kept, returns false if table is full
+  bool add(const char * raw, uint32_t rank, uint32_t flags);
+
+  // returns 0 if digest isn't added
+  uint32_t find(const char * raw, uint32_t * rank) const;
+
+private:
+  struct slot_t
+  {
+    uint64_t key;    // 0 - empty slot
+    uint32_t rank;
+    uint32_t flags;
+  };
+
+  slot_t * find_slot(const char * raw) const;
+
+  slot_t * slots_;
+  size_t count_ = 16;
+  size_t used_ = 0;
+};
+
+liveness_t::liveness_t(size_t capacity)
+{
+  // load factor is under 1/2 after adding capacity digests
+  while (count_ < 2 * capacity) count_ *= 2;
+  const std::filesystem::path path = hashes_dir / COMPACT_LIVENESS_FILENAME;
+  file_t file(path, O_RDWR | O_CREAT | O_TRUNC);
+  if (!file.open() || file.truncate(count_ * sizeof(slot_t)) < 0) {
+    exit_error(wrap_ostringstream("error: can't create " << path << ", errno: " << errno), 10);
+  }
+  void * map = mmap(nullptr, count_ * sizeof(slot_t), PROT_READ | PROT_WRITE, MAP_SHARED, file.fd(), 0);
+  std::filesystem::remove(path);
+  if (map == MAP_FAILED) exit_error(wrap_ostringstream("error: can't map " << path << ", errno: " << errno), 10);
+  slots_ = (slot_t *) map;
+}
+
+liveness_t::~liveness_t()
+{
+  munmap(slots_, count_ * sizeof(slot_t));
+}
+
+liveness_t::slot_t * liveness_t::find_slot(const char * raw) const
+{
+  uint64_t key;
+  memcpy(&key, raw, sizeof(key));
+  key |= 1;
+  size_t slot = key & (count_ - 1);
+  while (slots_[slot].key != 0 && slots_[slot].key != key) slot = (slot + 1) & (count_ - 1);
+  return slots_ + slot;
+}
+
+bool liveness_t::add(const char * raw, uint32_t rank, uint32_t flags)
+{
+  slot_t * slot = find_slot(raw);
+  if (slot->key == 0) {
+    if (4 * (used_ + 1) > 3 * count_) return false;
+    used_++;
+    memcpy(&slot->key, raw, sizeof(slot->key));
+    slot->key |= 1;
+    slot->rank = rank;
+  }
+  slot->rank = std::min(slot->rank, rank);
+  slot->flags |= flags;
+  return true;
+}
+
+uint32_t liveness_t::find(const char * raw, uint32_t * rank) const
+{
+  const slot_t * slot = find_slot(raw);
+  if (slot->key == 0) return 0;
+  *rank = slot->rank;
+  return slot->flags;
+}
+
+void exec_command(const char * request, const char * error_prefix)
+{
+  PGresult* res = PQexec(dbconn, request);
+  exec_conn(res, PGRES_COMMAND_OK, error_prefix);
+  PQclear(res);
+}
+
+// calls handler for each raw hash of each stored file changed not earlier than since,
+// newest files first
+template<typename Handler>
+void for_each_file_hash(time_point_t since, rate_limiter_t& limiter, Handler handler)
+{
+  std::vector<std::pair<time_point_t, std::filesystem::path>> stored;
+  for (auto& entry : std::filesystem::recursive_directory_iterator(files_dir)) {
+    if (!entry.is_regular_file()) continue;
+    auto changed = entry.last_write_time();
+    if (changed >= since) stored.emplace_back(changed, entry.path());
+  }
+  std::sort(stored.begin(), stored.end(), [](const auto& a, const auto& b) { return a.first > b.first; });
+  std::string buf((BUFFER_READ_SIZE / BYTES_HASH) * BYTES_HASH, 0);
+  for (size_t rank = 0; rank < stored.size(); rank++) {
+    file_t file(stored[rank].second, O_RDONLY);
+    if (!file.open()) {
+      std::cerr << "warn: can't open stored file " << stored[rank].second << "\n";
+      continue;
+    }
+    ssize_t readed;
+    while ((readed = file.read(buf.data(), buf.size())) > 0) {
+      limiter.consume(readed);
+      for (ssize_t i = 0; i + BYTES_HASH <= readed; i += BYTES_HASH) {
+        handler(buf.data() + i, rank);
+      }
+    }
+  }
+}
+
+// fills locations of hashes from chunks[begin, end) found in DB, key - hex
+void query_locations(const std::vector<chunk_t>& chunks, size_t begin, size_t end,
+                     std::unordered_map<std::string, location_t>& locations)
+{
+  const size_t first_part_end = sizeof(SELECT_FILE_POS_FROM_HASHES_MANY) - 1;
+  std::string request(first_part_end + (HASH_HEX_BYTES + 3) * (end - begin) + 3, 0);
+  memcpy(request.data(), SELECT_FILE_POS_FROM_HASHES_MANY, first_part_end);
+  size_t pos = first_part_end;
+  std::string hex(HASH_HEX_BYTES, 0);
+  for (size_t i = begin; i < end; i++) {
+    to_my_hex(hex.data(), (const unsigned char *) chunks[i].raw.data(), BYTES_HASH);
+    if (i == begin) {
+      pos += add_wrapped_sql(request.data() + pos, request.size() - pos, hex.data(), HASH_HEX_BYTES);
+    } else {
+      pos += add_wrapped_with_delim_sql(request.data() + pos, request.size() - pos, hex.data(), HASH_HEX_BYTES);
+    }
+  }
+  strcpy(request.data() + pos, SQL_QUARY_SCOPE_END);
+  PGresult* res = PQexec(dbconn, request.c_str());
+  exec_conn(res, PGRES_TUPLES_OK, "error: failed query hashes from DB");
+  const int hash_col = PQfnumber(res, "hash");
+  const int file_col = PQfnumber(res, "file");
+  const int pos_col  = PQfnumber(res, "pos");
+  soft_assert(hash_col > -1 && file_col > -1 && pos_col > -1);
+  const size_t rows = PQntuples(res);
+  for (size_t i = 0; i < rows; i++) {
+    locations[PQgetvalue(res, i, hash_col)] = { PQgetvalue(res, i, file_col),
+                                                atoll(PQgetvalue(res, i, pos_col)) };
+  }
+  PQclear(res);
+}
+
+// fills raw hash of block of record, delta record is resolved against its base to block of HASHING_BLOCK_SIZE
+bool hash_record(const char * data, size_t len, bool delta, chunk_t& chunk, char * block)
+{
+  if (delta) {
+    const ssize_t size = resolve_record(data, len, true, block);
+    if (size < 0) return false;
+    chunk.delta = true;
+    memcpy(chunk.base.data(), data, BYTES_HASH);
+    data = block;
+    len = size;
+  }
+#if (HASH_BITS == 256)
+  SHA256((const unsigned char *) data, len, (unsigned char *) chunk.raw.data());
+#else
+#error "unknown algoritm"
+#endif
+  return true;
+}
+
+// calls handler for base of each delta record of hash file, liveness of records isn't checked
+template<typename Handler>
+void for_each_delta_base(const std::filesystem::path& path, rate_limiter_t& limiter, Handler handler)
+{
+  file_t file(path, O_RDONLY);
+  if (!file.open()) return;
+  std::string buf(COMPACTION_BUFFER_SIZE, 0);
+  size_t buffered = 0;
+  ssize_t readed;
+  while ((readed = file.read(buf.data() + buffered, buf.size() - buffered)) > 0) {
+    limiter.consume(readed);
+    buffered += readed;
+    size_t pos = 0;
+    while (pos + BLOCK_SIZE_BYTES <= buffered) {
+      bool delta;
+      const size_t block_len = read_record_prefix(buf.data() + pos, &delta);
+      if (pos + BLOCK_SIZE_BYTES + block_len > buffered) break;
+      if (delta && block_len >= BYTES_HASH) handler(buf.data() + pos + BLOCK_SIZE_BYTES);
+      pos += BLOCK_SIZE_BYTES + block_len;
+    }
+    memmove(buf.data(), buf.data() + pos, buffered - pos);
+    buffered -= pos;
+  }
+}
+
+// marks records of slice found in index by their position
+void mark_indexed(const hash_file_t& hash_file, std::vector<chunk_t>& chunks)
+{
+  std::unordered_map<std::string, location_t> locations;
+  std::string hex(HASH_HEX_BYTES, 0);
+  for (size_t begin = 0; begin < chunks.size(); begin += INSERT_MANY_HASHES_COUNT) {
+    const size_t end = std::min(chunks.size(), begin + INSERT_MANY_HASHES_COUNT);
+    locations.clear();
+    query_locations(chunks, begin, end, locations);
+    for (size_t i = begin; i < end; i++) {
+      to_my_hex(hex.data(), (const unsigned char *) chunks[i].raw.data(), BYTES_HASH);
+      auto location = locations.find(hex);
+      chunks[i].indexed = location != locations.end() && location->second.file == hash_file.id
+                          && location->second.pos == chunks[i].pos;
+    }
+  }
+}
+
+// scans records of hash file by slices of at most COMPACTION_BATCH_CHUNKS records, so memory doesn't depend
+// on size of hash file, handler gets each slice marked by mark_indexed. returns false if hash file can't be readed
+template<typename Handler>
+bool scan_hash_file(hash_file_t& hash_file, size_t index, rate_limiter_t& limiter, Handler handler)
+{
+  file_t file(hash_file.path, O_RDONLY);
+  if (!file.open()) {
+    std::cerr << "warn: can't open hash file " << hash_file.path << ", skipped\n";
+    return false;
+  }
+  std::vector<chunk_t> chunks;
+  auto flush_slice = [&]() {
+    mark_indexed(hash_file, chunks);
+    handler(chunks);
+    chunks.clear();
+  };
+  std::string buf(COMPACTION_BUFFER_SIZE, 0);
+  std::vector<char> block(HASHING_BLOCK_SIZE);
+  size_t buffered = 0;
+  off_t buf_offset = 0;
+  ssize_t readed;
+  while ((readed = file.read(buf.data() + buffered, buf.size() - buffered)) > 0) {
+    limiter.consume(readed);
+    buffered += readed;
+    size_t pos = 0;
+    while (pos + BLOCK_SIZE_BYTES <= buffered) {
+      bool delta;
+      const size_t block_len = read_record_prefix(buf.data() + pos, &delta);
+      if (pos + BLOCK_SIZE_BYTES + block_len > buffered) break;
+      chunk_t chunk { {}, index, buf_offset + (off_t) pos, block_len, NOT_REFERENCED, 0, false, {}, false };
+      if (hash_record(buf.data() + pos + BLOCK_SIZE_BYTES, block_len, delta, chunk, block.data())) {
+        chunks.push_back(chunk);
+        if (chunks.size() == COMPACTION_BATCH_CHUNKS) flush_slice();
+      } else {
+        std::cerr << "warn: base of delta record at " << chunk.pos << " of " << hash_file.path
+                  << " not resolved, record is dead\n";
+      }
+      pos += BLOCK_SIZE_BYTES + block_len;
+    }
+    memmove(buf.data(), buf.data() + pos, buffered - pos);
+    buffered -= pos;
+    buf_offset += pos;
+  }
+  if (!chunks.empty()) flush_slice();
+  // torn tail of interrupted writing is dead space
+  hash_file.total_bytes = buf_offset + buffered;
+  return true;
+}
+
+void relocate_chunks(const std::vector<hash_file_t>& hash_files, const std::vector<chunk_t>& chunks,
+                     size_t begin, size_t end, const std::string& new_id)
+{
+  std::string request(sizeof(RELOCATE_HASHES_BEGIN) + sizeof(RELOCATE_HASHES_VALUES) + sizeof(RELOCATE_HASHES_END)
+                      + new_id.size() + RELOCATE_ROW_MAX_LENGTH * RELOCATE_HASHES_COUNT, 0);
+  std::string hex(HASH_HEX_BYTES, 0);
+  for (size_t batch = begin; batch < end; batch += RELOCATE_HASHES_COUNT) {
+    const size_t batch_end = std::min(end, batch + RELOCATE_HASHES_COUNT);
+    size_t pos = 0;
+    memcpy(request.data(), RELOCATE_HASHES_BEGIN, sizeof(RELOCATE_HASHES_BEGIN) - 1);
+    pos += sizeof(RELOCATE_HASHES_BEGIN) - 1;
+    memcpy(request.data() + pos, new_id.data(), new_id.size());
+    pos += new_id.size();
+    memcpy(request.data() + pos, RELOCATE_HASHES_VALUES, sizeof(RELOCATE_HASHES_VALUES) - 1);
+    pos += sizeof(RELOCATE_HASHES_VALUES) - 1;
+    for (size_t i = batch; i < batch_end; i++) {
+      const chunk_t& chunk = chunks[i];
+      if (i != batch) request.data()[pos++] = ',';
+      request.data()[pos++] = '(';
+      to_my_hex(hex.data(), (const unsigned char *) chunk.raw.data(), BYTES_HASH);
+      pos += add_wrapped_sql(request.data() + pos, request.size() - pos, hex.data(), HASH_HEX_BYTES);
+      request.data()[pos++] = ',';
+      const std::string& old_id = hash_files[chunk.file].id;
+      memcpy(request.data() + pos, old_id.data(), old_id.size());
+      pos += old_id.size();
+      request.data()[pos++] = ',';
+      pos += add_number(request.data() + pos, request.size() - pos, chunk.pos);
+      request.data()[pos++] = ',';
+      pos += add_number(request.data() + pos, request.size() - pos, chunk.new_pos);
+      request.data()[pos++] = ')';
+    }
+    strcpy(request.data() + pos, RELOCATE_HASHES_END);
+    exec_command(request.c_str(), "error: failed relocate hashes in DB");
+  }
+}
+
+// moves written temporary file to free hash filename and registers it
+std::string publish_hash_file(file_t& tmp_file)
+{
+  soft_assert(tmp_file.sync() == 0);
+  tmp_file.close();
+  std::string current_file = last_hash_filename();
+  std::filesystem::path published;
+  while (true) {
+    current_file = find_free_hash_filename(current_file);
+    published = hashes_dir / current_file;
+    if (renameat2(AT_FDCWD, tmp_file.path().c_str(), AT_FDCWD, published.c_str(), RENAME_NOREPLACE) == 0)
+      break;
+    if (errno != EEXIST) {
+      exit_error(wrap_ostringstream("error: can't publish hash file " << published << ": " << strerror(errno)), 10);
+    }
+  }
+  file_t dir(hashes_dir, O_RDONLY | O_DIRECTORY);
+  if (dir.open()) dir.sync();
+  return std::to_string(register_hash_file(published));
+}
+
+size_t write_moving_chunks(std::vector<hash_file_t>& hash_files, std::vector<chunk_t>& moving,
+                           rate_limiter_t& limiter)
+{
+  std::sort(moving.begin(), moving.end(), [](const chunk_t& a, const chunk_t& b) {
+    if (a.rank != b.rank) return a.rank < b.rank;
+    if (a.file != b.file) return a.file < b.file;
+    return a.pos < b.pos;
+  });
+  std::vector<file_t> sources;
+  for (auto& hash_file : hash_files) {
+    sources.emplace_back(hash_file.path, O_RDONLY);
+  }
+  const std::filesystem::path tmp_path = hashes_dir / COMPACT_TMP_FILENAME;
+  std::string buf(COMPACTION_BUFFER_SIZE, 0);
+  size_t buffered = 0;
+  size_t written = 0;
+  size_t container_begin = 0;
+  off_t container_size = 0;
+  std::optional<file_t> output;
+  output.emplace(tmp_path, O_WRONLY | O_CREAT | O_TRUNC);
+  soft_assert(output->open());
+  auto flush = [&]() {
+    if (buffered == 0) return;
+    soft_assert(output->write(buf.data(), buffered) == (ssize_t) buffered);
+    limiter.consume(buffered);
+    buffered = 0;
+  };
+  auto finish_container = [&](size_t end) {
+    flush();
+    std::string new_id = publish_hash_file(*output);
+    relocate_chunks(hash_files, moving, container_begin, end, new_id);
+    written++;
+    container_begin = end;
+    container_size = 0;
+  };
+  for (size_t i = 0; i < moving.size(); i++) {
+    chunk_t& chunk = moving[i];
+    const size_t record_len = BLOCK_SIZE_BYTES + chunk.len;
+    if (container_size + (off_t) record_len > MAX_SINGLE_HASH_FILE_SIZE) {
+      finish_container(i);
+      output.emplace(tmp_path, O_WRONLY | O_CREAT | O_TRUNC);
+      soft_assert(output->open());
+    }
+    if (buffered + record_len > buf.size()) flush();
+    file_t& source = sources[chunk.file];
+    if (!source) soft_assert(source.open());
+    const ssize_t readed = source.read(chunk.pos, buf.data() + buffered, record_len);
+    soft_assert(readed == (ssize_t) record_len);
+    limiter.consume(readed);
+    chunk.new_pos = container_size;
+    container_size += record_len;
+    buffered += record_len;
+  }
+  finish_container(moving.size());
+  return written;
+}
+
+// upper bound of count of digests added to liveness: entries of stored files and delta records of hash files
+size_t liveness_capacity()
+{
+  size_t count = 0;
+  std::error_code ec;
+  for (auto& entry : std::filesystem::recursive_directory_iterator(files_dir)) {
+    if (entry.is_regular_file()) count += entry.file_size(ec) / BYTES_HASH;
+  }
+  for (auto& entry : std::filesystem::directory_iterator(hashes_dir)) {
+    if (!check_valid_hash_filename(entry.path().filename().string())) continue;
+    count += entry.file_size(ec) / (BLOCK_SIZE_BYTES + BYTES_HASH);
+  }
+  return count;
+}
+
+// adds chunks referenced by stored files and bases of delta records of all hash files,
+// bases of dead delta records are kept too, so chains of bases are kept without resolving them
+void build_liveness(liveness_t& liveness, rate_limiter_t& limiter)
+{
+  bool full = false;
+  for_each_file_hash(time_point_t::min(), limiter, [&](const char * entry, size_t rank) {
+    full |= !liveness.add(entry, std::min<size_t>(rank, BASE_RANK - 1), LIVE_REFERENCED);
+  });
+  for (auto& entry : std::filesystem::directory_iterator(hashes_dir)) {
+    if (!check_valid_hash_filename(entry.path().filename().string())) continue;
+    for_each_delta_base(entry.path(), limiter, [&](const char * base) {
+      full |= !liveness.add(base, BASE_RANK, LIVE_BASE);
+    });
+  }
+  if (full) exit_error("error: stored files grew while compaction started, liveness table is full, aborted...", 12);
+}
+
+// finishes retirement interrupted by crash: hash files deleted from DB are removed, rows of other journaled
+// hash files are restored, because stored files written while compaction weren't rechecked for their chunks
+void recover_retired(rate_limiter_t& limiter)
+{
+  const std::filesystem::path journal_path = hashes_dir / COMPACT_RETIRE_FILENAME;
+  if (!std::filesystem::exists(journal_path)) return;
+  std::ifstream journal(journal_path);
+  std::string id;
+  std::string path;
+  std::string hex(HASH_HEX_BYTES, 0);
+  while (journal >> id >> path) {
+    std::string request = SELECT_USED_FILE_EXISTS + id + ";";
+    PGresult* res = PQexec(dbconn, request.c_str());
+    exec_conn(res, PGRES_TUPLES_OK, "error: can't query saved files from DB");
+    const bool retired = PQntuples(res) == 0;
+    PQclear(res);
+    if (retired) {
+      forget_hash_file(atoll(id.c_str()));
+      std::filesystem::remove(path);
+      std::filesystem::remove(path + HASH_FILE_END_SUFFIX);
+      continue;
+    }
+    hash_file_t hash_file { id, path };
+    scan_hash_file(hash_file, 0, limiter, [&](std::vector<chunk_t>& chunks) {
+      for (const auto& chunk : chunks) {
+        if (chunk.indexed) continue;
+        to_my_hex(hex.data(), (const unsigned char *) chunk.raw.data(), BYTES_HASH);
+        hash_index->insert(hex.data(), atoll(id.c_str()), chunk.pos, BLOCK_SIZE_BYTES + chunk.len);
+      }
+    });
+    hash_index->flush_inserts();
+  }
+  std::filesystem::remove(journal_path);
+}
+
+// moves live chunks of retiring hash files to new hash files by batches, indexed dead chunks are saved to dead log.
+// hash file is locked like output of session, so it's retired only if nobody appended it since accounting
+void move_live_chunks(std::vector<hash_file_t>& hash_files, const liveness_t& liveness, file_t& dead_log,
+                      std::vector<file_t>& locked, rate_limiter_t& limiter, compaction_totals_t& totals)
+{
+  std::vector<chunk_t> moving;
+  std::vector<dead_chunk_t> dead;
+  auto flush_dead = [&]() {
+    const ssize_t size = dead.size() * sizeof(dead_chunk_t);
+    soft_assert(dead_log.write((const char *) dead.data(), size) == size);
+    dead.clear();
+  };
+  for (size_t i = 0; i < hash_files.size(); i++) {
+    hash_file_t& hash_file = hash_files[i];
+    if (!hash_file.retire) continue;
+    file_t lock(hash_file.path, O_RDONLY);
+    if (!lock.open() || !lock_hash_file(lock) || lock.to_end() != (off_t) hash_file.total_bytes) {
+      std::cerr << "info: hash file " << hash_file.path << " is written by other session, skipped\n";
+      hash_file.retire = false;
+      continue;
+    }
+    locked.push_back(std::move(lock));
+    hash_file.retire = scan_hash_file(hash_file, i, limiter, [&](std::vector<chunk_t>& chunks) {
+      for (auto& chunk : chunks) {
+        if (!chunk.indexed) continue;
+        uint32_t rank;
+        if (liveness.find(chunk.raw.data(), &rank) & (LIVE_REFERENCED | LIVE_BASE)) {
+          chunk.rank = rank;
+          moving.push_back(chunk);
+        } else {
+          dead.push_back({ chunk.raw, i, chunk.pos, chunk.len });
+        }
+      }
+      if (dead.size() >= COMPACTION_BATCH_CHUNKS) flush_dead();
+      if (moving.size() >= COMPACTION_BATCH_CHUNKS) {
+        totals.written += write_moving_chunks(hash_files, moving, limiter);
+        totals.moved += moving.size();
+        moving.clear();
+      }
+    });
+  }
+  flush_dead();
+  if (!moving.empty()) {
+    totals.written += write_moving_chunks(hash_files, moving, limiter);
+    totals.moved += moving.size();
+  }
+}
+
+std::string retiring_ids(const std::vector<hash_file_t>& hash_files)
+{
+  std::string ids;
+  for (auto& hash_file : hash_files) {
+    if (!hash_file.retire) continue;
+    if (!ids.empty()) ids += ',';
+    ids += hash_file.id;
+  }
+  return ids;
+}
+
+// dead rows of retiring hash files are deleted first, sessions which could find them are awaited,
+// then dead chunks referenced by stored files or delta records written since start are restored
+// with their hash file kept, other hash files are removed
+void retire_hash_files(std::vector<hash_file_t>& hash_files, liveness_t& liveness, file_t& dead_log,
+                       time_point_t start, rate_limiter_t& limiter)
+{
+  const std::filesystem::path journal_path = hashes_dir / COMPACT_RETIRE_FILENAME;
+  std::string ids = retiring_ids(hash_files);
+  if (ids.empty()) return;
+  {
+    file_t journal(journal_path, O_WRONLY | O_CREAT | O_TRUNC);
+    soft_assert(journal.open());
+    for (auto& hash_file : hash_files) {
+      if (!hash_file.retire) continue;
+      std::string line = hash_file.id + "\t" + hash_file.path + "\n";
+      soft_assert(journal.write(line.data(), line.size()) == (ssize_t) line.size());
+    }
+    soft_assert(journal.sync() == 0);
+  }
+  exec_command((DELETE_HASHES_OF_FILES + ids + SQL_QUARY_SCOPE_END).c_str(), "error: can't delete dead hashes");
+  wait_store_sessions();
+
+  // table full of later references keeps all dead chunks
+  bool full = false;
+  for_each_file_hash(start, limiter, [&](const char * entry, size_t) {
+    full |= !liveness.add(entry, 0, REFERENCED_LATER);
+  });
+  std::unordered_set<std::string> retiring;
+  for (auto& hash_file : hash_files) {
+    if (hash_file.retire) retiring.insert(hash_file.path);
+  }
+  for (auto& entry : std::filesystem::directory_iterator(hashes_dir)) {
+    if (!check_valid_hash_filename(entry.path().filename().string()) || retiring.count(entry.path().string())) continue;
+    std::error_code ec;
+    auto changed = std::filesystem::last_write_time(entry.path(), ec);
+    if (ec || changed < start) continue;
+    for_each_delta_base(entry.path(), limiter, [&](const char * base) {
+      full |= !liveness.add(base, 0, REFERENCED_LATER);
+    });
+  }
+
+  std::vector<dead_chunk_t> dead(COMPACTION_BUFFER_SIZE / sizeof(dead_chunk_t));
+  std::string hex(HASH_HEX_BYTES, 0);
+  ssize_t readed;
+  off_t offset = 0;
+  while ((readed = dead_log.read(offset, (char *) dead.data(), dead.size() * sizeof(dead_chunk_t))) > 0) {
+    offset += readed;
+    for (size_t i = 0; i < readed / sizeof(dead_chunk_t); i++) {
+      hash_file_t& hash_file = hash_files[dead[i].file];
+      uint32_t rank;
+      if (!full && !(liveness.find(dead[i].raw.data(), &rank) & REFERENCED_LATER)) continue;
+      to_my_hex(hex.data(), (const unsigned char *) dead[i].raw.data(), BYTES_HASH);
+      hash_index->insert(hex.data(), atoll(hash_file.id.c_str()), dead[i].pos, BLOCK_SIZE_BYTES + dead[i].len);
+      hash_file.retire = false;
+    }
+  }
+  hash_index->flush_inserts();
+
+  ids = retiring_ids(hash_files);
+  if (!ids.empty()) {
+    exec_command(BEGIN_TRANSACTION, "error: can't begin transaction");
+    exec_command((DELETE_HASHES_OF_FILES + ids + SQL_QUARY_SCOPE_END).c_str(), "error: can't delete dead hashes");
+    exec_command((DELETE_USED_FILES + ids + SQL_QUARY_SCOPE_END).c_str(), "error: can't delete hash files");
+    exec_command(COMMIT_TRANSACTION, "error: can't commit retirement");
+  }
+  for (auto& hash_file : hash_files) {
+    if (!hash_file.retire) continue;
+    forget_hash_file(atoll(hash_file.id.c_str()));
+    std::filesystem::remove(hash_file.path);
+    std::filesystem::remove(hash_file.path + HASH_FILE_END_SUFFIX);
+  }
+  std::filesystem::remove(journal_path);
+}
+
+} // anonimous namespace
+
+size_t compact_hash_files(const compaction_options_t& options)
+{
+  // relocation and retirement queries use hash table of dbconn only
+  if (shard_conns.size() > 1) {
+    exit_error("error: compaction of sharded index is not supported, aborted...", 12);
+  }
+  // records of files stored with sparse index aren't indexed, they would be retired as dead
+  if (std::filesystem::exists(hashes_dir / SPARSE_MANIFESTS_FILENAME)) {
+    exit_error("error: compaction of store with sparse index is not supported, aborted...", 12);
+  }
+  // other sessions run meanwhile, compactions use the same temporary files
+  file_t compaction_lock(hashes_dir / COMPACT_LOCK_FILENAME, O_RDONLY | O_CREAT);
+  if (!compaction_lock.open() || !lock_hash_file(compaction_lock)) {
+    exit_error("error: other compaction of store is running, aborted...", 12);
+  }
+  rate_limiter_t limiter(options.rate_bytes);
+  recover_retired(limiter);
+  const time_point_t start = time_point_t::clock::now();
+  const time_point_t min_age = start - std::chrono::seconds(COMPACTION_MIN_AGE_SEC);
+
+  std::vector<hash_file_t> hash_files;
+  {
+    const std::string active = last_hash_filename();
+    PGresult* res = PQexec(dbconn, SELECT_FILES_FROM_DB);
+    exec_conn(res, PGRES_TUPLES_OK, "error: can't query saved files from DB");
+    const size_t rows = PQntuples(res);
+    for (size_t i = 0; i < rows; i++) {
+      std::filesystem::path path = PQgetvalue(res, i, 1);
+      if (!active.empty() && path == hashes_dir / active) continue;
+      std::error_code ec;
+      auto changed = std::filesystem::last_write_time(path, ec);
+      if (ec || changed >= min_age) continue;
+      hash_files.push_back({ PQgetvalue(res, i, 0), path });
+    }
+    PQclear(res);
+  }
+
+  // stored files and hash files are readed once for liveness of all hash files
+  liveness_t liveness(liveness_capacity());
+  build_liveness(liveness, limiter);
+
+  compaction_totals_t totals;
+  for (size_t i = 0; i < hash_files.size(); i++) {
+    hash_file_t& hash_file = hash_files[i];
+    const bool scanned = scan_hash_file(hash_file, i, limiter, [&](const std::vector<chunk_t>& chunks) {
+      uint32_t rank;
+      for (const auto& chunk : chunks) {
+        if (chunk.indexed && (liveness.find(chunk.raw.data(), &rank) & (LIVE_REFERENCED | LIVE_BASE))) {
+          hash_file.live_bytes += BLOCK_SIZE_BYTES + chunk.len;
+        }
+      }
+    });
+    if (!scanned) continue;
+    hash_file.retire = hash_file.live_bytes < options.live_ratio * hash_file.total_bytes;
+    totals.scanned++;
+    totals.scanned_bytes += hash_file.total_bytes;
+  }
+
+  const std::filesystem::path dead_log_path = hashes_dir / COMPACT_DEAD_FILENAME;
+  file_t dead_log(dead_log_path, O_RDWR | O_CREAT | O_TRUNC);
+  soft_assert(dead_log.open());
+  std::filesystem::remove(dead_log_path);
+  // hash files stay locked until their retirement
+  std::vector<file_t> locked;
+  move_live_chunks(hash_files, liveness, dead_log, locked, limiter, totals);
+  retire_hash_files(hash_files, liveness, dead_log, start, limiter);
+
+  for (auto& hash_file : hash_files) {
+    if (!hash_file.retire) continue;
+    totals.retired++;
+    totals.freed_bytes += hash_file.total_bytes - hash_file.live_bytes;
+  }
+  std::cout << "compaction: scanned hash files: " << totals.scanned
+            << ", scanned bytes: " << totals.scanned_bytes
+            << ", retired hash files: " << totals.retired
+            << ", written hash files: " << totals.written
+            << ", moved chunks: " << totals.moved
+            << ", freed bytes: " << totals.freed_bytes << std::endl;
+  return totals.retired;
+}
@@ -0,0 +1,21 @@
+#ifndef COMPACTION_H
+#define COMPACTION_H
+
+#include <cstddef>
+
+#include "defines.h"
+
+struct compaction_options_t
+{
+  // containers with smaller part of live bytes will be rewritten
+  double live_ratio = COMPACTION_DEFAULT_LIVE_RATIO;
+
+  // 0 - unlimited
+  double rate_bytes = 0;
+};
+
+// rewrites live chunks of sparse hash files into new dense hash files,
+// returns count of retired hash files
+size_t compact_hash_files(const compaction_options_t& options);
+
+#endif // COMPACTION_H
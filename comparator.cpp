@@ -1,68 +1,476 @@
+#include <algorithm>
+#include <chrono>
 #include <filesystem>
 #include <iostream>
 #include <string.h>
+#include <thread>
+#include <vector>
 
-#include "file.h"
+#include <openssl/sha.h>
+#include <sys/mman.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "chunker.h"
 #include "defines.h"
+#include "fingerprint_set.h"
+#include "mapped_file.h"
 
-int main(int argc, char ** argv)
+namespace {
+
+// blocks are compared by groups of 64, result of group is bit mask
+constexpr size_t GROUP_BLOCKS = 64;
+constexpr size_t GROUP_BYTES = GROUP_BLOCKS * HASHING_BLOCK_SIZE;
+// equal windows are skipped by one memcmp
+constexpr size_t WINDOW_BYTES = 1024 * GROUP_BYTES;
+
+constexpr size_t DEFAULT_MAX_RANGES = 32;
+
+constexpr size_t DEFAULT_CHUNK_SIZE = 4096;
+constexpr size_t DEFAULT_MAX_FINGERPRINTS = 4 * 1024 * 1024;
+constexpr size_t LONGEST_RUNS = 5;
+// chunked pages are released by such parts
+constexpr size_t RELEASE_BYTES = 64 * 1024 * 1024;
+
+// bit i is set if block i of group differs
+#if !(defined(__x86_64__) && (HASHING_BLOCK_SIZE == 16))
+uint64_t group_diff_generic(const char * first, const char * second)
 {
-  if (argc != 3) {
-    std::cerr << "bad command line args - need 2 files for compare\n";
-    return -1;
+  uint64_t mask = 0;
+  for (size_t i = 0; i < GROUP_BLOCKS; i++) {
+    if (memcmp(first + i * HASHING_BLOCK_SIZE, second + i * HASHING_BLOCK_SIZE, HASHING_BLOCK_SIZE) != 0) {
+      mask |= uint64_t(1) << i;
+    }
   }
-  if (!(std::filesystem::exists(std::filesystem::path(argv[1]))
-     && std::filesystem::exists(std::filesystem::path(argv[2])))) {
-    std::cerr << "files: \'" << argv[1] << "\', \'" << argv[2] << "\' not found, aborted...\n";
-    return -2;
+  return mask;
+}
+#else
+uint64_t group_diff_sse2(const char * first, const char * second)
+{
+  uint64_t mask = 0;
+  for (size_t i = 0; i < GROUP_BLOCKS; i++) {
+    const __m128i a = _mm_loadu_si128((const __m128i *) (first + i * 16));
+    const __m128i b = _mm_loadu_si128((const __m128i *) (second + i * 16));
+    mask |= uint64_t(_mm_movemask_epi8(_mm_cmpeq_epi8(a, b)) != 0xFFFF) << i;
   }
-  file_t first(argv[1], O_RDONLY);
-  file_t second(argv[2], O_RDONLY);
-  if (!(first.open() && second.open())) {
-    std::cerr << "can't open files: " << strerror(errno) << std::endl;
-    return -3;
+  return mask;
+}
+
+__attribute__((target("avx2")))
+uint64_t group_diff_avx2(const char * first, const char * second)
+{
+  uint64_t mask = 0;
+  for (size_t i = 0; i < GROUP_BLOCKS; i += 2) {
+    const __m256i a = _mm256_loadu_si256((const __m256i *) (first + i * 16));
+    const __m256i b = _mm256_loadu_si256((const __m256i *) (second + i * 16));
+    const uint32_t equal = _mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b));
+    mask |= uint64_t((equal & 0xFFFF) != 0xFFFF) << i;
+    mask |= uint64_t((equal >> 16) != 0xFFFF) << (i + 1);
   }
-  std::string buffer1(BUFFER_READ_SIZE, 0);
-  std::string buffer2(BUFFER_READ_SIZE, 0);
+  return mask;
+}
+#endif
+
+using group_diff_t = uint64_t (*)(const char *, const char *);
+
+std::pair<group_diff_t, const char *> select_group_diff()
+{
+#if defined(__x86_64__) && (HASHING_BLOCK_SIZE == 16)
+  if (__builtin_cpu_supports("avx2")) return { group_diff_avx2, "avx2" };
+  return { group_diff_sse2, "sse2" };
+#else
+  return { group_diff_generic, "generic" };
+#endif
+}
+
+// [first_block, end_block)
+struct diff_range_t
+{
+  size_t first_block;
+  size_t end_block;
+};
+
+struct segment_result_t
+{
+  size_t blocks = 0;
   size_t deltas = 0;
-  ssize_t readed1 = 0;
-  ssize_t readed2 = 0;
-  ssize_t left1 = 0;
-  ssize_t left2 = 0;
-  size_t blocks;
-  do {
-    size_t block;
-    size_t min = std::min(readed1 + left1, readed2 + left2);
-    for (block = 0; block + HASHING_BLOCK_SIZE <= min; block += HASHING_BLOCK_SIZE) {
-      if (memcmp(buffer1.data() + block, buffer2.data() + block, HASHING_BLOCK_SIZE) != 0) {
-        deltas++;
+  size_t ranges = 0;
+  // first ranges of segment, one more than reported for merging with previous segment
+  std::vector<diff_range_t> listed;
+  diff_range_t last = { 0, 0 };
+};
+
+class segment_differ_t
+{
+public:
+  segment_differ_t(segment_result_t& result, size_t max_listed)
+    : result_(result)
+    , max_listed_(max_listed)
+  {
+  }
+
+  void differ(size_t block)
+  {
+    result_.deltas++;
+    if (open_ && current_.end_block == block) {
+      current_.end_block++;
+      return;
+    }
+    close();
+    open_ = true;
+    current_ = { block, block + 1 };
+  }
+
+  void close()
+  {
+    if (!open_) return;
+    open_ = false;
+    result_.ranges++;
+    result_.last = current_;
+    if (result_.listed.size() < max_listed_) result_.listed.push_back(current_);
+  }
+
+private:
+  segment_result_t& result_;
+  size_t max_listed_;
+  bool open_ = false;
+  diff_range_t current_;
+};
+
+// compares bytes [begin, end) of both mappings, begin is multiple of GROUP_BYTES,
+// end is multiple of GROUP_BYTES or end of compared part
+void compare_segment(const mapped_file_t& first, const mapped_file_t& second, size_t begin, size_t end,
+                     group_diff_t group_diff, size_t max_listed, segment_result_t& result)
+{
+  segment_differ_t differ(result, max_listed + 1);
+  const char * a = first.data();
+  const char * b = second.data();
+  size_t pos = begin;
+  while (pos + GROUP_BYTES <= end) {
+    const size_t window = std::min(WINDOW_BYTES, (end - pos) / GROUP_BYTES * GROUP_BYTES);
+    if (memcmp(a + pos, b + pos, window) == 0) {
+      differ.close();
+    } else {
+      for (size_t group = pos; group < pos + window; group += GROUP_BYTES) {
+        uint64_t mask = group_diff(a + group, b + group);
+        if (mask == 0) {
+          differ.close();
+          continue;
+        }
+        const size_t first_block = group / HASHING_BLOCK_SIZE;
+        for (size_t i = 0; i < GROUP_BLOCKS; i++) {
+          if (mask & (uint64_t(1) << i)) {
+            differ.differ(first_block + i);
+          } else {
+            differ.close();
+          }
+        }
       }
     }
-    blocks += block / HASHING_BLOCK_SIZE;
-    left1 = readed1 + left1 - block;
-    left2 = readed2 + left2 - block;
-    if (left1 > 0) memcpy(buffer1.data(), buffer1.data() + block, left1);
-    if (left2 > 0) memcpy(buffer2.data(), buffer2.data() + block, left2);
-    readed1 = first.read(buffer1.data() + left1, BUFFER_READ_SIZE - left1);
-    readed2 = second.read(buffer2.data() + left2, BUFFER_READ_SIZE - left2);
-  } while (readed1 > 0 && readed2 > 0);
-  ssize_t min = std::min(readed1 + left1, readed2 + left2);
-  if (min > 0) {
-    blocks++;
-    if (memcpy(buffer1.data(), buffer2.data(), min) != 0) {
-      deltas++;
+    // pages behind are not needed anymore
+    first.advise(pos, window, MADV_DONTNEED);
+    second.advise(pos, window, MADV_DONTNEED);
+    pos += window;
+  }
+  // tail of compared part, last block may be short
+  for (; pos < end; pos += HASHING_BLOCK_SIZE) {
+    const size_t length = std::min<size_t>(HASHING_BLOCK_SIZE, end - pos);
+    if (memcmp(a + pos, b + pos, length) != 0) {
+      differ.differ(pos / HASHING_BLOCK_SIZE);
+    } else {
+      differ.close();
+    }
+  }
+  differ.close();
+  result.blocks = (end - begin + HASHING_BLOCK_SIZE - 1) / HASHING_BLOCK_SIZE;
+}
+
+void compare_blocks(const mapped_file_t& first, const mapped_file_t& second, size_t threads, size_t max_ranges)
+{
+  const auto start = std::chrono::steady_clock::now();
+  const size_t common = std::min(first.size(), second.size());
+  first.advise(0, common, MADV_SEQUENTIAL);
+  second.advise(0, common, MADV_SEQUENTIAL);
+
+  // segments are cut by groups, at least a window per thread
+  const size_t groups = common / GROUP_BYTES;
+  threads = std::max<size_t>(1, std::min(threads, groups / (WINDOW_BYTES / GROUP_BYTES)));
+  const auto [group_diff, kernel] = select_group_diff();
+  std::vector<segment_result_t> results(threads);
+  std::vector<std::thread> workers;
+  for (size_t t = 0; t < threads; t++) {
+    const size_t begin = groups * t / threads * GROUP_BYTES;
+    const size_t end = (t + 1 == threads) ? common : groups * (t + 1) / threads * GROUP_BYTES;
+    workers.emplace_back(compare_segment, std::cref(first), std::cref(second), begin, end,
+                         group_diff, max_ranges, std::ref(results[t]));
+  }
+  for (auto& worker : workers) {
+    worker.join();
+  }
+
+  // ranges touching segment bound are merged
+  size_t blocks = 0;
+  size_t deltas = 0;
+  size_t ranges = 0;
+  std::vector<diff_range_t> listed;
+  size_t previous_end = SIZE_MAX;
+  for (const auto& result : results) {
+    blocks += result.blocks;
+    deltas += result.deltas;
+    ranges += result.ranges;
+    for (size_t i = 0; i < result.listed.size(); i++) {
+      const diff_range_t& range = result.listed[i];
+      if (i == 0 && range.first_block == previous_end) {
+        ranges--;
+        if (!listed.empty() && listed.back().end_block == previous_end) {
+          listed.back().end_block = range.end_block;
+        }
+      } else if (listed.size() < max_ranges) {
+        listed.push_back(range);
+      }
     }
-    readed1 -= min;
-    readed2 -= min;
+    if (result.ranges > 0) previous_end = result.last.end_block;
   }
-  if (readed1 + left1 > 0 || readed2 + left2 > 0) {
-    if (readed1 + left1 > 0) {
-      std::cout << "file \'" << argv[2] << "\' ended earlier.\n";
+  const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+  if (first.size() != second.size()) {
+    if (first.size() > second.size()) {
+      std::cout << "file \'" << second.path() << "\' ended earlier.\n";
     } else {
-      std::cout << "file \'" << argv[1] << "\' ended earlier.\n";
+      std::cout << "file \'" << first.path() << "\' ended earlier.\n";
     }
   }
+  for (const auto& range : listed) {
+    std::cout << "differ: bytes [" << range.first_block * HASHING_BLOCK_SIZE << ", "
+              << std::min(range.end_block * HASHING_BLOCK_SIZE, common) << ")\n";
+  }
+  if (listed.size() < ranges) {
+    std::cout << "differ: ... " << ranges - listed.size() << " more ranges\n";
+  }
   std::cout << "deltas: " << deltas << ", all compared blocks: " << blocks
-            << ", delta %: " << ((float) deltas) / blocks << std::endl;
+            << ", delta %: " << (blocks ? 100.0 * deltas / blocks : 0.0)
+            << ", differing ranges: " << ranges << std::endl;
+  std::cerr << "info: compared " << common << " bytes in " << elapsed.count() << " s ("
+            << common / (1024.0 * 1024.0) / std::max(elapsed.count(), 1e-9) << " MiB/s), threads: "
+            << threads << ", kernel: " << kernel << std::endl;
+}
+
+struct similarity_options_t
+{
+  chunking_t chunking = CHUNKING_CDC;
+  size_t chunk_size = DEFAULT_CHUNK_SIZE;
+  size_t max_fingerprints = DEFAULT_MAX_FINGERPRINTS;
+};
+
+// fingerprints of chunks, only chunks with sample_bits high zero bits
+// of fingerprint are kept, sample_bits grows when max_fingerprints is reached
+class chunk_sample_t
+{
+public:
+  explicit chunk_sample_t(size_t max_fingerprints)
+    : fingerprints_(std::min<size_t>(max_fingerprints, 64 * 1024))
+    , max_fingerprints_(max_fingerprints)
+  {
+  }
+
+  bool sampled(uint64_t fingerprint) const
+  {
+    return sample_bits_ == 0 || (fingerprint >> (64 - sample_bits_)) == 0;
+  }
+
+  void add(uint64_t fingerprint)
+  {
+    if (!sampled(fingerprint) || !fingerprints_.insert(fingerprint)) return;
+    if (fingerprints_.size() > max_fingerprints_) {
+      sample_bits_++;
+      fingerprints_.filter([this](uint64_t value) { return sampled(value); });
+    }
+  }
+
+  bool contains(uint64_t fingerprint) const { return fingerprints_.contains(fingerprint); }
+
+  size_t sample_bits() const { return sample_bits_; }
+
+  size_t memory() const { return fingerprints_.memory(); }
+
+private:
+  fingerprint_set_t fingerprints_;
+  size_t max_fingerprints_;
+  size_t sample_bits_ = 0;
+};
+
+// handler(pos, length, hash) for each chunk of file, pages behind are released
+template<typename Handler>
+void for_each_chunk(const mapped_file_t& file, const chunker_t& chunker, Handler handler)
+{
+  unsigned char hash[BYTES_HASH];
+  size_t released = 0;
+  file.advise(0, file.size(), MADV_SEQUENTIAL);
+  for (size_t pos = 0; pos < file.size();) {
+    const size_t length = chunker.next(file.data() + pos, file.size() - pos);
+#if (HASH_BITS == 256)
+    SHA256((const unsigned char *) file.data() + pos, length, hash);
+#else
+#error "unknown algoritm"
+#endif
+    handler(pos, length, hash);
+    pos += length;
+    if (pos - released >= RELEASE_BYTES) {
+      file.advise(released, pos - released, MADV_DONTNEED);
+      released = pos;
+    }
+  }
+}
+
+// runs of file2 chunks found in file1, in bytes of file2
+struct shared_run_t
+{
+  size_t begin;
+  size_t end;
+};
+
+void compare_similarity(const mapped_file_t& first, const mapped_file_t& second,
+                        const similarity_options_t& options)
+{
+  const auto start = std::chrono::steady_clock::now();
+  const chunker_t chunker(options.chunking, options.chunk_size);
+  chunk_sample_t sample(options.max_fingerprints);
+  size_t first_chunks = 0;
+  for_each_chunk(first, chunker, [&](size_t, size_t, const unsigned char * hash) {
+    first_chunks++;
+    sample.add(fingerprint_set_t::fingerprint(hash));
+  });
+
+  // unsampled chunks neither break nor extend run
+  size_t second_chunks = 0;
+  size_t sampled_chunks = 0;
+  size_t shared_chunks = 0;
+  size_t shared_bytes = 0;
+  std::vector<shared_run_t> longest;
+  bool run_open = false;
+  shared_run_t run = { 0, 0 };
+  auto close_run = [&]() {
+    if (!run_open) return;
+    run_open = false;
+    longest.push_back(run);
+    std::sort(longest.begin(), longest.end(), [](const shared_run_t& a, const shared_run_t& b) {
+      return a.end - a.begin > b.end - b.begin;
+    });
+    if (longest.size() > LONGEST_RUNS) longest.pop_back();
+  };
+  for_each_chunk(second, chunker, [&](size_t pos, size_t length, const unsigned char * hash) {
+    second_chunks++;
+    const uint64_t fingerprint = fingerprint_set_t::fingerprint(hash);
+    if (!sample.sampled(fingerprint)) return;
+    sampled_chunks++;
+    if (!sample.contains(fingerprint)) {
+      close_run();
+      return;
+    }
+    shared_chunks++;
+    shared_bytes += length;
+    if (!run_open) {
+      run_open = true;
+      run.begin = pos;
+    }
+    run.end = pos + length;
+  });
+  close_run();
+  const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+  const size_t scale = size_t(1) << sample.sample_bits();
+  shared_chunks = std::min(shared_chunks * scale, second_chunks);
+  shared_bytes = std::min(shared_bytes * scale, second.size());
+  std::cout << "similarity: chunking: " << (options.chunking == CHUNKING_CDC ? "cdc" : "fixed")
+            << ", chunk size: " << chunker.min_size() << ".." << chunker.max_size()
+            << "\nsimilarity: file1 chunks: " << first_chunks << ", bytes: " << first.size()
+            << "\nsimilarity: file2 chunks: " << second_chunks << ", bytes: " << second.size();
+  if (sample.sample_bits() > 0) {
+    std::cout << "\nsimilarity: sampled 1/" << scale << " of chunks (" << sampled_chunks
+              << " of file2), shared values and runs are estimates";
+  }
+  std::cout << "\nsimilarity: shared chunks: " << shared_chunks
+            << ", shared bytes: " << shared_bytes
+            << ", shared % of file2: " << (second.size() ? 100.0 * shared_bytes / second.size() : 0.0);
+  for (const auto& longest_run : longest) {
+    std::cout << "\nsimilarity: shared run: file2 bytes [" << longest_run.begin << ", " << longest_run.end
+              << "), length: " << longest_run.end - longest_run.begin;
+  }
+  std::cout << std::endl;
+  std::cerr << "info: chunked " << first.size() + second.size() << " bytes in " << elapsed.count()
+            << " s, fingerprints memory: " << sample.memory() << " bytes" << std::endl;
+}
+
+} // anonimous namespace
+
+int main(int argc, char ** argv)
+{
+  size_t threads = std::max(1u, std::thread::hardware_concurrency());
+  size_t max_ranges = DEFAULT_MAX_RANGES;
+  bool similarity = false;
+  similarity_options_t similarity_options;
+  std::vector<std::string> paths;
+  for (int i = 1; i < argc; i++) {
+    if (!(strcmp(argv[i], "-h") && strcmp(argv[i], "--help"))) {
+      std::cout << "usage: <program> [--threads count] [--max-ranges count] file1 file2 |"
+                   "\n<program> --similarity [--chunking (cdc|fixed)] [--chunk-size bytes]"
+                   " [--max-fingerprints count] file1 file2"
+                   "\ncompares files by blocks of " << HASHING_BLOCK_SIZE << " bytes at identical offsets,"
+                   "\nprints count of differing blocks and first \"--max-ranges\" (default "
+                << DEFAULT_MAX_RANGES << ") differing ranges."
+                   "\nuse option \"--similarity\" for compare chunks of files at any offsets:"
+                   "\n\tchunks of file2 (content defined by default, average \"--chunk-size\" "
+                << DEFAULT_CHUNK_SIZE << " bytes) are looked up"
+                   "\n\tin fingerprints of file1 chunks, prints shared bytes, shared chunks and longest shared runs,"
+                   "\n\tfingerprints are sampled when there are more than \"--max-fingerprints\" (default "
+                << DEFAULT_MAX_FINGERPRINTS << ").\n";
+      return 0;
+    }
+    if (i + 1 < argc && !strcmp(argv[i], "--threads")) {
+      threads = std::max(1, atoi(argv[++i]));
+    } else if (i + 1 < argc && !strcmp(argv[i], "--max-ranges")) {
+      max_ranges = std::max(0, atoi(argv[++i]));
+    } else if (!strcmp(argv[i], "--similarity")) {
+      similarity = true;
+    } else if (i + 1 < argc && !strcmp(argv[i], "--chunking")) {
+      i++;
+      if (!strcmp(argv[i], "cdc")) {
+        similarity_options.chunking = CHUNKING_CDC;
+      } else if (!strcmp(argv[i], "fixed")) {
+        similarity_options.chunking = CHUNKING_FIXED;
+      } else {
+        std::cerr << "unknown chunking \'" << argv[i] << "\', aborted...\n";
+        return -1;
+      }
+    } else if (i + 1 < argc && !strcmp(argv[i], "--chunk-size")) {
+      similarity_options.chunk_size = std::max(1ll, atoll(argv[++i]));
+    } else if (i + 1 < argc && !strcmp(argv[i], "--max-fingerprints")) {
+      similarity_options.max_fingerprints = std::max(1ll, atoll(argv[++i]));
+    } else {
+      paths.push_back(argv[i]);
+    }
+  }
+  if (paths.size() != 2) {
+    std::cerr << "bad command line args - need 2 files for compare\n";
+    return -1;
+  }
+  if (!(std::filesystem::exists(std::filesystem::path(paths[0]))
+     && std::filesystem::exists(std::filesystem::path(paths[1])))) {
+    std::cerr << "files: \'" << paths[0] << "\', \'" << paths[1] << "\' not found, aborted...\n";
+    return -2;
+  }
+  mapped_file_t first(paths[0]);
+  mapped_file_t second(paths[1]);
+  if (!(first.map() && second.map())) {
+    std::cerr << "can't map files: " << strerror(errno) << std::endl;
+    return -3;
+  }
+  if (similarity) {
+    compare_similarity(first, second, similarity_options);
+  } else {
+    compare_blocks(first, second, threads, max_ranges);
+  }
   return 0;
 }
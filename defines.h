@@ -21,9 +21,18 @@
 
 #define HASH_FILENAME_POSTFIX_NUMBERS 6
 
-#define MAX_SINGLE_HASH_FILE_SIZE (1 << 31)
+#define MAX_SINGLE_HASH_FILE_SIZE (1ll << 31)
 
+// record of hash file is length prefix of BLOCK_SIZE_BYTES and data, highest bit of prefix is DELTA_RECORD_FLAG.
+// prefix grows with HASHING_BLOCK_SIZE, so records of large blocks don't pay for it much;
+// index keeps length of record, so it's readed by one read of exact size
+#if (HASHING_BLOCK_SIZE < (1 << 7))
 #define BLOCK_SIZE_BYTES 1
+#elif (HASHING_BLOCK_SIZE < (1 << 15))
+#define BLOCK_SIZE_BYTES 2
+#else
+#define BLOCK_SIZE_BYTES 4
+#endif
 
 #define HASH_TABLE_NAME "hashes_" USED_HASH "_" HASHING_BLOCK_SIZE_STR
 
@@ -35,22 +44,144 @@
 
 #define INSERT_MANY_HASHES_COUNT (BUFFER_READ_SIZE / HASHING_BLOCK_SIZE)
 
+#define SELECT_MANY_HASHES_COUNT (SQL_REQUEST_LENGTH_LIMIT / (HASH_HEX_BYTES + 3))
+
 #define BIGSERIAL_MAX_NUMBERS 19    // 1 .. 9223372036854775807 + bigint
 #define SERIAL_MAX_NUMBERS    10    // 1 .. 2147483647          + integer
 
 #define SUBDIRECTORY_HASHES_PATH "/tmp/deduplicated_server/hashes"
 #define SUBDIRECTORY_FILES_PATH "/tmp/deduplicated_server/files_" USED_HASH "_" HASHING_BLOCK_SIZE_STR
+#define SUBDIRECTORY_OFFSETS_PATH "/tmp/deduplicated_server/offsets_" USED_HASH "_" HASHING_BLOCK_SIZE_STR
 #define PREF_LAST_HASH_FILENAME "." USED_HASH "_" HASHING_BLOCK_SIZE_STR ".last"
+// previous versions of stored file "name" are recipes VERSIONS_DIRECTORY/name/N in files dir,
+// version being written has VERSION_TMP_SUFFIX until it replaces latest one
+#define VERSIONS_DIRECTORY ".versions"
+#define VERSION_TMP_SUFFIX ".tmp"
+// copy of used_files in hashes dir, path of hash file by id without DB
+#define HASH_FILES_TABLE_FILENAME ".used_files"
+#define HASH_FILES_TABLE_RECORD 256
+// end of whole records of hash file "name" is saved in "name" HASH_FILE_END_SUFFIX by session appending to it
+#define HASH_FILE_END_SUFFIX ".end"
 #define wrap_ostringstream(X) (std::ostringstream() << X).str().data()
 
 // 'HASH_HEX_BYTES',
 #define SELECT_MANY_HASHES_LENGTH ((3 + HASH_HEX_BYTES) * SELECT_MANY_HASHES_COUNT - 1)
 
-// ('HASH_HEX_BYTES',serial,bigserial,1),
-#define INSERT_ROW_MAX_LENGTH (9 + HASH_HEX_BYTES + BIGSERIAL_MAX_NUMBERS + SERIAL_MAX_NUMBERS)
+// ('HASH_HEX_BYTES',serial,bigserial,1,integer),
+#define INSERT_ROW_MAX_LENGTH (10 + HASH_HEX_BYTES + BIGSERIAL_MAX_NUMBERS + 2 * SERIAL_MAX_NUMBERS)
 
 #define INSERT_MAX_MANY_HASHES_LENGTH (INSERT_ROW_MAX_LENGTH * INSERT_MANY_HASHES_COUNT - 1)
 
+#define STATS_DEFAULT_INTERVAL_SEC 10
+
+// 4 MiB of fingerprints
+#define ESTIMATE_DEFAULT_MAX_FINGERPRINTS (512 * 1024)
+
+// heap tuple and primary key entry of HASH_TABLE_NAME row
+#define INDEX_ROW_ESTIMATED_BYTES (2 * (HASH_HEX_BYTES + 1) + 16 + 24 + 16)
+
+#define COMPACTION_BUFFER_SIZE (16 * BUFFER_READ_SIZE)
+
+#define COMPACTION_DEFAULT_LIVE_RATIO 0.5
+
+// hash files changed later than this count of seconds before compaction start are skipped
+#define COMPACTION_MIN_AGE_SEC 60
+
+// hash files are scanned by slices of this count of records, live chunks are moved by batches of about this count
+#define COMPACTION_BATCH_CHUNKS (1024 * 1024)
+
+#define COMPACT_TMP_FILENAME ".compact.tmp"
+#define COMPACT_RETIRE_FILENAME ".compact.retire"
+#define COMPACT_LIVENESS_FILENAME ".compact.live"
+#define COMPACT_DEAD_FILENAME ".compact.dead"
+#define COMPACT_LOCK_FILENAME ".compact.lock"
+
+#define RELOCATE_HASHES_COUNT (INSERT_MANY_HASHES_COUNT / 4)
+
+// ('HASH_HEX_BYTES',serial,bigint,bigint),
+#define RELOCATE_ROW_MAX_LENGTH (8 + HASH_HEX_BYTES + SERIAL_MAX_NUMBERS + 2 * BIGSERIAL_MAX_NUMBERS)
+
+// files not larger are read ahead by bulk ingest while previous files are stored
+#define BULK_PREFETCH_FILE_LIMIT (16 * BUFFER_READ_SIZE)
+#define BULK_PREFETCH_BYTES (64 * 1024 * 1024)
+
+// records of offset index sidecar buffered before writing
+#define OFFSET_INDEX_BUFFERED_RECORDS 4096
+
+// requests in flight of io engine, fallback thread pool size, registered files slots
+#define IO_ENGINE_DEPTH 256
+#define IO_ENGINE_THREADS 8
+#define IO_ENGINE_MAX_FILES 256
+
+// appends to output hash file and to recipe are combined in buffers of this size
+#define CHUNK_WRITE_BUFFER_SIZE (1024 * 1024)
+#define RECIPE_WRITE_BUFFER_SIZE (4 * BUFFER_READ_SIZE)
+
+// input of -w not mappable to memory is readed to buffer of BUFFER_READ_SIZE with this alignment
+#define INPUT_BUFFER_ALIGNMENT 4096
+
+// delta record: block size prefix with DELTA_RECORD_FLAG, raw digest of base block, delta of block against base.
+// base chains are not longer than DELTA_MAX_DEPTH, delta is stored if it saves DELTA_MIN_SAVING bytes
+#define DELTA_RECORD_FLAG (1ull << (8 * BLOCK_SIZE_BYTES - 1))
+#define DELTA_MAX_DEPTH 4
+#define DELTA_MIN_SAVING 8
+#define DELTA_FEATURES 6
+#define DELTA_SUPER_FEATURES 3
+#define DELTA_MATCH_BYTES 4
+#define DELTA_MIN_MATCH 8
+// slots of direct mapped sketch index, saved in hashes directory
+#define DELTA_SKETCH_SLOTS (1024 * 1024)
+#define SKETCH_INDEX_FILENAME ".sketches_" USED_HASH "_" HASHING_BLOCK_SIZE_STR
+
+// recipe entry of run of zero bytes instead of digest: magic and big endian length of run,
+// run of one buffer is one entry, its blocks are not hashed and not stored
+#define ZERO_RUN_ENTRY_MAGIC "ZERO_RUN_ENTRY_V1_MAGIC\xff"
+#define ZERO_RUN_ENTRY_MAGIC_BYTES (sizeof(ZERO_RUN_ENTRY_MAGIC) - 1)
+
+// hashes are sharded by first byte of digest, shards are listed in db_connection.txt by lines with prefix
+#define INDEX_MAX_SHARDS 256
+#define DB_SHARD_LINE_PREFIX "shard:"
+
+// sparse index: digests with SPARSE_SAMPLE_BITS low zero bits of last byte are hooks of HOOK_TABLE_NAME,
+// hook refers to manifest of first segment (saved buffer) with it in SPARSE_MANIFESTS_FILENAME of hashes dir.
+// segment is deduplicated against SPARSE_CHAMPIONS manifests sharing most hooks with it and against previous segment,
+// SPARSE_CACHED_MANIFESTS manifests are kept in memory
+#define SPARSE_SAMPLE_BITS 6
+#define SPARSE_CHAMPIONS 16
+#define SPARSE_CACHED_MANIFESTS 64
+#define HOOK_TABLE_NAME "hooks_" USED_HASH "_" HASHING_BLOCK_SIZE_STR
+#define SPARSE_MANIFESTS_FILENAME ".manifests_" USED_HASH "_" HASHING_BLOCK_SIZE_STR
+// locations of recipe entries of files stored with sparse index, LOCATIONS_DIRECTORY/name in offsets dir
+#define LOCATIONS_DIRECTORY ".locations"
+
+// replication session starts with REPLICATE_MAGIC, recipes are sent by parts of REPLICATE_PART_ENTRIES entries,
+// receiver answers each part with digests it misses and sender sends only their blocks
+#define REPLICATE_MAGIC "DDREPL01"
+#define REPLICATE_MAGIC_BYTES (sizeof(REPLICATE_MAGIC) - 1)
+#define REPLICATE_PART_ENTRIES (16 * 1024)
+#define REPLICATE_BUFFER_SIZE (256 * 1024)
+
+// archive restore resolves chunks of files by batches of ARCHIVE_BATCH_ENTRIES entries and not more than
+// ARCHIVE_BATCH_BYTES of blocks, records close in hash file are readed by one span of ARCHIVE_READ_SPAN_BYTES,
+// ARCHIVE_READ_SPANS spans are in flight
+#define ARCHIVE_BATCH_ENTRIES (256 * 1024)
+#define ARCHIVE_BATCH_BYTES (32 * 1024 * 1024)
+#define ARCHIVE_READ_SPAN_BYTES (256 * 1024)
+#define ARCHIVE_READ_GAP_BYTES BUFFER_READ_SIZE
+#define ARCHIVE_READ_SPANS 32
+#define TAR_BLOCK_SIZE 512
+
+// trace of store session starts with TRACE_MAGIC, records are written by TRACE_BUFFER_SIZE bytes
+#define TRACE_MAGIC "DDTRACE1"
+#define TRACE_MAGIC_BYTES (sizeof(TRACE_MAGIC) - 1)
+#define TRACE_BUFFER_SIZE (1024 * 1024)
+// random salt of trace seeds in hashes dir, traces of one store have same seeds of same blocks
+#define TRACE_SALT_FILENAME ".trace_salt"
+
+// index changes of ingest are committed after this count of input bytes or seconds
+#define COMMIT_GROUP_DEFAULT_BYTES (64 * 1024 * 1024)
+#define COMMIT_GROUP_DEFAULT_INTERVAL_SEC 1.0
+
 constexpr const char HASH_FILENAME_PREFIX[] = USED_HASH "_" HASHING_BLOCK_SIZE_STR "_";
 
 #if (BUFFER_READ_SIZE % HASHING_BLOCK_SIZE)
@@ -65,8 +196,20 @@ constexpr const char HASH_FILENAME_PREFIX[] = USED_HASH "_" HASHING_BLOCK_SIZE_S
 #error "bad hash size"
 #endif
 
-#if (HASHING_BLOCK_SIZE >= (1 << (8 * BLOCK_SIZE_BYTES)))
-#error "HASHING_BLOCK_SIZE overflow BLOCK_SIZE_BYTES"
+#if (HASHING_BLOCK_SIZE > (1 << 30))
+#error "record length of HASHING_BLOCK_SIZE should fit hash_location_t"
+#endif
+
+#if (BYTES_HASH != 32)
+#error "ZERO_RUN_ENTRY_MAGIC and run length should fill BYTES_HASH"
+#endif
+
+#if (HASHING_BLOCK_SIZE >= DELTA_RECORD_FLAG)
+#error "HASHING_BLOCK_SIZE overlaps DELTA_RECORD_FLAG"
+#endif
+
+#if (SPARSE_SAMPLE_BITS > 8)
+#error "SPARSE_SAMPLE_BITS should fit last byte of digest"
 #endif
 
 #endif // DEFINES_H
@@ -0,0 +1,172 @@
+#include "delta.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace {
+
+struct feature_tables_t
+{
+  feature_tables_t()
+  {
+    uint64_t state = 0x736B65746368ull;
+    auto next = [&state]() {
+      uint64_t z = (state += 0x9E3779B97F4A7C15ull);
+      z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+      z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+      return z ^ (z >> 31);
+    };
+    for (auto& value : gear) {
+      value = next();
+    }
+    for (size_t i = 0; i < DELTA_FEATURES; i++) {
+      multipliers[i] = next() | 1;
+      addends[i] = next();
+    }
+  }
+
+  uint64_t gear[256];
+  uint64_t multipliers[DELTA_FEATURES];
+  uint64_t addends[DELTA_FEATURES];
+};
+
+const feature_tables_t tables;
+
+constexpr size_t features_per_super = DELTA_FEATURES / DELTA_SUPER_FEATURES;
+
+// hash of last 16 bytes, each byte is shifted by 4 bits
+constexpr size_t sketch_window = 16;
+
+uint32_t match_hash(const char * data, size_t bits)
+{
+  uint32_t value;
+  memcpy(&value, data, DELTA_MATCH_BYTES);
+  return (value * 2654435761u) >> (32 - bits);
+}
+
+size_t put_varint(char * out, uint64_t value)
+{
+  size_t len = 0;
+  while (value >= 0x80) {
+    out[len++] = (char) (value | 0x80);
+    value >>= 7;
+  }
+  out[len++] = (char) value;
+  return len;
+}
+
+bool get_varint(const char * data, size_t len, size_t * pos, uint64_t * value)
+{
+  *value = 0;
+  for (size_t shift = 0; *pos < len && shift < 64; shift += 7) {
+    const unsigned char byte = data[(*pos)++];
+    *value |= uint64_t(byte & 0x7F) << shift;
+    if (!(byte & 0x80)) return true;
+  }
+  return false;
+}
+
+} // anonimous namespace
+
+static_assert(DELTA_FEATURES % DELTA_SUPER_FEATURES == 0, "features are grouped to super-features evenly");
+
+void compute_sketch(const char * data, size_t len, sketch_t * sketch)
+{
+  const unsigned char * bytes = (const unsigned char *) data;
+  uint64_t features[DELTA_FEATURES] = {};
+  uint64_t hash = 0;
+  // short chunks have one window
+  const size_t first = std::min(len, sketch_window) - 1;
+  for (size_t i = 0; i < len; i++) {
+    hash = (hash << 4) + tables.gear[bytes[i]];
+    if (i < first) continue;
+    for (size_t f = 0; f < DELTA_FEATURES; f++) {
+      features[f] = std::max(features[f], hash * tables.multipliers[f] + tables.addends[f]);
+    }
+  }
+  for (size_t s = 0; s < DELTA_SUPER_FEATURES; s++) {
+    uint64_t super_feature = s;
+    for (size_t f = s * features_per_super; f < (s + 1) * features_per_super; f++) {
+      super_feature = (super_feature ^ features[f]) * 0x9E3779B97F4A7C15ull;
+      super_feature ^= super_feature >> 29;
+    }
+    sketch->super_features[s] = super_feature;
+  }
+}
+
+size_t delta_encoder_t::encode(const char * base, size_t base_len, const char * target, size_t target_len,
+                               char * out, size_t limit)
+{
+  size_t bits = 6;
+  while ((size_t(1) << bits) < 2 * base_len) bits++;
+  table_.assign(size_t(1) << bits, 0);
+  for (size_t pos = 0; pos + DELTA_MATCH_BYTES <= base_len; pos++) {
+    table_[match_hash(base + pos, bits)] = pos + 1;
+  }
+  // varints are at most 10 bytes
+  char op[20];
+  size_t out_pos = 0;
+  auto add = [&](size_t begin, size_t end) {
+    if (begin == end) return true;
+    const size_t op_len = put_varint(op, (end - begin) << 1);
+    if (out_pos + op_len + end - begin > limit) return false;
+    memcpy(out + out_pos, op, op_len);
+    memcpy(out + out_pos + op_len, target + begin, end - begin);
+    out_pos += op_len + end - begin;
+    return true;
+  };
+  auto copy = [&](size_t offset, size_t len) {
+    size_t op_len = put_varint(op, (len << 1) | 1);
+    op_len += put_varint(op + op_len, offset);
+    if (out_pos + op_len > limit) return false;
+    memcpy(out + out_pos, op, op_len);
+    out_pos += op_len;
+    return true;
+  };
+  size_t literal = 0;
+  size_t pos = 0;
+  while (pos + DELTA_MATCH_BYTES <= target_len) {
+    const uint32_t candidate = table_[match_hash(target + pos, bits)];
+    if (candidate) {
+      const size_t offset = candidate - 1;
+      size_t len = 0;
+      while (offset + len < base_len && pos + len < target_len && base[offset + len] == target[pos + len]) {
+        len++;
+      }
+      if (len >= DELTA_MIN_MATCH) {
+        if (!add(literal, pos) || !copy(offset, len)) return 0;
+        pos += len;
+        literal = pos;
+        continue;
+      }
+    }
+    pos++;
+  }
+  if (!add(literal, target_len)) return 0;
+  return out_pos;
+}
+
+ssize_t delta_decode(const char * base, size_t base_len, const char * delta, size_t delta_len,
+                     char * out, size_t out_size)
+{
+  size_t pos = 0;
+  size_t out_pos = 0;
+  while (pos < delta_len) {
+    uint64_t op;
+    if (!get_varint(delta, delta_len, &pos, &op)) return -1;
+    const uint64_t len = op >> 1;
+    if (len > out_size - out_pos) return -1;
+    if (op & 1) {
+      uint64_t offset;
+      if (!get_varint(delta, delta_len, &pos, &offset)) return -1;
+      if (offset > base_len || len > base_len - offset) return -1;
+      memcpy(out + out_pos, base + offset, len);
+    } else {
+      if (len > delta_len - pos) return -1;
+      memcpy(out + out_pos, delta + pos, len);
+      pos += len;
+    }
+    out_pos += len;
+  }
+  return out_pos;
+}
@@ -0,0 +1,39 @@
+#ifndef DELTA_H
+#define DELTA_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include <sys/types.h>
+
+#include "defines.h"
+
+// super-features of chunk: similar chunks share some of them with high probability
+struct sketch_t
+{
+  uint64_t super_features[DELTA_SUPER_FEATURES];
+};
+
+void compute_sketch(const char * data, size_t len, sketch_t * sketch);
+
+// delta is sequence of operations, each starts with varint (len << 1 | copy):
+// copy is followed by varint offset in base, add - by len bytes of target
+class delta_encoder_t
+{
+public:
+  // writes delta turning base into target to out, returns its size
+  // or 0 if it doesn't fit to limit bytes
+  size_t encode(const char * base, size_t base_len, const char * target, size_t target_len,
+                char * out, size_t limit);
+
+private:
+  // position + 1 of DELTA_MATCH_BYTES of base by their hash, 0 - empty
+  std::vector<uint32_t> table_;
+};
+
+// returns target size or -1 if delta is broken or target is larger than out_size
+ssize_t delta_decode(const char * base, size_t base_len, const char * delta, size_t delta_len,
+                     char * out, size_t out_size);
+
+#endif // DELTA_H
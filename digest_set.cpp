@@ -0,0 +1,68 @@
+#include "digest_set.h"
+
+#include <algorithm>
+#include <cstring>
+
+digest_set_t::digest_set_t(size_t capacity)
+{
+  size_t slots = 16;
+  // load factor is kept under 1/2
+  while (slots < 2 * capacity) slots *= 2;
+  digests_.resize(slots * BYTES_HASH);
+  generations_.resize(slots, 0);
+}
+
+size_t digest_set_t::find_slot(const unsigned char * digest) const
+{
+  const size_t mask = generations_.size() - 1;
+  uint64_t prefix;
+  memcpy(&prefix, digest, sizeof(prefix));
+  size_t slot = prefix & mask;
+  while (generations_[slot] == generation_
+         && memcmp(digests_.data() + slot * BYTES_HASH, digest, BYTES_HASH) != 0) {
+    slot = (slot + 1) & mask;
+  }
+  return slot;
+}
+
+bool digest_set_t::insert(const unsigned char * digest)
+{
+  if (2 * (size_ + 1) > generations_.size()) grow();
+  const size_t slot = find_slot(digest);
+  if (generations_[slot] == generation_) return false;
+  generations_[slot] = generation_;
+  memcpy(digests_.data() + slot * BYTES_HASH, digest, BYTES_HASH);
+  size_++;
+  return true;
+}
+
+bool digest_set_t::contains(const unsigned char * digest) const
+{
+  return generations_[find_slot(digest)] == generation_;
+}
+
+void digest_set_t::clear()
+{
+  size_ = 0;
+  if (++generation_ == 0) {
+    std::fill(generations_.begin(), generations_.end(), 0);
+    generation_ = 1;
+  }
+}
+
+void digest_set_t::grow()
+{
+  std::vector<unsigned char> digests(std::move(digests_));
+  std::vector<uint32_t> generations(std::move(generations_));
+  digests_.assign(digests.size() * 2, 0);
+  generations_.assign(generations.size() * 2, 0);
+  const uint32_t generation = generation_;
+  generation_ = 1;
+  for (size_t slot = 0; slot < generations.size(); slot++) {
+    if (generations[slot] != generation) continue;
+    const unsigned char * digest = digests.data() + slot * BYTES_HASH;
+    const size_t target = find_slot(digest);
+    generations_[target] = generation_;
+    memcpy(digests_.data() + target * BYTES_HASH, digest, BYTES_HASH);
+  }
+}
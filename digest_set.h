@@ -0,0 +1,37 @@
+#ifndef DIGEST_SET_H
+#define DIGEST_SET_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "defines.h"
+
+// open addressing set of raw digests, digest bytes are uniform so their prefix is hash.
+// clear is O(1): slot is used if its generation is current, memory is kept for next batch
+class digest_set_t
+{
+public:
+  explicit digest_set_t(size_t capacity);
+
+  // returns false if digest is already in set
+  bool insert(const unsigned char * digest);
+
+  bool contains(const unsigned char * digest) const;
+
+  size_t size() const { return size_; }
+
+  void clear();
+
+private:
+  void grow();
+
+  size_t find_slot(const unsigned char * digest) const;
+
+  std::vector<unsigned char> digests_;
+  std::vector<uint32_t> generations_;
+  uint32_t generation_ = 1;
+  size_t size_ = 0;
+};
+
+#endif // DIGEST_SET_H
@@ -0,0 +1,200 @@
+#include "estimator.h"
+
+#include <cmath>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <openssl/sha.h>
+
+#include "fingerprint_set.h"
+#include "stats.h"
+#include "store.h"
+#include "utils.h"
+
+namespace {
+
+class hyperloglog_t
+{
+public:
+  static constexpr size_t PRECISION = 14;
+
+  hyperloglog_t()
+    : registers_(1 << PRECISION, 0)
+  {
+  }
+
+  void add(uint64_t hash)
+  {
+    const size_t index = hash >> (64 - PRECISION);
+    const uint64_t rest = (hash << PRECISION) | (1ull << (PRECISION - 1));
+    const unsigned char rank = __builtin_clzll(rest) + 1;
+    if (registers_[index] < rank) registers_[index] = rank;
+  }
+
+  double estimate() const
+  {
+    const double m = registers_.size();
+    double sum = 0;
+    size_t zeros = 0;
+    for (unsigned char rank : registers_) {
+      sum += std::ldexp(1.0, -rank);
+      if (rank == 0) zeros++;
+    }
+    const double estimate = (0.7213 / (1 + 1.079 / m)) * m * m / sum;
+    if (estimate <= 2.5 * m && zeros > 0) {
+      return m * std::log(m / zeros);
+    }
+    return estimate;
+  }
+
+private:
+  std::vector<unsigned char> registers_;
+};
+
+class estimator_t
+{
+public:
+  estimator_t(const estimate_options_t& options, estimate_t& estimate)
+    : options_(options)
+    , estimate_(estimate)
+    , unique_(options.max_fingerprints)
+  {
+    estimate_.sample_bits = options.sample_bits;
+    pending_hex_.reserve(SELECT_MANY_HASHES_COUNT * HASH_HEX_BYTES);
+  }
+
+  void add(const unsigned char * hash, size_t block_len)
+  {
+    estimate_.blocks++;
+    uint64_t second;
+    memcpy(&second, hash + sizeof(uint64_t), sizeof(second));
+    hyperloglog_.add(second);
+    const uint64_t fingerprint = fingerprint_set_t::fingerprint(hash);
+    if (!sampled(fingerprint)) return;
+    if (!unique_.insert(fingerprint)) return;
+    if (block_len < HASHING_BLOCK_SIZE) short_blocks_.emplace_back(fingerprint, block_len);
+    if (options_.probe) {
+      const size_t pos = pending_hex_.size();
+      pending_hex_.resize(pos + HASH_HEX_BYTES);
+      to_my_hex(pending_hex_.data() + pos, hash, BYTES_HASH);
+      pending_.push_back(fingerprint);
+      if (pending_.size() == SELECT_MANY_HASHES_COUNT) probe();
+    }
+    if (unique_.size() > options_.max_fingerprints) increase_sampling();
+  }
+
+  void finish()
+  {
+    probe();
+    estimate_.sampled_unique_blocks = unique_.size();
+    estimate_.sampled_unique_bytes = unique_.size() * HASHING_BLOCK_SIZE;
+    estimate_.sampled_known_blocks = known_.size();
+    estimate_.sampled_known_bytes = known_.size() * HASHING_BLOCK_SIZE;
+    for (auto [fingerprint, len] : short_blocks_) {
+      if (!unique_.contains(fingerprint)) continue;
+      estimate_.sampled_unique_bytes -= HASHING_BLOCK_SIZE - len;
+      if (known_.contains(fingerprint)) estimate_.sampled_known_bytes -= HASHING_BLOCK_SIZE - len;
+    }
+    estimate_.hyperloglog_unique_blocks = hyperloglog_.estimate();
+    estimate_.fingerprints_memory = unique_.memory() + known_.memory();
+  }
+
+private:
+  bool sampled(uint64_t fingerprint) const
+  {
+    return estimate_.sample_bits == 0 || (fingerprint >> (64 - estimate_.sample_bits)) == 0;
+  }
+
+  void increase_sampling()
+  {
+    probe();
+    estimate_.sample_bits++;
+    auto keep = [this](uint64_t fingerprint) { return sampled(fingerprint); };
+    unique_.filter(keep);
+    known_.filter(keep);
+  }
+
+  void probe()
+  {
+    if (pending_.empty()) return;
+    std::unique_ptr<bool[]> found(new bool[pending_.size()]);
+    {
+      stage_timer_t timer(STAGE_DB_LOOKUP);
+      hash_index->exists_many(pending_hex_.data(), pending_.size(), found.get());
+    }
+    for (size_t i = 0; i < pending_.size(); i++) {
+      if (found[i]) known_.insert(pending_[i]);
+    }
+    pending_.clear();
+    pending_hex_.clear();
+  }
+
+  const estimate_options_t& options_;
+  estimate_t& estimate_;
+  fingerprint_set_t unique_;
+  fingerprint_set_t known_;
+  hyperloglog_t hyperloglog_;
+  std::vector<uint64_t> pending_;
+  std::string pending_hex_;
+  std::vector<std::pair<uint64_t, size_t>> short_blocks_;
+};
+
+} // anonimous namespace
+
+estimate_t estimate_dedup(std::istream& in, const estimate_options_t& options)
+{
+  estimate_t estimate;
+  estimator_t estimator(options, estimate);
+  std::string readbuf(BUFFER_READ_SIZE, 0);
+  unsigned char hash[BYTES_HASH];
+  while (in) {
+    std::streamsize readed_bytes;
+    {
+      stage_timer_t timer(STAGE_INPUT_READ);
+      in.read(readbuf.data(), BUFFER_READ_SIZE);
+      readed_bytes = in.gcount();
+    }
+    if (readed_bytes <= 0) break;
+    estimate.input_bytes += readed_bytes;
+    for (std::streamsize delta = 0; delta < readed_bytes; delta += HASHING_BLOCK_SIZE) {
+      const size_t hashing_bytes = std::min<size_t>(HASHING_BLOCK_SIZE, readed_bytes - delta);
+      {
+        stage_timer_t timer(STAGE_HASHING);
+#if (HASH_BITS == 256)
+        SHA256((const unsigned char *) readbuf.data() + delta, hashing_bytes, hash);
+#else
+#error "unknown algoritm"
+#endif
+      }
+      estimator.add(hash, hashing_bytes);
+    }
+  }
+  estimator.finish();
+  return estimate;
+}
+
+void print_estimate(std::ostream& out, const estimate_t& estimate, bool probed)
+{
+  const size_t scale = size_t(1) << estimate.sample_bits;
+  const size_t unique_blocks = estimate.sampled_unique_blocks * scale;
+  const size_t unique_bytes = estimate.sampled_unique_bytes * scale;
+  const size_t new_blocks = (estimate.sampled_unique_blocks - estimate.sampled_known_blocks) * scale;
+  const size_t new_bytes = (estimate.sampled_unique_bytes - estimate.sampled_known_bytes) * scale;
+  out << "estimate: input bytes: " << estimate.input_bytes << ", blocks: " << estimate.blocks
+      << "\nestimate: sampled 1/" << scale << " of fingerprints, fingerprints memory: "
+      << estimate.fingerprints_memory << " bytes"
+      << "\nestimate: unique blocks: " << unique_blocks
+      << " (HyperLogLog: " << size_t(estimate.hyperloglog_unique_blocks) << ")"
+      << ", unique bytes: " << unique_bytes
+      << ", self dedup ratio: " << (unique_bytes > 0 ? double(estimate.input_bytes) / unique_bytes : 0);
+  if (probed) {
+    out << "\nestimate: blocks known by store: " << estimate.sampled_known_blocks * scale
+        << ", dedup ratio with store: " << (new_bytes > 0 ? double(estimate.input_bytes) / new_bytes : 0);
+  }
+  out << "\nestimate: projected stored bytes: " << new_bytes + new_blocks * BLOCK_SIZE_BYTES
+      << ", file bytes: " << estimate.blocks * BYTES_HASH
+      << "\nestimate: projected index growth: " << new_blocks << " rows, ~"
+      << new_blocks * INDEX_ROW_ESTIMATED_BYTES << " bytes" << std::endl;
+}
@@ -0,0 +1,39 @@
+#ifndef ESTIMATOR_H
+#define ESTIMATOR_H
+
+#include <cstddef>
+#include <iostream>
+
+#include "defines.h"
+
+struct estimate_options_t
+{
+  // only blocks with sample_bits high zero bits of fingerprint are counted (1/2^sample_bits),
+  // grows automatically when max_fingerprints is reached
+  size_t sample_bits = 0;
+
+  size_t max_fingerprints = ESTIMATE_DEFAULT_MAX_FINGERPRINTS;
+
+  // check sampled unique blocks in hash_index
+  bool probe = false;
+};
+
+struct estimate_t
+{
+  size_t input_bytes = 0;
+  size_t blocks = 0;
+  size_t sample_bits = 0;
+  size_t sampled_unique_blocks = 0;
+  size_t sampled_unique_bytes = 0;
+  size_t sampled_known_blocks = 0;
+  size_t sampled_known_bytes = 0;
+  double hyperloglog_unique_blocks = 0;
+  size_t fingerprints_memory = 0;
+};
+
+// hashes input as save_buffer does without writing anything
+estimate_t estimate_dedup(std::istream& in, const estimate_options_t& options);
+
+void print_estimate(std::ostream& out, const estimate_t& estimate, bool probed);
+
+#endif // ESTIMATOR_H
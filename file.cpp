@@ -3,6 +3,9 @@
 #include <errno.h>
 #include <iostream>
 #include <string.h>
+#include <sys/stat.h>
+
+#include "stats.h"
 
 file_t::file_t(std::string path, int open_mode)
   : path_(path)
@@ -25,22 +28,30 @@ file_t::~file_t()
 
 file_t& file_t::operator =(file_t&& other)
 {
-  ::close(fd_);
-  fd_ = std::exchange(fd_, other.fd_);
+  close();
+  path_ = std::exchange(other.path_, {});
+  mode_ = other.mode_;
+  fd_ = std::exchange(other.fd_, -1);
   return *this;
 }
 
 bool file_t::open()
 {
-  fd_ = handle_eintr(::open, path_.c_str(), mode_);
+  stats_add(COUNTER_SYSCALLS);
+  fd_ = handle_eintr(::open, path_.c_str(), mode_, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
   if (fd_ < 0) return false;
+  stats_add(COUNTER_FDS_OPENED);
   return true;
 }
 
 void file_t::close()
 {
-  if (fd_ >= 0)
+  if (fd_ >= 0) {
+    stats_add(COUNTER_SYSCALLS);
+    stats_add(COUNTER_FDS_CLOSED);
     ::close(fd_);
+    fd_ = -1;
+  }
 }
 
 file_t::operator bool()
@@ -51,12 +62,14 @@ file_t::operator bool()
 ssize_t file_t::read(char* buff, off_t count)
 {
   if (fd_ < 0) return -1;
+  stats_add(COUNTER_SYSCALLS);
   return check_result(::read(fd_, buff, count));
 }
 
 ssize_t file_t::read(off_t pos, char* buff, off_t count)
 {
   if (fd_ < 0) return -1;
+  stats_add(COUNTER_SYSCALLS);
   lseek(fd_, pos, SEEK_SET);
   return read(buff, count);
 }
@@ -64,18 +77,21 @@ ssize_t file_t::read(off_t pos, char* buff, off_t count)
 off_t file_t::to_begin()
 {
   if (fd_ < 0) return -1;
+  stats_add(COUNTER_SYSCALLS);
   return lseek(fd_, 0, SEEK_SET);
 }
 
 off_t file_t::to_end()
 {
   if (fd_ < 0) return -1;
+  stats_add(COUNTER_SYSCALLS);
   return lseek(fd_, 0, SEEK_END);
 }
 
 off_t file_t::truncate(off_t lenght)
 {
   if (fd_ < 0 || lenght < 0) return -1;
+  stats_add(COUNTER_SYSCALLS, 2);
   if (check_result(ftruncate(fd_, lenght)) != 0) {
     return -1;
   }
@@ -85,22 +101,32 @@ off_t file_t::truncate(off_t lenght)
 ssize_t file_t::write(const char* buff, off_t count)
 {
   if (fd_ < 0) return -1;
+  stats_add(COUNTER_SYSCALLS);
   return check_result(::write(fd_, buff, count));
 }
 
 ssize_t file_t::write(off_t pos, const char* buff, off_t count)
 {
   if (fd_ < 0) return -1;
+  stats_add(COUNTER_SYSCALLS);
   lseek(fd_, pos, SEEK_SET);
-  return write(pos, buff, count);
+  return write(buff, count);
 }
 
 off_t file_t::position()
 {
   if (fd_ < 0) return -1;
+  stats_add(COUNTER_SYSCALLS);
   return check_result(lseek(fd_, 0, SEEK_CUR));
 }
 
+int file_t::sync()
+{
+  if (fd_ < 0) return -1;
+  stats_add(COUNTER_SYSCALLS);
+  return check_result(handle_eintr(::fdatasync, fd_));
+}
+
 template<typename result_type>
 result_type file_t::check_result(result_type result)
 {
@@ -54,7 +54,12 @@ public:
 
   off_t position();
 
-  std::string path() { return path_; }
+  // flushes written data to disk
+  int sync();
+
+  std::string path() const { return path_; }
+
+  int fd() const { return fd_; }
 
 private:
   std::string path_;
@@ -0,0 +1,96 @@
+#ifndef FINGERPRINT_SET_H
+#define FINGERPRINT_SET_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+// open addressing set of 64 bit fingerprints (prefixes of block hashes),
+// fingerprint 0 is stored as 1
+class fingerprint_set_t
+{
+public:
+  explicit fingerprint_set_t(size_t capacity = 1024)
+  {
+    size_t slots = 16;
+    while (slots < capacity * 2) slots *= 2;
+    slots_.assign(slots, 0);
+  }
+
+  // first 8 bytes of hash
+  static uint64_t fingerprint(const unsigned char * hash)
+  {
+    uint64_t result;
+    memcpy(&result, hash, sizeof(result));
+    return result ? result : 1;
+  }
+
+  // returns false if fingerprint already in set
+  bool insert(uint64_t value)
+  {
+    if (value == 0) value = 1;
+    if ((size_ + 1) * 2 > slots_.size()) grow();
+    uint64_t& slot = find_slot(value);
+    if (slot == value) return false;
+    slot = value;
+    size_++;
+    return true;
+  }
+
+  bool contains(uint64_t value) const
+  {
+    if (value == 0) value = 1;
+    return const_cast<fingerprint_set_t *>(this)->find_slot(value) == value;
+  }
+
+  // keeps only fingerprints satisfying predicate
+  template<typename Predicate>
+  void filter(Predicate keep)
+  {
+    std::vector<uint64_t> old(slots_.size(), 0);
+    old.swap(slots_);
+    size_ = 0;
+    for (uint64_t value : old) {
+      if (value != 0 && keep(value)) {
+        find_slot(value) = value;
+        size_++;
+      }
+    }
+  }
+
+  void clear()
+  {
+    std::fill(slots_.begin(), slots_.end(), 0);
+    size_ = 0;
+  }
+
+  size_t size() const { return size_; }
+
+  size_t memory() const { return slots_.size() * sizeof(uint64_t); }
+
+private:
+  uint64_t& find_slot(uint64_t value)
+  {
+    const size_t mask = slots_.size() - 1;
+    size_t pos = (value ^ (value >> 29)) & mask;
+    while (slots_[pos] != 0 && slots_[pos] != value) {
+      pos = (pos + 1) & mask;
+    }
+    return slots_[pos];
+  }
+
+  void grow()
+  {
+    std::vector<uint64_t> old(slots_.size() * 2, 0);
+    old.swap(slots_);
+    for (uint64_t value : old) {
+      if (value != 0) find_slot(value) = value;
+    }
+  }
+
+  std::vector<uint64_t> slots_;
+  size_t size_ = 0;
+};
+
+#endif // FINGERPRINT_SET_H
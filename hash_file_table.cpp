@@ -0,0 +1,57 @@
+#include "hash_file_table.h"
+
+#include <cstring>
+
+#include "defines.h"
+#include "store.h"
+
+hash_file_table_t::hash_file_table_t(const std::filesystem::path& path)
+  : file_(path, O_RDONLY)
+{
+}
+
+bool hash_file_table_t::exists() const
+{
+  std::error_code error;
+  return std::filesystem::exists(file_.path(), error);
+}
+
+bool hash_file_table_t::open(bool create)
+{
+  if (file_ && (writable_ || !create)) return true;
+  file_ = file_t(file_.path(), create ? O_RDWR | O_CREAT : O_RDONLY);
+  writable_ = create;
+  return file_.open();
+}
+
+std::string hash_file_table_t::get(hash_file_id_t id)
+{
+  if (!open(false)) return {};
+  char record[HASH_FILES_TABLE_RECORD];
+  if (file_.read((off_t) id * HASH_FILES_TABLE_RECORD, record, HASH_FILES_TABLE_RECORD) != HASH_FILES_TABLE_RECORD) {
+    return {};
+  }
+  return std::string(record, strnlen(record, HASH_FILES_TABLE_RECORD));
+}
+
+void hash_file_table_t::set(hash_file_id_t id, const std::string& path)
+{
+  if (path.size() > HASH_FILES_TABLE_RECORD) {
+    std::cerr << "warn: hash file path " << path << " is too long for " << file_.path() << "\n";
+    return;
+  }
+  soft_assert(open(true));
+  char record[HASH_FILES_TABLE_RECORD] = {};
+  memcpy(record, path.data(), path.size());
+  soft_assert(file_.write((off_t) id * HASH_FILES_TABLE_RECORD, record, HASH_FILES_TABLE_RECORD)
+              == HASH_FILES_TABLE_RECORD);
+}
+
+void hash_file_table_t::erase(hash_file_id_t id)
+{
+  if (!exists()) return;
+  soft_assert(open(true));
+  const char record[HASH_FILES_TABLE_RECORD] = {};
+  soft_assert(file_.write((off_t) id * HASH_FILES_TABLE_RECORD, record, HASH_FILES_TABLE_RECORD)
+              == HASH_FILES_TABLE_RECORD);
+}
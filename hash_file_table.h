@@ -0,0 +1,36 @@
+#ifndef HASH_FILE_TABLE_H
+#define HASH_FILE_TABLE_H
+
+#include <filesystem>
+#include <string>
+
+#include "file.h"
+#include "index.h"
+
+// persistent copy of used_files: record of HASH_FILES_TABLE_RECORD bytes
+// with zero padded path at offset id * HASH_FILES_TABLE_RECORD,
+// zero record - unknown id
+class hash_file_table_t
+{
+public:
+  explicit hash_file_table_t(const std::filesystem::path& path);
+
+  bool exists() const;
+
+  // empty string if id is unknown
+  std::string get(hash_file_id_t id);
+
+  void set(hash_file_id_t id, const std::string& path);
+
+  void erase(hash_file_id_t id);
+
+  void close() { file_.close(); }
+
+private:
+  bool open(bool create);
+
+  file_t file_;
+  bool writable_ = false;
+};
+
+#endif // HASH_FILE_TABLE_H
@@ -0,0 +1,568 @@
+#include "index.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include "codec.h"
+#include "queries.h"
+#include "store.h"
+#include "utils.h"
+
+std::string hash_table_query(const char * query, const std::string& table)
+{
+  std::string result = query;
+  const size_t pos = result.find(HASH_TABLE_NAME);
+  if (pos != std::string::npos) result.replace(pos, sizeof(HASH_TABLE_NAME) - 1, table);
+  return result;
+}
+
+pg_hash_index_t::pg_hash_index_t(PGconn * conn, const std::string& table)
+  : conn_(conn)
+{
+  const std::string exists = hash_table_query(EXISTS_HASH, table);
+  const std::string find = hash_table_query(SELECT_FILE_POS_FROM_HASHES, table);
+  const std::string exists_many = hash_table_query(SELECT_EXISTS_HASHES_MANY, table);
+  const std::string insert = hash_table_query(INSERT_MANY_CACHES, table);
+  exists_end_ = exists.size();
+  find_end_ = find.size();
+  exists_many_end_ = exists_many.size();
+  insert_begin_ = insert.size();
+  exists_request_.assign(exists_end_ + HASH_HEX_BYTES + 3, 0);
+  find_request_.assign(find_end_ + HASH_HEX_BYTES + 3, 0);
+  exists_many_request_.assign(exists_many_end_ + SELECT_MANY_HASHES_LENGTH + 3, 0);
+  insert_request_.assign(insert_begin_ + INSERT_MAX_MANY_HASHES_LENGTH + sizeof(INSERT_MANY_CACHES_END) + 1, 0);
+  insert_pos_ = insert_begin_;
+  inserting_ = 0;
+  memcpy(exists_request_.data(), exists.data(), exists_end_);
+  exists_request_.data()[exists_request_.size() - 1] = ';';
+  memcpy(find_request_.data(), find.data(), find_end_);
+  find_request_.data()[find_request_.size() - 1] = ';';
+  memcpy(insert_request_.data(), insert.data(), insert_begin_);
+  memcpy(exists_many_request_.data(), exists_many.data(), exists_many_end_);
+  find_many_query_ = hash_table_query(SELECT_FILE_POS_FROM_HASHES_MANY, table);
+  erase_many_query_ = hash_table_query(DELETE_HASHES_MANY, table);
+  many_request_.assign(std::max(find_many_query_.size(), erase_many_query_.size()) + SELECT_MANY_HASHES_LENGTH + 3, 0);
+  existing_.reserve(SELECT_MANY_HASHES_COUNT);
+  located_.reserve(SELECT_MANY_HASHES_COUNT);
+}
+
+bool pg_hash_index_t::batch_result(PGresult * res, ExecStatusType expected, const char * error_prefix)
+{
+  if (!defer_errors_ || PQresultStatus(res) == expected) {
+    exec_conn(res, expected, error_prefix);
+    return true;
+  }
+  error_ = wrap_ostringstream(error_prefix << ": " << PQresultStatus(res) << ", "
+                              << (res ? PQresultErrorMessage(res) : PQerrorMessage(conn_)));
+  PQclear(res);
+  return false;
+}
+
+const char * pg_hash_index_t::many_request(const std::string& query, const char * hexes, size_t count)
+{
+  char * request = many_request_.data();
+  memcpy(request, query.data(), query.size());
+  size_t pos = query.size();
+  pos += codec_add_hex_list(request + pos, many_request_.size() - pos, hexes, count);
+  strcpy(request + pos, SQL_QUARY_SCOPE_END);
+  return request;
+}
+
+bool pg_hash_index_t::exists(const char * hex)
+{
+  size_t added = add_wrapped_sql(exists_request_.data() + exists_end_, exists_request_.size() - exists_end_,
+                                 hex, HASH_HEX_BYTES);
+  soft_assert(added > 0);
+#if (FULL_LOGGING)
+  static bool request_printed = false;
+  if (!request_printed) {
+    std::cerr << "info: formed query: " << exists_request_.c_str() << std::endl;
+    request_printed = true;
+  }
+#endif
+  round_trips_++;
+  PGresult* res = PQexec(conn_, exists_request_.c_str());
+  exec_conn(res, ExecStatusType::PGRES_TUPLES_OK, "error: failed query hashes from DB");
+  const bool found = PQntuples(res) > 0;
+  PQclear(res);
+  return found;
+}
+
+bool pg_hash_index_t::find(const char * hex, hash_location_t * location)
+{
+  add_wrapped_sql(find_request_.data() + find_end_, find_request_.size() - find_end_, hex, HASH_HEX_BYTES);
+#if (FULL_LOGGING)
+  static bool request_printed = false;
+  if (!request_printed) {
+    std::cerr << "info: formed query: " << find_request_ << std::endl;
+    request_printed = true;
+  }
+#endif
+  round_trips_++;
+  PGresult* res = PQexec(conn_, find_request_.c_str());
+  exec_conn(res, PGRES_TUPLES_OK, "error: failed query hashes from DB");
+  const bool found = PQntuples(res) > 0;
+  if (found) {
+    const int file_col = PQfnumber(res, "file");
+    const int pos_col  = PQfnumber(res, "pos");
+    const int len_col  = PQfnumber(res, "len");
+    soft_assert(file_col > -1 && pos_col > -1 && len_col > -1);
+    location->file = atoll(PQgetvalue(res, 0, file_col));
+    location->len = atoll(PQgetvalue(res, 0, len_col));
+    location->pos = atoll(PQgetvalue(res, 0, pos_col));
+  }
+  PQclear(res);
+  return found;
+}
+
+void pg_hash_index_t::exists_many(const char * hexes, size_t count, bool * found)
+{
+  soft_assert(count <= SELECT_MANY_HASHES_COUNT);
+  if (count == 0) return;
+  char * request = exists_many_request_.data();
+  size_t pos = exists_many_end_;
+  pos += codec_add_hex_list(request + pos, exists_many_request_.size() - pos, hexes, count);
+  strcpy(request + pos, SQL_QUARY_SCOPE_END);
+  round_trips_++;
+  PGresult* res = PQexec(conn_, request);
+  if (!batch_result(res, PGRES_TUPLES_OK, "error: failed query hashes from DB")) return;
+  existing_.clear();
+  const size_t rows = PQntuples(res);
+  for (size_t i = 0; i < rows; i++) {
+    existing_.emplace_back(PQgetvalue(res, i, 0), HASH_HEX_BYTES);
+  }
+  std::sort(existing_.begin(), existing_.end());
+  for (size_t i = 0; i < count; i++) {
+    found[i] = std::binary_search(existing_.begin(), existing_.end(),
+                                  std::string_view(hexes + i * HASH_HEX_BYTES, HASH_HEX_BYTES));
+  }
+  PQclear(res);
+}
+
+void pg_hash_index_t::find_many(const char * hexes, size_t count, bool * found, hash_location_t * locations)
+{
+  soft_assert(count <= SELECT_MANY_HASHES_COUNT);
+  if (count == 0) return;
+  round_trips_++;
+  PGresult* res = PQexec(conn_, many_request(find_many_query_, hexes, count));
+  if (!batch_result(res, PGRES_TUPLES_OK, "error: failed query hashes from DB")) return;
+  const int hash_col = PQfnumber(res, "hash");
+  const int file_col = PQfnumber(res, "file");
+  const int pos_col  = PQfnumber(res, "pos");
+  const int len_col  = PQfnumber(res, "len");
+  soft_assert(hash_col > -1 && file_col > -1 && pos_col > -1 && len_col > -1);
+  located_.clear();
+  const size_t rows = PQntuples(res);
+  for (size_t i = 0; i < rows; i++) {
+    located_.emplace_back(std::string_view(PQgetvalue(res, i, hash_col), HASH_HEX_BYTES),
+                          hash_location_t { (hash_file_id_t) atoll(PQgetvalue(res, i, file_col)),
+                                            (uint32_t) atoll(PQgetvalue(res, i, len_col)),
+                                            (off_t) atoll(PQgetvalue(res, i, pos_col)) });
+  }
+  std::sort(located_.begin(), located_.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+  for (size_t i = 0; i < count; i++) {
+    const std::string_view hex(hexes + i * HASH_HEX_BYTES, HASH_HEX_BYTES);
+    auto it = std::lower_bound(located_.begin(), located_.end(), hex,
+                               [](const auto& row, const std::string_view& hex) { return row.first < hex; });
+    found[i] = it != located_.end() && it->first == hex;
+    if (found[i]) locations[i] = it->second;
+  }
+  PQclear(res);
+}
+
+void pg_hash_index_t::erase_many(const char * hexes, size_t count)
+{
+  soft_assert(count <= SELECT_MANY_HASHES_COUNT);
+  if (count == 0) return;
+  round_trips_++;
+  PGresult* res = PQexec(conn_, many_request(erase_many_query_, hexes, count));
+  if (!batch_result(res, PGRES_COMMAND_OK, "error: failed delete hashes from DB")) return;
+  PQclear(res);
+}
+
+void pg_hash_index_t::insert(const char * hex, hash_file_id_t file, off_t pos, uint32_t len)
+{
+  if (inserting_ == INSERT_MANY_HASHES_COUNT) flush_inserts();
+  char * request = insert_request_.data();
+  if (inserting_ > 0) request[insert_pos_++] = ',';
+  inserting_++;
+  insert_pos_ += codec_add_insert_row(request + insert_pos_, insert_request_.size() - insert_pos_, hex, file, pos);
+  memcpy(request + insert_pos_, INSERT_HASH_COUNT, sizeof(INSERT_HASH_COUNT) - 1);
+  insert_pos_ += sizeof(INSERT_HASH_COUNT) - 1;
+  insert_pos_ += codec_add_number(request + insert_pos_, insert_request_.size() - insert_pos_, len);
+  request[insert_pos_++] = ')';
+}
+
+void pg_hash_index_t::flush_inserts()
+{
+  if (inserting_ == 0) return;
+  memcpy(insert_request_.data() + insert_pos_, INSERT_MANY_CACHES_END, sizeof(INSERT_MANY_CACHES_END));
+#if (FULL_LOGGING)
+  static bool insert_printed = false;
+  if (!insert_printed) {
+    std::cerr << "insert request : " << insert_request_.c_str() << std::endl;
+    insert_printed = true;
+  }
+#endif
+  round_trips_++;
+  PGresult* res = PQexec(conn_, insert_request_.c_str());
+  insert_pos_ = insert_begin_;
+  inserting_ = 0;
+  if (!batch_result(res, PGRES_COMMAND_OK, "error: failed insert hashes into DB")) return;
+  PQclear(res);
+}
+
+hash_file_id_t pg_hash_index_t::file_id(const std::string& path)
+{
+  PGresult* res;
+  std::string select_id(sizeof(SELECT_FILE_ID) + 258, 0);
+  std::string insert_file(sizeof(INSERT_HASH_FILE) + 259, 0);
+  memcpy(select_id.data(), SELECT_FILE_ID, sizeof(SELECT_FILE_ID) - 1);
+  memcpy(insert_file.data(), INSERT_HASH_FILE, sizeof(INSERT_HASH_FILE) - 1);
+  const size_t end = sizeof(SELECT_FILE_ID) - 1 +
+                     add_wrapped_sql(select_id.data() + sizeof(SELECT_FILE_ID) - 1, 258, path.data(), path.size());
+  select_id.data()[end] = ';';
+  round_trips_++;
+  res = PQexec(conn_, select_id.data());
+  exec_conn(res, PGRES_TUPLES_OK, "error: cann't select file");
+  hash_file_id_t result;
+  if (PQntuples(res) > 0) {
+    result = atoll(PQgetvalue(res, 0, 0));
+  } else {
+    PQclear(res);
+    const size_t end = sizeof(INSERT_HASH_FILE) - 1 +
+                       add_wrapped_sql(insert_file.data() + sizeof(INSERT_HASH_FILE) - 1, 258, path.data(), path.size());
+    strcpy(insert_file.data() + end, SQL_QUARY_SCOPE_END);
+    round_trips_ += 2;
+    res = PQexec(conn_, insert_file.data());
+    exec_conn(res, PGRES_COMMAND_OK, "error: cann't insert file");
+    PQclear(res);
+    res = PQexec(conn_, select_id.data());
+    exec_conn(res, PGRES_TUPLES_OK, "error: cann't select file");
+    if (PQntuples(res) < 1) {
+      exit_error("error: cann't select file", 10);
+    }
+    result = atoll(PQgetvalue(res, 0, 0));
+  }
+  PQclear(res);
+  return result;
+}
+
+std::vector<std::pair<hash_file_id_t, std::string>> pg_hash_index_t::hash_files()
+{
+  round_trips_++;
+  PGresult* res = PQexec(conn_, SELECT_FILES_FROM_DB);
+  exec_conn(res, PGRES_TUPLES_OK, "error: can't query saved files from DB");
+  std::vector<std::pair<hash_file_id_t, std::string>> result;
+  size_t rows = PQntuples(res);
+  if (rows > 0) {
+    const int idcol   = PQfnumber(res, "id");
+    const int pathcol = PQfnumber(res, "path");
+    soft_assert(idcol > -1 && pathcol > -1);
+    for (size_t i = 0; i < rows; i++) {
+      result.emplace_back(atoll(PQgetvalue(res, i, idcol)), PQgetvalue(res, i, pathcol));
+    }
+  }
+  PQclear(res);
+  return result;
+}
+
+void pg_hash_index_t::begin_batch()
+{
+  round_trips_++;
+  PGresult* res = PQexec(conn_, BEGIN_TRANSACTION);
+  if (!batch_result(res, PGRES_COMMAND_OK, "error: can't begin transaction")) return;
+  PQclear(res);
+}
+
+void pg_hash_index_t::commit_batch()
+{
+  flush_inserts();
+  // group with failed inserts isn't committed
+  if (!error_.empty()) return;
+  round_trips_++;
+  PGresult* res = PQexec(conn_, COMMIT_TRANSACTION);
+  if (!batch_result(res, PGRES_COMMAND_OK, "error: can't commit transaction")) return;
+  PQclear(res);
+}
+
+namespace {
+
+hex_key_t hex_key(const char * hex)
+{
+  hex_key_t key;
+  memcpy(key.data(), hex, HASH_HEX_BYTES);
+  return key;
+}
+
+} // anonimous namespace
+
+bool memory_hash_index_t::exists(const char * hex)
+{
+  round_trips_++;
+  return hashes_.count(hex_key(hex)) > 0;
+}
+
+bool memory_hash_index_t::find(const char * hex, hash_location_t * location)
+{
+  round_trips_++;
+  auto it = hashes_.find(hex_key(hex));
+  if (it == hashes_.end()) return false;
+  *location = it->second;
+  return true;
+}
+
+void memory_hash_index_t::exists_many(const char * hexes, size_t count, bool * found)
+{
+  round_trips_++;
+  for (size_t i = 0; i < count; i++) {
+    found[i] = hashes_.count(hex_key(hexes + i * HASH_HEX_BYTES)) > 0;
+  }
+}
+
+void memory_hash_index_t::find_many(const char * hexes, size_t count, bool * found, hash_location_t * locations)
+{
+  round_trips_++;
+  for (size_t i = 0; i < count; i++) {
+    auto it = hashes_.find(hex_key(hexes + i * HASH_HEX_BYTES));
+    found[i] = it != hashes_.end();
+    if (found[i]) locations[i] = it->second;
+  }
+}
+
+void memory_hash_index_t::erase_many(const char * hexes, size_t count)
+{
+  round_trips_++;
+  for (size_t i = 0; i < count; i++) {
+    hashes_.erase(hex_key(hexes + i * HASH_HEX_BYTES));
+  }
+}
+
+void memory_hash_index_t::insert(const char * hex, hash_file_id_t file, off_t pos, uint32_t len)
+{
+  inserting_.push_back({ hex_key(hex), { file, len, pos } });
+}
+
+void memory_hash_index_t::flush_inserts()
+{
+  if (inserting_.empty()) return;
+  round_trips_++;
+  for (auto& row : inserting_) {
+    auto [it, ok] = hashes_.emplace(row.first, row.second);
+    soft_assert(ok);
+  }
+  inserting_.clear();
+}
+
+hash_file_id_t memory_hash_index_t::file_id(const std::string& path)
+{
+  round_trips_++;
+  auto it = file_ids_.find(path);
+  if (it != file_ids_.end()) return it->second;
+  const hash_file_id_t id = hash_files_.size() + 1;
+  file_ids_.emplace(path, id);
+  hash_files_.emplace_back(id, path);
+  return id;
+}
+
+std::vector<std::pair<hash_file_id_t, std::string>> memory_hash_index_t::hash_files()
+{
+  round_trips_++;
+  return hash_files_;
+}
+
+sharded_hash_index_t::sharded_hash_index_t(std::vector<std::unique_ptr<hash_index_t>> shards)
+  : shards_(std::move(shards))
+  , inserting_(shards_.size(), 0)
+  , hexes_(shards_.size())
+  , positions_(shards_.size())
+{
+  soft_assert(!shards_.empty() && shards_.size() <= INDEX_MAX_SHARDS);
+  for (size_t i = 0; i < shards_.size(); i++) {
+    hexes_[i].reserve(SELECT_MANY_HASHES_COUNT * HASH_HEX_BYTES);
+    positions_[i].reserve(SELECT_MANY_HASHES_COUNT);
+    found_.emplace_back(new bool[SELECT_MANY_HASHES_COUNT]);
+    locations_.emplace_back(new hash_location_t[SELECT_MANY_HASHES_COUNT]);
+    shards_[i]->defer_errors();
+  }
+  // calling thread is one of requesting threads
+  for (size_t i = 1; i < shards_.size(); i++) {
+    workers_.emplace_back([this]() { work(); });
+  }
+}
+
+size_t sharded_hash_index_t::shard_of(const char * hex) const
+{
+  // hex digit is 'A' + nibble
+  const size_t first_byte = (hex[0] - 'A') * 16 + (hex[1] - 'A');
+  return first_byte % shards_.size();
+}
+
+sharded_hash_index_t::~sharded_hash_index_t()
+{
+  {
+    std::lock_guard lock(mutex_);
+    stopped_ = true;
+  }
+  changed_.notify_all();
+  for (auto& worker : workers_) {
+    worker.join();
+  }
+}
+
+void sharded_hash_index_t::work()
+{
+  std::unique_lock lock(mutex_);
+  while (true) {
+    changed_.wait(lock, [this]() { return stopped_ || (request_ && next_ < pending_.size()); });
+    if (stopped_) return;
+    const std::function<void(size_t)>& request = *request_;
+    const size_t shard = pending_[next_++];
+    lock.unlock();
+    request(shard);
+    lock.lock();
+    if (--remaining_ == 0) finished_.notify_one();
+  }
+}
+
+void sharded_hash_index_t::fan_out(const std::vector<char>& work, const std::function<void(size_t)>& request)
+{
+  {
+    std::unique_lock lock(mutex_);
+    pending_.clear();
+    for (size_t i = 0; i < shards_.size(); i++) {
+      if (work[i]) pending_.push_back(i);
+    }
+    request_ = &request;
+    next_ = 0;
+    remaining_ = pending_.size();
+    changed_.notify_all();
+    // calling thread requests shards too
+    while (next_ < pending_.size()) {
+      const size_t shard = pending_[next_++];
+      lock.unlock();
+      request(shard);
+      lock.lock();
+      remaining_--;
+    }
+    finished_.wait(lock, [this]() { return remaining_ == 0; });
+    request_ = nullptr;
+  }
+  count_round_trips();
+  for (auto& shard : shards_) {
+    const std::string error = shard->take_error();
+    if (!error.empty()) exit_error(error.c_str(), 1);
+  }
+}
+
+void sharded_hash_index_t::count_round_trips()
+{
+  round_trips_ = 0;
+  for (auto& shard : shards_) {
+    round_trips_ += shard->round_trips();
+  }
+}
+
+bool sharded_hash_index_t::exists(const char * hex)
+{
+  const bool found = shards_[shard_of(hex)]->exists(hex);
+  count_round_trips();
+  return found;
+}
+
+bool sharded_hash_index_t::find(const char * hex, hash_location_t * location)
+{
+  const bool found = shards_[shard_of(hex)]->find(hex, location);
+  count_round_trips();
+  return found;
+}
+
+std::vector<char> sharded_hash_index_t::split(const char * hexes, size_t count)
+{
+  soft_assert(count <= SELECT_MANY_HASHES_COUNT);
+  std::vector<char> work(shards_.size(), 0);
+  for (size_t i = 0; i < shards_.size(); i++) {
+    hexes_[i].clear();
+    positions_[i].clear();
+  }
+  for (size_t i = 0; i < count; i++) {
+    const char * hex = hexes + i * HASH_HEX_BYTES;
+    const size_t shard = shard_of(hex);
+    hexes_[shard].append(hex, HASH_HEX_BYTES);
+    positions_[shard].push_back(i);
+    work[shard] = 1;
+  }
+  return work;
+}
+
+void sharded_hash_index_t::exists_many(const char * hexes, size_t count, bool * found)
+{
+  fan_out(split(hexes, count), [this](size_t shard) {
+    shards_[shard]->exists_many(hexes_[shard].data(), positions_[shard].size(), found_[shard].get());
+  });
+  for (size_t shard = 0; shard < shards_.size(); shard++) {
+    for (size_t i = 0; i < positions_[shard].size(); i++) {
+      found[positions_[shard][i]] = found_[shard][i];
+    }
+  }
+}
+
+void sharded_hash_index_t::find_many(const char * hexes, size_t count, bool * found, hash_location_t * locations)
+{
+  fan_out(split(hexes, count), [this](size_t shard) {
+    shards_[shard]->find_many(hexes_[shard].data(), positions_[shard].size(), found_[shard].get(),
+                              locations_[shard].get());
+  });
+  for (size_t shard = 0; shard < shards_.size(); shard++) {
+    for (size_t i = 0; i < positions_[shard].size(); i++) {
+      found[positions_[shard][i]] = found_[shard][i];
+      if (found_[shard][i]) locations[positions_[shard][i]] = locations_[shard][i];
+    }
+  }
+}
+
+void sharded_hash_index_t::erase_many(const char * hexes, size_t count)
+{
+  fan_out(split(hexes, count), [this](size_t shard) {
+    shards_[shard]->erase_many(hexes_[shard].data(), positions_[shard].size());
+  });
+}
+
+void sharded_hash_index_t::insert(const char * hex, hash_file_id_t file, off_t pos, uint32_t len)
+{
+  const size_t shard = shard_of(hex);
+  shards_[shard]->insert(hex, file, pos, len);
+  inserting_[shard] = 1;
+}
+
+void sharded_hash_index_t::flush_inserts()
+{
+  fan_out(inserting_, [this](size_t shard) { shards_[shard]->flush_inserts(); });
+  std::fill(inserting_.begin(), inserting_.end(), 0);
+}
+
+hash_file_id_t sharded_hash_index_t::file_id(const std::string& path)
+{
+  const hash_file_id_t id = shards_[0]->file_id(path);
+  count_round_trips();
+  return id;
+}
+
+std::vector<std::pair<hash_file_id_t, std::string>> sharded_hash_index_t::hash_files()
+{
+  auto result = shards_[0]->hash_files();
+  count_round_trips();
+  return result;
+}
+
+void sharded_hash_index_t::begin_batch()
+{
+  fan_out(std::vector<char>(shards_.size(), 1), [this](size_t shard) { shards_[shard]->begin_batch(); });
+}
+
+// shards are committed independently, rows of committed shards refer to synced data
+void sharded_hash_index_t::commit_batch()
+{
+  fan_out(std::vector<char>(shards_.size(), 1), [this](size_t shard) { shards_[shard]->commit_batch(); });
+  std::fill(inserting_.begin(), inserting_.end(), 0);
+}
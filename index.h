@@ -0,0 +1,255 @@
+#ifndef INDEX_H
+#define INDEX_H
+
+#include <array>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <sys/types.h>
+
+#include <postgresql/libpq-fe.h>
+
+#include "defines.h"
+
+// used_files.id
+using hash_file_id_t = uint32_t;
+
+struct hash_location_t
+{
+  hash_file_id_t file; // id of hash file
+  uint32_t len;        // length of record with block size prefix, 0 - not known
+  off_t pos;           // position of block size prefix in hash file
+};
+
+// locations are written as is to sidecars and manifests
+static_assert(sizeof(hash_location_t) == 16, "hash location layout");
+
+// index of saved blocks (hash hex -> hash file position)
+// and registry of hash files (id -> path)
+class hash_index_t
+{
+public:
+  virtual ~hash_index_t() {}
+
+  // hex - HASH_HEX_BYTES symbols
+  virtual bool exists(const char * hex) = 0;
+
+  virtual bool find(const char * hex, hash_location_t * location) = 0;
+
+  // hexes - count * HASH_HEX_BYTES symbols, count <= SELECT_MANY_HASHES_COUNT
+  virtual void exists_many(const char * hexes, size_t count, bool * found) = 0;
+
+  // same as exists_many, locations of found hashes are filled
+  virtual void find_many(const char * hexes, size_t count, bool * found, hash_location_t * locations) = 0;
+
+  // removes rows of hashes, count <= SELECT_MANY_HASHES_COUNT
+  virtual void erase_many(const char * hexes, size_t count) = 0;
+
+  // inserted rows are visible after flush_inserts, len - length of record, 0 if not known
+  virtual void insert(const char * hex, hash_file_id_t file, off_t pos, uint32_t len) = 0;
+
+  virtual void flush_inserts() = 0;
+
+  // id of hash file, not known path is registered
+  virtual hash_file_id_t file_id(const std::string& path) = 0;
+
+  // all registered hash files: id, path
+  virtual std::vector<std::pair<hash_file_id_t, std::string>> hash_files() = 0;
+
+  // changes between begin_batch and commit_batch are committed together
+  virtual void begin_batch() {}
+
+  virtual void commit_batch() {}
+
+  // count of requests sent to index storage
+  size_t round_trips() const { return round_trips_; }
+
+  // failed batch requests (exists_many, find_many, erase_many, flush_inserts, begin_batch, commit_batch)
+  // keep error instead of exiting, so they can run on other threads; error is taken by calling thread
+  void defer_errors() { defer_errors_ = true; }
+
+  std::string take_error() { return std::exchange(error_, {}); }
+
+protected:
+  size_t round_trips_ = 0;
+  bool defer_errors_ = false;
+  std::string error_;
+};
+
+// query with HASH_TABLE_NAME replaced by table
+std::string hash_table_query(const char * query, const std::string& table);
+
+// index in hash table and used_files table of conn
+class pg_hash_index_t : public hash_index_t
+{
+public:
+  explicit pg_hash_index_t(PGconn * conn, const std::string& table = HASH_TABLE_NAME);
+
+  bool exists(const char * hex) override;
+
+  bool find(const char * hex, hash_location_t * location) override;
+
+  void exists_many(const char * hexes, size_t count, bool * found) override;
+
+  void find_many(const char * hexes, size_t count, bool * found, hash_location_t * locations) override;
+
+  void erase_many(const char * hexes, size_t count) override;
+
+  void insert(const char * hex, hash_file_id_t file, off_t pos, uint32_t len) override;
+
+  void flush_inserts() override;
+
+  hash_file_id_t file_id(const std::string& path) override;
+
+  std::vector<std::pair<hash_file_id_t, std::string>> hash_files() override;
+
+  void begin_batch() override;
+
+  void commit_batch() override;
+
+private:
+  // query followed by quoted hexes and end of scope
+  const char * many_request(const std::string& query, const char * hexes, size_t count);
+
+  // exec_conn of batch request, false if error is deferred, res is cleared then
+  bool batch_result(PGresult * res, ExecStatusType expected, const char * error_prefix);
+
+  PGconn * conn_;
+  std::string exists_request_;
+  std::string find_request_;
+  std::string exists_many_request_;
+  std::string insert_request_;
+  // queries of find_many and erase_many, their request is formed in many_request_
+  std::string find_many_query_;
+  std::string erase_many_query_;
+  std::string many_request_;
+  // rows of exists_many and find_many sorted by hash, request hexes are searched in them
+  std::vector<std::string_view> existing_;
+  std::vector<std::pair<std::string_view, hash_location_t>> located_;
+  size_t exists_end_;
+  size_t find_end_;
+  size_t exists_many_end_;
+  size_t insert_begin_;
+  size_t insert_pos_;
+  size_t inserting_;
+};
+
+// in-process stand-in of DB index, lives until process exit
+// hex of digest kept inline, so lookups don't allocate
+using hex_key_t = std::array<char, HASH_HEX_BYTES>;
+
+struct hex_key_hash_t
+{
+  size_t operator()(const hex_key_t& key) const
+  {
+    return std::hash<std::string_view>()(std::string_view(key.data(), key.size()));
+  }
+};
+
+class memory_hash_index_t : public hash_index_t
+{
+public:
+  bool exists(const char * hex) override;
+
+  bool find(const char * hex, hash_location_t * location) override;
+
+  void exists_many(const char * hexes, size_t count, bool * found) override;
+
+  void find_many(const char * hexes, size_t count, bool * found, hash_location_t * locations) override;
+
+  void erase_many(const char * hexes, size_t count) override;
+
+  void insert(const char * hex, hash_file_id_t file, off_t pos, uint32_t len) override;
+
+  void flush_inserts() override;
+
+  hash_file_id_t file_id(const std::string& path) override;
+
+  std::vector<std::pair<hash_file_id_t, std::string>> hash_files() override;
+
+private:
+  std::unordered_map<hex_key_t, hash_location_t, hex_key_hash_t> hashes_;
+  std::vector<std::pair<hex_key_t, hash_location_t>> inserting_;
+  // key - path
+  std::unordered_map<std::string, hash_file_id_t> file_ids_;
+  std::vector<std::pair<hash_file_id_t, std::string>> hash_files_;
+};
+
+// hashes are spread over shards by first byte of digest, hash files are registered in first shard.
+// batch requests are sent to shards in parallel, so shards shouldn't share connection
+class sharded_hash_index_t : public hash_index_t
+{
+public:
+  explicit sharded_hash_index_t(std::vector<std::unique_ptr<hash_index_t>> shards);
+
+  ~sharded_hash_index_t();
+
+  bool exists(const char * hex) override;
+
+  bool find(const char * hex, hash_location_t * location) override;
+
+  void exists_many(const char * hexes, size_t count, bool * found) override;
+
+  void find_many(const char * hexes, size_t count, bool * found, hash_location_t * locations) override;
+
+  void erase_many(const char * hexes, size_t count) override;
+
+  void insert(const char * hex, hash_file_id_t file, off_t pos, uint32_t len) override;
+
+  void flush_inserts() override;
+
+  hash_file_id_t file_id(const std::string& path) override;
+
+  std::vector<std::pair<hash_file_id_t, std::string>> hash_files() override;
+
+  void begin_batch() override;
+
+  void commit_batch() override;
+
+  size_t shards() const { return shards_.size(); }
+
+private:
+  size_t shard_of(const char * hex) const;
+
+  // calls request(shard) for each shard with work on workers and calling thread,
+  // exits with error of failed shard after all requests are done
+  void fan_out(const std::vector<char>& work, const std::function<void(size_t)>& request);
+
+  void work();
+
+  void count_round_trips();
+
+  std::vector<std::unique_ptr<hash_index_t>> shards_;
+  // inserts not flushed, by shard
+  std::vector<char> inserting_;
+  // exists_many and find_many parts by shard
+  std::vector<std::string> hexes_;
+  std::vector<std::vector<size_t>> positions_;
+  std::vector<std::unique_ptr<bool[]>> found_;
+  std::vector<std::unique_ptr<hash_location_t[]>> locations_;
+
+  // splits hexes to hexes_ and positions_, returns shards with work
+  std::vector<char> split(const char * hexes, size_t count);
+
+  // workers live with index, requests of fan_out are shards of pending_
+  std::mutex mutex_;
+  std::condition_variable changed_;
+  std::condition_variable finished_;
+  const std::function<void(size_t)> * request_ = nullptr;
+  std::vector<size_t> pending_;
+  size_t next_ = 0;
+  size_t remaining_ = 0;
+  bool stopped_ = false;
+  std::vector<std::thread> workers_;
+};
+
+#endif // INDEX_H
@@ -0,0 +1,386 @@
+#include "io_engine.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "defines.h"
+#include "stats.h"
+
+namespace {
+
+// liburing is not used, rings are driven by raw syscalls
+int io_uring_setup(unsigned entries, io_uring_params * params)
+{
+  return syscall(__NR_io_uring_setup, entries, params);
+}
+
+int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+  return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0);
+}
+
+int io_uring_register(int fd, unsigned opcode, const void * arg, unsigned nr_args)
+{
+  return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+class uring_engine_t : public io_engine_t
+{
+public:
+  static std::unique_ptr<io_engine_t> create(unsigned entries)
+  {
+    std::unique_ptr<uring_engine_t> engine(new uring_engine_t());
+    if (!engine->setup(entries)) return nullptr;
+    return engine;
+  }
+
+  ~uring_engine_t()
+  {
+    if (sqes_) munmap(sqes_, sqes_size_);
+    if (cq_ring_ && cq_ring_ != sq_ring_) munmap(cq_ring_, cq_ring_size_);
+    if (sq_ring_) munmap(sq_ring_, sq_ring_size_);
+    if (ring_fd_ >= 0) close(ring_fd_);
+  }
+
+  void register_buffer(char * buf, size_t len) override
+  {
+    if (!buffers_.empty()) io_uring_register(ring_fd_, IORING_UNREGISTER_BUFFERS, nullptr, 0);
+    buffers_.push_back({ buf, len });
+    stats_add(COUNTER_SYSCALLS);
+    if (io_uring_register(ring_fd_, IORING_REGISTER_BUFFERS, buffers_.data(), buffers_.size()) != 0) {
+      buffers_.pop_back();
+      if (!buffers_.empty()) io_uring_register(ring_fd_, IORING_REGISTER_BUFFERS, buffers_.data(), buffers_.size());
+    }
+  }
+
+  void unregister_buffers() override
+  {
+    if (buffers_.empty()) return;
+    stats_add(COUNTER_SYSCALLS);
+    io_uring_register(ring_fd_, IORING_UNREGISTER_BUFFERS, nullptr, 0);
+    buffers_.clear();
+  }
+
+  void register_file(int fd) override
+  {
+    if (!files_registered_ || file_slots_.count(fd)) return;
+    auto free_slot = std::find(slots_.begin(), slots_.end(), -1);
+    if (free_slot == slots_.end()) return;
+    if (update_slot(free_slot - slots_.begin(), fd)) {
+      file_slots_.emplace(fd, free_slot - slots_.begin());
+    }
+  }
+
+  void unregister_file(int fd) override
+  {
+    auto it = file_slots_.find(fd);
+    if (it == file_slots_.end()) return;
+    update_slot(it->second, -1);
+    file_slots_.erase(it);
+  }
+
+  void run(io_request_t * requests, size_t count) override
+  {
+    size_t next = 0;
+    size_t done = 0;
+    unsigned in_flight = 0;
+    // prepared entries left in submission queue by short or interrupted submit
+    unsigned unsubmitted = 0;
+    retry_.clear();
+    for (size_t i = 0; i < count; i++) {
+      requests[i].result = 0;
+    }
+    while (done < count) {
+      unsigned prepared = 0;
+      while (in_flight + unsubmitted + prepared < entries_ && (!retry_.empty() || next < count)) {
+        size_t i;
+        if (!retry_.empty()) {
+          i = retry_.back();
+          retry_.pop_back();
+        } else {
+          i = next++;
+        }
+        prepare(requests[i], i);
+        prepared++;
+      }
+      std::atomic_store_explicit((std::atomic<unsigned> *) sq_tail_, sq_tail_local_, std::memory_order_release);
+      stats_add(COUNTER_SYSCALLS);
+      unsubmitted += prepared;
+      const int entered = io_uring_enter(ring_fd_, unsubmitted, 1, IORING_ENTER_GETEVENTS);
+      if (entered < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+        // ring is broken, rest of requests are done synchronously
+        complete_synchronously(requests, count);
+        return;
+      }
+      if (entered > 0) {
+        in_flight += entered;
+        unsubmitted -= entered;
+      }
+      unsigned head = *cq_head_;
+      const unsigned tail = std::atomic_load_explicit((std::atomic<unsigned> *) cq_tail_, std::memory_order_acquire);
+      for (; head != tail; head++) {
+        const io_uring_cqe& cqe = cqes_[head & *cq_mask_];
+        io_request_t& request = requests[cqe.user_data];
+        in_flight--;
+        if (cqe.res == -EINTR || cqe.res == -EAGAIN) {
+          retry_.push_back(cqe.user_data);
+        } else if (cqe.res < 0) {
+          request.result = cqe.res;
+          done++;
+        } else {
+          request.result += cqe.res;
+          if (cqe.res > 0 && (size_t) request.result < request.len) {
+            retry_.push_back(cqe.user_data);
+          } else {
+            done++;
+          }
+        }
+      }
+      std::atomic_store_explicit((std::atomic<unsigned> *) cq_head_, head, std::memory_order_release);
+    }
+  }
+
+  const char * name() const override { return "io_uring"; }
+
+private:
+  uring_engine_t() = default;
+
+  bool setup(unsigned entries)
+  {
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    stats_add(COUNTER_SYSCALLS);
+    ring_fd_ = io_uring_setup(entries, &params);
+    if (ring_fd_ < 0) return false;
+    entries_ = params.sq_entries;
+    sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+      sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+    }
+    sq_ring_ = mmap(nullptr, sq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    ring_fd_, IORING_OFF_SQ_RING);
+    if (sq_ring_ == MAP_FAILED) {
+      sq_ring_ = nullptr;
+      return false;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+      cq_ring_ = sq_ring_;
+    } else {
+      cq_ring_ = mmap(nullptr, cq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring_fd_, IORING_OFF_CQ_RING);
+      if (cq_ring_ == MAP_FAILED) {
+        cq_ring_ = nullptr;
+        return false;
+      }
+    }
+    sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+    void * sqes = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       ring_fd_, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) return false;
+    sqes_ = (io_uring_sqe *) sqes;
+    char * sq = (char *) sq_ring_;
+    char * cq = (char *) cq_ring_;
+    sq_tail_ = (unsigned *) (sq + params.sq_off.tail);
+    sq_mask_ = (unsigned *) (sq + params.sq_off.ring_mask);
+    sq_array_ = (unsigned *) (sq + params.sq_off.array);
+    cq_head_ = (unsigned *) (cq + params.cq_off.head);
+    cq_tail_ = (unsigned *) (cq + params.cq_off.tail);
+    cq_mask_ = (unsigned *) (cq + params.cq_off.ring_mask);
+    cqes_ = (io_uring_cqe *) (cq + params.cq_off.cqes);
+    sq_tail_local_ = *sq_tail_;
+    // sparse table of registered files, filled by register_file
+    slots_.assign(IO_ENGINE_MAX_FILES, -1);
+    stats_add(COUNTER_SYSCALLS);
+    files_registered_ = io_uring_register(ring_fd_, IORING_REGISTER_FILES, slots_.data(), slots_.size()) == 0;
+    return true;
+  }
+
+  bool update_slot(size_t slot, int fd)
+  {
+    io_uring_files_update update;
+    memset(&update, 0, sizeof(update));
+    update.offset = slot;
+    update.fds = (uint64_t) &fd;
+    stats_add(COUNTER_SYSCALLS);
+    if (io_uring_register(ring_fd_, IORING_REGISTER_FILES_UPDATE, &update, 1) != 1) return false;
+    slots_[slot] = fd;
+    return true;
+  }
+
+  // index of registered buffer containing range or -1
+  int buffer_index(const char * buf, size_t len) const
+  {
+    for (size_t i = 0; i < buffers_.size(); i++) {
+      const char * base = (const char *) buffers_[i].iov_base;
+      if (buf >= base && buf + len <= base + buffers_[i].iov_len) return i;
+    }
+    return -1;
+  }
+
+  void prepare(const io_request_t& request, size_t i)
+  {
+    const unsigned index = sq_tail_local_ & *sq_mask_;
+    io_uring_sqe& sqe = sqes_[index];
+    memset(&sqe, 0, sizeof(sqe));
+    const size_t done = request.result;
+    const int buffer = buffer_index(request.buf, request.len);
+    if (buffer >= 0) {
+      sqe.opcode = request.write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+      sqe.buf_index = buffer;
+    } else {
+      sqe.opcode = request.write ? IORING_OP_WRITE : IORING_OP_READ;
+    }
+    auto slot = file_slots_.find(request.fd);
+    if (slot != file_slots_.end()) {
+      sqe.fd = slot->second;
+      sqe.flags = IOSQE_FIXED_FILE;
+    } else {
+      sqe.fd = request.fd;
+    }
+    sqe.off = request.pos + done;
+    sqe.addr = (uint64_t) (request.buf + done);
+    sqe.len = request.len - done;
+    sqe.user_data = i;
+    sq_array_[index] = index;
+    sq_tail_local_++;
+  }
+
+  void complete_synchronously(io_request_t * requests, size_t count);
+
+  int ring_fd_ = -1;
+  unsigned entries_ = 0;
+  void * sq_ring_ = nullptr;
+  void * cq_ring_ = nullptr;
+  size_t sq_ring_size_ = 0;
+  size_t cq_ring_size_ = 0;
+  io_uring_sqe * sqes_ = nullptr;
+  size_t sqes_size_ = 0;
+  unsigned * sq_tail_ = nullptr;
+  unsigned * sq_mask_ = nullptr;
+  unsigned * sq_array_ = nullptr;
+  unsigned * cq_head_ = nullptr;
+  unsigned * cq_tail_ = nullptr;
+  unsigned * cq_mask_ = nullptr;
+  io_uring_cqe * cqes_ = nullptr;
+  unsigned sq_tail_local_ = 0;
+  std::vector<iovec> buffers_;
+  bool files_registered_ = false;
+  std::vector<int> slots_;
+  // key - fd, value - slot in registered files
+  std::unordered_map<int, size_t> file_slots_;
+  std::vector<size_t> retry_;
+};
+
+// continues request from request.result transferred bytes
+void execute(io_request_t& request)
+{
+  while ((size_t) request.result < request.len) {
+    stats_add(COUNTER_SYSCALLS);
+    const size_t done = request.result;
+    const ssize_t transferred = request.write
+      ? pwrite(request.fd, request.buf + done, request.len - done, request.pos + done)
+      : pread(request.fd, request.buf + done, request.len - done, request.pos + done);
+    if (transferred < 0) {
+      if (errno == EINTR) continue;
+      request.result = -errno;
+      return;
+    }
+    if (transferred == 0) return;
+    request.result += transferred;
+  }
+}
+
+void uring_engine_t::complete_synchronously(io_request_t * requests, size_t count)
+{
+  for (size_t i = 0; i < count; i++) {
+    if (requests[i].result >= 0) execute(requests[i]);
+  }
+}
+
+class pool_engine_t : public io_engine_t
+{
+public:
+  explicit pool_engine_t(size_t threads)
+  {
+    for (size_t i = 0; i < threads; i++) {
+      threads_.emplace_back([this]() { work(); });
+    }
+  }
+
+  ~pool_engine_t()
+  {
+    {
+      std::lock_guard lock(mutex_);
+      stopped_ = true;
+    }
+    changed_.notify_all();
+    for (auto& thread : threads_) {
+      thread.join();
+    }
+  }
+
+  void run(io_request_t * requests, size_t count) override
+  {
+    if (count == 0) return;
+    for (size_t i = 0; i < count; i++) {
+      requests[i].result = 0;
+    }
+    std::unique_lock lock(mutex_);
+    requests_ = requests;
+    count_ = count;
+    next_ = 0;
+    remaining_ = count;
+    changed_.notify_all();
+    finished_.wait(lock, [this]() { return remaining_ == 0; });
+    requests_ = nullptr;
+  }
+
+  const char * name() const override { return "threads"; }
+
+private:
+  void work()
+  {
+    std::unique_lock lock(mutex_);
+    while (true) {
+      changed_.wait(lock, [this]() { return stopped_ || (requests_ && next_ < count_); });
+      if (stopped_) return;
+      io_request_t& request = requests_[next_++];
+      lock.unlock();
+      execute(request);
+      lock.lock();
+      if (--remaining_ == 0) finished_.notify_one();
+    }
+  }
+
+  std::mutex mutex_;
+  std::condition_variable changed_;
+  std::condition_variable finished_;
+  io_request_t * requests_ = nullptr;
+  size_t count_ = 0;
+  size_t next_ = 0;
+  size_t remaining_ = 0;
+  bool stopped_ = false;
+  std::vector<std::thread> threads_;
+};
+
+} // anonimous namespace
+
+std::unique_ptr<io_engine_t> make_io_engine(size_t depth)
+{
+  if (auto engine = uring_engine_t::create(depth)) return engine;
+  return std::make_unique<pool_engine_t>(IO_ENGINE_THREADS);
+}
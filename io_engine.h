@@ -0,0 +1,47 @@
+#ifndef IO_ENGINE_H
+#define IO_ENGINE_H
+
+#include <cstddef>
+#include <memory>
+
+#include <sys/types.h>
+
+// positioned read or write, result - transferred bytes or -errno
+struct io_request_t
+{
+  int fd;
+  char * buf;
+  size_t len;
+  off_t pos;
+  bool write;
+  ssize_t result;
+};
+
+// executes batches of positioned requests with many requests in flight
+class io_engine_t
+{
+public:
+  virtual ~io_engine_t() {}
+
+  // requests on registered buffer or file are cheaper,
+  // buffer should live until unregister_buffers or engine destruction
+  virtual void register_buffer(char * /* buf */, size_t /* len */) {}
+
+  virtual void unregister_buffers() {}
+
+  // registered fd should be unregistered before closing
+  virtual void register_file(int /* fd */) {}
+
+  virtual void unregister_file(int /* fd */) {}
+
+  // returns when all requests are done, short transfers are continued,
+  // result is shorter than len only on end of file or error
+  virtual void run(io_request_t * requests, size_t count) = 0;
+
+  virtual const char * name() const = 0;
+};
+
+// io_uring engine if kernel allows it, else thread pool with blocking pread/pwrite
+std::unique_ptr<io_engine_t> make_io_engine(size_t depth);
+
+#endif // IO_ENGINE_H
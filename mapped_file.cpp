@@ -0,0 +1,75 @@
+#include "mapped_file.h"
+
+#include <algorithm>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "file.h"
+#include "stats.h"
+
+mapped_file_t::mapped_file_t(std::string path)
+  : path_(path)
+  , data_(nullptr)
+  , size_(0)
+{
+}
+
+mapped_file_t::~mapped_file_t()
+{
+  unmap();
+}
+
+bool mapped_file_t::map()
+{
+  unmap();
+  stats_add(COUNTER_SYSCALLS, 3);
+  const int fd = handle_eintr(::open, path_.c_str(), O_RDONLY);
+  if (fd < 0) return false;
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    const int error = errno;
+    ::close(fd);
+    errno = error;
+    return false;
+  }
+  size_ = st.st_size;
+  if (size_ > 0) {
+    stats_add(COUNTER_SYSCALLS);
+    void * data = mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+      const int error = errno;
+      ::close(fd);
+      size_ = 0;
+      errno = error;
+      return false;
+    }
+    data_ = (const char *) data;
+  }
+  // mapping keeps file referenced
+  ::close(fd);
+  return true;
+}
+
+void mapped_file_t::unmap()
+{
+  if (data_) {
+    stats_add(COUNTER_SYSCALLS);
+    munmap((void *) data_, size_);
+  }
+  data_ = nullptr;
+  size_ = 0;
+}
+
+void mapped_file_t::advise(size_t pos, size_t length, int advice) const
+{
+  if (!data_ || pos >= size_) return;
+  static const size_t page = sysconf(_SC_PAGESIZE);
+  const size_t begin = pos / page * page;
+  const size_t end = std::min(pos + length, size_);
+  stats_add(COUNTER_SYSCALLS);
+  madvise((void *) (data_ + begin), end - begin, advice);
+}
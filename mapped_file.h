@@ -0,0 +1,37 @@
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <cstddef>
+#include <string>
+
+// read-only mapping of whole file
+class mapped_file_t
+{
+public:
+  explicit mapped_file_t(std::string path);
+
+  mapped_file_t(const mapped_file_t& other) = delete;
+
+  ~mapped_file_t();
+
+  // false with errno on failure, empty file is mapped as nullptr with size 0
+  bool map();
+
+  void unmap();
+
+  const char * data() const { return data_; }
+
+  size_t size() const { return size_; }
+
+  // madvise on range of mapping, range is expanded to pages
+  void advise(size_t pos, size_t length, int advice) const;
+
+  std::string path() const { return path_; }
+
+private:
+  std::string path_;
+  const char * data_;
+  size_t size_;
+};
+
+#endif // MAPPED_FILE_H
@@ -0,0 +1,95 @@
+#include "offset_index.h"
+
+#include <algorithm>
+
+#include "defines.h"
+#include "store.h"
+
+offset_index_writer_t::offset_index_writer_t(const std::filesystem::path& path, size_t nominal_size)
+  : file_(path, O_WRONLY | O_CREAT | O_TRUNC)
+  , nominal_size_(nominal_size)
+  , offset_(0)
+  , entry_(0)
+{
+  if (!file_.open()) {
+    exit_error(wrap_ostringstream("error: can't create offset index " << path << ", errno: " << errno), 9);
+  }
+  const uint64_t header = nominal_size_;
+  soft_assert(file_.write((const char *) &header, sizeof(header)) == sizeof(header));
+  records_.reserve(OFFSET_INDEX_BUFFERED_RECORDS);
+  record();
+}
+
+void offset_index_writer_t::record()
+{
+  last_ = { offset_, entry_ };
+  records_.push_back(last_);
+  if (records_.size() == OFFSET_INDEX_BUFFERED_RECORDS) flush();
+}
+
+void offset_index_writer_t::flush()
+{
+  if (records_.empty()) return;
+  const ssize_t bytes = records_.size() * sizeof(offset_record_t);
+  soft_assert(file_.write((const char *) records_.data(), bytes) == bytes);
+  records_.clear();
+}
+
+void offset_index_writer_t::finish()
+{
+  if (last_.entry != entry_) record();
+  flush();
+  file_.close();
+}
+
+namespace {
+
+offset_record_t read_record(file_t& index, uint64_t i)
+{
+  offset_record_t record;
+  const ssize_t readed = index.read(sizeof(uint64_t) + i * sizeof(offset_record_t),
+                                    (char *) &record, sizeof(record));
+  soft_assert(readed == sizeof(record));
+  return record;
+}
+
+} // anonimous namespace
+
+bool find_recipe_position(file_t& index, uint64_t offset, recipe_position_t * position)
+{
+  const off_t size = index.to_end();
+  soft_assert(size >= (off_t) (sizeof(uint64_t) + sizeof(offset_record_t)));
+  soft_assert((size - sizeof(uint64_t)) % sizeof(offset_record_t) == 0);
+  const uint64_t records = (size - sizeof(uint64_t)) / sizeof(offset_record_t);
+  uint64_t nominal_size;
+  soft_assert(index.read(0, (char *) &nominal_size, sizeof(nominal_size)) == sizeof(nominal_size));
+  soft_assert(nominal_size > 0);
+  // last record is end of file
+  if (offset >= read_record(index, records - 1).offset) return false;
+  // last record with record.offset <= offset
+  uint64_t low = 0;
+  uint64_t high = records - 1;
+  while (high - low > 1) {
+    const uint64_t middle = low + (high - low) / 2;
+    if (read_record(index, middle).offset <= offset) {
+      low = middle;
+    } else {
+      high = middle;
+    }
+  }
+  const offset_record_t first = read_record(index, low);
+  const offset_record_t next = read_record(index, low + 1);
+  soft_assert(next.entry > first.entry);
+  const uint64_t chunks = std::min((offset - first.offset) / nominal_size, next.entry - first.entry - 1);
+  position->entry = first.entry + chunks;
+  position->skip = offset - first.offset - chunks * nominal_size;
+  return true;
+}
+
+uint64_t stored_file_size(file_t& index)
+{
+  const off_t size = index.to_end();
+  soft_assert(size >= (off_t) (sizeof(uint64_t) + sizeof(offset_record_t)));
+  soft_assert((size - sizeof(uint64_t)) % sizeof(offset_record_t) == 0);
+  return read_record(index, (size - sizeof(uint64_t)) / sizeof(offset_record_t) - 1).offset;
+}
@@ -0,0 +1,64 @@
+#ifndef OFFSET_INDEX_H
+#define OFFSET_INDEX_H
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <vector>
+
+#include "file.h"
+
+// sidecar of stored file: maps byte offset of stored file to entry of its recipe.
+// layout: nominal chunk size (uint64), records (offset, entry) at start,
+// after every chunk of not nominal size and at end of file.
+// chunks between two records are nominal except the last one,
+// so fixed size chunks give two records per file, variable ones - record per chunk
+struct offset_record_t
+{
+  uint64_t offset;
+  uint64_t entry;
+};
+
+class offset_index_writer_t
+{
+public:
+  offset_index_writer_t(const std::filesystem::path& path, size_t nominal_size);
+
+  // called after chunk entry is appended to recipe
+  void add(size_t chunk_len)
+  {
+    offset_ += chunk_len;
+    entry_++;
+    if (chunk_len != nominal_size_) record();
+  }
+
+  // writes end record and flushes records
+  void finish();
+
+private:
+  void record();
+
+  void flush();
+
+  file_t file_;
+  size_t nominal_size_;
+  uint64_t offset_;
+  uint64_t entry_;
+  std::vector<offset_record_t> records_;
+  offset_record_t last_;
+};
+
+struct recipe_position_t
+{
+  uint64_t entry; // recipe entry with offset
+  uint64_t skip;  // bytes of entry chunk before offset
+};
+
+// false if offset is not less than size of stored file,
+// exits with error on broken sidecar
+bool find_recipe_position(file_t& index, uint64_t offset, recipe_position_t * position);
+
+// size of stored file by end record, exits with error on broken sidecar
+uint64_t stored_file_size(file_t& index);
+
+#endif // OFFSET_INDEX_H
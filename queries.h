@@ -7,9 +7,17 @@ constexpr const char * CREATE_HASH_TABLE = "CREATE TABLE if not exists " HASH_TA
                                            "hash  char(" HASH_HEX_BYTES_STR ") primary key,"
                                            "file  integer,"
                                            "pos   bigint,"
-                                           "count integer"
+                                           "count integer,"
+                                           "len   integer"
                                            ");";
 
+// tables created before len column, their rows have null len; column is checked first,
+// because ALTER TABLE locks the table exclusively even if column exists
+constexpr const char * SELECT_HASH_TABLE_LEN = "select 1 from information_schema.columns where "
+                                               "table_schema = current_schema() and table_name = '"
+                                               HASH_TABLE_NAME "' and column_name = 'len';";
+constexpr const char * ALTER_HASH_TABLE_LEN = "ALTER TABLE " HASH_TABLE_NAME " ADD COLUMN if not exists len integer;";
+
 constexpr const char * CREATE_FILE_TABLE = "CREATE TABLE if not exists used_files ("
                                            "id   serial primary key,"
                                            "path varchar(256)"
@@ -18,12 +26,15 @@ constexpr const char * CREATE_FILE_TABLE = "CREATE TABLE if not exists used_file
 constexpr const char * SQL_QUARY_SCOPE_END = ");";
 
 constexpr const char SELECT_FILE_POS_FROM_HASHES_MANY[] =
-  "select hash,file,pos from " HASH_TABLE_NAME " where hash in (";
+  "select hash,file,pos,len from " HASH_TABLE_NAME " where hash in (";
 
 constexpr const char INSERT_MANY_CACHES[] =
   "insert into " HASH_TABLE_NAME " values ";
 
-constexpr const char INSERT_HASH_COUNT_END[] = ",1)";
+constexpr const char INSERT_HASH_COUNT[] = ",1,";
+
+// row of same hash inserted by concurrent session is kept, this session's record of it becomes dead
+constexpr const char INSERT_MANY_CACHES_END[] = " on conflict (hash) do nothing;";
 
 constexpr const char SELECT_EXISTS_HASHES_MANY[] =
   "select hash from " HASH_TABLE_NAME " where hash in (";
@@ -34,7 +45,7 @@ constexpr const char EXISTS_HASH[] =
   "select 1 from " HASH_TABLE_NAME " where hash = ";
 
 constexpr const char SELECT_FILE_POS_FROM_HASHES[] =
-  "select file,pos from " HASH_TABLE_NAME " where hash = ";
+  "select file,pos,len from " HASH_TABLE_NAME " where hash = ";
 
 constexpr const char SELECT_FILE_ID[] =
   "select id from used_files where path = ";
@@ -42,4 +53,30 @@ constexpr const char SELECT_FILE_ID[] =
 constexpr const char INSERT_HASH_FILE[] =
   "insert into used_files (path) values (";
 
+// ('HASH_HEX_BYTES',old file,old pos,new pos)
+constexpr const char RELOCATE_HASHES_BEGIN[] =
+  "update " HASH_TABLE_NAME " as h set file = ";
+
+constexpr const char RELOCATE_HASHES_VALUES[] = ", pos = v.new_pos from (values ";
+
+constexpr const char RELOCATE_HASHES_END[] =
+  ") as v(hash, old_file, old_pos, new_pos) "
+  "where h.hash = v.hash and h.file = v.old_file and h.pos = v.old_pos;";
+
+constexpr const char DELETE_HASHES_MANY[] =
+  "delete from " HASH_TABLE_NAME " where hash in (";
+
+constexpr const char DELETE_HASHES_OF_FILES[] =
+  "delete from " HASH_TABLE_NAME " where file in (";
+
+constexpr const char DELETE_USED_FILES[] =
+  "delete from used_files where id in (";
+
+constexpr const char SELECT_USED_FILE_EXISTS[] =
+  "select 1 from used_files where id = ";
+
+constexpr const char * BEGIN_TRANSACTION = "BEGIN;";
+
+constexpr const char * COMMIT_TRANSACTION = "COMMIT;";
+
 #endif // QUERIES_H
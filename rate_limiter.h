@@ -0,0 +1,38 @@
+#ifndef RATE_LIMITER_H
+#define RATE_LIMITER_H
+
+#include <chrono>
+#include <cstddef>
+#include <thread>
+
+// keeps average throughput of consumed bytes under bytes_per_second,
+// zero limit means unlimited
+class rate_limiter_t
+{
+public:
+  explicit rate_limiter_t(double bytes_per_second = 0)
+    : bytes_per_second_(bytes_per_second)
+    , start_(std::chrono::steady_clock::now())
+  {
+  }
+
+  void consume(size_t bytes)
+  {
+    if (bytes_per_second_ <= 0) return;
+    consumed_ += bytes;
+    const std::chrono::duration<double> expected(consumed_ / bytes_per_second_);
+    const auto elapsed = std::chrono::steady_clock::now() - start_;
+    if (expected > elapsed) {
+      std::this_thread::sleep_for(expected - elapsed);
+    }
+  }
+
+  size_t consumed() const { return consumed_; }
+
+private:
+  double bytes_per_second_;
+  size_t consumed_ = 0;
+  std::chrono::steady_clock::time_point start_;
+};
+
+#endif // RATE_LIMITER_H
@@ -0,0 +1,288 @@
+#include "replay.h"
+
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <unordered_set>
+#include <vector>
+
+#include <openssl/sha.h>
+
+#include "stats.h"
+#include "store.h"
+#include "synthetic.h"
+#include "trace.h"
+
+namespace {
+
+void replay_error(const std::string& message)
+{
+  exit_error(wrap_ostringstream("error: " << message << ", aborted..."), 14);
+}
+
+std::vector<trace_record_t> read_trace(const std::string& path)
+{
+  std::ifstream in(path, std::ios::binary);
+  if (!in) replay_error(wrap_ostringstream("can't open trace " << path));
+  trace_header_t header;
+  if (!in.read((char *) &header, sizeof(header)) || memcmp(header.magic, TRACE_MAGIC, TRACE_MAGIC_BYTES)
+      || header.record_size != sizeof(trace_record_t)) {
+    replay_error(wrap_ostringstream(path << " is not trace"));
+  }
+  if (header.block_size != HASHING_BLOCK_SIZE) {
+    replay_error(wrap_ostringstream("trace is recorded with blocks of " << header.block_size << " bytes, not of "
+                                    << HASHING_BLOCK_SIZE));
+  }
+  const uint64_t size = std::filesystem::file_size(path) - sizeof(header);
+  if (size % sizeof(trace_record_t)) replay_error(wrap_ostringstream("trace " << path << " is truncated"));
+  std::vector<trace_record_t> records(size / sizeof(trace_record_t));
+  if (!in.read((char *) records.data(), size)) replay_error(wrap_ostringstream("can't read trace " << path));
+  return records;
+}
+
+bool found_outcome(uint8_t outcome)
+{
+  return outcome == TRACE_BATCH || outcome == TRACE_PREVIOUS || outcome == TRACE_INDEXED;
+}
+
+bool stored_outcome(uint8_t outcome)
+{
+  return outcome == TRACE_STORED || outcome == TRACE_DELTA;
+}
+
+double seconds_since(std::chrono::steady_clock::time_point start)
+{
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// replayed session writes recipes of W events and reads blocks of F events with own digests of seeds
+class replay_t
+{
+public:
+  replay_t(const std::vector<trace_record_t>& records, const std::string& prefix)
+    : records_(records)
+    , prefix_(prefix)
+    , buffer_(BUFFER_READ_SIZE, 0)
+    , output_(BUFFER_READ_SIZE, 0)
+    , block_(HASHING_BLOCK_SIZE, 0)
+  {
+  }
+
+  replay_result_t run()
+  {
+    warmup();
+    for (size_t i = 0; i < records_.size();) {
+      const trace_record_t& record = records_[i];
+      switch (record.event) {
+      case TRACE_INGEST_FILE:
+        begin_ingest();
+        next_file();
+        i++;
+        break;
+      case TRACE_BUFFER:
+        begin_ingest();
+        if (!file_open_) next_file();
+        i = replay_buffer(i);
+        break;
+      case TRACE_RESTORE_FILE:
+        end_ingest();
+        i++;
+        break;
+      case TRACE_FILL:
+        end_ingest();
+        i = replay_fill(i);
+        break;
+      default:
+        broken(i, "unexpected record");
+      }
+    }
+    end_ingest();
+    close_store_files();
+    return result_;
+  }
+
+private:
+  void broken(size_t i, const char * what)
+  {
+    replay_error(wrap_ostringstream("broken trace: " << what << " at record " << i));
+  }
+
+  // blocks found by recorded session without storing them before are stored, so lookups find them again
+  void warmup()
+  {
+    std::unordered_set<uint64_t> seen;
+    std::vector<const trace_record_t *> blocks;
+    for (const trace_record_t& record : records_) {
+      const bool found = (record.event == TRACE_CHUNK && found_outcome(record.outcome))
+                       || (record.event == TRACE_READ && record.outcome == TRACE_STORED);
+      if ((record.event == TRACE_CHUNK || record.event == TRACE_READ) && seen.insert(record.seed).second && found) {
+        blocks.push_back(&record);
+      }
+    }
+    result_.warmup_chunks = blocks.size();
+    if (blocks.empty()) return;
+    begin_ingest();
+    const std::filesystem::path file = files_dir / (prefix_ + "_warmup");
+    std::filesystem::remove(file);
+    const auto index_path = begin_stored_file(file);
+    // short block ends buffer like last block of recorded one
+    size_t used = 0;
+    for (const trace_record_t * block : blocks) {
+      if (block->size == 0 || block->size > HASHING_BLOCK_SIZE) broken(block - records_.data(), "wrong block size");
+      if (used + block->size > BUFFER_READ_SIZE) {
+        store_buffer(buffer_.data(), used);
+        used = 0;
+      }
+      synthetic_stream_t::fill_block(buffer_.data() + used, block->size, block->seed);
+      used += block->size;
+      if (block->size < HASHING_BLOCK_SIZE) {
+        store_buffer(buffer_.data(), used);
+        used = 0;
+      }
+    }
+    if (used > 0) store_buffer(buffer_.data(), used);
+    finish_stored_file(file, index_path);
+    end_commit_groups();
+    close_store_files();
+    ingest_ = false;
+  }
+
+  void begin_ingest()
+  {
+    if (ingest_) return;
+    open_output_hash_file();
+    begin_commit_groups();
+    ingest_ = true;
+  }
+
+  void end_ingest()
+  {
+    if (!ingest_) return;
+    const auto start = std::chrono::steady_clock::now();
+    close_file();
+    end_commit_groups();
+    close_store_files();
+    result_.ingest_seconds += seconds_since(start);
+    ingest_ = false;
+  }
+
+  void next_file()
+  {
+    close_file();
+    file_ = files_dir / (prefix_ + "_" + std::to_string(files_++));
+    std::filesystem::remove(file_);
+    index_path_ = begin_stored_file(file_);
+    file_open_ = true;
+  }
+
+  void close_file()
+  {
+    if (!file_open_) return;
+    finish_stored_file(file_, index_path_);
+    file_open_ = false;
+  }
+
+  // returns index of next record
+  size_t replay_buffer(size_t i)
+  {
+    const size_t buflen = records_[i].size;
+    if (buffer_.size() < buflen) buffer_.resize(buflen);
+    size_t pos = 0;
+    size_t stored = 0;
+    for (i++; pos < buflen; i++) {
+      if (i == records_.size()) broken(i, "buffer isn't finished");
+      const trace_record_t& record = records_[i];
+      if (pos + record.size > buflen) broken(i, "block crosses buffer end");
+      if (record.event == TRACE_ZERO_RUN) {
+        memset(buffer_.data() + pos, 0, record.size);
+      } else if (record.event == TRACE_CHUNK && record.size > 0 && record.size <= HASHING_BLOCK_SIZE) {
+        synthetic_stream_t::fill_block(buffer_.data() + pos, record.size, record.seed);
+        stored += stored_outcome(record.outcome);
+        result_.chunks++;
+      } else {
+        broken(i, "unexpected record in buffer");
+      }
+      pos += record.size;
+    }
+    const size_t unique = stats_counter(COUNTER_UNIQUE_CHUNKS);
+    const size_t round_trips = hash_index->round_trips();
+    const auto start = std::chrono::steady_clock::now();
+    store_buffer(buffer_.data(), buflen);
+    result_.ingest_seconds += seconds_since(start);
+    result_.ingest_round_trips += hash_index->round_trips() - round_trips;
+    const size_t replayed = stats_counter(COUNTER_UNIQUE_CHUNKS) - unique;
+    result_.outcome_mismatches += replayed > stored ? replayed - stored : stored - replayed;
+    result_.buffers++;
+    result_.ingested_bytes += buflen;
+    return i;
+  }
+
+  size_t replay_fill(size_t i)
+  {
+    const size_t count = records_[i].size;
+    if (i + count >= records_.size() || count == 0) broken(i, "fill isn't finished");
+    hashes_.resize(count * BYTES_HASH);
+    expected_.clear();
+    for (size_t k = 0; k < count; k++) {
+      const trace_record_t& record = records_[i + 1 + k];
+      if (record.event != TRACE_READ || record.size == 0 || record.size > HASHING_BLOCK_SIZE) {
+        broken(i + 1 + k, "unexpected record in fill");
+      }
+      synthetic_stream_t::fill_block(block_.data(), record.size, record.seed);
+#if (HASH_BITS == 256)
+      SHA256((const unsigned char *) block_.data(), record.size, (unsigned char *) hashes_.data() + k * BYTES_HASH);
+#else
+#error "unknown algoritm"
+#endif
+      expected_.append(block_.data(), record.size);
+      if (record.outcome != TRACE_STORED) continue;
+      const hash_location_t location = { record.file, 0, (off_t) record.pos };
+      result_.recorded_near_reads += is_near_read(recorded_last_, location);
+      recorded_last_ = location;
+    }
+    size_t used = count;
+    const size_t near_reads = stats_counter(COUNTER_NEAR_READS);
+    const size_t round_trips = hash_index->round_trips();
+    const auto start = std::chrono::steady_clock::now();
+    const size_t filled = fill_buffer_from_hashes(output_.data(), output_.size(), hashes_.data(), &used);
+    result_.restore_seconds += seconds_since(start);
+    result_.restore_round_trips += hash_index->round_trips() - round_trips;
+    result_.replayed_near_reads += stats_counter(COUNTER_NEAR_READS) - near_reads;
+    // blocks missed by recorded session are 'x' in both
+    for (size_t pos = 0, k = 0; k < count; pos += records_[i + 1 + k].size, k++) {
+      const trace_record_t& record = records_[i + 1 + k];
+      if (record.outcome != TRACE_STORED) continue;
+      for (size_t j = 0; j < record.size; j++) {
+        result_.mismatched_bytes += pos + j >= filled || output_[pos + j] != expected_[pos + j];
+      }
+    }
+    result_.fills++;
+    result_.reads += used;
+    result_.restored_bytes += filled;
+    return i + 1 + count;
+  }
+
+  const std::vector<trace_record_t>& records_;
+  const std::string prefix_;
+  replay_result_t result_;
+  std::string buffer_;
+  std::string output_;
+  std::string block_;
+  std::string hashes_;
+  std::string expected_;
+  hash_location_t recorded_last_ = { 0, 0, 0 };
+  bool ingest_ = false;
+  bool file_open_ = false;
+  size_t files_ = 0;
+  std::filesystem::path file_;
+  std::filesystem::path index_path_;
+};
+
+} // anonimous namespace
+
+replay_result_t replay_trace(const std::string& path, const std::string& prefix)
+{
+  const std::vector<trace_record_t> records = read_trace(path);
+  return replay_t(records, prefix).run();
+}
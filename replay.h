@@ -0,0 +1,36 @@
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+struct replay_result_t
+{
+  size_t buffers = 0;
+  size_t chunks = 0;
+  uint64_t ingested_bytes = 0;
+  // blocks which were looked up and found by recorded session, stored before replay
+  size_t warmup_chunks = 0;
+  // sum of differences of stored chunks of each buffer from recorded count
+  size_t outcome_mismatches = 0;
+  double ingest_seconds = 0;
+  size_t ingest_round_trips = 0;
+
+  size_t fills = 0;
+  size_t reads = 0;
+  uint64_t restored_bytes = 0;
+  size_t mismatched_bytes = 0;
+  double restore_seconds = 0;
+  size_t restore_round_trips = 0;
+  // reads of record within BUFFER_READ_SIZE after previous read of same hash file
+  size_t recorded_near_reads = 0;
+  size_t replayed_near_reads = 0;
+};
+
+// replays trace against store opened by caller, recipes are written to files_dir/prefix_N.
+// buffers of recorded session are rebuilt from seeds and saved with same boundaries, fills request
+// same blocks by same batches. exits with error if trace is broken or recorded with other HASHING_BLOCK_SIZE
+replay_result_t replay_trace(const std::string& path, const std::string& prefix);
+
+#endif // REPLAY_H
@@ -0,0 +1,499 @@
+#include "replication.h"
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <optional>
+#include <vector>
+
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <openssl/evp.h>
+
+#include "digest_set.h"
+#include "stats.h"
+#include "store.h"
+#include "utils.h"
+
+namespace {
+
+// frames of sender and answers of receiver, integers are uint64 of sender byte order
+enum frame_t : char {
+  FRAME_RECIPE = 'R', // path, size and digest of recipe; answered by 1 if receiver has same recipe
+  FRAME_PART   = 'P', // count of entries, entries; answered by count of missing digests, digests in
+                      // order of first entries, then sender sends length (uint32) and block of each one
+  FRAME_FINISH = 'F', // length of offset index, offset index; answered by FRAME_ACK after recipe is committed
+  FRAME_END    = 'E',
+  FRAME_ACK    = 'A'
+};
+
+// recipe paths are relative to files dir
+constexpr size_t MAX_RECIPE_PATH = 4096;
+
+// buffered frames of session, reading flushes written frames, broken connection is fatal
+class channel_t
+{
+public:
+  channel_t(int in, int out)
+    : in_(in)
+    , out_(out)
+    , write_buf_(REPLICATE_BUFFER_SIZE)
+    , read_buf_(REPLICATE_BUFFER_SIZE)
+  {
+  }
+
+  void write(const void * data, size_t len)
+  {
+    const char * bytes = (const char *) data;
+    while (len > 0) {
+      if (write_used_ == write_buf_.size()) flush();
+      const size_t part = std::min(len, write_buf_.size() - write_used_);
+      memcpy(write_buf_.data() + write_used_, bytes, part);
+      write_used_ += part;
+      bytes += part;
+      len -= part;
+    }
+  }
+
+  void write_u64(uint64_t value) { write(&value, sizeof(value)); }
+
+  void write_frame(frame_t frame) { write(&frame, 1); }
+
+  void flush()
+  {
+    for (size_t written = 0; written < write_used_;) {
+      stats_add(COUNTER_SYSCALLS);
+      ssize_t result = ::send(out_, write_buf_.data() + written, write_used_ - written, MSG_NOSIGNAL);
+      if (result < 0 && errno == ENOTSOCK) result = ::write(out_, write_buf_.data() + written, write_used_ - written);
+      if (result < 0 && errno == EINTR) continue;
+      if (result <= 0) {
+        exit_error(wrap_ostringstream("error: can't write to replication peer, errno: " << errno), 13);
+      }
+      written += result;
+    }
+    sent_ += write_used_;
+    write_used_ = 0;
+  }
+
+  void read(void * data, size_t len)
+  {
+    char * bytes = (char *) data;
+    while (len > 0) {
+      if (read_pos_ == read_size_) {
+        // peer answers only whole frames
+        flush();
+        ssize_t result;
+        do {
+          stats_add(COUNTER_SYSCALLS);
+          result = ::read(in_, read_buf_.data(), read_buf_.size());
+        } while (result < 0 && errno == EINTR);
+        if (result <= 0) exit_error("error: replication peer closed connection, aborted...", 13);
+        read_pos_ = 0;
+        read_size_ = result;
+      }
+      const size_t part = std::min(len, read_size_ - read_pos_);
+      memcpy(bytes, read_buf_.data() + read_pos_, part);
+      read_pos_ += part;
+      bytes += part;
+      len -= part;
+    }
+  }
+
+  uint64_t read_u64()
+  {
+    uint64_t value;
+    read(&value, sizeof(value));
+    return value;
+  }
+
+  char read_frame()
+  {
+    char frame;
+    read(&frame, 1);
+    return frame;
+  }
+
+  uint64_t sent() const { return sent_ + write_used_; }
+
+private:
+  int in_;
+  int out_;
+  std::vector<char> write_buf_;
+  size_t write_used_ = 0;
+  std::vector<char> read_buf_;
+  size_t read_pos_ = 0;
+  size_t read_size_ = 0;
+  uint64_t sent_ = 0;
+};
+
+struct replication_totals_t
+{
+  size_t recipes = 0;
+  size_t skipped = 0; // recipes receiver has
+  uint64_t entries = 0;
+  uint64_t blocks = 0;
+};
+
+void protocol_error(const char * what)
+{
+  exit_error(wrap_ostringstream("error: replication protocol error: " << what << ", aborted..."), 13);
+}
+
+// digest of whole recipe file, false if it can't be readed
+bool recipe_digest(const std::filesystem::path& path, unsigned char * raw)
+{
+  file_t file(path, O_RDONLY);
+  if (!file.open()) return false;
+  std::unique_ptr<EVP_MD_CTX, decltype(&EVP_MD_CTX_free)> ctx(EVP_MD_CTX_new(), &EVP_MD_CTX_free);
+  soft_assert(ctx && EVP_DigestInit_ex(ctx.get(), EVP_sha256(), nullptr) == 1);
+  std::vector<char> buf(BUFFER_READ_SIZE);
+  ssize_t readed;
+  while ((readed = file.read(buf.data(), buf.size())) > 0) {
+    EVP_DigestUpdate(ctx.get(), buf.data(), readed);
+  }
+  unsigned int len = 0;
+  EVP_DigestFinal_ex(ctx.get(), raw, &len);
+  return readed == 0 && len == BYTES_HASH;
+}
+
+bool read_whole_file(const std::filesystem::path& path, std::string& content)
+{
+  content.clear();
+  std::error_code error;
+  const auto size = std::filesystem::file_size(path, error);
+  if (error) return false;
+  file_t file(path, O_RDONLY);
+  if (!file.open()) return false;
+  content.resize(size);
+  return file.read(content.data(), size) == (ssize_t) size;
+}
+
+bool write_whole_file(const std::filesystem::path& path, const char * data, size_t len)
+{
+  file_t file(path, O_WRONLY | O_CREAT | O_TRUNC);
+  if (!file.open() || file.write(data, len) != (ssize_t) len) return false;
+  if (commit_options.durability == DURABILITY_GROUP) sync_store_file(file);
+  return true;
+}
+
+// blocks of missing digests in order of their first entries,
+// blocks of file stored with sparse index are found by locations of entries
+void send_blocks(channel_t& channel, const std::filesystem::path& recipe, const unsigned char * entries, size_t count,
+                 const hash_location_t * locations, const std::vector<unsigned char>& missing)
+{
+  std::vector<char> block(HASHING_BLOCK_SIZE);
+  char hex[HASH_HEX_BYTES + 1] = {};
+  size_t entry = 0;
+  for (size_t i = 0; i < missing.size(); i += BYTES_HASH) {
+    const unsigned char * raw = missing.data() + i;
+    to_my_hex(hex, raw, BYTES_HASH);
+    ssize_t len = -1;
+    if (locations) {
+      while (entry < count && memcmp(entries + entry * BYTES_HASH, raw, BYTES_HASH) != 0) entry++;
+      if (entry < count) len = read_located_block(locations[entry], block.data());
+    } else {
+      len = read_stored_block(hex, block.data());
+    }
+    if (len < 0) {
+      exit_error(wrap_ostringstream("error: block \'" << hex << "\' of " << recipe << " can't be readed, aborted..."), 13);
+    }
+    const uint32_t block_len = len;
+    channel.write(&block_len, sizeof(block_len));
+    channel.write(block.data(), len);
+  }
+}
+
+void send_recipe(channel_t& channel, const std::filesystem::path& recipe, replication_totals_t& totals)
+{
+  unsigned char digest[BYTES_HASH];
+  file_t file(recipe, O_RDONLY);
+  if (!recipe_digest(recipe, digest) || !file.open()) {
+    std::cerr << "warn: can't read stored file " << recipe << ", skipped\n";
+    return;
+  }
+  const std::string name = recipe.lexically_normal().lexically_relative(files_dir.lexically_normal()).string();
+  channel.write_frame(FRAME_RECIPE);
+  channel.write_u64(name.size());
+  channel.write(name.data(), name.size());
+  channel.write_u64(std::filesystem::file_size(recipe));
+  channel.write(digest, BYTES_HASH);
+  if (channel.read_u64()) {
+    totals.skipped++;
+    return;
+  }
+  std::optional<file_t> locations;
+  if (std::filesystem::exists(locations_path(recipe))) {
+    locations.emplace(locations_path(recipe), O_RDONLY);
+    if (!locations->open()) {
+      exit_error(wrap_ostringstream("error: can't open locations of " << recipe << ", aborted..."), 13);
+    }
+  }
+  std::vector<unsigned char> entries(REPLICATE_PART_ENTRIES * BYTES_HASH);
+  std::vector<hash_location_t> locations_buf(locations ? REPLICATE_PART_ENTRIES : 0);
+  std::vector<unsigned char> missing;
+  ssize_t readed;
+  while ((readed = file.read((char *) entries.data(), entries.size())) > 0) {
+    soft_assert((readed % BYTES_HASH) == 0);
+    const size_t count = readed / BYTES_HASH;
+    if (locations) {
+      const ssize_t size = count * sizeof(hash_location_t);
+      if (locations->read((char *) locations_buf.data(), size) != size) {
+        exit_error(wrap_ostringstream("error: locations of " << recipe << " are shorter than recipe, aborted..."), 13);
+      }
+    }
+    channel.write_frame(FRAME_PART);
+    channel.write_u64(count);
+    channel.write(entries.data(), readed);
+    const uint64_t missing_count = channel.read_u64();
+    if (missing_count > count) protocol_error("more missing digests than entries");
+    missing.resize(missing_count * BYTES_HASH);
+    channel.read(missing.data(), missing.size());
+    send_blocks(channel, recipe, entries.data(), count, locations ? locations_buf.data() : nullptr, missing);
+    totals.entries += count;
+    totals.blocks += missing_count;
+  }
+  std::string index;
+  if (std::filesystem::exists(offset_index_path(recipe)) && !read_whole_file(offset_index_path(recipe), index)) {
+    exit_error(wrap_ostringstream("error: can't read offset index of " << recipe << ", aborted..."), 13);
+  }
+  channel.write_frame(FRAME_FINISH);
+  channel.write_u64(index.size());
+  channel.write(index.data(), index.size());
+  if (channel.read_frame() != FRAME_ACK) protocol_error("recipe isn't acknowledged");
+  totals.recipes++;
+}
+
+// path should stay in files dir and shouldn't look like temporary file
+bool valid_recipe_name(const std::string& name)
+{
+  const std::filesystem::path path(name);
+  if (name.empty() || path.is_absolute()) return false;
+  for (const auto& part : path) {
+    if (part == ".." || part == "." || part.empty()) return false;
+  }
+  const size_t suffix = sizeof(VERSION_TMP_SUFFIX) - 1;
+  return name.size() < suffix || name.compare(name.size() - suffix, suffix, VERSION_TMP_SUFFIX) != 0;
+}
+
+// recipe is written to temporary file, it replaces stored one after its blocks are committed
+void receive_recipe(channel_t& channel, replication_totals_t& totals)
+{
+  const uint64_t name_len = channel.read_u64();
+  if (name_len > MAX_RECIPE_PATH) protocol_error("too long recipe path");
+  std::string name(name_len, 0);
+  channel.read(name.data(), name_len);
+  if (!valid_recipe_name(name)) protocol_error("invalid recipe path");
+  const uint64_t size = channel.read_u64();
+  unsigned char digest[BYTES_HASH];
+  channel.read(digest, BYTES_HASH);
+  const std::filesystem::path file = files_dir / name;
+  unsigned char local_digest[BYTES_HASH];
+  std::error_code error;
+  if (std::filesystem::file_size(file, error) == size && !error
+      && recipe_digest(file, local_digest) && !memcmp(digest, local_digest, BYTES_HASH)) {
+    channel.write_u64(1);
+    totals.skipped++;
+    return;
+  }
+  channel.write_u64(0);
+
+  const std::filesystem::path tmp = files_dir / (name + VERSION_TMP_SUFFIX);
+  std::filesystem::create_directories(tmp.parent_path());
+  std::filesystem::remove(offset_index_path(tmp));
+  file_t recipe(tmp, O_WRONLY | O_CREAT | O_TRUNC);
+  if (!recipe.open()) {
+    exit_error(wrap_ostringstream("error: can't create " << tmp << ", errno: " << errno), 13);
+  }
+  std::vector<unsigned char> entries;
+  std::vector<unsigned char> missing;
+  std::vector<char> candidates; // hexes of first entries of digests
+  std::vector<size_t> candidate_entries;
+  std::unique_ptr<bool[]> found(new bool[SELECT_MANY_HASHES_COUNT]);
+  digest_set_t part_digests(REPLICATE_PART_ENTRIES);
+  std::vector<char> block(HASHING_BLOCK_SIZE);
+  char frame;
+  while ((frame = channel.read_frame()) == FRAME_PART) {
+    const uint64_t count = channel.read_u64();
+    if (count > REPLICATE_PART_ENTRIES) protocol_error("too large part of recipe");
+    entries.resize(count * BYTES_HASH);
+    channel.read(entries.data(), entries.size());
+    part_digests.clear();
+    candidates.clear();
+    candidate_entries.clear();
+    uint64_t run_length;
+    for (size_t i = 0; i < count; i++) {
+      const unsigned char * entry = entries.data() + i * BYTES_HASH;
+      if (read_zero_run_entry(entry, &run_length) || !part_digests.insert(entry)) continue;
+      candidates.resize(candidates.size() + HASH_HEX_BYTES);
+      to_my_hex(candidates.data() + candidates.size() - HASH_HEX_BYTES, entry, BYTES_HASH);
+      candidate_entries.push_back(i);
+    }
+    missing.clear();
+    for (size_t begin = 0; begin < candidate_entries.size(); begin += SELECT_MANY_HASHES_COUNT) {
+      const size_t batch = std::min<size_t>(candidate_entries.size() - begin, SELECT_MANY_HASHES_COUNT);
+      {
+        stage_timer_t timer(STAGE_DB_LOOKUP);
+        hash_index->exists_many(candidates.data() + begin * HASH_HEX_BYTES, batch, found.get());
+      }
+      for (size_t i = 0; i < batch; i++) {
+        if (found[i]) continue;
+        const unsigned char * entry = entries.data() + candidate_entries[begin + i] * BYTES_HASH;
+        missing.insert(missing.end(), entry, entry + BYTES_HASH);
+      }
+    }
+    channel.write_u64(missing.size() / BYTES_HASH);
+    channel.write(missing.data(), missing.size());
+    for (size_t i = 0; i < missing.size(); i += BYTES_HASH) {
+      uint32_t len;
+      channel.read(&len, sizeof(len));
+      if (len > HASHING_BLOCK_SIZE) protocol_error("too large block");
+      channel.read(block.data(), len);
+      if (!store_received_block(missing.data() + i, block.data(), len)) protocol_error("block doesn't match its digest");
+    }
+    flush_saved_hashes();
+    rotate_output_hash_file();
+    {
+      stage_timer_t timer(STAGE_RECIPE_WRITE);
+      if (recipe.write((const char *) entries.data(), entries.size()) != (ssize_t) entries.size()) {
+        exit_error(wrap_ostringstream("error: can't write " << tmp << ", errno: " << errno), 13);
+      }
+    }
+    stats_add(COUNTER_BYTES_RECIPE, entries.size());
+    stats_add(COUNTER_DUPLICATE_CHUNKS, count - missing.size() / BYTES_HASH);
+    totals.entries += count;
+    totals.blocks += missing.size() / BYTES_HASH;
+    check_commit_group();
+  }
+  if (frame != FRAME_FINISH) protocol_error("unexpected frame in recipe");
+  const uint64_t index_len = channel.read_u64();
+  std::string index(index_len, 0);
+  channel.read(index.data(), index_len);
+  if (index_len > 0) {
+    const auto index_path = offset_index_path(tmp);
+    std::filesystem::create_directories(index_path.parent_path());
+    if (!write_whole_file(index_path, index.data(), index.size())) {
+      exit_error(wrap_ostringstream("error: can't write " << index_path << ", errno: " << errno), 13);
+    }
+  }
+  if (commit_options.durability == DURABILITY_GROUP) sync_store_file(recipe);
+  recipe.close();
+  // blocks are committed before recipe refers them
+  end_commit_groups();
+  std::filesystem::remove(locations_path(file));
+  rename_stored_file(tmp, file);
+  if (commit_options.durability == DURABILITY_GROUP) {
+    for (const auto& path : { file.parent_path(), offset_index_path(file).parent_path() }) {
+      file_t dir(path, O_RDONLY | O_DIRECTORY);
+      if (dir.open()) sync_store_file(dir);
+    }
+  }
+  begin_commit_groups();
+  channel.write_frame(FRAME_ACK);
+  totals.recipes++;
+}
+
+} // anonimous namespace
+
+int open_replication_peer(const std::string& peer, bool listen)
+{
+  static const char UNIX_PREFIX[] = "unix:";
+  if (peer.compare(0, sizeof(UNIX_PREFIX) - 1, UNIX_PREFIX) != 0) return -1;
+  sockaddr_un address {};
+  address.sun_family = AF_UNIX;
+  const std::string path = peer.substr(sizeof(UNIX_PREFIX) - 1);
+  if (path.size() >= sizeof(address.sun_path)) return -1;
+  memcpy(address.sun_path, path.c_str(), path.size() + 1);
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) return -1;
+  if (!listen) {
+    if (connect(fd, (sockaddr *) &address, sizeof(address)) != 0) {
+      ::close(fd);
+      return -1;
+    }
+    return fd;
+  }
+  unlink(path.c_str());
+  if (bind(fd, (sockaddr *) &address, sizeof(address)) != 0 || ::listen(fd, 1) != 0) {
+    ::close(fd);
+    return -1;
+  }
+  int connection;
+  while ((connection = accept4(fd, nullptr, nullptr, SOCK_CLOEXEC)) < 0 && errno == EINTR);
+  ::close(fd);
+  unlink(path.c_str());
+  return connection;
+}
+
+size_t replicate_send(const std::filesystem::path& path, int in, int out)
+{
+  std::vector<std::filesystem::path> recipes;
+  if (std::filesystem::is_directory(path)) {
+    for (auto it = std::filesystem::recursive_directory_iterator(path.lexically_normal()); it != std::filesystem::recursive_directory_iterator(); ++it) {
+      // versions are sent before their files
+      if (it->is_directory() && it->path().filename() == VERSIONS_DIRECTORY) {
+        it.disable_recursion_pending();
+        continue;
+      }
+      const std::string name = it->path().filename().string();
+      if (it->is_regular_file() && valid_recipe_name(name)) recipes.push_back(it->path());
+    }
+    std::sort(recipes.begin(), recipes.end());
+  } else if (std::filesystem::exists(path)) {
+    recipes.push_back(path);
+  } else {
+    exit_error(wrap_ostringstream("error: " << path << " not found, aborted..."), 6);
+  }
+
+  channel_t channel(in, out);
+  channel.write(REPLICATE_MAGIC, REPLICATE_MAGIC_BYTES);
+  channel.write_u64(HASHING_BLOCK_SIZE);
+  channel.write_u64(BYTES_HASH);
+  replication_totals_t totals;
+  for (const auto& recipe : recipes) {
+    const uint64_t versions = stored_versions(recipe);
+    for (uint64_t version = 1; version < versions; version++) {
+      send_recipe(channel, stored_version_path(recipe, version), totals);
+    }
+    send_recipe(channel, recipe, totals);
+  }
+  channel.write_frame(FRAME_END);
+  channel.flush();
+  std::cerr << "info: sent " << totals.recipes << " recipes (" << totals.skipped << " already replicated), "
+            << totals.blocks << " blocks of " << totals.entries << " entries, " << channel.sent() << " bytes\n";
+  return totals.recipes;
+}
+
+size_t replicate_receive(int in, int out)
+{
+  if (sparse_index) {
+    exit_error("error: replication to store with sparse index is not supported, aborted...", 13);
+  }
+  channel_t channel(in, out);
+  char magic[REPLICATE_MAGIC_BYTES];
+  channel.read(magic, sizeof(magic));
+  if (memcmp(magic, REPLICATE_MAGIC, sizeof(magic)) != 0) protocol_error("not replication session");
+  const uint64_t block_size = channel.read_u64();
+  const uint64_t hash_bytes = channel.read_u64();
+  if (block_size != HASHING_BLOCK_SIZE || hash_bytes != BYTES_HASH) {
+    exit_error(wrap_ostringstream("error: sender uses blocks of " << block_size << " bytes and digests of "
+                                  << hash_bytes << " bytes, aborted..."), 13);
+  }
+  open_output_hash_file();
+  begin_commit_groups();
+  replication_totals_t totals;
+  char frame;
+  while ((frame = channel.read_frame()) == FRAME_RECIPE) {
+    receive_recipe(channel, totals);
+  }
+  if (frame != FRAME_END) protocol_error("unexpected frame");
+  channel.flush();
+  end_commit_groups();
+  close_store_files();
+  std::cerr << "info: received " << totals.recipes << " recipes (" << totals.skipped << " already replicated), "
+            << totals.blocks << " blocks of " << totals.entries << " entries\n";
+  return totals.recipes;
+}
@@ -0,0 +1,19 @@
+#ifndef REPLICATION_H
+#define REPLICATION_H
+
+#include <cstddef>
+#include <filesystem>
+#include <string>
+
+// fd of peer "unix:path", listening side accepts one connection. -1 on error
+int open_replication_peer(const std::string& peer, bool listen);
+
+// sends stored file or all stored files of directory with their versions to receiver,
+// only blocks missed by receiver are sent. prints summary to stderr, returns count of sent recipes
+size_t replicate_send(const std::filesystem::path& path, int in, int out);
+
+// stores recipes and missing blocks of sender until it ends session,
+// recipe is visible after its blocks are committed. returns count of received recipes
+size_t replicate_receive(int in, int out);
+
+#endif // REPLICATION_H
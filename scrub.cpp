@@ -0,0 +1,349 @@
+#include "scrub.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <openssl/sha.h>
+
+#include "digest_set.h"
+#include "rate_limiter.h"
+#include "store.h"
+#include "utils.h"
+
+namespace {
+
+struct scrub_counters_t
+{
+  std::atomic<size_t> records { 0 };
+  std::atomic<size_t> bytes { 0 };
+  std::atomic<size_t> verified { 0 };   // index points to record
+  std::atomic<size_t> stale { 0 };      // index points to other copy of block
+  std::atomic<size_t> unindexed { 0 };  // not in index, space of compaction
+  std::atomic<size_t> invalid { 0 };    // bad block size prefix, rest of hash file is skipped
+  std::atomic<size_t> unresolved { 0 }; // base of delta record not found or broken
+  std::atomic<size_t> torn { 0 };       // incomplete record at end of hash file
+};
+
+// records of hash file waiting for index lookup
+struct scrub_batch_t
+{
+  std::vector<char> hexes;
+  std::vector<off_t> positions;
+  std::vector<hash_location_t> locations;
+};
+
+// resolve_record and index are not thread safe
+std::mutex index_mutex;
+
+void hash_block(const char * data, size_t len, unsigned char * raw)
+{
+#if (HASH_BITS == 256)
+  SHA256((const unsigned char *) data, len, raw);
+#else
+#error "unknown algoritm"
+#endif
+}
+
+// checks batched records in index, positions of verified ones are added to confirmed
+void lookup_batch(scrub_batch_t& batch, hash_file_id_t id, scrub_counters_t& counters, std::vector<off_t>& confirmed)
+{
+  const size_t count = batch.positions.size();
+  if (!count) return;
+  std::unique_ptr<bool[]> found(new bool[count]);
+  {
+    std::lock_guard<std::mutex> lock(index_mutex);
+    hash_index->find_many(batch.hexes.data(), count, found.get(), batch.locations.data());
+  }
+  for (size_t i = 0; i < count; i++) {
+    if (!found[i]) {
+      counters.unindexed++;
+    } else if (batch.locations[i].file == id && batch.locations[i].pos == batch.positions[i]) {
+      counters.verified++;
+      confirmed.push_back(batch.positions[i]);
+    } else {
+      counters.stale++;
+    }
+  }
+  batch.hexes.clear();
+  batch.positions.clear();
+}
+
+// rehashes all records of hash file, confirmed - sorted positions of verified records
+void scrub_hash_file(const std::pair<hash_file_id_t, std::string>& hash_file, rate_limiter_t& limiter,
+                     scrub_counters_t& counters, std::vector<off_t>& confirmed)
+{
+  file_t file(hash_file.second, O_RDONLY);
+  if (!file.open()) {
+    std::cout << "scrub: can't open hash file " << hash_file.second << "\n";
+    counters.invalid++;
+    return;
+  }
+  scrub_batch_t batch;
+  batch.hexes.reserve(SELECT_MANY_HASHES_COUNT * HASH_HEX_BYTES);
+  batch.positions.reserve(SELECT_MANY_HASHES_COUNT);
+  batch.locations.resize(SELECT_MANY_HASHES_COUNT);
+  std::vector<char> buf(COMPACTION_BUFFER_SIZE);
+  std::vector<char> block(HASHING_BLOCK_SIZE);
+  size_t buffered = 0;
+  off_t buf_offset = 0;
+  bool broken = false;
+  ssize_t readed;
+  while (!broken && (readed = file.read(buf.data() + buffered, buf.size() - buffered)) > 0) {
+    limiter.consume(readed);
+    counters.bytes += readed;
+    buffered += readed;
+    size_t pos = 0;
+    while (pos + BLOCK_SIZE_BYTES <= buffered) {
+      bool delta;
+      const size_t block_len = read_record_prefix(buf.data() + pos, &delta);
+      if (!block_len || block_len > HASHING_BLOCK_SIZE || (delta && block_len <= BYTES_HASH)) {
+        std::cout << "scrub: invalid record at " << buf_offset + pos << " of " << hash_file.second
+                  << ", rest of hash file is not checked\n";
+        counters.invalid++;
+        broken = true;
+        break;
+      }
+      if (pos + BLOCK_SIZE_BYTES + block_len > buffered) break;
+      const char * data = buf.data() + pos + BLOCK_SIZE_BYTES;
+      unsigned char raw[BYTES_HASH];
+      counters.records++;
+      if (delta) {
+        ssize_t size;
+        {
+          std::lock_guard<std::mutex> lock(index_mutex);
+          size = resolve_record(data, block_len, true, block.data());
+        }
+        if (size < 0) {
+          std::cout << "scrub: delta record at " << buf_offset + pos << " of " << hash_file.second
+                    << " not resolved\n";
+          counters.unresolved++;
+          pos += BLOCK_SIZE_BYTES + block_len;
+          continue;
+        }
+        hash_block(block.data(), size, raw);
+      } else {
+        hash_block(data, block_len, raw);
+      }
+      const size_t used = batch.hexes.size();
+      batch.hexes.resize(used + HASH_HEX_BYTES);
+      to_my_hex(batch.hexes.data() + used, raw, BYTES_HASH);
+      batch.positions.push_back(buf_offset + pos);
+      if (batch.positions.size() == SELECT_MANY_HASHES_COUNT) {
+        lookup_batch(batch, hash_file.first, counters, confirmed);
+      }
+      pos += BLOCK_SIZE_BYTES + block_len;
+    }
+    memmove(buf.data(), buf.data() + pos, buffered - pos);
+    buffered -= pos;
+    buf_offset += pos;
+  }
+  lookup_batch(batch, hash_file.first, counters, confirmed);
+  if (!broken && buffered) {
+    std::cerr << "warn: torn record at " << buf_offset << " of " << hash_file.second << "\n";
+    counters.torn++;
+  }
+  std::sort(confirmed.begin(), confirmed.end());
+}
+
+// blocks of recipe stored with sparse index are readed by its locations and rehashed,
+// returns count of corrupt ones
+size_t scrub_located_recipe(const std::string& path, rate_limiter_t& limiter, size_t& entries)
+{
+  file_t recipe(path, O_RDONLY);
+  file_t locations(locations_path(path), O_RDONLY);
+  if (!recipe.open() || !locations.open()) {
+    std::cerr << "warn: can't open stored file " << path << " or its locations\n";
+    return 0;
+  }
+  size_t corrupt = 0;
+  std::vector<unsigned char> buf((BUFFER_READ_SIZE / BYTES_HASH) * BYTES_HASH);
+  std::vector<hash_location_t> locations_buf(BUFFER_READ_SIZE / BYTES_HASH);
+  std::vector<char> block(HASHING_BLOCK_SIZE);
+  unsigned char raw[BYTES_HASH];
+  char hex[HASH_HEX_BYTES + 1] = {};
+  ssize_t readed;
+  while ((readed = recipe.read((char *) buf.data(), buf.size())) > 0) {
+    const ssize_t size = readed / BYTES_HASH * sizeof(hash_location_t);
+    if (locations.read((char *) locations_buf.data(), size) != size) {
+      std::cout << "scrub: locations of " << path << " are shorter than recipe\n";
+      return corrupt + 1;
+    }
+    limiter.consume(readed + size);
+    for (ssize_t i = 0; i + BYTES_HASH <= readed; i += BYTES_HASH) {
+      entries++;
+      uint64_t run;
+      if (read_zero_run_entry(buf.data() + i, &run)) continue;
+      const ssize_t len = read_located_block(locations_buf[i / BYTES_HASH], block.data());
+      if (len >= 0) hash_block(block.data(), len, raw);
+      if (len < 0 || memcmp(raw, buf.data() + i, BYTES_HASH) != 0) {
+        to_my_hex(hex, buf.data() + i, BYTES_HASH);
+        std::cout << "scrub: chunk " << hex << " of " << path << " is corrupt\n";
+        corrupt++;
+      }
+    }
+  }
+  return corrupt;
+}
+
+// records of corrupt chunks are readed again at locations index points to now, because concurrent
+// session or compaction can move or rewrite them after check, hexes of still corrupt ones are added
+// to erase, returns its count
+size_t recheck_corrupt(const char * hexes, size_t count, bool * found, hash_location_t * locations,
+                       std::vector<char>& erase)
+{
+  hash_index->find_many(hexes, count, found, locations);
+  std::vector<char> block(HASHING_BLOCK_SIZE);
+  unsigned char raw[BYTES_HASH];
+  char hex[HASH_HEX_BYTES + 1] = {};
+  size_t corrupt = 0;
+  for (size_t i = 0; i < count; i++) {
+    const char * expected = hexes + i * HASH_HEX_BYTES;
+    if (!found[i]) continue; // already removed from index
+    const ssize_t len = read_located_block(locations[i], block.data());
+    if (len >= 0) {
+      hash_block(block.data(), len, raw);
+      to_my_hex(hex, raw, BYTES_HASH);
+      if (!memcmp(hex, expected, HASH_HEX_BYTES)) continue;
+    }
+    erase.insert(erase.end(), expected, expected + HASH_HEX_BYTES);
+    corrupt++;
+  }
+  return corrupt;
+}
+
+} // anonimous namespace
+
+size_t scrub_store(const scrub_options_t& options)
+{
+  auto hash_files = hash_index->hash_files();
+  hash_files.erase(std::remove_if(hash_files.begin(), hash_files.end(),
+                                  [](const auto& hash_file) { return !std::filesystem::exists(hash_file.second); }),
+                   hash_files.end());
+
+  size_t threads = options.threads ? options.threads : std::max(1u, std::thread::hardware_concurrency());
+  threads = std::max<size_t>(1, std::min(threads, hash_files.size()));
+
+  // confirmed[i] - verified positions of hash_files[i]
+  std::vector<std::vector<off_t>> confirmed(hash_files.size());
+  std::unordered_map<hash_file_id_t, size_t> hash_file_index;
+  for (size_t i = 0; i < hash_files.size(); i++) hash_file_index[hash_files[i].first] = i;
+
+  scrub_counters_t counters;
+  std::atomic<size_t> next { 0 };
+  std::vector<std::thread> workers;
+  for (size_t t = 0; t < threads; t++) {
+    workers.emplace_back([&]() {
+      rate_limiter_t limiter(options.rate_bytes / threads);
+      size_t i;
+      while ((i = next++) < hash_files.size()) {
+        scrub_hash_file(hash_files[i], limiter, counters, confirmed[i]);
+      }
+    });
+  }
+  for (auto& worker : workers) worker.join();
+
+  // every chunk of stored files and their versions should be indexed at verified record
+  size_t entries = 0;
+  size_t missing = 0;
+  size_t corrupt = 0;
+  std::vector<char> corrupt_hexes;
+  digest_set_t checked(SELECT_MANY_HASHES_COUNT);
+  std::vector<char> hexes;
+  std::vector<std::string> recipes; // recipe of each batched hex
+  hexes.reserve(SELECT_MANY_HASHES_COUNT * HASH_HEX_BYTES);
+  std::unique_ptr<bool[]> found(new bool[SELECT_MANY_HASHES_COUNT]);
+  std::vector<hash_location_t> locations(SELECT_MANY_HASHES_COUNT);
+  auto check_batch = [&]() {
+    const size_t count = recipes.size();
+    if (!count) return;
+    hash_index->find_many(hexes.data(), count, found.get(), locations.data());
+    for (size_t i = 0; i < count; i++) {
+      const char * hex = hexes.data() + i * HASH_HEX_BYTES;
+      if (!found[i]) {
+        std::cout << "scrub: chunk " << std::string(hex, HASH_HEX_BYTES) << " of " << recipes[i]
+                  << " is missing\n";
+        missing++;
+        continue;
+      }
+      const auto it = hash_file_index.find(locations[i].file);
+      const bool verified = it != hash_file_index.end()
+        && std::binary_search(confirmed[it->second].begin(), confirmed[it->second].end(), locations[i].pos);
+      if (!verified) {
+        std::cout << "scrub: chunk " << std::string(hex, HASH_HEX_BYTES) << " of " << recipes[i]
+                  << " is corrupt\n";
+        corrupt++;
+        corrupt_hexes.insert(corrupt_hexes.end(), hex, hex + HASH_HEX_BYTES);
+      }
+    }
+    hexes.clear();
+    recipes.clear();
+  };
+
+  rate_limiter_t limiter(options.rate_bytes);
+  std::vector<unsigned char> buf((BUFFER_READ_SIZE / BYTES_HASH) * BYTES_HASH);
+  for (auto& entry : std::filesystem::recursive_directory_iterator(files_dir)) {
+    if (!entry.is_regular_file()) continue;
+    const std::string path = entry.path().string();
+    if (path.size() >= sizeof(VERSION_TMP_SUFFIX) - 1
+        && !path.compare(path.size() - (sizeof(VERSION_TMP_SUFFIX) - 1), std::string::npos, VERSION_TMP_SUFFIX)) {
+      continue;
+    }
+    // sparse index has only hooks, so blocks are checked at locations
+    if (std::filesystem::exists(locations_path(path))) {
+      corrupt += scrub_located_recipe(path, limiter, entries);
+      continue;
+    }
+    file_t file(path, O_RDONLY);
+    if (!file.open()) {
+      std::cerr << "warn: can't open stored file " << path << "\n";
+      continue;
+    }
+    ssize_t readed;
+    while ((readed = file.read((char *) buf.data(), buf.size())) > 0) {
+      limiter.consume(readed);
+      for (ssize_t i = 0; i + BYTES_HASH <= readed; i += BYTES_HASH) {
+        entries++;
+        uint64_t run;
+        if (read_zero_run_entry(buf.data() + i, &run) || !checked.insert(buf.data() + i)) continue;
+        const size_t used = hexes.size();
+        hexes.resize(used + HASH_HEX_BYTES);
+        to_my_hex(hexes.data() + used, buf.data() + i, BYTES_HASH);
+        recipes.push_back(path);
+        if (recipes.size() == SELECT_MANY_HASHES_COUNT) check_batch();
+      }
+    }
+  }
+  check_batch();
+
+  if (options.quarantine && !corrupt_hexes.empty()) {
+    const size_t count = corrupt_hexes.size() / HASH_HEX_BYTES;
+    size_t quarantined = 0;
+    hash_index->begin_batch();
+    for (size_t i = 0; i < count; i += SELECT_MANY_HASHES_COUNT) {
+      const size_t batch = std::min<size_t>(SELECT_MANY_HASHES_COUNT, count - i);
+      const char * batch_hexes = corrupt_hexes.data() + i * HASH_HEX_BYTES;
+      hexes.clear();
+      quarantined += recheck_corrupt(batch_hexes, batch, found.get(), locations.data(), hexes);
+      if (!hexes.empty()) hash_index->erase_many(hexes.data(), hexes.size() / HASH_HEX_BYTES);
+    }
+    hash_index->commit_batch();
+    std::cout << "scrub: " << quarantined << " corrupt chunks removed from index";
+    if (quarantined < count) std::cout << ", " << count - quarantined << " were rewritten since check";
+    std::cout << "\n";
+  }
+
+  const size_t problems = counters.invalid + counters.unresolved + missing + corrupt;
+  std::cout << "scrub: " << hash_files.size() << " hash files, " << counters.bytes << " bytes, "
+            << counters.records << " records, " << counters.verified << " verified, "
+            << counters.stale << " stale, " << counters.unindexed << " unindexed, "
+            << counters.invalid << " invalid, " << counters.unresolved << " unresolved, "
+            << counters.torn << " torn; " << entries << " recipe entries, "
+            << missing << " missing, " << corrupt << " corrupt\n";
+  return problems;
+}
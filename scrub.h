@@ -0,0 +1,25 @@
+#ifndef SCRUB_H
+#define SCRUB_H
+
+#include <cstddef>
+
+struct scrub_options_t
+{
+  // hash file reading threads, 0 - count of CPUs
+  size_t threads = 0;
+
+  // 0 - unlimited, shared by threads
+  double rate_bytes = 0;
+
+  // index rows of corrupt chunks are removed, so restore reports them missing
+  // instead of wrong bytes and next writes store them again
+  bool quarantine = false;
+};
+
+// rehashes records of all hash files and checks them against index in batches,
+// then checks that every chunk referenced by stored files is indexed at verified record,
+// chunks of files stored with sparse index are rehashed at their locations.
+// prints problems and summary to stdout, returns count of problems
+size_t scrub_store(const scrub_options_t& options);
+
+#endif // SCRUB_H
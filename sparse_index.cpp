@@ -0,0 +1,96 @@
+#include "sparse_index.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/file.h>
+
+#include "stats.h"
+#include "store.h"
+
+bool find_in_manifest(const manifest_t& manifest, const unsigned char * raw, hash_location_t * location)
+{
+  auto it = std::lower_bound(manifest.begin(), manifest.end(), raw, [](const manifest_entry_t& entry, const unsigned char * raw) {
+    return memcmp(entry.raw, raw, BYTES_HASH) < 0;
+  });
+  if (it == manifest.end() || memcmp(it->raw, raw, BYTES_HASH) != 0) return false;
+  *location = it->location;
+  return true;
+}
+
+manifest_log_t::manifest_log_t(size_t cached_manifests)
+  : file_("", O_RDWR | O_CREAT)
+  , cached_manifests_(cached_manifests)
+{
+}
+
+file_t& manifest_log_t::file()
+{
+  if (!file_) {
+    file_ = file_t(hashes_dir / SPARSE_MANIFESTS_FILENAME, O_RDWR | O_CREAT);
+    if (!file_.open()) {
+      exit_error(wrap_ostringstream("error: can't open " << file_.path() << ", errno: " << errno), 10);
+    }
+  }
+  return file_;
+}
+
+off_t manifest_log_t::reserve(off_t size)
+{
+  if (handle_eintr(flock, file_.fd(), LOCK_EX) != 0) {
+    exit_error(wrap_ostringstream("error: can't lock " << file_.path() << ", errno: " << errno), 10);
+  }
+  const off_t offset = file_.to_end();
+  const bool extended = offset >= 0 && file_.truncate(offset + size) == offset + size;
+  flock(file_.fd(), LOCK_UN);
+  if (!extended) {
+    exit_error(wrap_ostringstream("error: can't extend " << file_.path() << ", errno: " << errno), 10);
+  }
+  return offset;
+}
+
+off_t manifest_log_t::append(const manifest_t& manifest)
+{
+  file();
+  const uint64_t count = manifest.size();
+  const off_t size = count * sizeof(manifest_entry_t);
+  const off_t offset = reserve(sizeof(count) + size);
+  if (file_.write(offset, (const char *) &count, sizeof(count)) != (ssize_t) sizeof(count)
+      || file_.write(offset + sizeof(count), (const char *) manifest.data(), size) != size) {
+    exit_error(wrap_ostringstream("error: can't write manifest to " << file_.path() << ", errno: " << errno), 10);
+  }
+  return offset;
+}
+
+const manifest_t * manifest_log_t::load(off_t offset)
+{
+  for (auto it = cache_.begin(); it != cache_.end(); ++it) {
+    if (it->first == offset) {
+      cache_.splice(cache_.begin(), cache_, it);
+      return &cache_.front().second;
+    }
+  }
+  file();
+  manifest_t manifest;
+  uint64_t count;
+  if (file_.read(offset, (char *) &count, sizeof(count)) != (ssize_t) sizeof(count)) return nullptr;
+  manifest.resize(count);
+  const ssize_t size = count * sizeof(manifest_entry_t);
+  if (file_.read(offset + sizeof(count), (char *) manifest.data(), size) != size) return nullptr;
+  stats_add(COUNTER_MANIFESTS_LOADED);
+  if (cache_.size() >= cached_manifests_) {
+    cache_.back().first = offset;
+    cache_.back().second = std::move(manifest);
+    cache_.splice(cache_.begin(), cache_, std::prev(cache_.end()));
+  } else {
+    cache_.emplace_front(offset, std::move(manifest));
+  }
+  return &cache_.front().second;
+}
+
+void manifest_log_t::close()
+{
+  file_.close();
+  cache_.clear();
+}
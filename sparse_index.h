@@ -0,0 +1,59 @@
+#ifndef SPARSE_INDEX_H
+#define SPARSE_INDEX_H
+
+#include <cstddef>
+#include <filesystem>
+#include <list>
+#include <utility>
+#include <vector>
+
+#include "defines.h"
+#include "file.h"
+#include "index.h"
+
+struct manifest_entry_t
+{
+  unsigned char raw[BYTES_HASH];
+  hash_location_t location;
+};
+
+// unique digests of segment sorted by raw digest
+using manifest_t = std::vector<manifest_entry_t>;
+
+inline bool is_hook(const unsigned char * raw)
+{
+  return (raw[BYTES_HASH - 1] & ((1u << SPARSE_SAMPLE_BITS) - 1)) == 0;
+}
+
+bool find_in_manifest(const manifest_t& manifest, const unsigned char * raw, hash_location_t * location);
+
+// manifests are appended to file as count of entries (uint64) and entries.
+// file is shared by sessions, space of manifest is reserved at its end under flock before writing.
+// loaded manifests are cached, least recently used one is evicted
+class manifest_log_t
+{
+public:
+  explicit manifest_log_t(size_t cached_manifests);
+
+  // returns offset of written manifest
+  off_t append(const manifest_t& manifest);
+
+  // nullptr if manifest can't be read, pointer is valid until cached_manifests other loads
+  const manifest_t * load(off_t offset);
+
+  // closes file and drops cache
+  void close();
+
+  // opened on first use
+  file_t& file();
+
+private:
+  // extends file by size, returns offset of added space
+  off_t reserve(off_t size);
+
+  file_t file_;
+  size_t cached_manifests_;
+  std::list<std::pair<off_t, manifest_t>> cache_; // most recently used first
+};
+
+#endif // SPARSE_INDEX_H
@@ -0,0 +1,257 @@
+#include "stats.h"
+
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <new>
+#include <sstream>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace {
+
+// bucket i counts calls with latency in [2^i, 2^(i + 1)) ns
+constexpr size_t HISTOGRAM_BUCKETS = 40;
+
+const char * const STAGE_NAMES[STAGES_COUNT] = {
+  "input_read",
+  "hashing",
+  "db_lookup",
+  "db_insert",
+  "db_files",
+  "chunk_append",
+  "chunk_read",
+  "recipe_write",
+  "recipe_read",
+  "output_write",
+  "sync",
+  "db_commit",
+  "delta",
+};
+
+const char * const COUNTER_NAMES[COUNTERS_COUNT] = {
+  "unique_chunks",
+  "duplicate_chunks",
+  "missing_chunks",
+  "bytes_ingested",
+  "bytes_stored",
+  "bytes_recipe",
+  "bytes_restored",
+  "syscalls",
+  "fds_opened",
+  "fds_closed",
+  "commit_groups",
+  "delta_chunks",
+  "allocations",
+  "bytes_zero",
+  "previous_version_chunks",
+  "sparse_hooks",
+  "manifests_loaded",
+  "near_reads",
+};
+
+struct stage_stats_t
+{
+  std::atomic<uint64_t> calls { 0 };
+  std::atomic<uint64_t> nanoseconds { 0 };
+  std::atomic<uint64_t> histogram[HISTOGRAM_BUCKETS] {};
+};
+
+stage_stats_t stages[STAGES_COUNT];
+std::atomic<uint64_t> counters[COUNTERS_COUNT];
+const auto started = std::chrono::steady_clock::now();
+
+std::mutex reporter_mutex;
+std::condition_variable reporter_wakeup;
+std::thread reporter;
+bool reporter_stopping = false;
+
+size_t bucket_of(uint64_t nanoseconds)
+{
+  size_t bucket = 0;
+  while (nanoseconds > 1 && bucket + 1 < HISTOGRAM_BUCKETS) {
+    nanoseconds >>= 1;
+    bucket++;
+  }
+  return bucket;
+}
+
+// upper bound of bucket containing quantile, microseconds
+double quantile_us(const uint64_t * histogram, uint64_t calls, double quantile)
+{
+  if (calls == 0) return 0;
+  const uint64_t rank = calls * quantile;
+  uint64_t seen = 0;
+  for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+    seen += histogram[i];
+    if (seen > rank) return (2ull << i) / 1000.0;
+  }
+  return (2ull << (HISTOGRAM_BUCKETS - 1)) / 1000.0;
+}
+
+int open_target(const std::string& target)
+{
+  static const char UNIX_PREFIX[] = "unix:";
+  if (target.compare(0, sizeof(UNIX_PREFIX) - 1, UNIX_PREFIX) != 0) {
+    return ::open(target.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  }
+  sockaddr_un address {};
+  address.sun_family = AF_UNIX;
+  const std::string path = target.substr(sizeof(UNIX_PREFIX) - 1);
+  if (path.size() >= sizeof(address.sun_path)) return -1;
+  memcpy(address.sun_path, path.c_str(), path.size() + 1);
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) return -1;
+  if (connect(fd, (sockaddr *) &address, sizeof(address)) != 0) {
+    ::close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+void report(int fd)
+{
+  const std::string line = stats_json() + "\n";
+  size_t written = 0;
+  while (written < line.size()) {
+    ssize_t result = ::send(fd, line.data() + written, line.size() - written, MSG_NOSIGNAL);
+    if (result < 0 && errno == ENOTSOCK) result = ::write(fd, line.data() + written, line.size() - written);
+    if (result < 0 && errno == EINTR) continue;
+    if (result <= 0) return;
+    written += result;
+  }
+}
+
+} // anonimous namespace
+
+void stats_add(stats_counter_t counter, uint64_t value)
+{
+  counters[counter].fetch_add(value, std::memory_order_relaxed);
+}
+
+void stats_record(stats_stage_t stage, uint64_t nanoseconds)
+{
+  stage_stats_t& stats = stages[stage];
+  stats.calls.fetch_add(1, std::memory_order_relaxed);
+  stats.nanoseconds.fetch_add(nanoseconds, std::memory_order_relaxed);
+  stats.histogram[bucket_of(nanoseconds)].fetch_add(1, std::memory_order_relaxed);
+}
+
+uint64_t stats_counter(stats_counter_t counter)
+{
+  return counters[counter].load(std::memory_order_relaxed);
+}
+
+// counters are constant initialized, so allocations of static constructors are counted too
+void * operator new(size_t size)
+{
+  counters[COUNTER_ALLOCATIONS].fetch_add(1, std::memory_order_relaxed);
+  void * ptr = malloc(size ? size : 1);
+  if (!ptr) throw std::bad_alloc();
+  return ptr;
+}
+
+void operator delete(void * ptr) noexcept
+{
+  free(ptr);
+}
+
+void operator delete(void * ptr, size_t) noexcept
+{
+  free(ptr);
+}
+
+std::string stats_json()
+{
+  std::ostringstream out;
+  out << std::setprecision(6) << "{\"elapsed_ms\":"
+      << std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - started).count()
+      << ",\"counters\":{";
+  for (size_t i = 0; i < COUNTERS_COUNT; i++) {
+    if (i > 0) out << ',';
+    out << '"' << COUNTER_NAMES[i] << "\":" << counters[i].load(std::memory_order_relaxed);
+  }
+  out << "},\"stages\":{";
+  bool first = true;
+  for (size_t i = 0; i < STAGES_COUNT; i++) {
+    const uint64_t calls = stages[i].calls.load(std::memory_order_relaxed);
+    if (calls == 0) continue;
+    uint64_t histogram[HISTOGRAM_BUCKETS];
+    size_t last_bucket = 0;
+    for (size_t bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++) {
+      histogram[bucket] = stages[i].histogram[bucket].load(std::memory_order_relaxed);
+      if (histogram[bucket] > 0) last_bucket = bucket;
+    }
+    if (!first) out << ',';
+    first = false;
+    out << '"' << STAGE_NAMES[i] << "\":{\"calls\":" << calls
+        << ",\"total_ms\":" << stages[i].nanoseconds.load(std::memory_order_relaxed) / 1e6
+        << ",\"p50_us\":" << quantile_us(histogram, calls, 0.5)
+        << ",\"p99_us\":" << quantile_us(histogram, calls, 0.99)
+        << ",\"max_us\":" << (2ull << last_bucket) / 1000.0
+        << ",\"log2_ns_histogram\":[";
+    for (size_t bucket = 0; bucket <= last_bucket; bucket++) {
+      if (bucket > 0) out << ',';
+      out << histogram[bucket];
+    }
+    out << "]}";
+  }
+  out << "}}";
+  return out.str();
+}
+
+void stats_print_at_exit()
+{
+  static bool registered = false;
+  if (registered) return;
+  registered = true;
+  std::atexit([]() {
+    stats_stop_reporter();
+    std::cerr << stats_json() << std::endl;
+  });
+}
+
+void stats_start_reporter(const std::string& target, double interval)
+{
+  if (reporter.joinable()) return;
+  int fd = open_target(target);
+  if (fd < 0) {
+    std::cerr << "warn: can't open stats target \"" << target << "\": " << strerror(errno) << std::endl;
+    return;
+  }
+  reporter_stopping = false;
+  reporter = std::thread([fd, interval]() {
+    std::unique_lock<std::mutex> lock(reporter_mutex);
+    while (!reporter_wakeup.wait_for(lock, std::chrono::duration<double>(interval),
+                                     []() { return reporter_stopping; })) {
+      report(fd);
+    }
+    report(fd);
+    ::close(fd);
+  });
+  static bool registered = false;
+  if (!registered) {
+    registered = true;
+    std::atexit(stats_stop_reporter);
+  }
+}
+
+void stats_stop_reporter()
+{
+  if (!reporter.joinable()) return;
+  {
+    std::lock_guard<std::mutex> lock(reporter_mutex);
+    reporter_stopping = true;
+  }
+  reporter_wakeup.notify_all();
+  reporter.join();
+}
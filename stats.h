@@ -0,0 +1,88 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+// timed parts of ingest and restore, each has latency histogram
+enum stats_stage_t {
+  STAGE_INPUT_READ   = 0,
+  STAGE_HASHING      = 1,
+  STAGE_DB_LOOKUP    = 2,
+  STAGE_DB_INSERT    = 3,
+  STAGE_DB_FILES     = 4,
+  STAGE_CHUNK_APPEND = 5,
+  STAGE_CHUNK_READ   = 6,
+  STAGE_RECIPE_WRITE = 7,
+  STAGE_RECIPE_READ  = 8,
+  STAGE_OUTPUT_WRITE = 9,
+  STAGE_SYNC         = 10,
+  STAGE_DB_COMMIT    = 11,
+  STAGE_DELTA        = 12,
+  STAGES_COUNT
+};
+
+enum stats_counter_t {
+  COUNTER_UNIQUE_CHUNKS    = 0,
+  COUNTER_DUPLICATE_CHUNKS = 1,
+  COUNTER_MISSING_CHUNKS   = 2,
+  COUNTER_BYTES_INGESTED   = 3,
+  COUNTER_BYTES_STORED     = 4,
+  COUNTER_BYTES_RECIPE     = 5,
+  COUNTER_BYTES_RESTORED   = 6,
+  COUNTER_SYSCALLS         = 7,
+  COUNTER_FDS_OPENED       = 8,
+  COUNTER_FDS_CLOSED       = 9,
+  COUNTER_COMMIT_GROUPS    = 10,
+  COUNTER_DELTA_CHUNKS     = 11,
+  COUNTER_ALLOCATIONS      = 12, // operator new calls of process
+  COUNTER_BYTES_ZERO       = 13, // ingested bytes of zero runs
+  COUNTER_PREVIOUS_CHUNKS  = 14, // chunks found in previous version without index lookup
+  COUNTER_SPARSE_HOOKS     = 15, // hooks inserted to sparse index
+  COUNTER_MANIFESTS_LOADED = 16, // segment manifests readed from disk by sparse index
+  COUNTER_NEAR_READS       = 17, // restored records close after previous one in same hash file
+  COUNTERS_COUNT
+};
+
+void stats_add(stats_counter_t counter, uint64_t value = 1);
+
+void stats_record(stats_stage_t stage, uint64_t nanoseconds);
+
+uint64_t stats_counter(stats_counter_t counter);
+
+// measures lifetime of object as one stage call
+class stage_timer_t
+{
+public:
+  explicit stage_timer_t(stats_stage_t stage)
+    : stage_(stage)
+    , start_(std::chrono::steady_clock::now())
+  {
+  }
+
+  ~stage_timer_t()
+  {
+    stats_record(stage_, std::chrono::duration_cast<std::chrono::nanoseconds>(
+                           std::chrono::steady_clock::now() - start_).count());
+  }
+
+  stage_timer_t(const stage_timer_t&) = delete;
+
+private:
+  stats_stage_t stage_;
+  std::chrono::steady_clock::time_point start_;
+};
+
+// one line JSON object with all counters and stages
+std::string stats_json();
+
+// prints stats_json to stderr at process exit
+void stats_print_at_exit();
+
+// appends stats_json line every interval seconds to file path or to "unix:path" socket
+void stats_start_reporter(const std::string& target, double interval);
+
+void stats_stop_reporter();
+
+#endif // STATS_H
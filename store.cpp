@@ -0,0 +1,1894 @@
+#include <algorithm>
+#include <assert.h>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <list>
+#include <unordered_map>
+#include <optional>
+#include <set>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <postgresql/libpq-fe.h>
+
+#include <openssl/sha.h>
+
+#include "store.h"
+
+#include "defines.h"
+#include "buffered_writer.h"
+#include "codec.h"
+#include "delta.h"
+#include "deque.h"
+#include "digest_set.h"
+#include "file.h"
+#include "hash_file_table.h"
+#include "io_engine.h"
+#include "offset_index.h"
+#include "queries.h"
+#include "sparse_index.h"
+#include "stats.h"
+#include "trace.h"
+#include "utils.h"
+
+std::filesystem::path files_dir;
+std::filesystem::path hashes_dir;
+std::filesystem::path offsets_dir;
+
+size_t max_fd = 10;
+size_t opened_fd = 0;
+
+int store_lock_fd = -1;
+
+PGconn* dbconn = nullptr;
+
+std::vector<PGconn*> shard_conns;
+
+std::unique_ptr<hash_index_t> hash_index;
+
+deque_t<file_t> files;
+
+// opened hash files, key - id
+std::unordered_map<hash_file_id_t, deque_t<file_t>::iterator> hashes_files;
+
+std::optional<hash_file_table_t> hash_file_table;
+
+// hash_file_table is filled from index once if it misses id
+bool hash_file_table_synced = false;
+
+deque_t<file_t>::iterator output_hash_file;
+deque_t<file_t>::iterator requested_file;
+
+hash_file_id_t output_hash_id;
+
+// offset index of writing file
+std::optional<offset_index_writer_t> offsets_writer;
+
+bool batch_inserts = false;
+
+// created on first chunk store I/O
+std::unique_ptr<io_engine_t> io_engine;
+
+// registered buffer for records of chunks read by fill_buffer_from_hashes,
+// one record per block of BUFFER_READ_SIZE
+constexpr size_t io_record_size = BLOCK_SIZE_BYTES + HASHING_BLOCK_SIZE;
+std::vector<char> io_staging;
+std::vector<io_request_t> io_requests;
+// locations of io_requests and location of last requested record, for near reads
+std::vector<hash_location_t> fill_locations(READED_BLOCKS);
+hash_location_t last_read = { 0, 0, 0 };
+// record and base block of each level of delta chain, level 0 - record of caller of resolve_record.
+// blocks can be too large for stack
+constexpr size_t chain_slice_size = io_record_size + HASHING_BLOCK_SIZE;
+std::vector<char> chain_scratch;
+
+// appends of save_buffer, attached to output_hash_file and requested_file
+buffered_writer_t chunk_writer(CHUNK_WRITE_BUFFER_SIZE);
+static_assert(CHUNK_WRITE_BUFFER_SIZE >= io_record_size, "record is reserved in chunk writer whole");
+buffered_writer_t recipe_writer(RECIPE_WRITE_BUFFER_SIZE);
+
+// raw hashes seen by save_buffer since last flush_saved_hashes, one buffer is added after flush check
+digest_set_t batch_hashes(2 * INSERT_MANY_HASHES_COUNT);
+
+// digests of previous version of updated file, its chunks found in index are counted as previous ones
+digest_set_t previous_version(0);
+// entries of saved buffer found in index by exists_many of its digests not seen in batch,
+// digest repeated in buffer is looked up by its first entry
+std::vector<char> buffer_indexed;
+std::vector<uint32_t> lookup_entries;
+digest_set_t lookup_digests(INSERT_MANY_HASHES_COUNT);
+std::string lookup_hexes;
+std::unique_ptr<bool[]> lookup_found(new bool[SELECT_MANY_HASHES_COUNT]);
+// hexes of fill_buffer_from_hashes and their locations found by find_many
+std::string fill_hexes;
+std::unique_ptr<bool[]> fill_found(new bool[READED_BLOCKS]);
+std::vector<hash_location_t> fill_found_locations(READED_BLOCKS);
+
+// recipe entries of buffer in save_buffer and lengths of their blocks, grow to largest buffer and are reused
+std::vector<unsigned char> buffer_raw;
+std::vector<size_t> buffer_lens;
+std::string buffer_hex;
+
+commit_options_t commit_options;
+
+bool commit_groups = false;
+uint64_t group_start_bytes = 0;
+std::chrono::steady_clock::time_point group_start;
+
+// written files closed in current group, synced before its commit
+std::vector<std::filesystem::path> group_closed_files;
+
+bool delta_compression = false;
+
+struct sketch_slot_t
+{
+  uint64_t super_feature;
+  unsigned char raw[BYTES_HASH];
+};
+
+// direct mapped by super-feature, newer block replaces older one.
+// loaded from SKETCH_INDEX_FILENAME on first use, saved on close if changed
+std::vector<sketch_slot_t> sketch_index;
+bool sketch_index_dirty = false;
+
+delta_encoder_t delta_encoder;
+// delta record of stored block, blocks can be too large for stack
+std::vector<char> delta_record(HASHING_BLOCK_SIZE);
+
+bool sparse_index = false;
+
+// shares transaction of dbconn with hash_index
+std::unique_ptr<hash_index_t> hook_index;
+
+manifest_log_t manifest_log(SPARSE_CACHED_MANIFESTS);
+
+// locations sidecar of writing file stored with sparse index
+deque_t<file_t>::iterator locations_file;
+buffered_writer_t locations_writer(RECIPE_WRITE_BUFFER_SIZE);
+
+// manifests of last saved segment and of previous version of updated file, all segments are compared with them
+manifest_t previous_segment;
+manifest_t previous_version_manifest;
+
+// state of save_sparse_segment, grows to largest segment and is reused:
+// not zero entries sorted by digest, entry storing block of each entry, locations of entries
+std::vector<uint32_t> segment_order;
+digest_sorter_t segment_sorter;
+std::vector<uint32_t> segment_owners;
+std::vector<hash_location_t> segment_locations;
+manifest_t segment_manifest;
+std::vector<uint32_t> segment_hooks;
+std::vector<uint32_t> new_hooks;
+std::string hook_hexes;
+std::unique_ptr<bool[]> hooks_found(new bool[SELECT_MANY_HASHES_COUNT]);
+std::vector<hash_location_t> hook_locations(SELECT_MANY_HASHES_COUNT);
+// key - offset of manifest, value - count of hooks referring it
+std::vector<std::pair<off_t, size_t>> champion_votes;
+std::vector<const manifest_t *> champions;
+
+void soft_close_all() {
+  files.remove_all();
+  hash_index.reset();
+  for (auto conn : shard_conns) {
+    if (conn != dbconn) PQfinish(conn);
+  }
+  shard_conns.clear();
+  if (dbconn) PQfinish(dbconn);
+  dbconn = nullptr;
+}
+
+void exec_conn(PGresult* res, ExecStatusType expected, const char * error_prefix) {
+  if (PQresultStatus(res) != expected) {
+    // result knows its connection error, dbconn can be other shard
+    std::cerr << error_prefix << ": " << PQresultStatus(res) << ", "
+              << (res ? PQresultErrorMessage(res) : PQerrorMessage(dbconn)) << std::endl;
+    PQclear(res);
+    soft_close_all();
+    exit(1);
+  }
+}
+
+void exit_error(const char * error_msg, int exit_code) {
+  std::cerr << error_msg << std::endl;
+  soft_close_all();
+  exit(exit_code);
+}
+
+static void
+noNoticeProcessor(void *arg, const char *message)
+{
+}
+
+//
+// if future, when fd limit will be ocurred then
+// we can use binary_tree for searching useless opened fd and close it
+// and open new. Now my system will close
+// alse we can close oldest used fd
+deque_t<file_t>::iterator openfile(std::string path, int open_mode) {
+  file_t file(path, open_mode);
+  if (opened_fd < max_fd) {
+    soft_assert(file.open());
+  } else {
+    exit_error("error: limit files occurred", 10);
+  }
+  return files.add(std::move(file));
+}
+
+bool check_valid_hash_filename(std::string filename)
+{
+  if ((filename.size() < sizeof(HASH_FILENAME_PREFIX) - 1 + HASH_FILENAME_POSTFIX_NUMBERS)
+     || (memcmp(filename.data(), HASH_FILENAME_PREFIX, sizeof(HASH_FILENAME_PREFIX) - 1) != 0))
+    return false;
+  for (size_t i = sizeof(HASH_FILENAME_PREFIX) - 1; i < filename.size(); i++) {
+    if (filename.data()[i] < '0' || filename.data()[i] > '9') return false;
+  }
+  return true;
+}
+
+std::string create_hash_filename_template(size_t numbers) {
+  size_t postfix_begin = sizeof(HASH_FILENAME_PREFIX) - 1;
+  std::string current_file(postfix_begin + numbers, 0);
+  memcpy(current_file.data(), HASH_FILENAME_PREFIX, postfix_begin);
+  strset(current_file.data() + postfix_begin, '0', numbers);
+  return current_file;
+}
+
+std::string find_free_hash_filename(std::string current_file)
+{
+  if (!check_valid_hash_filename(current_file)) {
+    current_file = create_hash_filename_template(HASH_FILENAME_POSTFIX_NUMBERS);
+  }
+
+  size_t postfix_begin = sizeof(HASH_FILENAME_PREFIX) - 1;
+  size_t extra_numbers = 0;
+  bool find_file = true;
+  while (find_file) {
+    soft_assert(current_file.data()[current_file.size()] == 0  &&
+                current_file.data()[current_file.size() - 1] >= '0' &&
+                current_file.data()[current_file.size() - 1] <= '9');
+    for (size_t i = current_file.size() - 1; i >= postfix_begin && find_file; i--) {
+      for (char* j = current_file.data() + i; *j <= '9'; (*j)++) {
+        if (!std::filesystem::exists(hashes_dir / current_file)) {
+          find_file = false;
+          break;
+        }
+      }
+    }
+    if (find_file) {
+      extra_numbers += 1;
+      current_file = create_hash_filename_template(HASH_FILENAME_POSTFIX_NUMBERS + extra_numbers);
+    }
+  }
+  return current_file;
+}
+
+std::string last_hash_filename()
+{
+  auto last_file_pref = hashes_dir / PREF_LAST_HASH_FILENAME;
+  if (!std::filesystem::exists(last_file_pref)) return {};
+  file_t pref_file(last_file_pref, O_RDONLY);
+  if (!pref_file.open()) return {};
+  std::string buf(256, 0);
+  if (pref_file.read(buf.data(), 255) <= 0) return {};
+  std::string current_file = buf.data();
+  if (!check_valid_hash_filename(current_file)) return {};
+  return current_file;
+}
+
+// chunk_writer keeps offset of end of output hash file, so it's appended only by session holding its flock
+bool lock_hash_file(file_t& file)
+{
+  return flock(file.fd(), LOCK_EX | LOCK_NB) == 0;
+}
+
+// saved end of whole records can be behind the end of hash file, records after it are parsed by prefixes.
+// hash file with torn record at end or without saved end isn't appended, because records after
+// torn one can't be parsed
+bool hash_file_tail_parses(const std::string& path)
+{
+  file_t file(path, O_RDONLY);
+  file_t end_file(path + HASH_FILE_END_SUFFIX, O_RDONLY);
+  if (!file.open()) return false;
+  const off_t size = file.to_end();
+  uint64_t end = 0;
+  if (!end_file.open() || end_file.read((char *) &end, sizeof(end)) != sizeof(end)) return size == 0;
+  if (end > (uint64_t) size) return false;
+  std::vector<char> buf(BUFFER_READ_SIZE);
+  off_t pos = end;
+  while (pos < size) {
+    const ssize_t readed = file.read(pos, buf.data(), std::min<off_t>(buf.size(), size - pos));
+    if (readed < BLOCK_SIZE_BYTES) return false;
+    size_t used = 0;
+    while (used + BLOCK_SIZE_BYTES <= (size_t) readed) {
+      bool delta;
+      const size_t len = read_record_prefix(buf.data() + used, &delta);
+      if (!len || len > HASHING_BLOCK_SIZE || (delta && len <= BYTES_HASH)) return false;
+      if (pos + (off_t) (used + BLOCK_SIZE_BYTES + len) > size) return false;
+      used += BLOCK_SIZE_BYTES + len;
+    }
+    pos += used;
+  }
+  return true;
+}
+
+void save_hash_file_end()
+{
+  if (!output_hash_file || chunk_writer.fd() != output_hash_file->fd()) return;
+  const uint64_t end = chunk_writer.offset();
+  file_t end_file(output_hash_file->path() + HASH_FILE_END_SUFFIX, O_WRONLY | O_CREAT);
+  if (!end_file.open() || end_file.write(0, (const char *) &end, sizeof(end)) != sizeof(end)) {
+    exit_error(wrap_ostringstream("error: can't save end of " << output_hash_file->path() << ", errno: " << errno), 10);
+  }
+}
+
+void open_output_hash_file()
+{
+  auto last_file_pref = hashes_dir / PREF_LAST_HASH_FILENAME;
+  std::string current_file;
+  std::string buf(256, 0);
+  deque_t<file_t>::iterator pref_file;
+  if (std::filesystem::exists(last_file_pref)) {
+    pref_file = openfile(last_file_pref.c_str(), O_RDWR);
+    soft_assert(*pref_file);
+    if (pref_file->to_end() < 256) {
+      pref_file->to_begin();
+      pref_file->read(buf.data(), 256);
+      current_file = buf.data();
+      auto last = hashes_dir / current_file;
+      if (check_valid_hash_filename(current_file) && std::filesystem::exists(last)) {
+        auto last_file = openfile(last, O_WRONLY | O_APPEND);
+        if (!lock_hash_file(*last_file) || last_file->to_end() >= MAX_SINGLE_HASH_FILE_SIZE) {
+          last_file.remove_element();
+        } else if (!hash_file_tail_parses(last.string())) {
+          std::cerr << "info: end of hash file " << last << " is torn or unknown, new hash file is used\n";
+          last_file.remove_element();
+        } else {
+          output_hash_file = last_file;
+        }
+      }
+    }
+  } else {
+    pref_file = openfile(last_file_pref.c_str(), O_WRONLY | S_IRWXU | O_CREAT);
+    soft_assert(*pref_file);
+  }
+  // new hash file is created by one session, other ones find next free name
+  while (!output_hash_file) {
+    current_file = find_free_hash_filename(current_file);
+    soft_assert(check_valid_hash_filename(current_file));
+    if (opened_fd >= max_fd) exit_error("error: limit files occurred", 10);
+    file_t file(hashes_dir / current_file, O_WRONLY | O_CREAT | O_EXCL);
+    if (file.open()) {
+      if (lock_hash_file(file)) output_hash_file = files.add(std::move(file));
+    } else if (errno != EEXIST) {
+      exit_error(wrap_ostringstream("error: can't create hash file " << current_file << ", errno: " << errno), 10);
+    }
+  }
+  if (memcmp(buf.data(), current_file.data(), current_file.size() + 1) != 0) {
+    auto trunc = pref_file->truncate();
+    soft_assert(trunc == 0);
+    pref_file->write(current_file.data(), current_file.size());
+  }
+  output_hash_id = register_hash_file(output_hash_file->path());
+  pref_file.remove_element();
+}
+
+void close_fd(deque_t<file_t>::iterator it) {
+  if (it) {
+    it.remove_element();
+  }
+}
+
+hash_file_id_t register_hash_file(const std::string& path)
+{
+  hash_file_id_t id;
+  {
+    stage_timer_t timer(STAGE_DB_FILES);
+    id = hash_index->file_id(path);
+  }
+  if (!hash_file_table) hash_file_table.emplace(hashes_dir / HASH_FILES_TABLE_FILENAME);
+  if (hash_file_table->get(id) != path) hash_file_table->set(id, path);
+  return id;
+}
+
+void forget_hash_file(hash_file_id_t id)
+{
+  if (!hash_file_table) hash_file_table.emplace(hashes_dir / HASH_FILES_TABLE_FILENAME);
+  hash_file_table->erase(id);
+}
+
+std::string hash_file_path(hash_file_id_t id)
+{
+  if (!hash_file_table) hash_file_table.emplace(hashes_dir / HASH_FILES_TABLE_FILENAME);
+  std::string path = hash_file_table->get(id);
+  if (path.empty() && !hash_file_table_synced) {
+    // store is older than table or table is lost
+    hash_file_table_synced = true;
+    std::vector<std::pair<hash_file_id_t, std::string>> registered;
+    {
+      stage_timer_t timer(STAGE_DB_FILES);
+      registered = hash_index->hash_files();
+    }
+    for (auto& [registered_id, registered_path] : registered) {
+      if (hash_file_table->get(registered_id) != registered_path) {
+        hash_file_table->set(registered_id, registered_path);
+      }
+    }
+    path = hash_file_table->get(id);
+  }
+  return path;
+}
+
+io_engine_t& store_io_engine()
+{
+  if (!io_engine) {
+    io_engine = make_io_engine(IO_ENGINE_DEPTH);
+    io_staging.resize(READED_BLOCKS * io_record_size);
+    io_engine->register_buffer(io_staging.data(), io_staging.size());
+    chunk_writer.set_engine(io_engine.get());
+    io_requests.reserve(READED_BLOCKS);
+#if (FULL_LOGGING)
+    std::cerr << "io engine: " << io_engine->name() << std::endl;
+#endif
+  }
+  return *io_engine;
+}
+
+deque_t<file_t>::iterator open_hash_file(hash_file_id_t id)
+{
+  auto it = hashes_files.find(id);
+  if (it != hashes_files.end()) return it->second;
+  const std::string path = hash_file_path(id);
+  if (path.empty()) return files.end();
+  file_t file(path, O_RDONLY);
+  if (opened_fd >= max_fd || !file.open()) {
+    std::cerr << "warn: can't open hash file " << path << "\n";
+    return files.end();
+  }
+  store_io_engine().register_file(file.fd());
+  return hashes_files.emplace(id, files.add(std::move(file))).first->second;
+}
+
+void write_record_prefix(char * prefix, size_t len, bool delta)
+{
+  const uint64_t value = len | (delta ? DELTA_RECORD_FLAG : 0);
+  for (size_t i = 0; i < BLOCK_SIZE_BYTES; i++) {
+    prefix[i] = (value >> (8 * (BLOCK_SIZE_BYTES - i - 1))) % 256;
+  }
+}
+
+size_t read_record_prefix(const char * prefix, bool * delta)
+{
+  uint64_t value = 0;
+  for (size_t i = 0; i < BLOCK_SIZE_BYTES; i++) {
+    value += ((uint64_t) (unsigned char) prefix[i] << (8 * (BLOCK_SIZE_BYTES - i - 1)));
+  }
+  *delta = (value & DELTA_RECORD_FLAG) != 0;
+  return value & ~DELTA_RECORD_FLAG;
+}
+
+size_t record_read_size(const hash_location_t& location)
+{
+  return location.len >= BLOCK_SIZE_BYTES && location.len <= io_record_size ? location.len : io_record_size;
+}
+
+char * chain_slice(size_t depth)
+{
+  if (chain_scratch.empty()) chain_scratch.resize((DELTA_MAX_DEPTH + 1) * chain_slice_size);
+  return chain_scratch.data() + depth * chain_slice_size;
+}
+
+// reads record at location to record of io_record_size, returns readed bytes or -1.
+// record is readed by its length from index, rows without it or with wrong one are readed again by io_record_size
+ssize_t read_record(const hash_location_t& location, char * record)
+{
+  auto it = open_hash_file(location.file);
+  if (!it) return -1;
+  stage_timer_t timer(STAGE_CHUNK_READ);
+  const size_t size = record_read_size(location);
+  ssize_t readed = pread(it->fd(), record, size, location.pos);
+  if (readed < (ssize_t) BLOCK_SIZE_BYTES) return -1;
+  bool delta;
+  if (size < io_record_size && BLOCK_SIZE_BYTES + read_record_prefix(record, &delta) > (size_t) readed) {
+    readed = pread(it->fd(), record, io_record_size, location.pos);
+  }
+  return readed < (ssize_t) BLOCK_SIZE_BYTES ? -1 : readed;
+}
+
+// reads record of found block to record of io_record_size, returns readed bytes or -1
+ssize_t read_hash_record(const char * hex, char * record)
+{
+  hash_location_t location;
+  {
+    stage_timer_t timer(STAGE_DB_LOOKUP);
+    if (!hash_index->find(hex, &location)) return -1;
+  }
+  return read_record(location, record);
+}
+
+ssize_t read_located_block(const hash_location_t& location, char * block)
+{
+  char * record = chain_slice(0);
+  const ssize_t readed = read_record(location, record);
+  if (readed < 0) return -1;
+  bool delta;
+  const size_t len = read_record_prefix(record, &delta);
+  if (BLOCK_SIZE_BYTES + len > (size_t) readed) return -1;
+  return resolve_record(record + BLOCK_SIZE_BYTES, len, delta, block);
+}
+
+ssize_t read_stored_block(const char * hex, char * block)
+{
+  hash_location_t location;
+  {
+    stage_timer_t timer(STAGE_DB_LOOKUP);
+    if (!hash_index->find(hex, &location)) return -1;
+  }
+  return read_located_block(location, block);
+}
+
+ssize_t resolve_record_chain(const char * data, size_t len, bool delta, char * out, size_t depth, size_t * chain)
+{
+  if (!delta) {
+    if (len > HASHING_BLOCK_SIZE) return -1;
+    memcpy(out, data, len);
+    *chain = depth;
+    return len;
+  }
+  if (depth == DELTA_MAX_DEPTH || len < BYTES_HASH) return -1;
+  char hex[HASH_HEX_BYTES + 1] = {};
+  to_my_hex(hex, (const unsigned char *) data, BYTES_HASH);
+  char * record = chain_slice(depth + 1);
+  const ssize_t readed = read_hash_record(hex, record);
+  if (readed < 0) return -1;
+  bool base_delta;
+  const size_t base_len = read_record_prefix(record, &base_delta);
+  if (BLOCK_SIZE_BYTES + base_len > (size_t) readed) return -1;
+  char * base = record + io_record_size;
+  const ssize_t base_size = resolve_record_chain(record + BLOCK_SIZE_BYTES, base_len, base_delta, base,
+                                                 depth + 1, chain);
+  if (base_size < 0) return -1;
+  return delta_decode(base, base_size, data + BYTES_HASH, len - BYTES_HASH, out, HASHING_BLOCK_SIZE);
+}
+
+ssize_t resolve_record(const char * data, size_t len, bool delta, char * out, size_t * chain)
+{
+  size_t depth = 0;
+  return resolve_record_chain(data, len, delta, out, 0, chain ? chain : &depth);
+}
+
+std::vector<sketch_slot_t>& sketches()
+{
+  if (sketch_index.empty()) {
+    sketch_index.resize(DELTA_SKETCH_SLOTS);
+    const auto path = hashes_dir / SKETCH_INDEX_FILENAME;
+    if (std::filesystem::exists(path)) {
+      file_t file(path, O_RDONLY);
+      const size_t size = sketch_index.size() * sizeof(sketch_slot_t);
+      if (!file.open() || file.read((char *) sketch_index.data(), size) != (ssize_t) size) {
+        std::cerr << "warn: can't read " << path << ", similar blocks are searched from scratch\n";
+        std::fill(sketch_index.begin(), sketch_index.end(), sketch_slot_t {});
+      }
+    }
+  }
+  return sketch_index;
+}
+
+void add_sketch(const sketch_t& sketch, const unsigned char * raw)
+{
+  auto& slots = sketches();
+  for (uint64_t super_feature : sketch.super_features) {
+    sketch_slot_t& slot = slots[super_feature % slots.size()];
+    slot.super_feature = super_feature;
+    memcpy(slot.raw, raw, BYTES_HASH);
+  }
+  sketch_index_dirty = true;
+}
+
+void save_sketch_index()
+{
+  if (!sketch_index_dirty) return;
+  const auto path = hashes_dir / SKETCH_INDEX_FILENAME;
+  const auto tmp = hashes_dir / (SKETCH_INDEX_FILENAME ".tmp");
+  {
+    file_t file(tmp, O_WRONLY | O_CREAT | O_TRUNC);
+    const size_t size = sketch_index.size() * sizeof(sketch_slot_t);
+    if (!file.open() || file.write((const char *) sketch_index.data(), size) != (ssize_t) size) {
+      std::cerr << "warn: can't write " << tmp << ", errno: " << errno << "\n";
+      return;
+    }
+  }
+  std::error_code error;
+  std::filesystem::rename(tmp, path, error);
+  if (error) std::cerr << "warn: can't replace " << path << ": " << error.message() << "\n";
+  sketch_index_dirty = false;
+}
+
+// writes base hash and delta of block against stored block with common super-feature,
+// returns written size or 0 if there is no base or delta doesn't save enough
+size_t encode_delta_record(const char * block, size_t len, const sketch_t& sketch, char * out)
+{
+  auto& slots = sketches();
+  char hex[HASH_HEX_BYTES + 1] = {};
+  char * record = chain_slice(0);
+  char * base = record + io_record_size;
+  for (uint64_t super_feature : sketch.super_features) {
+    const sketch_slot_t& slot = slots[super_feature % slots.size()];
+    if (slot.super_feature != super_feature) continue;
+    to_my_hex(hex, slot.raw, BYTES_HASH);
+    const ssize_t readed = read_hash_record(hex, record);
+    if (readed < 0) continue;
+    bool base_delta;
+    const size_t base_len = read_record_prefix(record, &base_delta);
+    if (BLOCK_SIZE_BYTES + base_len > (size_t) readed) continue;
+    size_t chain = 0;
+    const ssize_t base_size = resolve_record(record + BLOCK_SIZE_BYTES, base_len, base_delta, base, &chain);
+    if (base_size < 0 || chain + 1 > DELTA_MAX_DEPTH) continue;
+    const size_t ops = delta_encoder.encode(base, base_size, block, len, out + BYTES_HASH,
+                                            len - BYTES_HASH - DELTA_MIN_SAVING);
+    if (ops == 0) continue;
+    memcpy(out, slot.raw, BYTES_HASH);
+    return BYTES_HASH + ops;
+  }
+  return 0;
+}
+
+bool is_zero_block(const unsigned char * data, size_t len)
+{
+  return len > 0 && data[0] == 0 && memcmp(data, data + 1, len - 1) == 0;
+}
+
+void write_zero_run_entry(unsigned char * entry, uint64_t length)
+{
+  memcpy(entry, ZERO_RUN_ENTRY_MAGIC, ZERO_RUN_ENTRY_MAGIC_BYTES);
+  for (size_t i = 0; i < sizeof(length); i++) {
+    entry[ZERO_RUN_ENTRY_MAGIC_BYTES + i] = (length >> (8 * (sizeof(length) - i - 1))) % 256;
+  }
+}
+
+bool read_zero_run_entry(const unsigned char * entry, uint64_t * length)
+{
+  if (memcmp(entry, ZERO_RUN_ENTRY_MAGIC, ZERO_RUN_ENTRY_MAGIC_BYTES) != 0) return false;
+  *length = 0;
+  for (size_t i = 0; i < sizeof(*length); i++) {
+    *length = (*length << 8) | entry[ZERO_RUN_ENTRY_MAGIC_BYTES + i];
+  }
+  return true;
+}
+
+// appends of chunk_writer go to end of output hash file
+void attach_chunk_writer()
+{
+  if (!output_hash_file) {
+    exit_error("error: file struct destroyed", 10);
+  }
+  if (!(*output_hash_file)) {
+    if (!(output_hash_file->open())) {
+      exit_error(wrap_ostringstream("error: cann't open file " << output_hash_file->path()), 10);
+    }
+    if (!lock_hash_file(*output_hash_file)) {
+      exit_error(wrap_ostringstream("error: hash file " << output_hash_file->path() << " is appended by other session"), 10);
+    }
+  }
+  store_io_engine();
+  if (chunk_writer.fd() != output_hash_file->fd()) {
+    chunk_writer.attach(output_hash_file->fd(), output_hash_file->to_end());
+  }
+}
+
+// fills champions by votes of hooks of segment found in hook index, not found hooks are new_hooks
+void find_champions(const unsigned char * hash_raw)
+{
+  segment_hooks.clear();
+  for (size_t i = 0; i < segment_order.size(); i++) {
+    const unsigned char * raw = hash_raw + (size_t) segment_order[i] * BYTES_HASH;
+    if (i > 0 && !memcmp(raw, hash_raw + (size_t) segment_order[i - 1] * BYTES_HASH, BYTES_HASH)) continue;
+    if (is_hook(raw)) segment_hooks.push_back(segment_order[i]);
+  }
+  champion_votes.clear();
+  new_hooks.clear();
+  for (size_t begin = 0; begin < segment_hooks.size(); begin += SELECT_MANY_HASHES_COUNT) {
+    const size_t count = std::min<size_t>(segment_hooks.size() - begin, SELECT_MANY_HASHES_COUNT);
+    hook_hexes.resize(count * HASH_HEX_BYTES);
+    for (size_t i = 0; i < count; i++) {
+      memcpy(hook_hexes.data() + i * HASH_HEX_BYTES, buffer_hex.data() + (size_t) segment_hooks[begin + i] * HASH_HEX_BYTES,
+             HASH_HEX_BYTES);
+    }
+    hook_index->find_many(hook_hexes.data(), count, hooks_found.get(), hook_locations.data());
+    for (size_t i = 0; i < count; i++) {
+      const uint32_t entry = segment_hooks[begin + i];
+      if (!hooks_found[i]) {
+        new_hooks.push_back(entry);
+        continue;
+      }
+      auto vote = std::find_if(champion_votes.begin(), champion_votes.end(),
+                               [&](const auto& vote) { return vote.first == hook_locations[i].pos; });
+      if (vote == champion_votes.end()) {
+        champion_votes.emplace_back(hook_locations[i].pos, 1);
+      } else {
+        vote->second++;
+      }
+    }
+  }
+  std::sort(champion_votes.begin(), champion_votes.end(), [](const auto& a, const auto& b) {
+    return a.second > b.second || (a.second == b.second && a.first > b.first);
+  });
+  champions.clear();
+  for (size_t i = 0; i < champion_votes.size() && champions.size() < SPARSE_CHAMPIONS; i++) {
+    const manifest_t * manifest = manifest_log.load(champion_votes[i].first);
+    if (manifest) {
+      champions.push_back(manifest);
+    } else {
+      std::cerr << "warn: manifest at " << champion_votes[i].first << " of " SPARSE_MANIFESTS_FILENAME " not readed\n";
+    }
+  }
+}
+
+// blocks of segment are deduplicated against previous version, previous segment and champions,
+// locations of all entries are appended to locations sidecar
+void save_sparse_segment(const unsigned char * inbuf, size_t buflen, size_t entries)
+{
+  soft_assert(locations_file && hook_index);
+  const unsigned char * hash_raw = buffer_raw.data();
+  auto raw = [hash_raw](uint32_t entry) { return hash_raw + (size_t) entry * BYTES_HASH; };
+  // true if i-th sorted entry has digest of previous one
+  auto repeated = [&](size_t i) { return i > 0 && !memcmp(raw(segment_order[i]), raw(segment_order[i - 1]), BYTES_HASH); };
+  uint64_t run_length;
+  segment_order.clear();
+  for (uint32_t entry = 0; entry < entries; entry++) {
+    if (!read_zero_run_entry(raw(entry), &run_length)) segment_order.push_back(entry);
+  }
+  segment_sorter.sort(hash_raw, segment_order.data(), segment_order.size());
+  {
+    stage_timer_t timer(STAGE_DB_LOOKUP);
+    find_champions(hash_raw);
+  }
+  // first entry of digest owns it and stores block if digest isn't found
+  constexpr uint32_t found_owner = UINT32_MAX;
+  segment_owners.resize(entries);
+  segment_locations.resize(entries);
+  for (size_t i = 0; i < segment_order.size(); i++) {
+    const uint32_t entry = segment_order[i];
+    if (repeated(i)) {
+      segment_owners[entry] = segment_owners[segment_order[i - 1]];
+      segment_locations[entry] = segment_locations[segment_order[i - 1]];
+      continue;
+    }
+    hash_location_t& location = segment_locations[entry];
+    bool found = find_in_manifest(previous_version_manifest, raw(entry), &location);
+    if (found) {
+      stats_add(COUNTER_PREVIOUS_CHUNKS);
+    } else {
+      found = find_in_manifest(previous_segment, raw(entry), &location);
+    }
+    for (size_t champion = 0; !found && champion < champions.size(); champion++) {
+      found = find_in_manifest(*champions[champion], raw(entry), &location);
+    }
+    segment_owners[entry] = found ? found_owner : entry;
+  }
+  size_t bufpos = 0;
+  for (uint32_t entry = 0; entry < entries; entry++) {
+    const size_t hashing_bytes = buffer_lens[entry];
+    if (offsets_writer) offsets_writer->add(hashing_bytes);
+    hash_location_t location = { 0, 0, 0 };
+    if (!read_zero_run_entry(raw(entry), &run_length)) {
+      const uint32_t owner = segment_owners[entry];
+      if (owner == entry) {
+        stage_timer_t timer(STAGE_CHUNK_APPEND);
+        char * record = chunk_writer.reserve(BLOCK_SIZE_BYTES + hashing_bytes);
+        write_record_prefix(record, hashing_bytes, false);
+        memcpy(record + BLOCK_SIZE_BYTES, inbuf + bufpos, hashing_bytes);
+        segment_locations[entry] = { output_hash_id, (uint32_t) (BLOCK_SIZE_BYTES + hashing_bytes), chunk_writer.offset() };
+        chunk_writer.commit(BLOCK_SIZE_BYTES + hashing_bytes);
+        stats_add(COUNTER_BYTES_STORED, BLOCK_SIZE_BYTES + hashing_bytes);
+      } else if (owner != found_owner) {
+        segment_locations[entry] = segment_locations[owner];
+      }
+      location = segment_locations[entry];
+      stats_add(owner == entry ? COUNTER_UNIQUE_CHUNKS : COUNTER_DUPLICATE_CHUNKS);
+    }
+    if (trace_recording) {
+      if (location.file == 0) {
+        trace_zero_run(hashing_bytes);
+      } else {
+        const uint32_t owner = segment_owners[entry];
+        trace_chunk(raw(entry), hashing_bytes, owner == entry ? TRACE_STORED : owner == found_owner ? TRACE_INDEXED : TRACE_BATCH);
+      }
+    }
+    locations_writer.append((const char *) &location, sizeof(location));
+    bufpos += hashing_bytes;
+  }
+  soft_assert(bufpos == buflen);
+  segment_manifest.clear();
+  for (size_t i = 0; i < segment_order.size(); i++) {
+    if (repeated(i)) continue;
+    segment_manifest.emplace_back();
+    memcpy(segment_manifest.back().raw, raw(segment_order[i]), BYTES_HASH);
+    segment_manifest.back().location = segment_locations[segment_order[i]];
+  }
+  // manifest is found only by its own hooks
+  if (!new_hooks.empty()) {
+    const off_t offset = manifest_log.append(segment_manifest);
+    stage_timer_t timer(STAGE_DB_INSERT);
+    for (uint32_t entry : new_hooks) {
+      hook_index->insert(buffer_hex.data() + (size_t) entry * HASH_HEX_BYTES, 0, offset, 0);
+    }
+    stats_add(COUNTER_SPARSE_HOOKS, new_hooks.size());
+  }
+  previous_segment.swap(segment_manifest);
+}
+
+// fills buffer_indexed of entries by one exists_many per SELECT_MANY_HASHES_COUNT of their new digests
+void lookup_buffer(const unsigned char * hash_raw, const char * hex, size_t entries)
+{
+  buffer_indexed.assign(entries, 0);
+  lookup_entries.clear();
+  lookup_digests.clear();
+  uint64_t run_length;
+  for (size_t i = 0; i < entries; i++) {
+    const unsigned char * entry = hash_raw + i * BYTES_HASH;
+    if (read_zero_run_entry(entry, &run_length) || batch_hashes.contains(entry) || !lookup_digests.insert(entry)) {
+      continue;
+    }
+    lookup_entries.push_back(i);
+  }
+  stage_timer_t timer(STAGE_DB_LOOKUP);
+  for (size_t begin = 0; begin < lookup_entries.size(); begin += SELECT_MANY_HASHES_COUNT) {
+    const size_t count = std::min<size_t>(lookup_entries.size() - begin, SELECT_MANY_HASHES_COUNT);
+    lookup_hexes.resize(count * HASH_HEX_BYTES);
+    for (size_t i = 0; i < count; i++) {
+      memcpy(lookup_hexes.data() + i * HASH_HEX_BYTES, hex + lookup_entries[begin + i] * HASH_HEX_BYTES,
+             HASH_HEX_BYTES);
+    }
+    hash_index->exists_many(lookup_hexes.data(), count, lookup_found.get());
+    for (size_t i = 0; i < count; i++) {
+      buffer_indexed[lookup_entries[begin + i]] = lookup_found[i];
+    }
+  }
+}
+
+size_t save_buffer(const unsigned char * inbuf, size_t buflen) {
+  size_t max = buflen / HASHING_BLOCK_SIZE;
+  if ((buflen % HASHING_BLOCK_SIZE) > 0) max++;
+  std::vector<unsigned char>& hash_raw = buffer_raw;
+  hash_raw.resize(max * BYTES_HASH);
+  std::vector<size_t>& lens = buffer_lens;
+  lens.resize(max);
+  stats_add(COUNTER_BYTES_INGESTED, buflen);
+  if (trace_recording) trace_buffer(buflen);
+  // consecutive zero blocks are one zero run entry, they aren't hashed and indexed
+  size_t entries = 0;
+  bool zero_run = false;
+  std::optional<stage_timer_t> hashing_timer(STAGE_HASHING);
+  for (size_t delta = 0; delta < buflen; delta += HASHING_BLOCK_SIZE) {
+    const size_t hashing_bytes = std::min<size_t>(buflen - delta, HASHING_BLOCK_SIZE);
+    if (is_zero_block(inbuf + delta, hashing_bytes)) {
+      if (!zero_run) lens[entries++] = 0;
+      lens[entries - 1] += hashing_bytes;
+      zero_run = true;
+      stats_add(COUNTER_BYTES_ZERO, hashing_bytes);
+      continue;
+    }
+    if (zero_run) write_zero_run_entry(hash_raw.data() + (entries - 1) * BYTES_HASH, lens[entries - 1]);
+    zero_run = false;
+#if (HASH_BITS == 256)
+    SHA256(inbuf + delta, hashing_bytes, hash_raw.data() + entries * BYTES_HASH);
+#elif
+#error "unknown algoritm"
+#endif
+    lens[entries++] = hashing_bytes;
+  }
+  if (zero_run) write_zero_run_entry(hash_raw.data() + (entries - 1) * BYTES_HASH, lens[entries - 1]);
+  std::string& hex = buffer_hex;
+  hex.resize(entries * HASH_HEX_BYTES);
+  to_my_hex(hex.data(), hash_raw.data(), entries * BYTES_HASH);
+  hashing_timer.reset();
+  attach_chunk_writer();
+  if (recipe_writer.fd() != requested_file->fd()) {
+    recipe_writer.attach(requested_file->fd(), requested_file->to_end());
+  }
+  {
+    stage_timer_t timer(STAGE_RECIPE_WRITE);
+    recipe_writer.append((const char *) hash_raw.data(), entries * BYTES_HASH);
+  }
+  stats_add(COUNTER_BYTES_RECIPE, entries * BYTES_HASH);
+  if (sparse_index) {
+    save_sparse_segment(inbuf, buflen, entries);
+    // hooks are found by next segment, their manifest is flushed by load
+    if (!batch_inserts) {
+      flush_saved_hashes();
+    } else {
+      stage_timer_t timer(STAGE_DB_INSERT);
+      hook_index->flush_inserts();
+    }
+    return buflen;
+  }
+  lookup_buffer(hash_raw.data(), hex.data(), entries);
+  size_t bufpos = 0;
+  uint64_t run_length;
+  for (size_t current = 0; current < entries; current++) {
+    const size_t hashing_bytes = lens[current];
+    if (offsets_writer) offsets_writer->add(hashing_bytes);
+    if (read_zero_run_entry(hash_raw.data() + current * BYTES_HASH, &run_length)) {
+      if (trace_recording) trace_zero_run(hashing_bytes);
+      bufpos += hashing_bytes;
+      continue;
+    }
+    const char * current_hex = hex.data() + HASH_HEX_BYTES * current;
+    bool duplicate = true;
+    trace_outcome_t outcome = TRACE_BATCH;
+    if (batch_hashes.insert(hash_raw.data() + current * BYTES_HASH)) {
+      const bool exists = buffer_indexed[current];
+      outcome = TRACE_INDEXED;
+      if (exists && previous_version.size() > 0 && previous_version.contains(hash_raw.data() + current * BYTES_HASH)) {
+        outcome = TRACE_PREVIOUS;
+        stats_add(COUNTER_PREVIOUS_CHUNKS);
+      }
+      if (!exists) {
+        duplicate = false;
+        outcome = TRACE_STORED;
+        const char * block = (const char *) inbuf + bufpos;
+        sketch_t sketch;
+        size_t delta_len = 0;
+        if (delta_compression && hashing_bytes > BYTES_HASH + DELTA_MIN_SAVING) {
+          stage_timer_t timer(STAGE_DELTA);
+          compute_sketch(block, hashing_bytes, &sketch);
+          delta_len = encode_delta_record(block, hashing_bytes, sketch, delta_record.data());
+        }
+        stage_timer_t timer(STAGE_CHUNK_APPEND);
+        const size_t data_len = delta_len ? delta_len : hashing_bytes;
+        char * record = chunk_writer.reserve(BLOCK_SIZE_BYTES + data_len);
+        write_record_prefix(record, data_len, delta_len > 0);
+        memcpy(record + BLOCK_SIZE_BYTES, delta_len ? delta_record.data() : block, data_len);
+        hash_index->insert(current_hex, output_hash_id, chunk_writer.offset(), BLOCK_SIZE_BYTES + data_len);
+        chunk_writer.commit(BLOCK_SIZE_BYTES + data_len);
+        stats_add(COUNTER_BYTES_STORED, BLOCK_SIZE_BYTES + data_len);
+        if (delta_len) {
+          outcome = TRACE_DELTA;
+          stats_add(COUNTER_DELTA_CHUNKS);
+        } else if (delta_compression && hashing_bytes > BYTES_HASH + DELTA_MIN_SAVING) {
+          add_sketch(sketch, hash_raw.data() + current * BYTES_HASH);
+        }
+      }
+    }
+    stats_add(duplicate ? COUNTER_DUPLICATE_CHUNKS : COUNTER_UNIQUE_CHUNKS);
+    if (trace_recording) trace_chunk(hash_raw.data() + current * BYTES_HASH, hashing_bytes, outcome);
+    bufpos += hashing_bytes;
+  }
+  soft_assert(bufpos == buflen);
+  if (!batch_inserts || batch_hashes.size() >= INSERT_MANY_HASHES_COUNT) {
+    flush_saved_hashes();
+  }
+  return bufpos;
+}
+
+bool store_received_block(const unsigned char * raw, const char * data, size_t len)
+{
+  if (len == 0 || len > HASHING_BLOCK_SIZE) return false;
+  unsigned char digest[BYTES_HASH];
+  {
+    stage_timer_t timer(STAGE_HASHING);
+#if (HASH_BITS == 256)
+    SHA256((const unsigned char *) data, len, digest);
+#else
+#error "unknown algoritm"
+#endif
+  }
+  if (memcmp(digest, raw, BYTES_HASH) != 0) return false;
+  attach_chunk_writer();
+  char hex[HASH_HEX_BYTES];
+  to_my_hex(hex, raw, BYTES_HASH);
+  stage_timer_t timer(STAGE_CHUNK_APPEND);
+  char * record = chunk_writer.reserve(BLOCK_SIZE_BYTES + len);
+  write_record_prefix(record, len, false);
+  memcpy(record + BLOCK_SIZE_BYTES, data, len);
+  hash_index->insert(hex, output_hash_id, chunk_writer.offset(), BLOCK_SIZE_BYTES + len);
+  chunk_writer.commit(BLOCK_SIZE_BYTES + len);
+  stats_add(COUNTER_BYTES_STORED, BLOCK_SIZE_BYTES + len);
+  stats_add(COUNTER_UNIQUE_CHUNKS);
+  return true;
+}
+
+void flush_saved_hashes()
+{
+  // chunks are written before index refers them, manifests are written by append
+  {
+    stage_timer_t timer(STAGE_CHUNK_APPEND);
+    chunk_writer.flush();
+  }
+  {
+    stage_timer_t timer(STAGE_DB_INSERT);
+    hash_index->flush_inserts();
+    if (hook_index) hook_index->flush_inserts();
+  }
+  batch_hashes.clear();
+}
+
+void rotate_output_hash_file()
+{
+  soft_assert(output_hash_file);
+  const off_t size = chunk_writer.fd() == output_hash_file->fd() ? chunk_writer.offset() : output_hash_file->to_end();
+  if (size < MAX_SINGLE_HASH_FILE_SIZE) return;
+  if (chunk_writer.fd() == output_hash_file->fd()) {
+    chunk_writer.flush();
+    save_hash_file_end();
+    chunk_writer.detach();
+  }
+  if (commit_groups) group_closed_files.push_back(output_hash_file->path());
+  output_hash_file.remove_element();
+  output_hash_file = {};
+  open_output_hash_file();
+}
+
+void sync_store_file(file_t& file)
+{
+  if (file.sync() != 0) {
+    exit_error(wrap_ostringstream("error: can't sync " << file.path() << ", errno: " << errno), 10);
+  }
+}
+
+void begin_commit_groups()
+{
+  commit_groups = true;
+  batch_inserts = true;
+  group_start_bytes = stats_counter(COUNTER_BYTES_INGESTED);
+  group_start = std::chrono::steady_clock::now();
+  stage_timer_t timer(STAGE_DB_COMMIT);
+  hash_index->begin_batch();
+}
+
+// index rows of group are committed only after data they refer is on disk
+void commit_group(bool next)
+{
+  {
+    stage_timer_t timer(STAGE_CHUNK_APPEND);
+    chunk_writer.flush();
+  }
+  {
+    stage_timer_t timer(STAGE_RECIPE_WRITE);
+    recipe_writer.flush();
+    locations_writer.flush();
+  }
+  if (commit_options.durability == DURABILITY_GROUP) {
+    stage_timer_t timer(STAGE_SYNC);
+    // new files are durable when their directory entries are
+    std::set<std::filesystem::path> dirs = { hashes_dir };
+    if (output_hash_file && *output_hash_file) sync_store_file(*output_hash_file);
+    if (requested_file && *requested_file) {
+      sync_store_file(*requested_file);
+      dirs.insert(std::filesystem::path(requested_file->path()).parent_path());
+    }
+    if (locations_file && *locations_file) {
+      sync_store_file(*locations_file);
+      dirs.insert(std::filesystem::path(locations_file->path()).parent_path());
+    }
+    if (sparse_index) sync_store_file(manifest_log.file());
+    for (const auto& path : group_closed_files) {
+      file_t file(path, O_RDONLY);
+      if (!file.open()) {
+        exit_error(wrap_ostringstream("error: can't open " << path << " for sync, errno: " << errno), 10);
+      }
+      sync_store_file(file);
+      dirs.insert(path.parent_path());
+    }
+    for (const auto& dir : dirs) {
+      file_t file(dir, O_RDONLY | O_DIRECTORY);
+      if (file.open()) sync_store_file(file);
+    }
+  }
+  group_closed_files.clear();
+  flush_saved_hashes();
+  save_hash_file_end();
+  {
+    stage_timer_t timer(STAGE_DB_COMMIT);
+    hash_index->commit_batch();
+    if (next) hash_index->begin_batch();
+  }
+  stats_add(COUNTER_COMMIT_GROUPS);
+  group_start_bytes = stats_counter(COUNTER_BYTES_INGESTED);
+  group_start = std::chrono::steady_clock::now();
+}
+
+void check_commit_group()
+{
+  if (!commit_groups) return;
+  const std::chrono::duration<double> age = std::chrono::steady_clock::now() - group_start;
+  if (stats_counter(COUNTER_BYTES_INGESTED) - group_start_bytes >= commit_options.group_bytes
+      || age.count() >= commit_options.group_seconds) {
+    commit_group(true);
+  }
+}
+
+void end_commit_groups()
+{
+  if (!commit_groups) return;
+  commit_group(false);
+  commit_groups = false;
+  batch_inserts = false;
+}
+
+// returned filled buf size; nhashes - in max hashes in hashes arr, out - used hashes for buffer filling
+size_t fill_buffer_from_hashes(char * buf, size_t bufsize, const char * hashes_arr, size_t *nhashes,
+                               const hash_location_t * locations)
+{
+  soft_assert(buf && hashes_arr && nhashes);
+  if (*nhashes == 0 || bufsize < (HASHING_BLOCK_SIZE))
+    return 0;
+  io_engine_t& engine = store_io_engine();
+  // each block fits to HASHING_BLOCK_SIZE, so all taken blocks fit to buf
+  size_t all_hashes = std::min<size_t>({ *nhashes, bufsize / HASHING_BLOCK_SIZE, READED_BLOCKS });
+  char hash_hex[HASH_HEX_BYTES + 1] = {};
+  hash_location_t location;
+  uint64_t run_length;
+  // requests of found blocks are read with many in flight, slot of block in io_staging is its number
+  io_requests.clear();
+  for (size_t current = 0; current < all_hashes; current++) {
+    if (read_zero_run_entry((const unsigned char *) hashes_arr + current * BYTES_HASH, &run_length)) {
+      all_hashes = current;
+      break;
+    }
+  }
+  if (!locations) {
+    fill_hexes.resize(all_hashes * HASH_HEX_BYTES);
+    to_my_hex(fill_hexes.data(), (const unsigned char *) hashes_arr, all_hashes * BYTES_HASH);
+    stage_timer_t timer(STAGE_DB_LOOKUP);
+    for (size_t begin = 0; begin < all_hashes; begin += SELECT_MANY_HASHES_COUNT) {
+      hash_index->find_many(fill_hexes.data() + begin * HASH_HEX_BYTES,
+                            std::min<size_t>(all_hashes - begin, SELECT_MANY_HASHES_COUNT),
+                            fill_found.get() + begin, fill_found_locations.data() + begin);
+    }
+  }
+  for (size_t current = 0; current < all_hashes; current++) {
+    bool found;
+    if (locations) {
+      location = locations[current];
+      found = location.file != 0;
+    } else {
+      location = fill_found_locations[current];
+      found = fill_found[current];
+    }
+    if (found) {
+      auto it = open_hash_file(location.file);
+      if (it) {
+        io_requests.push_back({ it->fd(), io_staging.data() + current * io_record_size, record_read_size(location),
+                                (off_t) location.pos, false, 0 });
+        fill_locations[io_requests.size() - 1] = location;
+        if (is_near_read(last_read, location)) stats_add(COUNTER_NEAR_READS);
+        last_read = location;
+      }
+    }
+  }
+  {
+    stage_timer_t timer(STAGE_CHUNK_READ);
+    engine.run(io_requests.data(), io_requests.size());
+  }
+  size_t outpos = 0;
+  size_t next_request = 0;
+  if (trace_recording) trace_fill(all_hashes);
+  for (size_t current = 0; current < all_hashes; current++) {
+    const unsigned char * raw = (const unsigned char *) hashes_arr + current * BYTES_HASH;
+    const size_t block_pos = outpos;
+    if (next_request == io_requests.size()
+        || io_requests[next_request].buf != io_staging.data() + current * io_record_size) {
+      to_my_hex(hash_hex, raw, BYTES_HASH);
+      stats_add(COUNTER_MISSING_CHUNKS);
+      std::cerr << "warn: block \'" << hash_hex << "\' not found, replace by \'x\' symbols\n";
+      strset(buf + outpos, 'x', HASHING_BLOCK_SIZE);
+      outpos += HASHING_BLOCK_SIZE;
+      if (trace_recording) trace_read(raw, HASHING_BLOCK_SIZE, nullptr);
+      continue;
+    }
+    const hash_location_t& request_location = fill_locations[next_request];
+    io_request_t& request = io_requests[next_request++];
+    soft_assert(request.result >= BLOCK_SIZE_BYTES);
+    bool delta;
+    size_t block_len = read_record_prefix(request.buf, &delta);
+    if (BLOCK_SIZE_BYTES + block_len > (size_t) request.result && request.len < io_record_size) {
+      // length of record isn't known by location or is wrong
+      stage_timer_t timer(STAGE_CHUNK_READ);
+      request.result = std::max<ssize_t>(pread(request.fd, request.buf, io_record_size, request.pos), BLOCK_SIZE_BYTES);
+    }
+#if (FULL_LOGGING)
+    std::cerr << "block size: " << block_len << (delta ? ", delta" : "") << std::endl;
+#endif
+    if (delta) {
+      ssize_t resolved = -1;
+      if (BLOCK_SIZE_BYTES + block_len <= (size_t) request.result) {
+        stage_timer_t timer(STAGE_DELTA);
+        resolved = resolve_record(request.buf + BLOCK_SIZE_BYTES, block_len, true, buf + outpos);
+      }
+      if (resolved < 0) {
+        to_my_hex(hash_hex, raw, BYTES_HASH);
+        stats_add(COUNTER_MISSING_CHUNKS);
+        std::cerr << "warn: base of block \'" << hash_hex << "\' not resolved, replace by \'x\' symbols\n";
+        strset(buf + outpos, 'x', HASHING_BLOCK_SIZE);
+        resolved = HASHING_BLOCK_SIZE;
+      }
+      outpos += resolved;
+    } else {
+      ssize_t readed = std::min<ssize_t>(request.result - BLOCK_SIZE_BYTES, block_len);
+      memcpy(buf + outpos, request.buf + BLOCK_SIZE_BYTES, readed);
+      if (readed < (ssize_t) block_len) {
+        std::cerr << "warn: reading block error, unreaded symbols replaced to \'x\'.\n";
+        strset(buf + outpos + readed, 'x', block_len - readed);
+      }
+      outpos += block_len;
+    }
+    if (trace_recording) trace_read(raw, outpos - block_pos, &request_location);
+  }
+#if (FULL_LOGGING)
+  std::cerr << "hashes readed: " << all_hashes << std::endl;
+#endif
+  *nhashes = all_hashes;
+  stats_add(COUNTER_BYTES_RESTORED, outpos);
+  return outpos;
+}
+
+void init_store_dirs(const std::filesystem::path& files_path, const std::filesystem::path& hashes_path,
+                     const std::filesystem::path& offsets_path)
+{
+  files_dir = files_path;
+  if (!std::filesystem::exists(files_dir)) {
+    if (!std::filesystem::create_directories(files_dir)) {
+      exit_error(wrap_ostringstream("error: can't create directory \"" << files_dir << "\""), 9);
+    }
+  }
+
+  hashes_dir = hashes_path;
+  if (!std::filesystem::exists(hashes_dir)) {
+    if (!std::filesystem::create_directories(hashes_dir)) {
+      exit_error(wrap_ostringstream("error: can't create directory \"" << hashes_dir << "\""), 9);
+    }
+  }
+
+  offsets_dir = offsets_path;
+  if (!std::filesystem::exists(offsets_dir)) {
+    if (!std::filesystem::create_directories(offsets_dir)) {
+      exit_error(wrap_ostringstream("error: can't create directory \"" << offsets_dir << "\""), 9);
+    }
+  }
+}
+
+void lock_store()
+{
+  if (store_lock_fd < 0) store_lock_fd = open(hashes_dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (store_lock_fd < 0) {
+    exit_error(wrap_ostringstream("error: can't open " << hashes_dir << " for locking, errno: " << errno), 9);
+  }
+  if (flock(store_lock_fd, LOCK_SH | LOCK_NB) == 0) return;
+  std::cerr << "info: waiting for compaction to finish\n";
+  if (handle_eintr(flock, store_lock_fd, LOCK_SH) != 0) {
+    exit_error(wrap_ostringstream("error: can't lock " << hashes_dir << ", errno: " << errno), 9);
+  }
+}
+
+// conversion of flock isn't atomic, so two compactions waiting at once don't deadlock
+void wait_store_sessions()
+{
+  if (flock(store_lock_fd, LOCK_EX | LOCK_NB) != 0) {
+    std::cerr << "info: waiting for other sessions of store to finish\n";
+    if (handle_eintr(flock, store_lock_fd, LOCK_EX) != 0) {
+      exit_error(wrap_ostringstream("error: can't lock " << hashes_dir << ", errno: " << errno), 9);
+    }
+  }
+  if (handle_eintr(flock, store_lock_fd, LOCK_SH) != 0) {
+    exit_error(wrap_ostringstream("error: can't lock " << hashes_dir << ", errno: " << errno), 9);
+  }
+}
+
+std::filesystem::path offset_index_path(const std::filesystem::path& file)
+{
+  return offsets_dir / file.lexically_relative(files_dir);
+}
+
+std::filesystem::path locations_path(const std::filesystem::path& file)
+{
+  return offsets_dir / LOCATIONS_DIRECTORY / file.lexically_relative(files_dir);
+}
+
+PGconn* connect_db(const std::string& conninfo)
+{
+  PGconn* conn = PQconnectdb(conninfo.data());
+  if (PQstatus(conn) != CONNECTION_OK) {
+    const std::string message = PQerrorMessage(conn);
+    const auto status = PQstatus(conn);
+    PQfinish(conn);
+    exit_error(wrap_ostringstream("Connection failed: " << message << "\nstatus = " << status), -2);
+  }
+#if (!__RELEASE)
+  PQsetNoticeProcessor(conn, noNoticeProcessor, nullptr);
+#endif
+  return conn;
+}
+
+void exec_create(PGconn* conn, const std::string& request, const char * error_prefix)
+{
+  PGresult* res = PQexec(conn, request.c_str());
+  exec_conn(res, PGRES_COMMAND_OK, error_prefix);
+  PQclear(res);
+}
+
+void create_hash_table(PGconn* conn, const std::string& table, const char * error_prefix)
+{
+  exec_create(conn, hash_table_query(CREATE_HASH_TABLE, table), error_prefix);
+  PGresult* res = PQexec(conn, hash_table_query(SELECT_HASH_TABLE_LEN, table).c_str());
+  exec_conn(res, PGRES_TUPLES_OK, error_prefix);
+  const bool has_len = PQntuples(res) > 0;
+  PQclear(res);
+  if (!has_len) exec_create(conn, hash_table_query(ALTER_HASH_TABLE_LEN, table), error_prefix);
+}
+
+void connect_store(const char * conninfo_path)
+{
+  auto connection_info = openfile(conninfo_path, O_RDONLY);
+  std::string conninfo;
+  if (!connection_info) {
+    exit_error(wrap_ostringstream("error occurred while opening " << conninfo_path << ", errno: " << errno), -1);
+  }
+  {
+    std::string buffer(256, 0);
+    while (connection_info->read(buffer.data(), 255)) {
+      conninfo.append(buffer.data());
+    }
+  }
+  connection_info.remove_element();
+
+  // lines "shard: conninfo" list shards, else whole file is one conninfo
+  std::vector<std::string> shards;
+  bool other_lines = false;
+  {
+    std::istringstream lines(conninfo);
+    std::string line;
+    while (std::getline(lines, line)) {
+      const size_t begin = line.find_first_not_of(" \t\r");
+      if (begin == std::string::npos) continue;
+      if (line.compare(begin, sizeof(DB_SHARD_LINE_PREFIX) - 1, DB_SHARD_LINE_PREFIX) == 0) {
+        shards.push_back(line.substr(begin + sizeof(DB_SHARD_LINE_PREFIX) - 1));
+      } else {
+        other_lines = true;
+      }
+    }
+  }
+  if (!shards.empty() && other_lines) {
+    exit_error(wrap_ostringstream("error: " << conninfo_path << " mixes shard lines with connection string"), -1);
+  }
+  if (shards.size() > INDEX_MAX_SHARDS) {
+    exit_error(wrap_ostringstream("error: more than " << INDEX_MAX_SHARDS << " shards in " << conninfo_path), -1);
+  }
+  if (shards.empty()) shards.push_back(conninfo);
+
+  for (const auto& shard : shards) {
+    shard_conns.push_back(connect_db(shard));
+  }
+  dbconn = shard_conns[0];
+  /*
+  PGresult* res = PQexec(dbconn, "SET search_path = deduplication_server;");
+  exec_conn(res, PGRES_COMMAND_OK, "SET failed: ");
+  PQclear(res);
+  */
+  exec_create(dbconn, CREATE_FILE_TABLE, "CREATE file TABLE failed: ");
+  if (sparse_index) {
+    create_hash_table(dbconn, HOOK_TABLE_NAME, "CREATE hook TABLE failed: ");
+    hook_index = std::make_unique<pg_hash_index_t>(dbconn, HOOK_TABLE_NAME);
+  }
+  if (shard_conns.size() == 1) {
+    create_hash_table(dbconn, HASH_TABLE_NAME, "CREATE hash TABLE failed: ");
+    hash_index = std::make_unique<pg_hash_index_t>(dbconn);
+    return;
+  }
+  // shards can share DB, so each has own table
+  std::vector<std::unique_ptr<hash_index_t>> indexes;
+  for (size_t i = 0; i < shard_conns.size(); i++) {
+    const std::string table = HASH_TABLE_NAME "_" + std::to_string(i);
+    create_hash_table(shard_conns[i], table, "CREATE hash TABLE failed: ");
+    indexes.push_back(std::make_unique<pg_hash_index_t>(shard_conns[i], table));
+  }
+  hash_index = std::make_unique<sharded_hash_index_t>(std::move(indexes));
+}
+
+void close_store_files()
+{
+  save_sketch_index();
+  chunk_writer.flush();
+  save_hash_file_end();
+  chunk_writer.detach();
+  recipe_writer.detach();
+  locations_writer.detach();
+  manifest_log.close();
+  if (io_engine) {
+    for (auto& [id, file] : hashes_files) {
+      io_engine->unregister_file(file->fd());
+    }
+  }
+  files.remove_all();
+  hashes_files.clear();
+  if (hash_file_table) hash_file_table->close();
+  output_hash_file = {};
+  requested_file = {};
+  locations_file = {};
+}
+
+void read_stored_file(const std::filesystem::path& file, std::ostream& out)
+{
+  read_stored_range(file, 0, UINT64_MAX, out);
+}
+
+// restored bytes go to stream or fd, zero runs of regular file become holes
+class restore_sink_t
+{
+public:
+  explicit restore_sink_t(std::ostream& out)
+    : out_(&out)
+  {
+  }
+
+  explicit restore_sink_t(int fd)
+    : fd_(fd)
+  {
+    struct stat st;
+    const int flags = fcntl(fd, F_GETFL);
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && flags >= 0 && !(flags & O_APPEND)) {
+      pos_ = lseek(fd, 0, SEEK_CUR);
+      holes_ = pos_ >= 0;
+      size_ = st.st_size;
+    }
+  }
+
+  void write(const char * data, size_t len)
+  {
+    if (out_) {
+      out_->write(data, len);
+      return;
+    }
+    for (size_t written = 0; written < len;) {
+      stats_add(COUNTER_SYSCALLS);
+      const ssize_t result = handle_eintr(::write, fd_, data + written, len - written);
+      if (result <= 0) exit_error(wrap_ostringstream("error: can't write output, errno: " << errno), 10);
+      written += result;
+    }
+    pos_ += len;
+  }
+
+  void zeros(uint64_t len)
+  {
+    static const char zero_block[BUFFER_READ_SIZE] = {};
+    if (holes_) {
+      // bytes of file before restore are punched, new ones are skipped
+      if (pos_ < size_) {
+        const uint64_t punched = std::min<uint64_t>(len, size_ - pos_);
+        stats_add(COUNTER_SYSCALLS);
+        if (fallocate(fd_, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, pos_, punched) != 0) {
+          holes_ = false;
+          return zeros(len);
+        }
+      }
+      pos_ += len;
+      stats_add(COUNTER_SYSCALLS);
+      soft_assert(lseek(fd_, pos_, SEEK_SET) == pos_);
+      return;
+    }
+    while (len > 0) {
+      const size_t writing = std::min<uint64_t>(len, sizeof(zero_block));
+      write(zero_block, writing);
+      len -= writing;
+    }
+  }
+
+  // file ending with hole is extended to its end
+  void finish()
+  {
+    if (holes_ && pos_ > size_) {
+      stats_add(COUNTER_SYSCALLS);
+      if (ftruncate(fd_, pos_) != 0) exit_error(wrap_ostringstream("error: can't extend output, errno: " << errno), 10);
+    }
+  }
+
+private:
+  std::ostream * out_ = nullptr;
+  int fd_ = -1;
+  bool holes_ = false;
+  off_t pos_ = 0;
+  off_t size_ = 0;
+};
+
+void read_stored_range(const std::filesystem::path& file, uint64_t offset, uint64_t length, restore_sink_t& out)
+{
+  if (trace_recording) trace_file(TRACE_RESTORE_FILE);
+  requested_file = openfile(file.c_str(), O_RDONLY);
+  soft_assert(*requested_file);
+  recipe_position_t position = { 0, 0 };
+  bool found = true;
+  if (offset > 0) {
+    const auto index_path = offset_index_path(file);
+    if (std::filesystem::exists(index_path)) {
+      auto index = openfile(index_path, O_RDONLY);
+      found = find_recipe_position(*index, offset, &position);
+      index.remove_element();
+    } else {
+      // files stored before offset index have only last chunk shorter
+      std::cerr << "warn: offset index of file not found, nominal chunk size is used\n";
+      position = { offset / HASHING_BLOCK_SIZE, offset % HASHING_BLOCK_SIZE };
+    }
+  }
+  constexpr size_t buffer_hexes_size = ((int)(BUFFER_READ_SIZE / BYTES_HASH)) * BYTES_HASH;
+  std::string readbuf(buffer_hexes_size, 0);
+  // files stored with sparse index have locations of blocks
+  deque_t<file_t>::iterator locations;
+  std::vector<hash_location_t> locations_buf;
+  if (std::filesystem::exists(locations_path(file))) {
+    locations = openfile(locations_path(file), O_RDONLY);
+    soft_assert(*locations);
+    locations_buf.resize(buffer_hexes_size / BYTES_HASH);
+  }
+  std::string output(BUFFER_READ_SIZE, 0);
+  off_t readed = found ? 1 : 0;
+  off_t recipe_pos = position.entry * BYTES_HASH;
+  uint64_t skip = position.skip;
+  // at least one entry per HASHING_BLOCK_SIZE bytes is needed, ranges don't read whole buffers
+  auto needed_hashes = [&skip, &length]() {
+    return std::min<uint64_t>((skip + std::min<uint64_t>(length, BUFFER_READ_SIZE) + HASHING_BLOCK_SIZE - 1)
+                              / HASHING_BLOCK_SIZE, buffer_hexes_size / BYTES_HASH);
+  };
+  while (readed > 0 && length > 0) {
+    {
+      stage_timer_t timer(STAGE_RECIPE_READ);
+      readed = requested_file->read(recipe_pos, readbuf.data(), needed_hashes() * BYTES_HASH);
+      if (locations && readed > 0) {
+        const off_t size = readed / BYTES_HASH * sizeof(hash_location_t);
+        if (locations->read(recipe_pos / BYTES_HASH * sizeof(hash_location_t), (char *) locations_buf.data(), size) != size) {
+          exit_error(wrap_ostringstream("error: locations of " << file << " are shorter than recipe"), 10);
+        }
+      }
+    }
+    soft_assert((readed % BYTES_HASH) == 0);
+    recipe_pos += readed;
+    size_t readed_hashes = readed / BYTES_HASH;
+    size_t current_hashes = 0;
+    while (current_hashes < readed_hashes && length > 0) {
+      uint64_t run_length;
+      if (read_zero_run_entry((const unsigned char *) readbuf.data() + current_hashes * BYTES_HASH, &run_length)) {
+        current_hashes++;
+        stats_add(COUNTER_BYTES_RESTORED, run_length);
+        const uint64_t skipped = std::min<uint64_t>(skip, run_length);
+        skip -= skipped;
+        const uint64_t writing = std::min<uint64_t>(run_length - skipped, length);
+        length -= writing;
+        stage_timer_t timer(STAGE_OUTPUT_WRITE);
+        out.zeros(writing);
+        continue;
+      }
+      size_t hashes_last = std::min<size_t>(readed_hashes - current_hashes, needed_hashes());
+      size_t writed = fill_buffer_from_hashes(output.data(), BUFFER_READ_SIZE,
+                                              readbuf.data() + current_hashes * BYTES_HASH, &hashes_last,
+                                              locations ? locations_buf.data() + current_hashes : nullptr);
+#if (FULL_LOGGING)
+      std::cerr << "filled from hashes: " << writed << std::endl;
+#endif
+      soft_assert(writed > 0);
+      current_hashes += hashes_last;
+      const size_t skipped = std::min<uint64_t>(skip, writed);
+      skip -= skipped;
+      const size_t writing = std::min<uint64_t>(writed - skipped, length);
+      length -= writing;
+      stage_timer_t timer(STAGE_OUTPUT_WRITE);
+      out.write(output.data() + skipped, writing);
+    }
+  }
+  out.finish();
+  if (locations) locations.remove_element();
+  close_store_files();
+}
+
+void read_stored_range(const std::filesystem::path& file, uint64_t offset, uint64_t length, std::ostream& out)
+{
+  restore_sink_t sink(out);
+  read_stored_range(file, offset, length, sink);
+}
+
+void read_stored_range(const std::filesystem::path& file, uint64_t offset, uint64_t length, int fd)
+{
+  restore_sink_t sink(fd);
+  read_stored_range(file, offset, length, sink);
+}
+
+std::filesystem::path begin_stored_file(const std::filesystem::path& file)
+{
+  if (trace_recording) trace_file(TRACE_INGEST_FILE);
+  requested_file = openfile(file.c_str(), O_APPEND | O_WRONLY | O_CREAT | S_IRWXU);
+  const auto index_path = offset_index_path(file);
+  std::filesystem::create_directories(index_path.parent_path());
+  offsets_writer.emplace(index_path, HASHING_BLOCK_SIZE);
+  if (sparse_index) {
+    const auto sidecar = locations_path(file);
+    std::filesystem::create_directories(sidecar.parent_path());
+    locations_file = openfile(sidecar, O_APPEND | O_WRONLY | O_CREAT);
+    if (!*locations_file) {
+      exit_error(wrap_ostringstream("error: can't open " << sidecar << ", errno: " << errno), 10);
+    }
+    locations_writer.attach(locations_file->fd(), locations_file->to_end());
+  }
+  return index_path;
+}
+
+void store_buffer(const char * data, size_t len)
+{
+  if (len != save_buffer((const unsigned char *) data, len))
+    exit_error("error: saved len not equally buffer size", 10);
+  check_commit_group();
+}
+
+void finish_stored_file(const std::filesystem::path& file, const std::filesystem::path& index_path)
+{
+  offsets_writer->finish();
+  offsets_writer.reset();
+  {
+    stage_timer_t timer(STAGE_RECIPE_WRITE);
+    recipe_writer.detach();
+  }
+  if (commit_groups) {
+    group_closed_files.push_back(file);
+    group_closed_files.push_back(index_path);
+  }
+  requested_file.remove_element();
+  requested_file = {};
+  if (locations_file) {
+    locations_writer.detach();
+    if (commit_groups) group_closed_files.push_back(locations_file->path());
+    locations_file.remove_element();
+    locations_file = {};
+  }
+}
+
+void store_stream(const std::filesystem::path& file, std::istream& in)
+{
+  std::string readbuf(BUFFER_READ_SIZE, 0);
+  const auto index_path = begin_stored_file(file);
+  std::streamsize readed_bytes = 1;
+  while (in) {
+    {
+      stage_timer_t timer(STAGE_INPUT_READ);
+      in.read(readbuf.data(), BUFFER_READ_SIZE);
+      readed_bytes = in.gcount();
+    }
+#if (FULL_LOGGING)
+    std::cerr << "readed bytes " << readed_bytes << std::endl;
+#endif
+    if (readed_bytes > 0) {
+      store_buffer(readbuf.data(), readed_bytes);
+    } else
+      break;
+  }
+  finish_stored_file(file, index_path);
+}
+
+// chunks mapped input file in place, returns false if it can't be mapped
+// input is stored from its current position like by reads, position is moved to end
+bool store_mapped(int fd)
+{
+  struct stat st;
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) return false;
+  const off_t start = lseek(fd, 0, SEEK_CUR);
+  if (start < 0 || start >= st.st_size) return false;
+  const off_t map_start = start - start % sysconf(_SC_PAGESIZE);
+  const size_t map_size = st.st_size - map_start;
+  void * map = mmap(nullptr, map_size, PROT_READ, MAP_PRIVATE, fd, map_start);
+  if (map == MAP_FAILED) return false;
+  madvise(map, map_size, MADV_SEQUENTIAL);
+  const char * data = (const char *) map + (start - map_start);
+  const size_t size = st.st_size - start;
+  for (size_t pos = 0; pos < size; pos += BUFFER_READ_SIZE) {
+    const size_t len = std::min<size_t>(BUFFER_READ_SIZE, size - pos);
+    store_buffer(data + pos, len);
+  }
+  munmap(map, map_size);
+  lseek(fd, st.st_size, SEEK_SET);
+  return true;
+}
+
+void store_fd(const std::filesystem::path& file, int fd)
+{
+  const auto index_path = begin_stored_file(file);
+  if (!store_mapped(fd)) {
+    std::unique_ptr<char, decltype(&free)> readbuf(
+      (char *) aligned_alloc(INPUT_BUFFER_ALIGNMENT, BUFFER_READ_SIZE), &free);
+    soft_assert(readbuf);
+    bool eof = false;
+    while (!eof) {
+      size_t filled = 0;
+      {
+        stage_timer_t timer(STAGE_INPUT_READ);
+        // blocks are cut at buffer end, so buffer is filled up unless input ends
+        while (filled < BUFFER_READ_SIZE) {
+          stats_add(COUNTER_SYSCALLS);
+          const ssize_t readed = handle_eintr(::read, fd, readbuf.get() + filled, BUFFER_READ_SIZE - filled);
+          if (readed < 0) {
+            exit_error(wrap_ostringstream("error: can't read input, errno: " << errno), 10);
+          }
+          if (readed == 0) {
+            eof = true;
+            break;
+          }
+          filled += readed;
+        }
+      }
+      if (filled > 0) store_buffer(readbuf.get(), filled);
+    }
+  }
+  finish_stored_file(file, index_path);
+}
+
+void write_stored_file(const std::filesystem::path& file, std::istream& in)
+{
+  open_output_hash_file();
+  begin_commit_groups();
+  store_stream(file, in);
+  end_commit_groups();
+  close_store_files();
+}
+
+void write_stored_file(const std::filesystem::path& file, int fd)
+{
+  open_output_hash_file();
+  begin_commit_groups();
+  store_fd(file, fd);
+  end_commit_groups();
+  close_store_files();
+}
+
+std::filesystem::path versions_dir(const std::filesystem::path& file)
+{
+  return files_dir / VERSIONS_DIRECTORY / file.lexically_relative(files_dir);
+}
+
+uint64_t stored_versions(const std::filesystem::path& file)
+{
+  if (!std::filesystem::exists(file)) return 0;
+  uint64_t previous = 0;
+  const auto dir = versions_dir(file);
+  std::error_code error;
+  for (auto& entry : std::filesystem::directory_iterator(dir, error)) {
+    const std::string name = entry.path().filename().string();
+    if (name.empty() || name.find_first_not_of("0123456789") != std::string::npos) continue;
+    previous = std::max<uint64_t>(previous, std::stoull(name));
+  }
+  // link of file itself is left by update interrupted before its rename
+  if (previous && std::filesystem::equivalent(dir / std::to_string(previous), file, error)) previous--;
+  return previous + 1;
+}
+
+std::filesystem::path stored_version_path(const std::filesystem::path& file, uint64_t version)
+{
+  const uint64_t versions = stored_versions(file);
+  if (version == 0 || version > versions) return {};
+  if (version == versions) return file;
+  return versions_dir(file) / std::to_string(version);
+}
+
+// blocks of previous version stored with sparse index are known with locations
+void load_previous_manifest(const std::filesystem::path& file)
+{
+  file_t recipe(file, O_RDONLY);
+  file_t locations(locations_path(file), O_RDONLY);
+  if (!recipe.open() || !locations.open()) {
+    std::cerr << "warn: can't open previous version " << file << ", it isn't used for deduplication\n";
+    return;
+  }
+  std::string buf(BUFFER_READ_SIZE, 0);
+  std::vector<hash_location_t> locations_buf(BUFFER_READ_SIZE / BYTES_HASH);
+  ssize_t readed;
+  uint64_t run_length;
+  stage_timer_t timer(STAGE_RECIPE_READ);
+  while ((readed = recipe.read(buf.data(), buf.size())) > 0) {
+    soft_assert((readed % BYTES_HASH) == 0);
+    const ssize_t size = readed / BYTES_HASH * sizeof(hash_location_t);
+    if (locations.read((char *) locations_buf.data(), size) != size) {
+      std::cerr << "warn: locations of previous version " << file << " are shorter than recipe\n";
+      break;
+    }
+    for (ssize_t pos = 0; pos < readed; pos += BYTES_HASH) {
+      const unsigned char * entry = (const unsigned char *) buf.data() + pos;
+      const hash_location_t& location = locations_buf[pos / BYTES_HASH];
+      if (read_zero_run_entry(entry, &run_length) || location.file == 0) continue;
+      previous_version_manifest.emplace_back();
+      memcpy(previous_version_manifest.back().raw, entry, BYTES_HASH);
+      previous_version_manifest.back().location = location;
+    }
+  }
+  std::sort(previous_version_manifest.begin(), previous_version_manifest.end(),
+            [](const manifest_entry_t& a, const manifest_entry_t& b) { return memcmp(a.raw, b.raw, BYTES_HASH) < 0; });
+}
+
+void load_previous_version(const std::filesystem::path& file)
+{
+  if (sparse_index) {
+    if (std::filesystem::exists(locations_path(file))) load_previous_manifest(file);
+    return;
+  }
+  file_t recipe(file, O_RDONLY);
+  if (!recipe.open()) {
+    std::cerr << "warn: can't open previous version " << file << ", all chunks are looked up in index\n";
+    return;
+  }
+  std::string buf(BUFFER_READ_SIZE, 0);
+  ssize_t readed;
+  uint64_t run_length;
+  stage_timer_t timer(STAGE_RECIPE_READ);
+  while ((readed = recipe.read(buf.data(), buf.size())) > 0) {
+    soft_assert((readed % BYTES_HASH) == 0);
+    for (ssize_t pos = 0; pos < readed; pos += BYTES_HASH) {
+      const unsigned char * entry = (const unsigned char *) buf.data() + pos;
+      if (!read_zero_run_entry(entry, &run_length)) previous_version.insert(entry);
+    }
+  }
+}
+
+void rename_stored_file(const std::filesystem::path& from, const std::filesystem::path& to)
+{
+  for (auto sidecar : { offset_index_path, locations_path }) {
+    const auto from_sidecar = sidecar(from);
+    if (std::filesystem::exists(from_sidecar)) {
+      const auto to_sidecar = sidecar(to);
+      std::filesystem::create_directories(to_sidecar.parent_path());
+      std::filesystem::rename(from_sidecar, to_sidecar);
+    }
+  }
+  std::filesystem::create_directories(to.parent_path());
+  std::filesystem::rename(from, to);
+}
+
+// hard links recipe and its offset index and locations, recipe is linked last
+void link_stored_file(const std::filesystem::path& from, const std::filesystem::path& to)
+{
+  for (auto sidecar : { offset_index_path, locations_path }) {
+    const auto from_sidecar = sidecar(from);
+    const auto to_sidecar = sidecar(to);
+    std::filesystem::remove(to_sidecar);
+    if (std::filesystem::exists(from_sidecar)) {
+      std::filesystem::create_directories(to_sidecar.parent_path());
+      std::filesystem::create_hard_link(from_sidecar, to_sidecar);
+    }
+  }
+  std::filesystem::create_directories(to.parent_path());
+  std::filesystem::remove(to);
+  std::filesystem::create_hard_link(from, to);
+}
+
+void update_stored_file(const std::filesystem::path& file, int fd)
+{
+  const uint64_t versions = stored_versions(file);
+  if (versions == 0) {
+    write_stored_file(file, fd);
+    return;
+  }
+  const auto dir = versions_dir(file);
+  const auto next = dir / (std::to_string(versions + 1) + VERSION_TMP_SUFFIX);
+  // rest of interrupted update
+  std::filesystem::remove(next);
+  std::filesystem::remove(offset_index_path(next));
+  std::filesystem::remove(locations_path(next));
+  std::filesystem::create_directories(dir);
+  load_previous_version(file);
+  write_stored_file(next, fd);
+  previous_version = digest_set_t(0);
+  previous_version_manifest = manifest_t();
+  // stored name resolves to previous or new recipe at any moment
+  link_stored_file(file, dir / std::to_string(versions));
+  for (auto sidecar : { offset_index_path, locations_path }) {
+    if (!std::filesystem::exists(sidecar(next))) std::filesystem::remove(sidecar(file));
+  }
+  rename_stored_file(next, file);
+  if (commit_options.durability == DURABILITY_GROUP) {
+    for (const auto& path : { file.parent_path(), dir, offset_index_path(file).parent_path(), offset_index_path(dir),
+                              locations_path(file).parent_path(), locations_path(dir) }) {
+      file_t dir_file(path, O_RDONLY | O_DIRECTORY);
+      if (dir_file.open()) sync_store_file(dir_file);
+    }
+  }
+}
@@ -0,0 +1,239 @@
+#ifndef STORE_H
+#define STORE_H
+
+#include <filesystem>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <postgresql/libpq-fe.h>
+
+#include "defines.h"
+#include "deque.h"
+#include "file.h"
+#include "index.h"
+
+class io_engine_t;
+
+#if (!__RELEASE)
+#define soft_assert(expr)                                             \
+  if (!(expr)) {                                                      \
+    soft_close_all();                                                 \
+    std::cerr << "assert failed: " << #expr << ", file: " << __FILE__ \
+              << ", line: " << __LINE__ << std::endl;                 \
+    abort();                                                          \
+  }
+#else
+#define soft_assert(X)                                                \
+  if (!(X)) {                                                         \
+    exit_error(wrap_ostringstream("assert failed: " << #X ), 126);    \
+  }
+#endif
+
+extern std::filesystem::path files_dir;
+extern std::filesystem::path hashes_dir;
+extern std::filesystem::path offsets_dir;
+
+extern size_t max_fd;
+extern size_t opened_fd;
+
+extern PGconn* dbconn;
+
+// connections of index shards, first one is dbconn
+extern std::vector<PGconn*> shard_conns;
+
+extern deque_t<file_t> files;
+
+extern std::unique_ptr<hash_index_t> hash_index;
+
+// save_buffer keeps index inserts until INSERT_MANY_HASHES_COUNT hashes are seen
+extern bool batch_inserts;
+
+enum durability_t {
+  DURABILITY_GROUP   = 0, // written chunks and recipes are fdatasync'd before index group commit
+  DURABILITY_RELAXED = 1  // index group is committed without syncing files
+};
+
+struct commit_options_t
+{
+  durability_t durability = DURABILITY_GROUP;
+  // group is committed when it has this count of ingested bytes or is older than group_seconds
+  uint64_t group_bytes = COMMIT_GROUP_DEFAULT_BYTES;
+  double group_seconds = COMMIT_GROUP_DEFAULT_INTERVAL_SEC;
+};
+
+extern commit_options_t commit_options;
+
+// save_buffer stores new blocks similar to stored ones as deltas
+extern bool delta_compression;
+
+// save_buffer looks up blocks in manifests of champions found by hooks instead of index,
+// only hooks are indexed, locations of recipe entries are written to sidecar of stored file
+extern bool sparse_index;
+
+// hooks of sparse index, created by connect_store if sparse_index is set
+extern std::unique_ptr<hash_index_t> hook_index;
+
+extern deque_t<file_t>::iterator output_hash_file;
+extern deque_t<file_t>::iterator requested_file;
+
+void soft_close_all();
+
+void exec_conn(PGresult* res, ExecStatusType expected, const char * error_prefix);
+
+void exit_error(const char * error_msg, int exit_code);
+
+deque_t<file_t>::iterator openfile(std::string path, int open_mode);
+
+bool check_valid_hash_filename(std::string filename);
+
+std::string create_hash_filename_template(size_t numbers);
+
+// returns first not existing hash filename starting from current_file
+std::string find_free_hash_filename(std::string current_file);
+
+// returns hash filename stored in PREF_LAST_HASH_FILENAME or empty string
+std::string last_hash_filename();
+
+void open_output_hash_file();
+
+// registers hash file in index and in HASH_FILES_TABLE_FILENAME
+hash_file_id_t register_hash_file(const std::string& path);
+
+// removes retired hash file from HASH_FILES_TABLE_FILENAME
+void forget_hash_file(hash_file_id_t id);
+
+// path of hash file from HASH_FILES_TABLE_FILENAME, empty if unknown
+std::string hash_file_path(hash_file_id_t id);
+
+// hash file of id opened for reading and registered in store_io_engine, files.end() if it can't be opened
+deque_t<file_t>::iterator open_hash_file(hash_file_id_t id);
+
+// engine of chunk store reads and writes, created on first use
+io_engine_t& store_io_engine();
+
+// block size prefix of hash file record, delta records have DELTA_RECORD_FLAG
+void write_record_prefix(char * prefix, size_t len, bool delta);
+
+size_t read_record_prefix(const char * prefix, bool * delta);
+
+// block of record data, delta records are resolved by bases found in index.
+// returns block size or -1, chain - count of delta records in chain
+ssize_t resolve_record(const char * data, size_t len, bool delta, char * out, size_t * chain = nullptr);
+
+// recipe entry of zero run, length in bytes
+void write_zero_run_entry(unsigned char * entry, uint64_t length);
+
+// returns false if entry is digest
+bool read_zero_run_entry(const unsigned char * entry, uint64_t * length);
+
+// returns saved bytes
+size_t save_buffer(const unsigned char * inbuf, size_t buflen);
+
+// stores received block as new full record if data has digest raw, returns false otherwise.
+// block should be missing in index, it's visible after flush_saved_hashes
+bool store_received_block(const unsigned char * raw, const char * data, size_t len);
+
+// flushes index inserts of save_buffer
+void flush_saved_hashes();
+
+// switches to new hash file when current one is full
+void rotate_output_hash_file();
+
+// index changes are committed by groups in transactions until end_commit_groups
+void begin_commit_groups();
+
+// commits group if it's large or old enough, called between saved buffers.
+// written files are flushed and synced by commit_options before index commit
+void check_commit_group();
+
+// commits last group
+void end_commit_groups();
+
+// exits with error if file can't be synced
+void sync_store_file(file_t& file);
+
+// returned filled buf size; nhashes - in max hashes in hashes arr, out - used hashes for buffer filling.
+// filling stops before zero run entry, blocks are found by locations of entries if they are given
+size_t fill_buffer_from_hashes(char * buf, size_t bufsize, const char * hashes_arr, size_t *nhashes,
+                               const hash_location_t * locations = nullptr);
+
+// bytes to read for record at location: its length or length of largest record if it isn't known
+size_t record_read_size(const hash_location_t& location);
+
+// block of record at location, -1 if record can't be readed or resolved
+ssize_t read_located_block(const hash_location_t& location, char * block);
+
+// block of digest found in index, -1 if it isn't found or can't be readed
+ssize_t read_stored_block(const char * hex, char * block);
+
+// creates not existing directories
+void init_store_dirs(const std::filesystem::path& files_path, const std::filesystem::path& hashes_path,
+                     const std::filesystem::path& offsets_path);
+
+// shared flock of hashes dir is held by each session of store until exit,
+// compaction takes it exclusively only for a moment before removing retired hash files
+void lock_store();
+
+// waits until sessions holding lock of store now finish, lock is kept shared
+void wait_store_sessions();
+
+// flock of hash file taken by session appending to it, returns false if other session holds it
+bool lock_hash_file(file_t& file);
+
+// offset index sidecar of stored file
+std::filesystem::path offset_index_path(const std::filesystem::path& file);
+
+// locations sidecar of file stored with sparse index: hash_location_t of each recipe entry, zero for zero runs
+std::filesystem::path locations_path(const std::filesystem::path& file);
+
+// connects to DB by connection string from conninfo_path or to each shard of "shard: conninfo" lines,
+// creates tables and hash_index
+void connect_store(const char * conninfo_path);
+
+// closes all opened stored and hash files
+void close_store_files();
+
+void read_stored_file(const std::filesystem::path& file, std::ostream& out);
+
+// writes bytes [offset, offset + length) of stored file, less if file ends earlier
+void read_stored_range(const std::filesystem::path& file, uint64_t offset, uint64_t length, std::ostream& out);
+
+// zero runs are holes if fd is regular file not opened for appending
+void read_stored_range(const std::filesystem::path& file, uint64_t offset, uint64_t length, int fd);
+
+// opens recipe, offset index and locations of file for store_buffer, returns path of offset index
+std::filesystem::path begin_stored_file(const std::filesystem::path& file);
+
+// saves buffer to opened recipe and commits group if it's time
+void store_buffer(const char * data, size_t len);
+
+// closes files of begin_stored_file, they are synced by next group commit
+void finish_stored_file(const std::filesystem::path& file, const std::filesystem::path& index_path);
+
+// writes recipe and offset index of file, output hash file should be opened
+void store_stream(const std::filesystem::path& file, std::istream& in);
+
+// regular input file is mapped to memory and chunked in place, other input is readed to aligned buffer
+void store_fd(const std::filesystem::path& file, int fd);
+
+void write_stored_file(const std::filesystem::path& file, std::istream& in);
+
+void write_stored_file(const std::filesystem::path& file, int fd);
+
+// count of stored versions of file, latest one is file itself
+uint64_t stored_versions(const std::filesystem::path& file);
+
+// recipe of version from 1, empty if file has no such version
+std::filesystem::path stored_version_path(const std::filesystem::path& file, uint64_t version);
+
+// moves recipe and its offset index and locations, recipe is moved last
+void rename_stored_file(const std::filesystem::path& from, const std::filesystem::path& to);
+
+// stores new latest version of file, chunks of previous version are known without index lookups.
+// previous version stays readable by its number
+void update_stored_file(const std::filesystem::path& file, int fd);
+
+#endif // STORE_H
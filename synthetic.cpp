@@ -0,0 +1,103 @@
+#include "synthetic.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace {
+
+uint64_t splitmix64(uint64_t& state)
+{
+  uint64_t z = (state += 0x9E3779B97F4A7C15ull);
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+  return z ^ (z >> 31);
+}
+
+} // anonimous namespace
+
+synthetic_stream_t::synthetic_stream_t(const synthetic_options_t& options)
+  : options_(options)
+{
+  reset();
+}
+
+void synthetic_stream_t::reset()
+{
+  state_ = options_.seed;
+  next_seed_ = options_.seed << 32;
+  emitted_ = 0;
+  last_repeated_ = 0;
+  zero_blocks_ = 0;
+  history_.clear();
+  block_.clear();
+  block_pos_ = 0;
+}
+
+uint64_t synthetic_stream_t::random()
+{
+  return splitmix64(state_);
+}
+
+double synthetic_stream_t::random_ratio()
+{
+  return (random() >> 11) * (1.0 / (1ull << 53));
+}
+
+void synthetic_stream_t::fill_block(char * buf, size_t len, uint64_t seed)
+{
+  uint64_t state = seed;
+  for (size_t i = 0; i < len; i += sizeof(uint64_t)) {
+    const uint64_t value = splitmix64(state);
+    memcpy(buf + i, &value, std::min(sizeof(uint64_t), len - i));
+  }
+}
+
+void synthetic_stream_t::next_block()
+{
+  block_.clear();
+  block_pos_ = 0;
+  if (options_.shift_ratio > 0 && random_ratio() < options_.shift_ratio) {
+    block_.resize(1 + random() % options_.block_size);
+    fill_block(block_.data(), block_.size(), random());
+  }
+  if (zero_blocks_ == 0 && options_.zero_ratio > 0 && random_ratio() < options_.zero_ratio) {
+    zero_blocks_ = 1 + random() % SYNTHETIC_MAX_ZERO_RUN;
+  }
+  if (zero_blocks_ > 0) {
+    zero_blocks_--;
+    block_.resize(block_.size() + options_.block_size, 0);
+    return;
+  }
+  uint64_t seed;
+  if (!history_.empty() && random_ratio() < options_.duplicate_ratio) {
+    if (last_repeated_ + 1 < history_.size() && random_ratio() < options_.locality) {
+      last_repeated_++;
+    } else {
+      last_repeated_ = random() % history_.size();
+    }
+    seed = history_[last_repeated_];
+  } else {
+    seed = next_seed_++;
+    history_.push_back(seed);
+  }
+  const size_t begin = block_.size();
+  block_.resize(begin + options_.block_size);
+  fill_block(block_.data() + begin, options_.block_size, seed);
+  if (options_.edit_ratio > 0 && random_ratio() < options_.edit_ratio) {
+    block_[begin + random() % options_.block_size] ^= 1 + random() % 255;
+  }
+}
+
+size_t synthetic_stream_t::read(char * buf, size_t len)
+{
+  size_t filled = 0;
+  while (filled < len && emitted_ < options_.total_bytes) {
+    if (block_pos_ == block_.size()) next_block();
+    const size_t count = std::min({ len - filled, block_.size() - block_pos_, options_.total_bytes - emitted_ });
+    memcpy(buf + filled, block_.data() + block_pos_, count);
+    block_pos_ += count;
+    filled += count;
+    emitted_ += count;
+  }
+  return filled;
+}
@@ -0,0 +1,71 @@
+#ifndef SYNTHETIC_H
+#define SYNTHETIC_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "defines.h"
+
+#define SYNTHETIC_MAX_ZERO_RUN 4096
+
+struct synthetic_options_t
+{
+  size_t total_bytes = 64 * 1024 * 1024;
+
+  // part of blocks repeating content of earlier blocks
+  double duplicate_ratio = 0.5;
+
+  // probability that repeated block continues previous repeated run
+  // instead of jumping to random earlier block
+  double locality = 0.9;
+
+  // probability of one overwritten byte in emitted block
+  double edit_ratio = 0;
+
+  // probability of few inserted bytes before emitted block, shifts following blocks
+  double shift_ratio = 0;
+
+  // probability that block starts run of up to SYNTHETIC_MAX_ZERO_RUN zero blocks
+  double zero_ratio = 0;
+
+  size_t block_size = HASHING_BLOCK_SIZE;
+
+  uint64_t seed = 1;
+};
+
+// reproducible stream of blocks, each block content is generated from 64 bit seed
+class synthetic_stream_t
+{
+public:
+  explicit synthetic_stream_t(const synthetic_options_t& options);
+
+  // returns count of filled bytes, 0 - stream ended
+  size_t read(char * buf, size_t len);
+
+  // restarts stream from beginning, same bytes will be generated
+  void reset();
+
+  // fills len bytes generated from seed
+  static void fill_block(char * buf, size_t len, uint64_t seed);
+
+private:
+  uint64_t random();
+
+  double random_ratio();
+
+  void next_block();
+
+  synthetic_options_t options_;
+  uint64_t state_;
+  uint64_t next_seed_;
+  size_t emitted_;
+  size_t last_repeated_;
+  size_t zero_blocks_;
+  std::vector<uint64_t> history_;
+  std::string block_;
+  size_t block_pos_;
+};
+
+#endif // SYNTHETIC_H
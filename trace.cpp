@@ -0,0 +1,152 @@
+#include "trace.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <random>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "buffered_writer.h"
+#include "store.h"
+
+bool trace_recording = false;
+
+namespace {
+
+buffered_writer_t trace_writer(TRACE_BUFFER_SIZE);
+int trace_fd = -1;
+uint64_t trace_salt = 0;
+
+void trace_error(const std::string& message)
+{
+  trace_recording = false;
+  exit_error(wrap_ostringstream("error: " << message << ", aborted..."), 14);
+}
+
+// salt is created once per store, so traces of its sessions share seeds
+uint64_t load_trace_salt()
+{
+  const std::filesystem::path path = hashes_dir / TRACE_SALT_FILENAME;
+  uint64_t salt = 0;
+  int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+  if (fd >= 0) {
+    std::random_device random;
+    salt = ((uint64_t) random() << 32) | random();
+    const bool writed = write(fd, &salt, sizeof(salt)) == sizeof(salt) && fsync(fd) == 0;
+    close(fd);
+    if (!writed) trace_error(wrap_ostringstream("can't write " << path << ", errno: " << errno));
+    return salt;
+  }
+  fd = open(path.c_str(), O_RDONLY);
+  const bool readed = fd >= 0 && read(fd, &salt, sizeof(salt)) == sizeof(salt);
+  if (fd >= 0) close(fd);
+  if (!readed) trace_error(wrap_ostringstream("can't read " << path << ", errno: " << errno));
+  return salt;
+}
+
+// bijective, so seeds of different digest prefixes are different
+uint64_t mix64(uint64_t z)
+{
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+  return z ^ (z >> 31);
+}
+
+uint64_t digest_seed(const unsigned char * raw)
+{
+  uint64_t prefix;
+  memcpy(&prefix, raw, sizeof(prefix));
+  return mix64(prefix ^ trace_salt);
+}
+
+void append_record(trace_event_t event, trace_outcome_t outcome, uint64_t seed, uint64_t size,
+                   const hash_location_t * location = nullptr)
+{
+  trace_record_t record = {};
+  record.event = event;
+  record.outcome = outcome;
+  record.seed = seed;
+  record.size = size;
+  if (location) {
+    record.file = location->file;
+    record.pos = location->pos;
+  }
+  trace_writer.append((const char *) &record, sizeof(record));
+}
+
+} // anonimous namespace
+
+void trace_start(const std::string& path)
+{
+  if (trace_recording) return;
+  trace_salt = load_trace_salt();
+  trace_fd = open(path.c_str(), O_RDWR | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+  if (trace_fd < 0) trace_error(wrap_ostringstream("can't open trace " << path << ", errno: " << errno));
+  struct stat st;
+  soft_assert(fstat(trace_fd, &st) == 0);
+  trace_header_t header;
+  if (st.st_size == 0) {
+    memcpy(header.magic, TRACE_MAGIC, TRACE_MAGIC_BYTES);
+    header.block_size = HASHING_BLOCK_SIZE;
+    header.record_size = sizeof(trace_record_t);
+    if (write(trace_fd, &header, sizeof(header)) != sizeof(header)) {
+      trace_error(wrap_ostringstream("can't write trace " << path << ", errno: " << errno));
+    }
+    st.st_size = sizeof(header);
+  } else if (read(trace_fd, &header, sizeof(header)) != sizeof(header)
+             || memcmp(header.magic, TRACE_MAGIC, TRACE_MAGIC_BYTES) || header.block_size != HASHING_BLOCK_SIZE
+             || header.record_size != sizeof(trace_record_t)
+             || (st.st_size - sizeof(header)) % sizeof(trace_record_t)) {
+    trace_error(wrap_ostringstream(path << " is not trace of blocks of " << HASHING_BLOCK_SIZE << " bytes"));
+  }
+  trace_writer.attach(trace_fd, st.st_size);
+  trace_recording = true;
+  static bool registered = false;
+  if (!registered) {
+    registered = true;
+    std::atexit(trace_stop);
+  }
+}
+
+void trace_stop()
+{
+  if (trace_fd < 0) return;
+  trace_recording = false;
+  trace_writer.detach();
+  close(trace_fd);
+  trace_fd = -1;
+}
+
+void trace_file(trace_event_t event)
+{
+  append_record(event, TRACE_NONE, 0, 0);
+}
+
+void trace_buffer(size_t len)
+{
+  append_record(TRACE_BUFFER, TRACE_NONE, 0, len);
+}
+
+void trace_chunk(const unsigned char * raw, size_t len, trace_outcome_t outcome)
+{
+  append_record(TRACE_CHUNK, outcome, digest_seed(raw), len);
+}
+
+void trace_zero_run(uint64_t length)
+{
+  append_record(TRACE_ZERO_RUN, TRACE_NONE, 0, length);
+}
+
+void trace_fill(size_t hashes)
+{
+  append_record(TRACE_FILL, TRACE_NONE, 0, hashes);
+}
+
+void trace_read(const unsigned char * raw, size_t len, const hash_location_t * location)
+{
+  append_record(TRACE_READ, location ? TRACE_STORED : TRACE_MISSING, digest_seed(raw), len, location);
+}
@@ -0,0 +1,84 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "defines.h"
+#include "index.h"
+
+// trace of store session: operations of save_buffer and fill_buffer_from_hashes with chunk contents
+// replaced by seeds, so trace can be shared and replayed with synthetic content.
+// trace file is TRACE_MAGIC, HASHING_BLOCK_SIZE and size of record as uint32 and trace_record_t records
+enum trace_event_t : uint8_t {
+  TRACE_INGEST_FILE  = 'W', // recipe opened for writing
+  TRACE_BUFFER       = 'B', // save_buffer call, size - buffer length
+  TRACE_CHUNK        = 'C', // block of buffer with lookup outcome
+  TRACE_ZERO_RUN     = 'Z', // zero run of buffer, size - run length
+  TRACE_RESTORE_FILE = 'R', // recipe opened for reading
+  TRACE_FILL         = 'F', // fill_buffer_from_hashes call, size - used hashes
+  TRACE_READ         = 'D'  // block restored by fill, location of its record, outcome is TRACE_STORED if found
+};
+
+enum trace_outcome_t : uint8_t {
+  TRACE_NONE     = 0,
+  TRACE_STORED   = 1, // not found, stored as full record
+  TRACE_DELTA    = 2, // not found, stored as delta record
+  TRACE_BATCH    = 3, // repeats block of current insert batch, not looked up
+  TRACE_PREVIOUS = 4, // found in previous version without lookup
+  TRACE_INDEXED  = 5, // found by index or by manifests of sparse index
+  TRACE_MISSING  = 6  // restored block not found
+};
+
+struct trace_record_t
+{
+  uint64_t seed; // of block content, equal blocks have equal seeds
+  uint64_t pos;
+  uint32_t size;
+  uint32_t file;
+  uint8_t event;
+  uint8_t outcome;
+  uint8_t reserved[6];
+};
+
+static_assert(sizeof(trace_record_t) == 32, "trace record layout");
+
+struct trace_header_t
+{
+  char magic[TRACE_MAGIC_BYTES];
+  uint32_t block_size;
+  uint32_t record_size;
+};
+
+// set while trace is recorded, store calls trace functions only then
+extern bool trace_recording;
+
+// starts recording to file of path, records are appended to existing trace.
+// seeds are salted by TRACE_SALT_FILENAME of store which isn't written to trace, so contents can't be guessed
+// by seeds. store dirs should be initialized, exits with error if trace can't be opened
+void trace_start(const std::string& path);
+
+// flushes and closes trace, called at exit
+void trace_stop();
+
+void trace_file(trace_event_t event);
+
+void trace_buffer(size_t len);
+
+void trace_chunk(const unsigned char * raw, size_t len, trace_outcome_t outcome);
+
+void trace_zero_run(uint64_t length);
+
+void trace_fill(size_t hashes);
+
+void trace_read(const unsigned char * raw, size_t len, const hash_location_t * location);
+
+// read of location follows read of previous one closely in same hash file
+inline bool is_near_read(const hash_location_t& previous, const hash_location_t& location)
+{
+  return location.file == previous.file && location.pos > previous.pos
+         && location.pos - previous.pos <= BUFFER_READ_SIZE;
+}
+
+#endif // TRACE_H
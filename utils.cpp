@@ -2,11 +2,10 @@
 
 #include "memory.h"
 
+#include "codec.h"
+
 void to_my_hex(char * hex, const unsigned char * byte, size_t n) {
-  for (size_t i = 0; i < n; i++) {
-    hex[2 * i]     = 'A' + ((byte[i] >> 4) % 0x10);
-    hex[2 * i + 1] = 'A' +  (byte[i]       % 0x10);
-  }
+  codec_to_hex(hex, byte, n);
 }
 
 size_t add_wrapped_with_delim_sql(char * buf, size_t left, const char * value, size_t len)
@@ -98,21 +97,5 @@ void strset(char * dest, char ch, size_t count)
 
 size_t add_number(char * buf, size_t left, unsigned long long number)
 {
-  size_t power = 0;
-  unsigned long long current = 10;
-  const size_t max_digit = (sizeof(number) * 256) / 10;
-  while (power < max_digit && current < number) {
-    current *= 10;
-    power++;
-  }
-  current /= 10;
-  if (left < power) return 0;
-  size_t writed = 0;
-  while (power >= 0 && current > 0) {
-    buf[writed++] = '0' + ((number / current) % 10);
-    number = number % current;
-    current /= 10;
-    power--;
-  }
-  return writed;
+  return codec_add_number(buf, left, number);
 }